@@ -15,6 +15,9 @@ struct ident_pid {
 };
 
 struct connect_limit {
+	/* idents, ident_pids and hash nodes are allocated and freed for every
+	   login, so use a slab pool for them */
+	pool_t pool;
 	/* ident => unsigned int refcount */
 	HASH_TABLE(char *, void *) ident_hash;
 	/* struct ident_pid => struct ident_pid */
@@ -41,8 +44,9 @@ struct connect_limit *connect_limit_init(void)
 	struct connect_limit *limit;
 
 	limit = i_new(struct connect_limit, 1);
-	hash_table_create(&limit->ident_hash, default_pool, 0, str_hash, strcmp);
-	hash_table_create(&limit->ident_pid_hash, default_pool, 0,
+	limit->pool = pool_slab_create("connect limit");
+	hash_table_create(&limit->ident_hash, limit->pool, 0, str_hash, strcmp);
+	hash_table_create(&limit->ident_pid_hash, limit->pool, 0,
 			  ident_pid_hash, ident_pid_cmp);
 	return limit;
 }
@@ -54,6 +58,7 @@ void connect_limit_deinit(struct connect_limit **_limit)
 	*_limit = NULL;
 	hash_table_destroy(&limit->ident_hash);
 	hash_table_destroy(&limit->ident_pid_hash);
+	pool_unref(&limit->pool);
 	i_free(limit);
 }
 
@@ -75,7 +80,7 @@ void connect_limit_connect(struct connect_limit *limit, pid_t pid,
 
 	if (!hash_table_lookup_full(limit->ident_hash, ident,
 				    &key, &value)) {
-		key = i_strdup(ident);
+		key = p_strdup(limit->pool, ident);
 		value = POINTER_CAST(1);
 		hash_table_insert(limit->ident_hash, key, value);
 	} else {
@@ -87,7 +92,7 @@ void connect_limit_connect(struct connect_limit *limit, pid_t pid,
 	lookup_i.pid = pid;
 	i = hash_table_lookup(limit->ident_pid_hash, &lookup_i);
 	if (i == NULL) {
-		i = i_new(struct ident_pid, 1);
+		i = p_new(limit->pool, struct ident_pid, 1);
 		i->ident = key;
 		i->pid = pid;
 		i->refcount = 1;
@@ -113,7 +118,7 @@ connect_limit_ident_hash_unref(struct connect_limit *limit, const char *ident)
 		hash_table_update(limit->ident_hash, key, value);
 	} else {
 		hash_table_remove(limit->ident_hash, key);
-		i_free(key);
+		p_free(limit->pool, key);
 	}
 }
 
@@ -134,7 +139,7 @@ void connect_limit_disconnect(struct connect_limit *limit, pid_t pid,
 
 	if (--i->refcount == 0) {
 		hash_table_remove(limit->ident_pid_hash, i);
-		i_free(i);
+		p_free(limit->pool, i);
 	}
 
 	connect_limit_ident_hash_unref(limit, ident);
@@ -153,7 +158,7 @@ void connect_limit_disconnect_pid(struct connect_limit *limit, pid_t pid)
 			hash_table_remove(limit->ident_pid_hash, i);
 			for (; i->refcount > 0; i->refcount--)
 				connect_limit_ident_hash_unref(limit, i->ident);
-			i_free(i);
+			p_free(limit->pool, i);
 		}
 	}
 	hash_table_iterate_deinit(&iter);
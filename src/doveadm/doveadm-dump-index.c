@@ -355,10 +355,32 @@ static const char *cache_type2str(enum mail_cache_field_type type)
 	}
 }
 
+static void dump_cache_columns(struct mail_cache *cache)
+{
+	const struct mail_cache_column *column;
+	unsigned int i;
+
+	if (mail_cache_columns_read(cache) < 0) {
+		printf("columns are broken\n");
+		return;
+	}
+	printf("-- Cache columns --\n");
+	printf("rows_count ........... = %u\n", cache->column_hdr.rows_count);
+	printf("uids_offset .......... = %u\n", cache->column_hdr.uids_offset);
+	printf(" #  Field Size Bitmap offset Data offset\n");
+	for (i = 0; i < cache->column_hdr.columns_count; i++) {
+		column = &cache->columns[i];
+		printf("%2u: %5u %4u %13u %11u\n", i, column->file_field,
+		       column->field_size, column->bitmap_offset,
+		       column->data_offset);
+	}
+}
+
 static void dump_cache_hdr(struct mail_cache *cache)
 {
 	const struct mail_cache_header *hdr;
 	const struct mail_cache_field *fields, *field;
+	struct mail_cache_field_stats stats;
 	unsigned int i, count, cache_idx;
 
 	(void)mail_cache_open_and_verify(cache);
@@ -382,11 +404,20 @@ static void dump_cache_hdr(struct mail_cache *cache)
 	       mail_index_offset_to_uint32(hdr->field_header_offset),
 	       hdr->field_header_offset);
 
+	if (MAIL_CACHE_HAS_COLUMNS(hdr))
+		dump_cache_columns(cache);
+
 	printf("-- Cache fields --\n");
+	if (cache->field_stats_offset != 0) {
+		printf("stats since .......... = %u (%s)\n",
+		       cache->field_stats_since,
+		       unixdate2str(cache->field_stats_since));
+	}
 	fields = mail_cache_register_get_list(cache, pool_datastack_create(),
 					      &count);
 	printf(
-" #  Name                                         Type Size Dec  Last used\n");
+" #  Name                                         Type Size Dec  "
+"Last used              Hits     Misses      Bytes\n");
 	for (i = 0; i < cache->file_fields_count; i++) {
 		cache_idx = cache->file_field_map[i];
 		field = &fields[cache_idx];
@@ -398,9 +429,11 @@ static void dump_cache_hdr(struct mail_cache *cache)
 			printf("%4u ", field->field_size);
 		else
 			printf("   - ");
-		printf("%-4s %.16s\n",
+		mail_cache_decision_get_stats(cache, cache_idx, &stats);
+		printf("%-4s %-16.16s %10u %10u %10u\n",
 		       cache_decision2str(field->decision),
-		       unixdate2str(field->last_used));
+		       unixdate2str(field->last_used),
+		       stats.hits, stats.misses, stats.bytes);
 	}
 }
 
@@ -452,8 +485,12 @@ static void dump_cache(struct mail_cache_view *cache_view, unsigned int seq)
 
 	str = t_str_new(512);
 	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	if (iter.column_row != (uint32_t)-1)
+		printf(" - cache column row=%u\n", iter.column_row);
 	while ((ret = mail_cache_lookup_iter_next(&iter, &iter_field)) > 0) {
-		if (iter.rec != prev_rec) {
+		if (iter.rec == NULL) {
+			/* field from columns */
+		} else if (iter.rec != prev_rec) {
 			printf(" - cache offset=%u size=%u, prev_offset = %u\n",
 			       iter.offset, iter.rec->size,
 			       iter.rec->prev_offset);
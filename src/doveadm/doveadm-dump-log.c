@@ -1,7 +1,9 @@
 /* Copyright (c) 2007-2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "istream.h"
 #include "hex-binary.h"
+#include "compression.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log.h"
 #include "doveadm-dump.h"
@@ -10,22 +12,23 @@
 
 static struct mail_transaction_ext_intro prev_intro;
 
-static void dump_hdr(int fd, uint64_t *modseq_r)
+static void dump_hdr(struct istream *input, uint64_t *modseq_r,
+		     struct mail_transaction_log_header *hdr_r)
 {
 	struct mail_transaction_log_header hdr;
-	ssize_t ret;
+	const unsigned char *data;
+	size_t size;
 
-	ret = read(fd, &hdr, sizeof(hdr));
-	if (ret != sizeof(hdr)) {
+	if (i_stream_read_data(input, &data, &size, sizeof(hdr)-1) <= 0) {
 		i_fatal("file hdr read() %"PRIuSIZE_T" != %"PRIuSIZE_T,
-			ret, sizeof(hdr));
+			size, sizeof(hdr));
 	}
+	memcpy(&hdr, data, sizeof(hdr));
 	if (hdr.hdr_size < sizeof(hdr)) {
 		memset(PTR_OFFSET(&hdr, hdr.hdr_size), 0,
 		       sizeof(hdr) - hdr.hdr_size);
 	}
-	if (lseek(fd, hdr.hdr_size, SEEK_SET) < 0)
-		i_fatal("lseek() failed: %m");
+	i_stream_seek(input, hdr.hdr_size);
 
 	printf("version = %u.%u\n", hdr.major_version, hdr.minor_version);
 	printf("hdr size = %u\n", hdr.hdr_size);
@@ -36,7 +39,9 @@ static void dump_hdr(int fd, uint64_t *modseq_r)
 	printf("initial modseq = %llu\n",
 	       (unsigned long long)hdr.initial_modseq);
 	printf("compat flags = %x\n", hdr.compat_flags);
+	printf("commit offset = %u\n", hdr.commit_offset);
 	*modseq_r = hdr.initial_modseq;
+	*hdr_r = hdr;
 }
 
 static bool
@@ -480,25 +485,29 @@ static void log_record_print(const struct mail_transaction_header *hdr,
 	}
 }
 
-static int dump_record(int fd, uint64_t *modseq)
+static int dump_record(struct istream *input, uoff_t start_offset,
+		       uint64_t *modseq)
 {
-	off_t offset;
-	ssize_t ret;
+	uoff_t offset;
+	const unsigned char *data;
+	size_t size;
 	struct mail_transaction_header hdr;
 	unsigned int orig_size;
 
-	offset = lseek(fd, 0, SEEK_CUR);
-	if (offset == -1)
-		i_fatal("lseek() failed: %m");
+	offset = start_offset + input->v_offset;
 
-	ret = read(fd, &hdr, sizeof(hdr));
-	if (ret == 0)
-		return 0;
-
-	if (ret != sizeof(hdr)) {
+	if (i_stream_read_data(input, &data, &size, sizeof(hdr)-1) <= 0) {
+		if (input->stream_errno != 0) {
+			i_fatal("read() failed: %s",
+				i_stream_get_error(input));
+		}
+		if (size == 0)
+			return 0;
 		i_fatal("rec hdr read() %"PRIuSIZE_T" != %"PRIuSIZE_T,
-			ret, sizeof(hdr));
+			size, sizeof(hdr));
 	}
+	memcpy(&hdr, data, sizeof(hdr));
+	i_stream_skip(input, sizeof(hdr));
 
 	orig_size = hdr.size;
 	hdr.size = mail_index_offset_to_uint32(hdr.size);
@@ -520,37 +529,57 @@ static int dump_record(int fd, uint64_t *modseq)
 	if (hdr.size < sizeof(hdr)) {
 		i_fatal("Invalid header size %u", hdr.size);
 	} else if (hdr.size < 1024*1024) {
-		unsigned char *buf = t_malloc(hdr.size);
+		size_t data_size = hdr.size - sizeof(hdr);
 
-		ret = read(fd, buf, hdr.size - sizeof(hdr));
-		if (ret != (ssize_t)(hdr.size - sizeof(hdr))) {
+		data = &uchar_nul;
+		if (data_size > 0 &&
+		    i_stream_read_data(input, &data, &size, data_size-1) <= 0) {
 			i_fatal("rec data read() %"PRIuSIZE_T" != %"PRIuSIZE_T,
-				ret, hdr.size - sizeof(hdr));
+				size, data_size);
 		}
-		log_record_print(&hdr, buf, (size_t)ret, modseq);
+		log_record_print(&hdr, data, data_size, modseq);
+		i_stream_skip(input, data_size);
 	} else {
-		if (lseek(fd, hdr.size - sizeof(hdr), SEEK_CUR) < 0)
-			i_fatal("lseek() failed: %m");
+		i_stream_skip(input, hdr.size - sizeof(hdr));
 	}
 	return 1;
 }
 
 static void cmd_dump_log(int argc ATTR_UNUSED, char *argv[])
 {
+	struct mail_transaction_log_header hdr;
+	const struct compression_handler *handler;
+	struct istream *input, *file_input;
+	uoff_t start_offset = 0;
 	uint64_t modseq;
 	int fd, ret;
 
 	fd = open(argv[1], O_RDONLY);
 	if (fd < 0)
 		i_fatal("open(%s) failed: %m", argv[1]);
-
-	dump_hdr(fd, &modseq);
+	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
+
+	dump_hdr(input, &modseq, &hdr);
+	if (hdr.major_version == MAIL_TRANSACTION_LOG_COMPRESSED_MAJOR_VERSION) {
+		handler = compression_detect_handler(input);
+		if (handler == NULL)
+			i_fatal("Unknown compression format");
+		if (handler->create_istream == NULL) {
+			i_fatal("Support not compiled in for %s compression",
+				handler->name);
+		}
+		printf("compression = %s\n", handler->name);
+		file_input = input;
+		input = handler->create_istream(file_input, TRUE);
+		i_stream_unref(&file_input);
+		start_offset = hdr.hdr_size;
+	}
 	do {
 		T_BEGIN {
-			ret = dump_record(fd, &modseq);
+			ret = dump_record(input, start_offset, &modseq);
 		} T_END;
 	} while (ret > 0);
-	i_close_fd(&fd);
+	i_stream_unref(&input);
 }
 
 static bool test_dump_log(const char *path)
@@ -572,7 +601,9 @@ static bool test_dump_log(const char *path)
 		return FALSE;
 
 	if (read(fd, &hdr, sizeof(hdr)) >= MAIL_TRANSACTION_LOG_HEADER_MIN_SIZE &&
-	    hdr.major_version == MAIL_TRANSACTION_LOG_MAJOR_VERSION &&
+	    (hdr.major_version == MAIL_TRANSACTION_LOG_MAJOR_VERSION ||
+	     hdr.major_version ==
+	     MAIL_TRANSACTION_LOG_COMPRESSED_MAJOR_VERSION) &&
 	    hdr.hdr_size >= MAIL_TRANSACTION_LOG_HEADER_MIN_SIZE)
 		ret = TRUE;
 	i_close_fd(&fd);
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "hash.h"
 #include "mail-storage.h"
+#include "mail-header-map.h"
 #include "mail-search-build.h"
 #include "doveadm-mailbox-list-iter.h"
 #include "doveadm-mail-iter.h"
@@ -80,15 +81,31 @@ cmd_deduplicate_box(struct doveadm_mail_cmd_context *_ctx,
 	HASH_TABLE(const char *, struct uidlist *) hash;
 	const char *key, *errstr;
 	struct uidlist *value;
+	ARRAY_TYPE(seq_range) msgid_uids;
+	bool have_msgid_uids = FALSE;
 	int ret = 0;
 
 	if (doveadm_mail_iter_init(_ctx, info, search_args, 0, NULL,
 				   &iter) < 0)
 		return -1;
 
+	if (ctx->by_msgid) {
+		/* look up only the messages whose Message-ID the header map
+		   says is used also by some other message */
+		t_array_init(&msgid_uids, 64);
+		box = doveadm_mail_iter_get_mailbox(iter);
+		if (mail_header_map_get_duplicates(box,
+				MAIL_HEADER_MAP_FIELD_MESSAGE_ID,
+				&msgid_uids) > 0)
+			have_msgid_uids = TRUE;
+	}
+
 	pool = pool_alloconly_create("deduplicate", 10240);
 	hash_table_create(&hash, pool, 0, str_hash, strcmp);
 	while (doveadm_mail_iter_next(iter, &mail)) {
+		if (have_msgid_uids &&
+		    !seq_range_exists(&msgid_uids, mail->uid))
+			continue;
 		if (ctx->by_msgid) {
 			if (mail_get_first_header(mail, "Message-ID", &key) < 0) {
 				errstr = mailbox_get_last_error(mail->box, &error);
@@ -1,6 +1,8 @@
 /* Copyright (c) 2002-2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "seq-bitmap.h"
 #include "imap-seqset.h"
 
 static uint32_t get_next_number(const char **str)
@@ -70,19 +72,46 @@ get_next_seq_range(const char **str, uint32_t *seq1_r, uint32_t *seq2_r)
 
 int imap_seq_set_parse(const char *str, ARRAY_TYPE(seq_range) *dest)
 {
+	struct seq_bitmap bitmap;
+	const struct seq_range *range;
+	unsigned int count;
 	uint32_t seq1, seq2;
+	bool use_bitmap = FALSE;
+	int ret = 0;
 
 	while (*str != '\0') {
-		if (get_next_seq_range(&str, &seq1, &seq2) < 0)
-			return -1;
-		seq_range_array_add_range(dest, seq1, seq2);
+		if (get_next_seq_range(&str, &seq1, &seq2) < 0) {
+			ret = -1;
+			break;
+		}
+		range = array_get(dest, &count);
+		if (use_bitmap)
+			seq_bitmap_add_range(&bitmap, seq1, seq2);
+		else if (count == 0 || range[count-1].seq2 < seq1)
+			seq_range_array_add_range(dest, seq1, seq2);
+		else {
+			/* not in ascending order. adding to the middle of a
+			   large fragmented array would be slow, so continue
+			   with a bitmap. */
+			seq_bitmap_init(&bitmap);
+			seq_bitmap_add_array(&bitmap, dest);
+			seq_bitmap_add_range(&bitmap, seq1, seq2);
+			use_bitmap = TRUE;
+		}
 
 		if (*str == ',')
 			str++;
-		else if (*str != '\0')
-			return -1;
+		else if (*str != '\0') {
+			ret = -1;
+			break;
+		}
 	}
-	return 0;
+	if (use_bitmap) {
+		array_clear(dest);
+		seq_bitmap_to_array(&bitmap, dest);
+		seq_bitmap_deinit(&bitmap);
+	}
+	return ret;
 }
 
 int imap_seq_set_nostar_parse(const char *str, ARRAY_TYPE(seq_range) *dest)
@@ -0,0 +1,87 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "imap-seqset.h"
+#include "test-common.h"
+
+static void test_imap_seq_set_parse(void)
+{
+	static const struct {
+		const char *input;
+		const char *output;
+	} tests[] = {
+		{ "1", "1" },
+		{ "1:5,7,9:10", "1:5,7,9:10" },
+		{ "5:1", "1:5" },
+		{ "3,1,2", "1:3" },
+		{ "10:20,1:5,15:30,7", "1:5,7,10:30" },
+		{ "100,50,1:*", "1:4294967295" },
+		{ "*,1", "1,4294967295" },
+		{ "", "" }
+	};
+	ARRAY_TYPE(seq_range) seqset;
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+	unsigned int i;
+
+	test_begin("imap_seq_set_parse");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		t_array_init(&seqset, 4);
+		test_assert_idx(imap_seq_set_parse(tests[i].input,
+						   &seqset) == 0, i);
+		str_truncate(str, 0);
+		array_foreach(&seqset, range) {
+			if (str_len(str) > 0)
+				str_append_c(str, ',');
+			if (range->seq1 == range->seq2)
+				str_printfa(str, "%u", range->seq1);
+			else {
+				str_printfa(str, "%u:%u",
+					    range->seq1, range->seq2);
+			}
+		}
+		test_assert_idx(strcmp(str_c(str), tests[i].output) == 0, i);
+	}
+
+	t_array_init(&seqset, 4);
+	test_assert(imap_seq_set_parse("1,x", &seqset) < 0);
+	test_assert(imap_seq_set_parse("0", &seqset) < 0);
+	test_assert(imap_seq_set_nostar_parse("5,1:*", &seqset) < 0);
+	test_end();
+}
+
+static void test_imap_seq_set_parse_unordered(void)
+{
+	ARRAY_TYPE(seq_range) seqset;
+	const struct seq_range *range;
+	string_t *str = t_str_new(1024*64);
+	unsigned int i, count;
+
+	test_begin("imap_seq_set_parse unordered");
+	/* every other number in descending order */
+	for (i = 20000; i > 0; i -= 2)
+		str_printfa(str, "%u,", i);
+	str_append(str, "19999:19990");
+
+	t_array_init(&seqset, 4);
+	test_assert(imap_seq_set_parse(str_c(str), &seqset) == 0);
+	range = array_get(&seqset, &count);
+	test_assert(count == 9995);
+	test_assert(range[0].seq1 == 2 && range[0].seq2 == 2);
+	test_assert(range[count-1].seq1 == 19990 &&
+		    range[count-1].seq2 == 20000);
+	test_assert(seq_range_count(&seqset) == 10005);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_imap_seq_set_parse,
+		test_imap_seq_set_parse_unordered,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,281 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare looking up date.received, size.virtual and imap.envelope for all
+   messages like FETCH 1:* (FLAGS INTERNALDATE RFC822.SIZE ENVELOPE) does,
+   either one field at a time with mail_cache_lookup_field() or by first
+   looking up the fields in batches with mail_cache_lookup_batch(). The
+   envelopes are added after the other fields, so each message has two cache
+   records in different parts of the file. "cold" drops the cache file from
+   the page cache with posix_fadvise() before each round, "hot" doesn't.
+   The looked up values are also checked to be the same with both methods.
+
+   Usage: bench-mail-cache-batch [<messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_ENVELOPE_SIZE 300
+#define BENCH_MESSAGES_PER_TRANSACTION 100
+#define BENCH_BATCH_COUNT 1000
+
+enum bench_field {
+	BENCH_FIELD_RECEIVED_DATE,
+	BENCH_FIELD_VIRTUAL_SIZE,
+	BENCH_FIELD_ENVELOPE,
+
+	BENCH_FIELD_COUNT
+};
+
+static const struct mail_cache_field bench_cache_fields[BENCH_FIELD_COUNT] = {
+	{ .name = "date.received",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "size.virtual",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uoff_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "imap.envelope",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static const char *index_dir;
+
+static struct mail_index *
+bench_index_open(struct mail_cache_field fields[BENCH_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, bench_cache_fields, sizeof(bench_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   BENCH_FIELD_COUNT);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void
+bench_add(struct mail_index *index,
+	  const struct mail_cache_field fields[BENCH_FIELD_COUNT],
+	  uint32_t seq1, uint32_t seq2, bool envelope)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	char envelope_data[BENCH_ENVELOPE_SIZE];
+	uint32_t seq, received_date;
+	uoff_t virtual_size;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = seq1; seq <= seq2; seq++) {
+		if (envelope) {
+			i_snprintf(envelope_data, sizeof(envelope_data),
+				   "\"%u\" \"subject %u\"", seq, seq);
+			mail_cache_add(cache_trans, seq,
+				       fields[BENCH_FIELD_ENVELOPE].idx,
+				       envelope_data, sizeof(envelope_data));
+			continue;
+		}
+		received_date = ioloop_time - seq2 + seq;
+		virtual_size = 1000 + seq % 5000;
+		mail_cache_add(cache_trans, seq,
+			       fields[BENCH_FIELD_RECEIVED_DATE].idx,
+			       &received_date, sizeof(received_date));
+		mail_cache_add(cache_trans, seq,
+			       fields[BENCH_FIELD_VIRTUAL_SIZE].idx,
+			       &virtual_size, sizeof(virtual_size));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void bench_fill(unsigned int messages_count)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, seq2, new_seq, uid_validity = ioloop_time;
+
+	index = bench_index_open(fields);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= messages_count; seq++)
+		mail_index_append(trans, seq, &new_seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	/* the messages were saved in small groups, and their envelopes were
+	   cached later by a client fetching them */
+	for (seq = 1; seq <= messages_count; seq = seq2 + 1) {
+		seq2 = I_MIN(seq + BENCH_MESSAGES_PER_TRANSACTION - 1,
+			     messages_count);
+		bench_add(index, fields, seq, seq2, FALSE);
+	}
+	for (seq = 1; seq <= messages_count; seq = seq2 + 1) {
+		seq2 = I_MIN(seq + BENCH_MESSAGES_PER_TRANSACTION - 1,
+			     messages_count);
+		bench_add(index, fields, seq, seq2, TRUE);
+	}
+	bench_index_close(&index);
+}
+
+static void bench_drop_cache(const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	i_close_fd(&fd);
+#endif
+}
+
+static long long bench_lookup(bool batch, bool cold, uint64_t *checksum_r)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	unsigned int field_idxs[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct bench_timer timer;
+	long long usecs;
+	uint32_t seq, batch_seq2 = 0, messages_count;
+	uint64_t checksum = 0;
+	unsigned int i, j;
+	buffer_t *buf;
+
+	if (cold) {
+		bench_drop_cache(t_strconcat(index_dir,
+					     "/dovecot.index.cache", NULL));
+	}
+
+	index = bench_index_open(fields);
+	for (i = 0; i < BENCH_FIELD_COUNT; i++)
+		field_idxs[i] = fields[i].idx;
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	mail_cache_view_update_cache_decisions(cache_view, FALSE);
+	messages_count = mail_index_view_get_messages_count(view);
+	buf = buffer_create_dynamic(default_pool, 512);
+
+	bench_timer_start(&timer);
+	for (seq = 1; seq <= messages_count; seq++) {
+		if (batch && seq > batch_seq2) {
+			batch_seq2 = I_MIN(seq + BENCH_BATCH_COUNT - 1,
+					   messages_count);
+			if (mail_cache_lookup_batch(cache_view, seq, batch_seq2,
+						    field_idxs,
+						    BENCH_FIELD_COUNT) < 0)
+				i_fatal("mail_cache_lookup_batch() failed");
+		}
+		for (i = 0; i < BENCH_FIELD_COUNT; i++) {
+			buffer_set_used_size(buf, 0);
+			if (mail_cache_lookup_field(cache_view, buf, seq,
+						    field_idxs[i]) <= 0)
+				i_fatal("Field %s not cached for seq %u",
+					fields[i].name, seq);
+			for (j = 0; j < buf->used; j++) {
+				checksum = checksum * 31 +
+					((const unsigned char *)buf->data)[j];
+			}
+		}
+	}
+	usecs = bench_timer_lap(&timer);
+
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+
+	*checksum_r = checksum;
+	return usecs;
+}
+
+static void
+bench_method(unsigned int messages_count, unsigned int rounds, bool batch,
+	     uint64_t *checksum)
+{
+	long long cold_usecs = 0, hot_usecs = 0;
+	uint64_t round_checksum;
+	unsigned int i;
+
+	for (i = 0; i < rounds * 2; i++) {
+		if (i % 2 == 0)
+			cold_usecs += bench_lookup(batch, TRUE, &round_checksum);
+		else
+			hot_usecs += bench_lookup(batch, FALSE, &round_checksum);
+		if (*checksum == 0)
+			*checksum = round_checksum;
+		else if (round_checksum != *checksum)
+			i_fatal("Looked up values differ");
+	}
+	printf("%9u %-8s %12lld %12lld\n", messages_count,
+	       batch ? "batch" : "single", cold_usecs / rounds,
+	       hot_usecs / rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count = 500000, rounds = 3;
+	uint64_t checksum = 0;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "messages", 1, UINT_MAX,
+		       &messages_count);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-cache-batch.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	bench_fill(messages_count);
+
+	printf("%9s %-8s %12s %12s\n", "messages", "method",
+	       "cold/us", "hot/us");
+	bench_method(messages_count, rounds, FALSE, &checksum);
+	bench_method(messages_count, rounds, TRUE, &checksum);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
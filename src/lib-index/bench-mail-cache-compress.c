@@ -0,0 +1,416 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure how long cache compression blocks writers. Writer processes keep
+   caching a new field for the existing messages, which appends to the
+   cache file, while the cache file gets compressed once. "locked" compresses
+   the whole file in mail_index_sync_commit() while the index and cache are
+   locked, "online" lets mail_index_sync_begin() copy the file before
+   locking, so only the messages that changed meanwhile are copied while
+   locked. Compression is skipped if the cache is locked, so the sync is
+   retried until it succeeds. The sync begin and commit times of the
+   successful try are shown separately, along with the slowest commit any
+   writer saw. Afterwards the cached values are verified.
+
+   Usage: bench-mail-cache-compress [<messages> [<writers> [<secs>]]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_DATA_SIZE 100
+#define BENCH_MESSAGES_PER_TRANSACTION 1000
+/* how many random messages writers try to update per transaction */
+#define BENCH_WRITER_UPDATES 10
+/* every nth message has the extra field cached initially */
+#define BENCH_EXTRA_INTERVAL 10
+#define BENCH_MAX_COMPRESS_TRIES 1000
+
+enum bench_field {
+	BENCH_FIELD_DATA,
+	BENCH_FIELD_EXTRA,
+
+	BENCH_FIELD_COUNT
+};
+
+static const struct mail_cache_field bench_cache_fields[BENCH_FIELD_COUNT] = {
+	{ .name = "data",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "extra",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+struct bench_result {
+	unsigned int commits, extras;
+	long long max_usecs;
+};
+
+static const char *index_dir;
+
+static struct mail_index *
+bench_index_open(struct mail_cache_field fields[BENCH_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, bench_cache_fields, sizeof(bench_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   BENCH_FIELD_COUNT);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_get_data(uint32_t uid, char data[BENCH_DATA_SIZE])
+{
+	memset(data, 0, BENCH_DATA_SIZE);
+	i_snprintf(data, BENCH_DATA_SIZE, "data for uid %u", uid);
+}
+
+static void
+bench_fill_range(struct mail_index *index,
+		 const struct mail_cache_field fields[BENCH_FIELD_COUNT],
+		 uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	char data[BENCH_DATA_SIZE];
+	uint32_t seq, uid;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = seq1; seq <= seq2; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		bench_get_data(uid, data);
+		mail_cache_add(cache_trans, seq, fields[BENCH_FIELD_DATA].idx,
+			       data, sizeof(data));
+		if (uid % BENCH_EXTRA_INTERVAL == 0) {
+			mail_cache_add(cache_trans, seq,
+				       fields[BENCH_FIELD_EXTRA].idx,
+				       &uid, sizeof(uid));
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void bench_fill(unsigned int messages_count)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, seq2, new_seq, uid_validity = ioloop_time;
+
+	index = bench_index_open(fields);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= messages_count; seq++)
+		mail_index_append(trans, seq, &new_seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	for (seq = 1; seq <= messages_count; seq = seq2 + 1) {
+		seq2 = I_MIN(seq + BENCH_MESSAGES_PER_TRANSACTION - 1,
+			     messages_count);
+		bench_fill_range(index, fields, seq, seq2);
+	}
+	bench_index_close(&index);
+}
+
+static bool bench_timeout(const struct timeval *end)
+{
+	struct timeval now;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_cmp(&now, end) >= 0;
+}
+
+static void
+bench_writer(unsigned int writer_idx, unsigned int writers_count,
+	     const struct timeval *end, struct bench_result *result_r)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	struct bench_timer timer;
+	uint32_t seq, uid, messages_count;
+	unsigned int i;
+	long long usecs;
+
+	index = bench_index_open(fields);
+	while (!bench_timeout(end)) {
+		if (mail_index_refresh(index) < 0)
+			i_fatal("mail_index_refresh() failed");
+		view = mail_index_view_open(index);
+		cache_view = mail_cache_view_open(mail_index_get_cache(index),
+						  view);
+		trans = mail_index_transaction_begin(view, 0);
+		cache_trans = mail_cache_get_transaction(cache_view, trans);
+
+		/* cache the extra field for some of the writer's own
+		   messages, so each message gets it at most once */
+		messages_count = mail_index_view_get_messages_count(view);
+		for (i = 0; i < BENCH_WRITER_UPDATES; i++) {
+			seq = 1 + rand() % messages_count;
+			mail_index_lookup_uid(view, seq, &uid);
+			if (uid % writers_count != writer_idx ||
+			    mail_cache_field_exists(cache_view, seq,
+					fields[BENCH_FIELD_EXTRA].idx) != 0)
+				continue;
+			mail_cache_add(cache_trans, seq,
+				       fields[BENCH_FIELD_EXTRA].idx,
+				       &uid, sizeof(uid));
+			result_r->extras++;
+		}
+		result_r->commits++;
+
+		bench_timer_start(&timer);
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("mail_index_transaction_commit() failed");
+		usecs = bench_timer_lap(&timer);
+		if (usecs > result_r->max_usecs)
+			result_r->max_usecs = usecs;
+
+		mail_cache_view_close(&cache_view);
+		mail_index_view_close(&view);
+	}
+	bench_index_close(&index);
+}
+
+static unsigned int
+bench_compress(bool online, long long *begin_usecs_r,
+	       long long *commit_usecs_r)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_cache *cache;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct bench_timer timer;
+	unsigned int tries;
+	bool compressed;
+
+	for (tries = 1;; tries++) {
+		/* reopen the index for each try, so that the cache doesn't
+		   remember that it wants to be compressed */
+		index = bench_index_open(fields);
+		cache = mail_index_get_cache(index);
+		if (mail_cache_open_and_verify(cache) < 0)
+			i_fatal("mail_cache_open_and_verify() failed");
+
+		/* enabling columns makes the cache want to be compressed.
+		   mail_index_sync_begin() copies it already if it wants. */
+		if (online)
+			mail_cache_set_columns(cache, TRUE);
+		bench_timer_start(&timer);
+		if (mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) <= 0)
+			i_fatal("mail_index_sync_begin() failed");
+		*begin_usecs_r = bench_timer_lap(&timer);
+		if (!online)
+			mail_cache_set_columns(cache, TRUE);
+		if (!mail_cache_need_compress(cache))
+			i_fatal("Cache doesn't want to be compressed");
+		if (mail_index_sync_commit(&sync_ctx) < 0)
+			i_fatal("mail_index_sync_commit() failed");
+		*commit_usecs_r = bench_timer_lap(&timer);
+		compressed = !mail_cache_need_compress(cache);
+		bench_index_close(&index);
+		if (compressed)
+			break;
+		if (tries == BENCH_MAX_COMPRESS_TRIES)
+			i_fatal("Cache wasn't compressed");
+	}
+
+	return tries;
+}
+
+static unsigned int bench_verify(unsigned int messages_count)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	char data[BENCH_DATA_SIZE];
+	uint32_t seq, uid, extra;
+	unsigned int extras = 0;
+	buffer_t *buf;
+	int ret;
+
+	index = bench_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 128);
+
+	if (mail_index_view_get_messages_count(view) != messages_count)
+		i_fatal("Messages count changed");
+	for (seq = 1; seq <= messages_count; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		bench_get_data(uid, data);
+		buffer_set_used_size(buf, 0);
+		ret = mail_cache_lookup_field(cache_view, buf, seq,
+					      fields[BENCH_FIELD_DATA].idx);
+		if (ret < 0)
+			i_fatal("mail_cache_lookup_field() failed");
+		if (ret == 0)
+			i_fatal("Data not cached for uid %u", uid);
+		if (buf->used != sizeof(data) ||
+		    memcmp(buf->data, data, sizeof(data)) != 0)
+			i_fatal("Wrong data cached for uid %u", uid);
+
+		buffer_set_used_size(buf, 0);
+		ret = mail_cache_lookup_field(cache_view, buf, seq,
+					      fields[BENCH_FIELD_EXTRA].idx);
+		if (ret < 0)
+			i_fatal("mail_cache_lookup_field() failed");
+		if (ret == 0)
+			continue;
+		memcpy(&extra, buf->data, sizeof(extra));
+		if (buf->used != sizeof(extra) || extra != uid)
+			i_fatal("Wrong extra cached for uid %u", uid);
+		if (uid % BENCH_EXTRA_INTERVAL != 0)
+			extras++;
+	}
+
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+
+	return extras;
+}
+
+static void
+bench_mode(bool online, unsigned int messages_count,
+	   unsigned int writers_count, unsigned int secs)
+{
+	struct bench_result result, writers;
+	struct timeval end;
+	long long begin_usecs, commit_usecs;
+	unsigned int i, tries, extras;
+	int fd[2], status;
+	pid_t pid;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	bench_fill(messages_count);
+
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	end.tv_sec += secs;
+
+	/* don't let the children flush our output */
+	fflush(stdout);
+	for (i = 0; i < writers_count; i++) {
+		if ((pid = fork()) < 0)
+			i_fatal("fork() failed: %m");
+		if (pid != 0)
+			continue;
+
+		srand(getpid());
+		memset(&result, 0, sizeof(result));
+		bench_writer(i, writers_count, &end, &result);
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+			i_fatal("write(pipe) failed: %m");
+		exit(0);
+	}
+
+	/* let the writers get going before compressing */
+	sleep(1);
+	tries = bench_compress(online, &begin_usecs, &commit_usecs);
+
+	memset(&writers, 0, sizeof(writers));
+	for (i = 0; i < writers_count; i++) {
+		if (read(fd[0], &result, sizeof(result)) != sizeof(result))
+			i_fatal("read(pipe) failed: %m");
+		writers.commits += result.commits;
+		writers.extras += result.extras;
+		if (result.max_usecs > writers.max_usecs)
+			writers.max_usecs = result.max_usecs;
+	}
+	for (i = 0; i < writers_count; i++) {
+		if (wait(&status) < 0)
+			i_fatal("wait() failed: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			i_fatal("Child process failed");
+	}
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+
+	extras = bench_verify(messages_count);
+
+	printf("%-8s %6u %12lld %12lld %14lld %10u %10u/%u\n",
+	       online ? "online" : "locked", tries, begin_usecs, commit_usecs,
+	       writers.max_usecs, writers.commits, extras, writers.extras);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count = 200000, writers_count = 2, secs = 5;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "messages", 1, UINT_MAX,
+		       &messages_count);
+	bench_arg_uint(argc, argv, 2, "writers", 1, UINT_MAX, &writers_count);
+	bench_arg_uint(argc, argv, 3, "secs", 2, UINT_MAX, &secs);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-cache-compress.%s",
+				    my_pid);
+
+	printf("%u messages, %u writers, %u secs\n",
+	       messages_count, writers_count, secs);
+	printf("%-8s %6s %12s %12s %14s %10s %10s\n", "mode", "tries",
+	       "begin/us", "commit/us", "max writer/us", "commits", "extras");
+	bench_mode(FALSE, messages_count, writers_count, secs);
+	bench_mode(TRUE, messages_count, writers_count, secs);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,252 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare how long it takes to look up cached fields for all messages with
+   and without mail_cache_set_columns(). "sort" looks up date.received like
+   SORT (ARRIVAL), "fetch" looks up date.received and size.virtual like
+   FETCH 1:* (INTERNALDATE RFC822.SIZE) and "envelope" looks up a string
+   field, which is never stored in columns.
+
+   Usage: bench-mail-cache [<max messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_ENVELOPE_SIZE 200
+
+enum bench_field {
+	BENCH_FIELD_RECEIVED_DATE,
+	BENCH_FIELD_VIRTUAL_SIZE,
+	BENCH_FIELD_ENVELOPE,
+
+	BENCH_FIELD_COUNT
+};
+
+static const struct mail_cache_field bench_cache_fields[BENCH_FIELD_COUNT] = {
+	{ .name = "date.received",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "size.virtual",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uoff_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "imap.envelope",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static const char *index_dir;
+
+static struct mail_index *
+bench_index_open(struct mail_cache_field fields[BENCH_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, bench_cache_fields, sizeof(bench_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   BENCH_FIELD_COUNT);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void
+bench_fill(struct mail_index *index,
+	   const struct mail_cache_field fields[BENCH_FIELD_COUNT],
+	   unsigned int messages_count)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, new_seq, uid_validity = ioloop_time, received_date;
+	uoff_t virtual_size;
+	char envelope[BENCH_ENVELOPE_SIZE];
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= messages_count; seq++)
+		mail_index_append(trans, seq, &new_seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	memset(envelope, 'x', sizeof(envelope));
+	for (seq = 1; seq <= messages_count; seq++) {
+		received_date = ioloop_time - messages_count + seq;
+		virtual_size = 1000 + seq % 5000;
+		mail_cache_add(cache_trans, seq,
+			       fields[BENCH_FIELD_RECEIVED_DATE].idx,
+			       &received_date, sizeof(received_date));
+		mail_cache_add(cache_trans, seq,
+			       fields[BENCH_FIELD_VIRTUAL_SIZE].idx,
+			       &virtual_size, sizeof(virtual_size));
+		mail_cache_add(cache_trans, seq,
+			       fields[BENCH_FIELD_ENVELOPE].idx,
+			       envelope, sizeof(envelope));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void bench_compress(struct mail_index *index)
+{
+	struct mail_cache *cache = mail_index_get_cache(index);
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+
+	/* enabling columns makes the cache want to be compressed */
+	mail_cache_set_columns(cache, TRUE);
+	if (!mail_cache_need_compress(cache))
+		i_fatal("Cache doesn't want to be compressed");
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_cache_compress(cache, trans, &lock) < 0)
+		i_fatal("mail_cache_compress() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	mail_cache_compress_unlock(&lock);
+}
+
+static long long
+bench_lookup(const enum bench_field *lookup_fields, unsigned int count)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct bench_timer timer;
+	long long usecs;
+	uint32_t seq, messages_count;
+	unsigned int i;
+	buffer_t *buf;
+
+	index = bench_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	mail_cache_view_update_cache_decisions(cache_view, FALSE);
+	messages_count = mail_index_view_get_messages_count(view);
+	buf = buffer_create_dynamic(default_pool, 256);
+
+	bench_timer_start(&timer);
+	for (seq = 1; seq <= messages_count; seq++) {
+		for (i = 0; i < count; i++) {
+			buffer_set_used_size(buf, 0);
+			if (mail_cache_lookup_field(cache_view, buf, seq,
+					fields[lookup_fields[i]].idx) <= 0)
+				i_fatal("Field %s not cached for seq %u",
+					fields[lookup_fields[i]].name, seq);
+		}
+	}
+	usecs = bench_timer_lap(&timer);
+
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+	return usecs;
+}
+
+static void bench_layout(unsigned int messages_count, unsigned int rounds,
+			 const char *layout)
+{
+	static const enum bench_field sort_fields[] = {
+		BENCH_FIELD_RECEIVED_DATE
+	};
+	static const enum bench_field fetch_fields[] = {
+		BENCH_FIELD_RECEIVED_DATE, BENCH_FIELD_VIRTUAL_SIZE
+	};
+	static const enum bench_field envelope_fields[] = {
+		BENCH_FIELD_ENVELOPE
+	};
+	long long sort_usecs = 0, fetch_usecs = 0, envelope_usecs = 0;
+	unsigned int i;
+
+	for (i = 0; i < rounds; i++) {
+		sort_usecs += bench_lookup(sort_fields,
+					   N_ELEMENTS(sort_fields));
+		fetch_usecs += bench_lookup(fetch_fields,
+					    N_ELEMENTS(fetch_fields));
+		envelope_usecs += bench_lookup(envelope_fields,
+					       N_ELEMENTS(envelope_fields));
+	}
+	printf("%9u %-8s %12lld %12lld %12lld\n", messages_count, layout,
+	       sort_usecs / rounds, fetch_usecs / rounds,
+	       envelope_usecs / rounds);
+}
+
+static void bench_mailbox_size(unsigned int messages_count, unsigned int rounds)
+{
+	struct mail_cache_field fields[BENCH_FIELD_COUNT];
+	struct mail_index *index;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = bench_index_open(fields);
+	bench_fill(index, fields, messages_count);
+
+	bench_layout(messages_count, rounds, "records");
+	bench_compress(index);
+	bench_layout(messages_count, rounds, "columns");
+
+	bench_index_close(&index);
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count, max_messages = 100000, rounds = 10;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "max messages", 0, UINT_MAX,
+		       &max_messages);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-cache.%s", my_pid);
+
+	printf("%9s %-8s %9s/us %9s/us %9s/us\n", "messages", "layout",
+	       "sort", "fetch", "envelope");
+	for (messages_count = 1000; messages_count <= max_messages;
+	     messages_count *= 10)
+		bench_mailbox_size(messages_count, rounds);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
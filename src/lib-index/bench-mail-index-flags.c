@@ -0,0 +1,303 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare finding the messages that match UNSEEN, FLAGGED and
+   KEYWORD $Junk by looking up each message's flags and keywords like
+   index-search does, or with mail_index_lookup_flags_seqs(). Between each
+   round some flags and keywords are changed, a message is expunged and a
+   new one is appended, and the view is synced, so the bitmaps need to be
+   kept updated. The first bitmap lookup also builds the bitmaps, so it's
+   shown separately. The results are checked to be the same with both
+   methods.
+
+   Usage: bench-mail-index-flags [<messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+enum bench_query {
+	BENCH_QUERY_UNSEEN,
+	BENCH_QUERY_FLAGGED,
+	BENCH_QUERY_JUNK,
+
+	BENCH_QUERY_COUNT
+};
+
+static const char *bench_query_names[BENCH_QUERY_COUNT] = {
+	"UNSEEN", "FLAGGED", "KEYWORD $Junk"
+};
+
+static const char *const bench_keywords[] = { "$Junk", NULL };
+
+static const char *index_dir;
+static unsigned int junk_idx;
+
+static enum mail_flags bench_initial_flags(uint32_t seq)
+{
+	enum mail_flags flags = 0;
+
+	if (seq % 10 != 0)
+		flags |= MAIL_SEEN;
+	if (seq % 50 == 0)
+		flags |= MAIL_FLAGGED;
+	return flags;
+}
+
+static void bench_fill(struct mail_index *index, unsigned int messages_count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	uint32_t seq, new_seq, uid_validity = ioloop_time;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	keywords = mail_index_keywords_create(index, bench_keywords);
+	for (seq = 1; seq <= messages_count; seq++) {
+		mail_index_append(trans, seq, &new_seq);
+		mail_index_update_flags(trans, new_seq, MODIFY_REPLACE,
+					bench_initial_flags(seq));
+		if (seq % 7 == 0) {
+			mail_index_update_keywords(trans, new_seq, MODIFY_ADD,
+						   keywords);
+		}
+	}
+	mail_index_keywords_unref(&keywords);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+static void bench_change(struct mail_index *index, unsigned int round)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	const struct mail_index_header *hdr;
+	uint32_t seq, count, new_seq;
+	unsigned int i;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	count = mail_index_view_get_messages_count(view);
+	hdr = mail_index_get_header(view);
+
+	/* a client reads some mails and moves some to spam */
+	keywords = mail_index_keywords_create(index, bench_keywords);
+	for (i = 0; i < 100; i++) {
+		seq = (round * 7919 + i * 104729) % count + 1;
+		mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		if (i % 10 == 0) {
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_FLAGGED);
+			mail_index_update_keywords(trans, seq, MODIFY_ADD,
+						   keywords);
+		}
+		if (i % 10 == 5) {
+			mail_index_update_keywords(trans, seq, MODIFY_REMOVE,
+						   keywords);
+		}
+	}
+	/* expunge a message somewhere in the middle and get a new one */
+	mail_index_expunge(trans, count / 2 + round % 100);
+	mail_index_append(trans, hdr->next_uid, &new_seq);
+	mail_index_update_keywords(trans, new_seq, MODIFY_ADD, keywords);
+	mail_index_keywords_unref(&keywords);
+
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static void bench_view_sync(struct mail_index *index,
+			    struct mail_index_view *view)
+{
+	struct mail_index_view_sync_ctx *sync_ctx;
+	struct mail_index_view_sync_rec sync_rec;
+	bool delayed_expunges;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	sync_ctx = mail_index_view_sync_begin(view, 0);
+	while (mail_index_view_sync_next(sync_ctx, &sync_rec)) ;
+	if (mail_index_view_sync_commit(&sync_ctx, &delayed_expunges) < 0)
+		i_fatal("mail_index_view_sync_commit() failed");
+}
+
+static bool bench_scan_match(struct mail_index_view *view, uint32_t seq,
+			     enum bench_query query,
+			     ARRAY_TYPE(keyword_indexes) *keyword_idx)
+{
+	const struct mail_index_record *rec;
+	const unsigned int *idx;
+
+	switch (query) {
+	case BENCH_QUERY_UNSEEN:
+		rec = mail_index_lookup(view, seq);
+		return (rec->flags & MAIL_SEEN) == 0;
+	case BENCH_QUERY_FLAGGED:
+		rec = mail_index_lookup(view, seq);
+		return (rec->flags & MAIL_FLAGGED) != 0;
+	case BENCH_QUERY_JUNK:
+		array_clear(keyword_idx);
+		mail_index_lookup_keywords(view, seq, keyword_idx);
+		array_foreach(keyword_idx, idx) {
+			if (*idx == junk_idx)
+				return TRUE;
+		}
+		return FALSE;
+	case BENCH_QUERY_COUNT:
+		break;
+	}
+	i_unreached();
+}
+
+static long long
+bench_query(struct mail_index_view *view, enum bench_query query,
+	    bool bitmap, ARRAY_TYPE(seq_range) *seqs)
+{
+	ARRAY_TYPE(keyword_indexes) keyword_idx;
+	struct mail_keywords *keywords;
+	struct bench_timer timer;
+	long long usecs;
+	uint32_t seq, count;
+
+	array_clear(seqs);
+	t_array_init(&keyword_idx, 8);
+	keywords = mail_index_keywords_create(mail_index_view_get_index(view),
+					      bench_keywords);
+
+	bench_timer_start(&timer);
+	if (!bitmap) {
+		count = mail_index_view_get_messages_count(view);
+		for (seq = 1; seq <= count; seq++) {
+			if (bench_scan_match(view, seq, query, &keyword_idx))
+				seq_range_array_add(seqs, seq);
+		}
+	} else switch (query) {
+	case BENCH_QUERY_UNSEEN:
+		mail_index_lookup_flags_seqs(view, MAIL_SEEN, NULL, TRUE, seqs);
+		break;
+	case BENCH_QUERY_FLAGGED:
+		mail_index_lookup_flags_seqs(view, MAIL_FLAGGED, NULL,
+					     FALSE, seqs);
+		break;
+	case BENCH_QUERY_JUNK:
+		mail_index_lookup_flags_seqs(view, 0, keywords, FALSE, seqs);
+		break;
+	case BENCH_QUERY_COUNT:
+		i_unreached();
+	}
+	usecs = bench_timer_lap(&timer);
+
+	mail_index_keywords_unref(&keywords);
+	return usecs;
+}
+
+static bool bench_seqs_equal(const ARRAY_TYPE(seq_range) *seqs1,
+			     const ARRAY_TYPE(seq_range) *seqs2)
+{
+	const struct seq_range *range1, *range2;
+	unsigned int count1, count2;
+
+	range1 = array_get(seqs1, &count1);
+	range2 = array_get(seqs2, &count2);
+	return count1 == count2 &&
+		memcmp(range1, range2, sizeof(*range1) * count1) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	ARRAY_TYPE(seq_range) scan_seqs, bitmap_seqs;
+	long long scan_usecs[BENCH_QUERY_COUNT];
+	long long build_usecs[BENCH_QUERY_COUNT];
+	long long bitmap_usecs[BENCH_QUERY_COUNT];
+	unsigned int matches[BENCH_QUERY_COUNT];
+	unsigned int messages_count = 500000, rounds = 10, i;
+	enum bench_query query;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "messages", 200, UINT_MAX,
+		       &messages_count);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-index-flags.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	bench_fill(index, messages_count);
+	if (!mail_index_keyword_lookup(index, bench_keywords[0], &junk_idx))
+		i_unreached();
+
+	/* the view is kept open like a mailbox's view */
+	view = mail_index_view_open(index);
+	i_array_init(&scan_seqs, 1024);
+	i_array_init(&bitmap_seqs, 1024);
+	memset(scan_usecs, 0, sizeof(scan_usecs));
+	memset(bitmap_usecs, 0, sizeof(bitmap_usecs));
+
+	for (i = 0; i <= rounds; i++) {
+		if (i > 0) {
+			bench_change(index, i);
+			bench_view_sync(index, view);
+		}
+		for (query = 0; query < BENCH_QUERY_COUNT; query++) T_BEGIN {
+			if (i > 0) {
+				scan_usecs[query] += bench_query(view, query,
+						FALSE, &scan_seqs);
+				bitmap_usecs[query] += bench_query(view, query,
+						TRUE, &bitmap_seqs);
+			} else {
+				(void)bench_query(view, query, FALSE,
+						  &scan_seqs);
+				build_usecs[query] = bench_query(view, query,
+						TRUE, &bitmap_seqs);
+			}
+			if (!bench_seqs_equal(&scan_seqs, &bitmap_seqs)) {
+				i_fatal("%s: Results differ in round %u",
+					bench_query_names[query], i);
+			}
+			matches[query] = seq_range_count(&bitmap_seqs);
+		} T_END;
+	}
+	array_free(&scan_seqs);
+	array_free(&bitmap_seqs);
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	printf("%-14s %9s %12s %12s %12s\n", "query", "matches",
+	       "scan/us", "build/us", "bitmap/us");
+	for (query = 0; query < BENCH_QUERY_COUNT; query++) {
+		printf("%-14s %9u %12lld %12lld %12lld\n",
+		       bench_query_names[query], matches[query],
+		       scan_usecs[query] / rounds, build_usecs[query],
+		       bitmap_usecs[query] / rounds);
+	}
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,204 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure how long it takes for a reader process to sync a single change
+   written by another process, depending on the number of messages.
+
+   Usage: bench-mail-index-map [<max messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum bench_op {
+	BENCH_OP_FLAGS,
+	BENCH_OP_APPEND,
+	BENCH_OP_EXPUNGE,
+
+	BENCH_OP_COUNT
+};
+
+static const char *bench_op_names[BENCH_OP_COUNT] = {
+	"flags", "append", "expunge"
+};
+
+static const char *index_dir;
+
+static struct mail_index *bench_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_header *hdr;
+	uint32_t seq, next_uid, uid_validity;
+	unsigned int i;
+
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	next_uid = hdr->next_uid;
+	trans = mail_index_transaction_begin(view, 0);
+	if (hdr->uid_validity == 0) {
+		uid_validity = ioloop_time;
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(trans, next_uid + i, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+static void bench_write_change(struct mail_index *index, enum bench_op op)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_record *rec;
+	uint32_t seq;
+
+	switch (op) {
+	case BENCH_OP_FLAGS:
+		/* toggle \Seen flag in the middle of the mailbox */
+		(void)mail_index_refresh(index);
+		view = mail_index_view_open(index);
+		seq = mail_index_view_get_messages_count(view) / 2 + 1;
+		rec = mail_index_lookup(view, seq);
+		trans = mail_index_transaction_begin(view, 0);
+		mail_index_update_flags(trans, seq,
+					(rec->flags & MAIL_SEEN) != 0 ?
+					MODIFY_REMOVE : MODIFY_ADD, MAIL_SEEN);
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("mail_index_transaction_commit() failed");
+		mail_index_view_close(&view);
+		break;
+	case BENCH_OP_APPEND:
+		(void)mail_index_refresh(index);
+		bench_append(index, 1);
+		break;
+	case BENCH_OP_EXPUNGE:
+		/* expunge the first message, so everything after it moves */
+		if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+			i_fatal("mail_index_sync_begin() failed");
+		mail_index_expunge(trans, 1);
+		if (mail_index_sync_commit(&sync_ctx) < 0)
+			i_fatal("mail_index_sync_commit() failed");
+		break;
+	case BENCH_OP_COUNT:
+		i_unreached();
+	}
+}
+
+static long long
+bench_sync_change(struct mail_index *writer, enum bench_op op)
+{
+	struct mail_index *reader;
+	struct mail_index_view *view;
+	struct mail_index_view_sync_ctx *sync_ctx;
+	struct mail_index_view_sync_rec sync_rec;
+	struct bench_timer timer;
+	long long usecs;
+	bool delayed_expunges;
+
+	/* the reader has the mailbox open with an existing view, so its
+	   map is shared when the change is synced. */
+	reader = bench_index_open();
+	view = mail_index_view_open(reader);
+
+	bench_write_change(writer, op);
+
+	bench_timer_start(&timer);
+	if (mail_index_refresh(reader) < 0)
+		i_fatal("mail_index_refresh() failed");
+	sync_ctx = mail_index_view_sync_begin(view, 0);
+	while (mail_index_view_sync_next(sync_ctx, &sync_rec)) ;
+	if (mail_index_view_sync_commit(&sync_ctx, &delayed_expunges) < 0)
+		i_fatal("mail_index_view_sync_commit() failed");
+	usecs = bench_timer_lap(&timer);
+
+	mail_index_view_close(&view);
+	bench_index_close(&reader);
+	return usecs;
+}
+
+static void bench_mailbox_size(unsigned int messages_count, unsigned int rounds)
+{
+	struct mail_index *writer;
+	long long usecs[BENCH_OP_COUNT];
+	unsigned int i, op;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	/* create the mailbox and write the index file */
+	writer = bench_index_open();
+	bench_append(writer, messages_count);
+	bench_write_change(writer, BENCH_OP_EXPUNGE);
+
+	memset(usecs, 0, sizeof(usecs));
+	for (i = 0; i < rounds; i++) {
+		for (op = 0; op < BENCH_OP_COUNT; op++)
+			usecs[op] += bench_sync_change(writer, op);
+	}
+	bench_index_close(&writer);
+
+	printf("%9u", messages_count);
+	for (op = 0; op < BENCH_OP_COUNT; op++)
+		printf(" %12lld", usecs[op] / rounds);
+	printf("\n");
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count, max_messages = 1000000, rounds = 10;
+	unsigned int op;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "max messages", 0, UINT_MAX,
+		       &max_messages);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-index-map.%s", my_pid);
+
+	printf("%9s", "messages");
+	for (op = 0; op < BENCH_OP_COUNT; op++)
+		printf(" %9s/us", bench_op_names[op]);
+	printf("\n");
+
+	for (messages_count = 1000; messages_count <= max_messages;
+	     messages_count *= 10)
+		bench_mailbox_size(messages_count, rounds);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
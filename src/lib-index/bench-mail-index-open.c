@@ -0,0 +1,200 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare how long it takes to do what SELECT does to the index files with
+   and without mail_index_prefetch(): open the index, count the unseen
+   messages and look up a cached field, which opens the cache file. With
+   posix_fadvise() the files are dropped from the page cache before each
+   round, so this measures reading them from the storage. The difference is
+   largest with network filesystems, where each read is a round-trip.
+
+   Usage: bench-mail-index-open [<max messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static struct mail_cache_field bench_cache_field = {
+	.name = "date.received",
+	.type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	.field_size = sizeof(uint32_t),
+	.decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED
+};
+
+static const char *index_dir;
+
+static struct mail_index *
+bench_index_open(enum mail_index_open_flags flags, bool prefetch)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (prefetch)
+		mail_index_prefetch(index);
+	if (mail_index_open(index, flags) <= 0)
+		i_fatal("mail_index_open(%s) failed", index_dir);
+	mail_cache_register_fields(mail_index_get_cache(index),
+				   &bench_cache_field, 1);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_fill(unsigned int messages_count)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, new_seq, uid_validity = ioloop_time, received_date;
+
+	index = bench_index_open(MAIL_INDEX_OPEN_FLAG_CREATE, FALSE);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= messages_count; seq++) {
+		mail_index_append(trans, seq, &new_seq);
+		if (seq % 3 != 0) {
+			mail_index_update_flags(trans, new_seq, MODIFY_REPLACE,
+						MAIL_SEEN);
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= messages_count; seq++) {
+		received_date = ioloop_time - messages_count + seq;
+		mail_cache_add(cache_trans, seq, bench_cache_field.idx,
+			       &received_date, sizeof(received_date));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+}
+
+static void bench_drop_cache(const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_fatal("open(%s) failed: %m", path);
+		return;
+	}
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	i_close_fd(&fd);
+#endif
+}
+
+static long long bench_open(bool prefetch)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	const struct mail_index_record *rec;
+	struct bench_timer timer;
+	long long usecs;
+	uint32_t seq, messages_count, unseen_count = 0;
+	const char *path;
+	buffer_t *buf;
+
+	path = t_strconcat(index_dir, "/dovecot.index", NULL);
+	bench_drop_cache(path);
+	bench_drop_cache(t_strconcat(path, ".log", NULL));
+	bench_drop_cache(t_strconcat(path, ".cache", NULL));
+	buf = buffer_create_dynamic(default_pool, 64);
+
+	bench_timer_start(&timer);
+	index = bench_index_open(0, prefetch);
+	view = mail_index_view_open(index);
+	messages_count = mail_index_view_get_messages_count(view);
+	for (seq = 1; seq <= messages_count; seq++) {
+		rec = mail_index_lookup(view, seq);
+		if ((rec->flags & MAIL_SEEN) == 0)
+			unseen_count++;
+	}
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	if (mail_cache_lookup_field(cache_view, buf, messages_count,
+				    bench_cache_field.idx) <= 0)
+		i_fatal("Field not cached for seq %u", messages_count);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+	usecs = bench_timer_lap(&timer);
+
+	if (unseen_count != messages_count / 3)
+		i_fatal("Unexpected unseen count %u", unseen_count);
+	buffer_free(&buf);
+	return usecs;
+}
+
+static void bench_mailbox_size(unsigned int messages_count, unsigned int rounds)
+{
+	long long sequential_usecs = 0, prefetch_usecs = 0;
+	unsigned int i;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	bench_fill(messages_count);
+
+	for (i = 0; i < rounds; i++) {
+		sequential_usecs += bench_open(FALSE);
+		prefetch_usecs += bench_open(TRUE);
+	}
+	printf("%9u %13lld %13lld\n", messages_count,
+	       sequential_usecs / rounds, prefetch_usecs / rounds);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count, max_messages = 100000, rounds = 10;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "max messages", 0, UINT_MAX,
+		       &max_messages);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-index-open.%s", my_pid);
+
+	printf("%9s %13s %13s\n", "messages", "sequential/us", "prefetch/us");
+	for (messages_count = 1000; messages_count <= max_messages;
+	     messages_count *= 10)
+		bench_mailbox_size(messages_count, rounds);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
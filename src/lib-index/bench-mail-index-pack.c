@@ -0,0 +1,226 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare the size of dovecot.index and how long it takes to open it and
+   read through all of its records, with and without
+   MAIL_INDEX_OPEN_FLAG_PACK_RECORDS. The index has modseq tracking enabled
+   and some of the messages have been modified after they were saved. With
+   posix_fadvise() the file is dropped from the page cache before each
+   round. The records are also checked to be the same in both files.
+
+   Usage: bench-mail-index-pack [<max messages> [<rounds>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "mail-index-private.h"
+#include "mail-index-modseq.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_CHANGES_PER_TRANSACTION 100
+
+static const char *index_dir;
+
+static struct mail_index *bench_index_open(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, flags) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_commit(struct mail_index_transaction **trans)
+{
+	if (mail_index_transaction_commit(trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+}
+
+static void bench_fill(struct mail_index *index, unsigned int messages_count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans = NULL;
+	uint32_t seq, uid = 0, uid_validity = ioloop_time;
+	unsigned int i;
+
+	mail_index_modseq_enable(index);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (i = 0; i < messages_count; i++) {
+		/* leave some gaps for expunged messages */
+		uid += 1 + (rand() % 8 == 0 ? rand() % 10 : 0);
+		mail_index_append(trans, uid, &seq);
+		if (rand() % 3 != 0)
+			mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+						MAIL_SEEN);
+	}
+	bench_commit(&trans);
+	mail_index_view_close(&view);
+
+	/* modify some of the messages afterwards to grow their modseqs */
+	view = mail_index_view_open(index);
+	for (i = 0; i < messages_count / 10; i++) {
+		if (i % BENCH_CHANGES_PER_TRANSACTION == 0) {
+			if (i > 0)
+				bench_commit(&trans);
+			trans = mail_index_transaction_begin(view,
+					MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+		}
+		mail_index_update_flags(trans, 1 + rand() % messages_count,
+					MODIFY_ADD, MAIL_FLAGGED);
+	}
+	if (i > 0)
+		bench_commit(&trans);
+	mail_index_view_close(&view);
+}
+
+static void bench_write(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	index = bench_index_open(flags);
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	/* rewrite dovecot.index with the wanted flags */
+	mail_index_write(index, FALSE);
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	bench_index_close(&index);
+}
+
+static void bench_drop_cache(const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_fatal("open(%s) failed: %m", path);
+		return;
+	}
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	i_close_fd(&fd);
+#endif
+}
+
+static long long bench_read(uint64_t *checksum_r)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	struct bench_timer timer;
+	long long usecs;
+	uint32_t seq, messages_count;
+	const char *path;
+	uint64_t checksum = 0;
+
+	path = t_strconcat(index_dir, "/dovecot.index", NULL);
+	bench_drop_cache(path);
+	bench_drop_cache(t_strconcat(path, ".log", NULL));
+
+	bench_timer_start(&timer);
+	index = bench_index_open(0);
+	view = mail_index_view_open(index);
+	messages_count = mail_index_view_get_messages_count(view);
+	for (seq = 1; seq <= messages_count; seq++) {
+		rec = mail_index_lookup(view, seq);
+		checksum = checksum * 31 + rec->uid;
+		checksum = checksum * 31 + rec->flags;
+		checksum = checksum * 31 + mail_index_modseq_lookup(view, seq);
+	}
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+	usecs = bench_timer_lap(&timer);
+
+	*checksum_r = checksum;
+	return usecs;
+}
+
+static void
+bench_layout(unsigned int messages_count, unsigned int rounds,
+	     enum mail_index_open_flags flags, uint64_t *checksum)
+{
+	struct stat st;
+	uint64_t round_checksum;
+	unsigned int i;
+	long long usecs = 0;
+
+	bench_write(flags);
+	if (stat(t_strconcat(index_dir, "/dovecot.index", NULL), &st) < 0)
+		i_fatal("stat(dovecot.index) failed: %m");
+
+	for (i = 0; i < rounds; i++) {
+		usecs += bench_read(&round_checksum);
+		if (*checksum == 0)
+			*checksum = round_checksum;
+		else if (round_checksum != *checksum)
+			i_fatal("Records differ after reading dovecot.index");
+	}
+	printf("%9u %-8s %12"PRIuUOFF_T" %12lld\n", messages_count,
+	       (flags & MAIL_INDEX_OPEN_FLAG_PACK_RECORDS) != 0 ?
+	       "packed" : "plain", (uoff_t)st.st_size, usecs / rounds);
+}
+
+static void bench_mailbox_size(unsigned int messages_count, unsigned int rounds)
+{
+	struct mail_index *index;
+	uint64_t checksum = 0;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	index = bench_index_open(MAIL_INDEX_OPEN_FLAG_CREATE);
+	bench_fill(index, messages_count);
+	bench_index_close(&index);
+
+	bench_layout(messages_count, rounds, 0, &checksum);
+	bench_layout(messages_count, rounds,
+		     MAIL_INDEX_OPEN_FLAG_PACK_RECORDS, &checksum);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int messages_count, max_messages = 100000, rounds = 10;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "max messages", 0, UINT_MAX,
+		       &max_messages);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-index-pack.%s", my_pid);
+
+	printf("%9s %-8s %12s %12s\n", "messages", "layout",
+	       "index bytes", "read/us");
+	for (messages_count = 1000; messages_count <= max_messages;
+	     messages_count *= 10)
+		bench_mailbox_size(messages_count, rounds);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,244 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare how quickly reader processes can follow a mailbox that other
+   processes keep changing, with and without
+   MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET. Writers commit flag changes as
+   fast as they can, while readers refresh the index and sync their view in
+   a loop, like IMAP processes do in shared mailboxes. Readers mmap() the
+   transaction log, so without commit offsets they have to check whether the
+   log changed while it was being read and retry if it did.
+
+   Usage: bench-mail-index-readers [<readers> [<writers> [<secs>]]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_MESSAGES_COUNT 10000
+
+struct bench_result {
+	bool writer;
+	unsigned int count;
+	long long max_usecs;
+};
+
+static const char *index_dir;
+
+static struct mail_index *bench_index_open(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, flags) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_fill(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, new_seq, uid_validity = ioloop_time;
+
+	index = bench_index_open(flags);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= BENCH_MESSAGES_COUNT; seq++)
+		mail_index_append(trans, seq, &new_seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+}
+
+static bool bench_timeout(const struct timeval *end)
+{
+	struct timeval now;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_cmp(&now, end) >= 0;
+}
+
+static void
+bench_writer(enum mail_index_open_flags flags, const struct timeval *end,
+	     struct bench_result *result_r)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq;
+
+	index = bench_index_open(flags);
+	view = mail_index_view_open(index);
+	while (!bench_timeout(end)) {
+		trans = mail_index_transaction_begin(view,
+					MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+		seq = 1 + rand() % BENCH_MESSAGES_COUNT;
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+			(result_r->count % 2) == 0 ? MAIL_FLAGGED : MAIL_SEEN);
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("mail_index_transaction_commit() failed");
+		result_r->count++;
+	}
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+}
+
+static void
+bench_reader(enum mail_index_open_flags flags, const struct timeval *end,
+	     struct bench_result *result_r)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_view_sync_ctx *sync_ctx;
+	struct mail_index_view_sync_rec sync_rec;
+	struct bench_timer timer;
+	long long usecs;
+	bool delayed_expunges;
+
+	index = bench_index_open(flags);
+	view = mail_index_view_open(index);
+	for (;;) {
+		if (bench_timeout(end))
+			break;
+		bench_timer_start(&timer);
+
+		if (mail_index_refresh(index) < 0)
+			i_fatal("mail_index_refresh() failed");
+		sync_ctx = mail_index_view_sync_begin(view, 0);
+		while (mail_index_view_sync_next(sync_ctx, &sync_rec)) ;
+		if (mail_index_view_sync_commit(&sync_ctx,
+						&delayed_expunges) < 0)
+			i_fatal("mail_index_view_sync_commit() failed");
+
+		usecs = bench_timer_lap(&timer);
+		if (usecs > result_r->max_usecs)
+			result_r->max_usecs = usecs;
+		result_r->count++;
+	}
+	mail_index_view_close(&view);
+	bench_index_close(&index);
+}
+
+static void
+bench_mode(enum mail_index_open_flags flags, unsigned int readers_count,
+	   unsigned int writers_count, unsigned int secs)
+{
+	struct bench_result result, readers, writers;
+	struct timeval end;
+	unsigned int i, count = readers_count + writers_count;
+	int fd[2], status;
+	pid_t pid;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	bench_fill(flags);
+
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	end.tv_sec += secs;
+
+	/* don't let the children flush our output */
+	fflush(stdout);
+	for (i = 0; i < count; i++) {
+		if ((pid = fork()) < 0)
+			i_fatal("fork() failed: %m");
+		if (pid != 0)
+			continue;
+
+		srand(getpid());
+		memset(&result, 0, sizeof(result));
+		result.writer = i < writers_count;
+		if (result.writer)
+			bench_writer(flags, &end, &result);
+		else
+			bench_reader(flags, &end, &result);
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+			i_fatal("write(pipe) failed: %m");
+		exit(0);
+	}
+
+	memset(&readers, 0, sizeof(readers));
+	memset(&writers, 0, sizeof(writers));
+	for (i = 0; i < count; i++) {
+		if (read(fd[0], &result, sizeof(result)) != sizeof(result))
+			i_fatal("read(pipe) failed: %m");
+		if (result.writer)
+			writers.count += result.count;
+		else {
+			readers.count += result.count;
+			if (result.max_usecs > readers.max_usecs)
+				readers.max_usecs = result.max_usecs;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (wait(&status) < 0)
+			i_fatal("wait() failed: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			i_fatal("Child process failed");
+	}
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+
+	printf("%-14s %12u %12u %12lld\n",
+	       (flags & MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET) != 0 ?
+	       "commit-offset" : "fstat",
+	       writers.count / secs, readers.count / secs,
+	       readers.max_usecs);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int readers_count = 8, writers_count = 2, secs = 5;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "readers", 1, UINT_MAX, &readers_count);
+	bench_arg_uint(argc, argv, 2, "writers", 1, UINT_MAX, &writers_count);
+	bench_arg_uint(argc, argv, 3, "secs", 1, UINT_MAX, &secs);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-index-readers.%s",
+				    my_pid);
+
+	printf("%u readers, %u writers, %u secs\n",
+	       readers_count, writers_count, secs);
+	printf("%-14s %12s %12s %12s\n", "mode", "commits/s", "refreshes/s",
+	       "max refresh/us");
+	bench_mode(MAIL_INDEX_OPEN_FLAG_CREATE, readers_count, writers_count,
+		   secs);
+	bench_mode(MAIL_INDEX_OPEN_FLAG_CREATE |
+		   MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET,
+		   readers_count, writers_count, secs);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,234 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare the size of a rotated transaction log and how long it takes for
+   a freshly opened index to read through all of its transactions, with and
+   without mail_index_set_log_compression(). This is what happens when an
+   old view (e.g. QRESYNC or dsync) is synced from the .log.2 file. The log
+   is filled with appends and flag changes until it gets rotated because of
+   its size. With posix_fadvise() the files are dropped from the page cache
+   before each round.
+
+   Usage: bench-mail-transaction-log [<rounds>] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "compression.h"
+#include "mail-index-private.h"
+#include "mail-transaction-log.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_APPENDS_PER_TRANSACTION 10
+#define BENCH_TRANSACTIONS_PER_SYNC 100
+
+static const char *index_dir;
+
+static struct mail_index *
+bench_index_open(const struct compression_handler *handler)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	mail_index_set_log_compression(index, handler);
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void bench_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void bench_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static void
+bench_write_transaction(struct mail_index *index, unsigned int keyword_idx)
+{
+	static const char *keyword_names[] = { "$Label1", NULL };
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	const struct mail_index_header *hdr;
+	uint32_t seq, next_uid, uid_validity, count;
+	unsigned int i;
+
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	next_uid = hdr->next_uid;
+	count = hdr->messages_count;
+	trans = mail_index_transaction_begin(view,
+				MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (hdr->uid_validity == 0) {
+		uid_validity = ioloop_time;
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < BENCH_APPENDS_PER_TRANSACTION; i++) {
+		mail_index_append(trans, next_uid + i, &seq);
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+					MAIL_RECENT);
+	}
+	if (count > 0) {
+		/* mark some older messages seen and flag a few of them */
+		seq = 1 + keyword_idx * 7 % count;
+		mail_index_update_flags_range(trans, seq,
+					      I_MIN(seq + 5, count),
+					      MODIFY_ADD, MAIL_SEEN);
+		keywords = mail_index_keywords_create(index, keyword_names);
+		mail_index_update_keywords(trans, 1 + keyword_idx * 13 % count,
+					   MODIFY_ADD, keywords);
+		mail_index_keywords_unref(&keywords);
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+static unsigned int bench_fill(struct mail_index *index)
+{
+	const char *log2_path = t_strconcat(index->filepath,
+		MAIL_TRANSACTION_LOG_SUFFIX".2", NULL);
+	unsigned int i;
+	struct stat st;
+
+	for (i = 1;; i++) {
+		bench_write_transaction(index, i);
+		if (i % BENCH_TRANSACTIONS_PER_SYNC != 0)
+			continue;
+
+		/* the log gets rotated while syncing */
+		bench_sync(index);
+		if (stat(log2_path, &st) == 0)
+			break;
+		if (errno != ENOENT)
+			i_fatal("stat(%s) failed: %m", log2_path);
+	}
+	/* a few more changes to the new .log */
+	bench_write_transaction(index, i);
+	bench_sync(index);
+	return i * BENCH_APPENDS_PER_TRANSACTION;
+}
+
+static void bench_drop_cache(const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_fatal("open(%s) failed: %m", path);
+		return;
+	}
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	i_close_fd(&fd);
+#endif
+}
+
+static long long
+bench_read_log(const struct compression_handler *handler,
+	       unsigned int *records_count_r)
+{
+	struct mail_index *index;
+	struct mail_transaction_log_view *log_view;
+	const struct mail_transaction_header *hdr;
+	const void *data;
+	struct bench_timer timer;
+	long long usecs;
+	const char *path;
+
+	path = t_strconcat(index_dir, "/dovecot.index", NULL);
+	bench_drop_cache(path);
+	bench_drop_cache(t_strconcat(path, ".log", NULL));
+	bench_drop_cache(t_strconcat(path, ".log.2", NULL));
+
+	bench_timer_start(&timer);
+	index = bench_index_open(handler);
+	log_view = mail_transaction_log_view_open(index->log);
+	if (mail_transaction_log_view_set_all(log_view) < 0)
+		i_fatal("mail_transaction_log_view_set_all() failed");
+	*records_count_r = 0;
+	while (mail_transaction_log_view_next(log_view, &hdr, &data) > 0)
+		*records_count_r += 1;
+	mail_transaction_log_view_close(&log_view);
+	bench_index_close(&index);
+	usecs = bench_timer_lap(&timer);
+	return usecs;
+}
+
+static void
+bench_layout(unsigned int rounds, const struct compression_handler *handler)
+{
+	struct mail_index *index;
+	struct stat st;
+	unsigned int i, messages_count, records_count = 0;
+	long long usecs = 0;
+
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = bench_index_open(handler);
+	messages_count = bench_fill(index);
+	bench_index_close(&index);
+
+	for (i = 0; i < rounds; i++)
+		usecs += bench_read_log(handler, &records_count);
+
+	if (stat(t_strconcat(index_dir, "/dovecot.index.log.2", NULL), &st) < 0)
+		i_fatal("stat(dovecot.index.log.2) failed: %m");
+	printf("%9u %-6s %12"PRIuUOFF_T" %9u %12lld\n", messages_count,
+	       handler == NULL ? "none" : handler->name,
+	       (uoff_t)st.st_size, records_count, usecs / rounds);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct compression_handler *handler;
+	struct ioloop *ioloop;
+	unsigned int i, rounds = 10;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "rounds", 1, UINT_MAX, &rounds);
+
+	index_dir = t_strdup_printf("/tmp/bench-mail-transaction-log.%s",
+				    my_pid);
+
+	printf("%9s %-6s %12s %9s %9s/us\n", "messages", "compr",
+	       ".log.2 bytes", "records", "read");
+	bench_layout(rounds, NULL);
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		handler = &compression_handlers[i];
+		if (handler->create_ostream != NULL &&
+		    handler->is_compressed != NULL)
+			bench_layout(rounds, handler);
+	}
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
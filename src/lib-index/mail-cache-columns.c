@@ -0,0 +1,225 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-cache-private.h"
+
+void mail_cache_columns_free(struct mail_cache *cache)
+{
+	i_free_and_null(cache->columns);
+	memset(&cache->column_hdr, 0, sizeof(cache->column_hdr));
+	cache->column_row_skip = 0;
+	cache->columns_read = FALSE;
+}
+
+static bool
+mail_cache_column_verify(struct mail_cache *cache,
+			 const struct mail_cache_column *column)
+{
+	const struct mail_cache_field *field;
+	uint32_t rows_count = cache->column_hdr.rows_count;
+	unsigned int i;
+
+	if (column->file_field >= cache->file_fields_count) {
+		mail_cache_set_corrupted(cache,
+			"column field index too large (%u >= %u)",
+			column->file_field, cache->file_fields_count);
+		return FALSE;
+	}
+	field = &cache->fields[cache->file_field_map[column->file_field]].field;
+	if (field->type != MAIL_CACHE_FIELD_FIXED_SIZE ||
+	    field->field_size != column->field_size ||
+	    column->field_size == 0) {
+		mail_cache_set_corrupted(cache,
+			"column for field %s has invalid size %u",
+			field->name, column->field_size);
+		return FALSE;
+	}
+	if ((uoff_t)column->bitmap_offset + (rows_count + 7) / 8 >
+	    (uint32_t)-1 ||
+	    (uoff_t)column->data_offset +
+	    (uoff_t)rows_count * column->field_size > (uint32_t)-1) {
+		mail_cache_set_corrupted(cache,
+			"column for field %s points outside file", field->name);
+		return FALSE;
+	}
+	for (i = 0; cache->columns + i != column; i++) {
+		if (cache->columns[i].file_field == column->file_field) {
+			mail_cache_set_corrupted(cache,
+				"duplicate column for field %s", field->name);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+int mail_cache_columns_read(struct mail_cache *cache)
+{
+	const struct mail_cache_column_header *column_hdr;
+	const void *data;
+	size_t offset;
+	unsigned int i;
+	int ret;
+
+	if (cache->columns_read || MAIL_CACHE_IS_UNUSABLE(cache))
+		return 0;
+	cache->columns_read = TRUE;
+
+	if (!MAIL_CACHE_HAS_COLUMNS(cache->hdr))
+		return 0;
+
+	offset = sizeof(struct mail_cache_header);
+	ret = mail_cache_map(cache, offset, sizeof(*column_hdr), &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"column header points outside file");
+		}
+		return -1;
+	}
+	column_hdr = data;
+	if (column_hdr->columns_count > cache->file_fields_count ||
+	    column_hdr->uids_offset % sizeof(uint32_t) != 0 ||
+	    (uoff_t)column_hdr->uids_offset +
+	    (uoff_t)column_hdr->rows_count * sizeof(uint32_t) > (uint32_t)-1) {
+		mail_cache_set_corrupted(cache, "invalid column header");
+		return -1;
+	}
+	cache->column_hdr = *column_hdr;
+	if (column_hdr->columns_count == 0)
+		return 0;
+
+	offset += sizeof(*column_hdr);
+	ret = mail_cache_map(cache, offset, cache->column_hdr.columns_count *
+			     sizeof(struct mail_cache_column), &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"column header points outside file");
+		}
+		mail_cache_columns_free(cache);
+		return -1;
+	}
+	cache->columns = i_new(struct mail_cache_column,
+			       cache->column_hdr.columns_count);
+	memcpy(cache->columns, data, cache->column_hdr.columns_count *
+	       sizeof(struct mail_cache_column));
+
+	for (i = 0; i < cache->column_hdr.columns_count; i++) {
+		if (!mail_cache_column_verify(cache, &cache->columns[i])) {
+			mail_cache_columns_free(cache);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool
+mail_cache_columns_bsearch_uid(const uint32_t *uids, uint32_t count,
+			       uint32_t uid, uint32_t *row_r)
+{
+	uint32_t left_idx = 0, right_idx = count, idx;
+
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (uids[idx] < uid)
+			left_idx = idx + 1;
+		else if (uids[idx] > uid)
+			right_idx = idx;
+		else {
+			*row_r = idx;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+int mail_cache_columns_lookup_row(struct mail_cache_view *view, uint32_t seq,
+				  uint32_t *row_r)
+{
+	struct mail_cache *cache = view->cache;
+	const uint32_t *uids;
+	const void *data;
+	uint32_t uid, row, rows_count;
+	int ret;
+
+	if (MAIL_CACHE_IS_UNUSABLE(cache))
+		return 0;
+	if (mail_cache_columns_read(cache) < 0)
+		return -1;
+	rows_count = cache->column_hdr.rows_count;
+	if (cache->column_hdr.columns_count == 0 || rows_count == 0)
+		return 0;
+
+	mail_index_lookup_uid(view->view, seq, &uid);
+	if (uid == 0)
+		return 0;
+
+	ret = mail_cache_map(cache, cache->column_hdr.uids_offset,
+			     rows_count * sizeof(uint32_t), &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"column uids point outside file");
+		}
+		return -1;
+	}
+	uids = data;
+
+	/* the messages were in the same order when the columns were written,
+	   only the expunged messages are missing. */
+	row = seq - 1 + cache->column_row_skip;
+	if (row >= rows_count || uids[row] != uid) {
+		if (!mail_cache_columns_bsearch_uid(uids, rows_count,
+						    uid, &row))
+			return 0;
+		cache->column_row_skip = row >= seq - 1 ? row - (seq - 1) : 0;
+	}
+	*row_r = row;
+	return 1;
+}
+
+const struct mail_cache_column *
+mail_cache_column_get(struct mail_cache *cache, unsigned int file_field)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->column_hdr.columns_count; i++) {
+		if (cache->columns[i].file_field == file_field)
+			return &cache->columns[i];
+	}
+	return NULL;
+}
+
+int mail_cache_column_lookup(struct mail_cache *cache,
+			     const struct mail_cache_column *column,
+			     uint32_t row, const void **data_r)
+{
+	const void *data;
+	int ret;
+
+	i_assert(row < cache->column_hdr.rows_count);
+
+	ret = mail_cache_map(cache, column->bitmap_offset + row / 8, 1, &data);
+	if (ret == 0) {
+		mail_cache_set_corrupted(cache,
+			"column bitmap points outside file");
+		return -1;
+	}
+	if (ret < 0)
+		return -1;
+	if ((*(const uint8_t *)data & (1 << (row % 8))) == 0)
+		return 0;
+
+	ret = mail_cache_map(cache, column->data_offset +
+			     row * column->field_size, column->field_size,
+			     &data);
+	if (ret == 0) {
+		mail_cache_set_corrupted(cache,
+			"column data points outside file");
+		return -1;
+	}
+	if (ret < 0)
+		return -1;
+	*data_r = data;
+	return 1;
+}
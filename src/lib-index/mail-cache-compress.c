@@ -13,15 +13,65 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+struct mail_cache_copy_column {
+	unsigned int field_idx;
+	buffer_t *bitmap, *data;
+};
+
+struct mail_cache_copy_msg {
+	uint32_t uid;
+	/* the message's cache offset in the old file when it was copied,
+	   0 if it had nothing cached */
+	uint32_t src_offset;
+	/* the message's record in the new file, 0 if nothing was copied */
+	uint32_t dest_offset;
+	/* the message's row in the columns */
+	uint32_t row;
+};
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
 
+	struct mail_cache_header hdr;
+	struct ostream *output;
+	/* reserved space for the column headers */
+	buffer_t *column_buf;
+
 	buffer_t *buffer, *field_seen;
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
+	unsigned int used_fields_count, orig_fields_count;
+	unsigned int src_file_fields_count;
+
+	/* field_idx -> index to columns, UINT_MAX if not in columns */
+	unsigned int *field_column_map;
+	ARRAY(struct mail_cache_copy_column) columns;
+	buffer_t *uids;
+	uint32_t row, rows_count;
+
+	/* field_idx -> bytes copied */
+	uint32_t *field_bytes;
+
+	/* file_seq of the cache file we're copying from */
+	uint32_t src_file_seq;
+	/* messages copied so far, sorted by UID */
+	ARRAY(struct mail_cache_copy_msg) msgs;
+
+	int fd;
+	char *temp_path;
+	/* compression dotlock while the copying is done before locking */
+	struct dotlock *dotlock;
+	/* the fields' decisions before they were updated for the copying
+	   (only when copying without locks), and the updated decisions that
+	   the copying uses. orig_fields_count of each. */
+	struct mail_cache_field_private *fields_before, *fields_after;
 
 	uint8_t field_seen_value;
 	bool new_msg;
+	/* a field unknown when the copying started was seen */
+	bool fields_changed;
+	bool stats_reset;
+	bool initialized;
 };
 
 struct mail_cache_compress_lock {
@@ -46,6 +96,19 @@ mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 		dest[i] |= ((const unsigned char*)field->data)[i];
 }
 
+static void
+mail_cache_compress_column(struct mail_cache_copy_context *ctx,
+			   struct mail_cache_copy_column *column,
+			   const struct mail_cache_iterate_field *field)
+{
+	uint8_t *bitmap;
+
+	buffer_write(column->data, ctx->row * field->size,
+		     field->data, field->size);
+	bitmap = buffer_get_space_unsafe(column->bitmap, ctx->row / 8, 1);
+	*bitmap |= 1 << (ctx->row % 8);
+}
+
 static void
 mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			  const struct mail_cache_iterate_field *field)
@@ -55,6 +118,14 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 	uint32_t file_field_idx, size32;
 	uint8_t *field_seen;
 
+	if (field->field_idx >= ctx->orig_fields_count) {
+		/* another process added a new field while we were copying
+		   without locks, and looking it up re-read the field
+		   header. */
+		ctx->fields_changed = TRUE;
+		return;
+	}
+
 	file_field_idx = ctx->field_file_map[field->field_idx];
 	if (file_field_idx == (uint32_t)-1)
 		return;
@@ -71,7 +142,10 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 	}
 	*field_seen = ctx->field_seen_value;
 
-	dec = cache_field->decision & ~MAIL_CACHE_DECISION_FORCED;
+	/* re-reading the field header may have changed the decisions in
+	   cache->fields meanwhile, so use the ones chosen for the copying */
+	dec = ctx->fields_after[field->field_idx].field.decision &
+		~MAIL_CACHE_DECISION_FORCED;
 	if (ctx->new_msg) {
 		if (dec == MAIL_CACHE_DECISION_NO)
 			return;
@@ -80,6 +154,18 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			return;
 	}
 
+	ctx->field_bytes[field->field_idx] += field->size;
+
+	if (ctx->field_column_map != NULL &&
+	    ctx->field_column_map[field->field_idx] != UINT_MAX &&
+	    field->size == cache_field->field_size) {
+		mail_cache_compress_column(ctx,
+			array_idx_modifiable(&ctx->columns,
+				ctx->field_column_map[field->field_idx]),
+			field);
+		return;
+	}
+
 	buffer_append(ctx->buffer, &file_field_idx, sizeof(file_field_idx));
 
 	if (cache_field->field_size == UINT_MAX) {
@@ -124,6 +210,7 @@ mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
 			       unsigned int used_fields_count)
 {
 	struct mail_cache *cache = ctx->cache;
+	struct mail_cache_field_private *priv;
 	struct mail_cache_field *field;
 	unsigned int i, j, idx;
 
@@ -149,57 +236,187 @@ mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
 
 		/* change permanent decisions to temporary decisions.
 		   if they're still permanent they'll get updated later. */
-		field = &cache->fields[i].field;
-		if (field->decision == MAIL_CACHE_DECISION_YES)
+		priv = &cache->fields[i];
+		field = &priv->field;
+		if (field->decision == MAIL_CACHE_DECISION_YES &&
+		    !priv->prefetch)
 			field->decision = MAIL_CACHE_DECISION_TEMP;
+		priv->prefetch = FALSE;
+
+		/* start collecting the lookup statistics again if they
+		   were used for the decisions. */
+		if (ctx->stats_reset) {
+			memset(&priv->file_stats, 0, sizeof(priv->file_stats));
+			memset(&priv->new_stats, 0, sizeof(priv->new_stats));
+		}
+		priv->file_stats.bytes = ctx->field_bytes[i];
+		priv->new_stats.bytes = 0;
 	}
 	i_assert(j == used_fields_count);
+	if (ctx->stats_reset)
+		cache->field_stats_since = ioloop_time;
 
 	buffer_set_used_size(ctx->buffer, 0);
 	mail_cache_header_fields_get(cache, ctx->buffer);
 }
 
-static int
-mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
-		int fd, uint32_t *file_seq_r,
-		ARRAY_TYPE(uint32_t) *ext_offsets)
+static void
+mail_cache_compress_init_columns(struct mail_cache_copy_context *ctx,
+				 uint32_t message_count)
 {
-        struct mail_cache_copy_context ctx;
-	struct mail_cache_lookup_iterate_ctx iter;
-	struct mail_cache_iterate_field field;
-	struct mail_index_view *view;
-	struct mail_cache_view *cache_view;
+	struct mail_cache *cache = ctx->cache;
+	const struct mail_cache_field *field;
+	struct mail_cache_copy_column *column;
+	unsigned int i;
+
+	/* put the fixed size fields that are wanted for all messages into
+	   columns */
+	i_array_init(&ctx->columns, 8);
+	ctx->field_column_map = i_new(unsigned int, cache->fields_count);
+	for (i = 0; i < cache->fields_count; i++) {
+		field = &cache->fields[i].field;
+		ctx->field_column_map[i] = UINT_MAX;
+		if (ctx->field_file_map[i] == (uint32_t)-1 ||
+		    field->type != MAIL_CACHE_FIELD_FIXED_SIZE ||
+		    field->field_size == 0 || field->field_size == UINT_MAX ||
+		    (field->decision & ~MAIL_CACHE_DECISION_FORCED) !=
+		    MAIL_CACHE_DECISION_YES)
+			continue;
+
+		ctx->field_column_map[i] = array_count(&ctx->columns);
+		column = array_append_space(&ctx->columns);
+		column->field_idx = i;
+		column->bitmap = buffer_create_dynamic(default_pool,
+						       message_count / 8 + 1);
+		column->data = buffer_create_dynamic(default_pool,
+					message_count * field->field_size + 1);
+	}
+	/* write the column header even without any columns, so the file
+	   isn't compressed again only to get the columns created */
+	ctx->uids = buffer_create_dynamic(default_pool,
+					  message_count * sizeof(uint32_t) + 1);
+}
+
+static void
+mail_cache_compress_add_row(struct mail_cache_copy_context *ctx, uint32_t uid)
+{
+	struct mail_cache_copy_column *column;
+
+	buffer_append(ctx->uids, &uid, sizeof(uid));
+
+	ctx->row = ctx->rows_count++;
+	array_foreach_modifiable(&ctx->columns, column) {
+		buffer_append_zero(column->data,
+			ctx->cache->fields[column->field_idx].field.field_size);
+		if (ctx->row % 8 == 0)
+			buffer_append_zero(column->bitmap, 1);
+	}
+}
+
+static void
+mail_cache_compress_reset_row(struct mail_cache_copy_context *ctx,
+			      uint32_t row)
+{
+	struct mail_cache_copy_column *column;
+	unsigned int field_size;
+	uint8_t *bitmap;
+
+	ctx->row = row;
+	array_foreach_modifiable(&ctx->columns, column) {
+		field_size = ctx->cache->fields[column->field_idx].field.field_size;
+		buffer_write_zero(column->data, row * field_size, field_size);
+		bitmap = buffer_get_space_unsafe(column->bitmap, row / 8, 1);
+		*bitmap &= ~(1 << (row % 8));
+	}
+}
+
+static void
+mail_cache_compress_write_columns(struct mail_cache_copy_context *ctx,
+				  struct ostream *output, buffer_t *dest)
+{
+	struct mail_cache_column_header column_hdr;
+	struct mail_cache_column cache_column;
+	struct mail_cache_copy_column *column;
+
+	memset(&column_hdr, 0, sizeof(column_hdr));
+	column_hdr.rows_count = ctx->rows_count;
+	column_hdr.uids_offset = output->offset;
+	column_hdr.columns_count = array_count(&ctx->columns);
+	o_stream_nsend(output, ctx->uids->data, ctx->uids->used);
+	buffer_append(dest, &column_hdr, sizeof(column_hdr));
+
+	array_foreach_modifiable(&ctx->columns, column) {
+		memset(&cache_column, 0, sizeof(cache_column));
+		cache_column.file_field = ctx->field_file_map[column->field_idx];
+		cache_column.field_size =
+			ctx->cache->fields[column->field_idx].field.field_size;
+
+		/* keep everything 32bit aligned */
+		if ((column->bitmap->used & 3) != 0) {
+			buffer_append_zero(column->bitmap,
+					   4 - (column->bitmap->used & 3));
+		}
+		if ((column->data->used & 3) != 0) {
+			buffer_append_zero(column->data,
+					   4 - (column->data->used & 3));
+		}
+
+		cache_column.bitmap_offset = output->offset;
+		o_stream_nsend(output, column->bitmap->data,
+			       column->bitmap->used);
+		cache_column.data_offset = output->offset;
+		o_stream_nsend(output, column->data->data, column->data->used);
+
+		buffer_append(dest, &cache_column, sizeof(cache_column));
+	}
+}
+
+static void
+mail_cache_compress_deinit_columns(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache_copy_column *column;
+
+	if (ctx->field_column_map == NULL)
+		return;
+
+	array_foreach_modifiable(&ctx->columns, column) {
+		buffer_free(&column->bitmap);
+		buffer_free(&column->data);
+	}
+	array_free(&ctx->columns);
+	buffer_free(&ctx->uids);
+	i_free(ctx->field_column_map);
+}
+
+static void
+mail_cache_copy_init(struct mail_cache_copy_context *ctx,
+		     struct mail_index_view *view)
+{
+	struct mail_cache *cache = ctx->cache;
 	const struct mail_index_header *idx_hdr;
-	struct mail_cache_header hdr;
-	struct mail_cache_record cache_rec;
-	struct ostream *output;
-	uint32_t message_count, seq, first_new_seq, ext_offset;
-	unsigned int i, used_fields_count, orig_fields_count, record_count;
+	uint32_t message_count;
+	unsigned int i;
 	time_t max_drop_time;
 
-	/* get the latest info on fields */
-	if (mail_cache_header_fields_read(cache) < 0)
-		return -1;
-
-	view = mail_index_transaction_get_view(trans);
-	cache_view = mail_cache_view_open(cache, view);
-	output = o_stream_create_fd_file(fd, 0, FALSE);
-
-	memset(&hdr, 0, sizeof(hdr));
-	hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
-	hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
-	hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
-	hdr.indexid = cache->index->indexid;
-	hdr.file_seq = get_next_file_seq(cache);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
-
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.cache = cache;
-	ctx.buffer = buffer_create_dynamic(default_pool, 4096);
-	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
-	ctx.field_seen_value = 0;
-	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
-	t_array_init(&ctx.bitmask_pos, 32);
+	i_assert(!ctx->initialized);
+	ctx->initialized = TRUE;
+
+	memset(&ctx->hdr, 0, sizeof(ctx->hdr));
+	ctx->hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
+	ctx->hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
+	ctx->hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
+	ctx->hdr.indexid = cache->index->indexid;
+	ctx->hdr.file_seq = get_next_file_seq(cache);
+
+	ctx->src_file_seq = MAIL_CACHE_IS_UNUSABLE(cache) ? 0 :
+		cache->hdr->file_seq;
+	ctx->src_file_fields_count = cache->file_fields_count;
+	ctx->buffer = buffer_create_dynamic(default_pool, 4096);
+	ctx->field_seen = buffer_create_dynamic(default_pool, 64);
+	ctx->field_seen_value = 0;
+	ctx->field_file_map = i_new(uint32_t, cache->fields_count + 1);
+	ctx->field_bytes = i_new(uint32_t, cache->fields_count + 1);
+	i_array_init(&ctx->bitmask_pos, 32);
 
 	/* @UNSAFE: drop unused fields and create a field mapping for
 	   used fields */
@@ -207,14 +424,17 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	max_drop_time = idx_hdr->day_stamp == 0 ? 0 :
 		idx_hdr->day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
 
-	orig_fields_count = cache->fields_count;
+	/* update the decisions based on the lookup statistics */
+	ctx->stats_reset = mail_cache_decisions_compress(cache);
+
+	ctx->orig_fields_count = cache->fields_count;
 	if (cache->file_fields_count == 0) {
 		/* creating the initial cache file. add all fields. */
-		for (i = 0; i < orig_fields_count; i++)
-			ctx.field_file_map[i] = i;
-		used_fields_count = i;
+		for (i = 0; i < ctx->orig_fields_count; i++)
+			ctx->field_file_map[i] = i;
+		ctx->used_fields_count = i;
 	} else {
-		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
+		for (i = 0; i < ctx->orig_fields_count; i++) {
 			struct mail_cache_field_private *priv =
 				&cache->fields[i];
 			enum mail_cache_decision_type dec =
@@ -236,110 +456,304 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 				priv->field.last_used = 0;
 			}
 
-			ctx.field_file_map[i] = !priv->used ?
-				(uint32_t)-1 : used_fields_count++;
+			ctx->field_file_map[i] = !priv->used ?
+				(uint32_t)-1 : ctx->used_fields_count++;
 		}
 	}
 
+	ctx->fields_after = i_new(struct mail_cache_field_private,
+				  ctx->orig_fields_count + 1);
+	memcpy(ctx->fields_after, cache->fields,
+	       sizeof(*cache->fields) * ctx->orig_fields_count);
+
+	message_count = mail_index_view_get_messages_count(view);
+	i_array_init(&ctx->msgs, message_count + 1);
+
+	ctx->output = o_stream_create_fd_file(ctx->fd, 0, FALSE);
+	if (cache->write_columns)
+		mail_cache_compress_init_columns(ctx, message_count);
+	if (ctx->field_column_map != NULL) {
+		/* the column header is written after the records, so just
+		   reserve space for it now */
+		ctx->hdr.minor_version = MAIL_CACHE_MINOR_VERSION_COLUMNS;
+		ctx->column_buf = buffer_create_dynamic(default_pool, 256);
+		buffer_append_zero(ctx->column_buf,
+			sizeof(struct mail_cache_column_header) +
+			array_count(&ctx->columns) *
+			sizeof(struct mail_cache_column));
+	}
+	o_stream_nsend(ctx->output, &ctx->hdr, sizeof(ctx->hdr));
+	if (ctx->column_buf != NULL) {
+		o_stream_nsend(ctx->output, ctx->column_buf->data,
+			       ctx->column_buf->used);
+		buffer_set_used_size(ctx->column_buf, 0);
+	}
+}
+
+static uint32_t
+mail_cache_copy_seq(struct mail_cache_copy_context *ctx,
+		    struct mail_cache_view *cache_view, uint32_t seq)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_record cache_rec;
+	uint32_t offset;
+
+	buffer_set_used_size(ctx->buffer, 0);
+	if (++ctx->field_seen_value == 0) {
+		memset(buffer_get_modifiable_data(ctx->field_seen, NULL),
+		       0, buffer_get_size(ctx->field_seen));
+		ctx->field_seen_value++;
+	}
+
+	memset(&cache_rec, 0, sizeof(cache_rec));
+	buffer_append(ctx->buffer, &cache_rec, sizeof(cache_rec));
+
+	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0)
+		mail_cache_compress_field(ctx, &field);
+
+	if (ctx->buffer->used == sizeof(cache_rec) ||
+	    ctx->buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
+		/* nothing cached */
+		return 0;
+	}
+
+	cache_rec.size = ctx->buffer->used;
+	offset = ctx->output->offset;
+	buffer_write(ctx->buffer, 0, &cache_rec, sizeof(cache_rec));
+	o_stream_nsend(ctx->output, ctx->buffer->data, cache_rec.size);
+	ctx->hdr.record_count++;
+	return offset;
+}
+
+static uint32_t
+mail_cache_copy_get_src_offset(struct mail_cache_copy_context *ctx,
+			       struct mail_index_view *view, uint32_t seq)
+{
+	uint32_t offset, reset_id;
+
+	offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
+	return offset != 0 && reset_id == ctx->src_file_seq ? offset : 0;
+}
+
+static int
+mail_cache_copy_msgs(struct mail_cache_copy_context *ctx,
+		     struct mail_index_view *view,
+		     struct mail_index_transaction *trans,
+		     ARRAY_TYPE(uint32_t) *ext_offsets)
+{
+	struct mail_cache_view *cache_view;
+	struct mail_cache_copy_msg *msgs, *msg;
+	uint32_t message_count, seq, uid, src_offset, first_new_seq;
+	unsigned int idx = 0, count;
+	int ret = 0;
+
+	cache_view = mail_cache_view_open(ctx->cache, view);
+
 	/* get sequence of first message which doesn't need its temp fields
 	   removed. */
 	first_new_seq = mail_cache_get_first_new_seq(view);
 	message_count = mail_index_view_get_messages_count(view);
 
-	i_array_init(ext_offsets, message_count); record_count = 0;
 	for (seq = 1; seq <= message_count; seq++) {
-		if (mail_index_transaction_is_expunged(trans, seq)) {
-			array_append_zero(ext_offsets);
+		if (trans != NULL &&
+		    mail_index_transaction_is_expunged(trans, seq)) {
+			if (ext_offsets != NULL)
+				array_append_zero(ext_offsets);
 			continue;
 		}
 
-		ctx.new_msg = seq >= first_new_seq;
-		buffer_set_used_size(ctx.buffer, 0);
-
-		if (++ctx.field_seen_value == 0) {
-			memset(buffer_get_modifiable_data(ctx.field_seen, NULL),
-			       0, buffer_get_size(ctx.field_seen));
-			ctx.field_seen_value++;
+		mail_index_lookup_uid(view, seq, &uid);
+		src_offset = mail_cache_copy_get_src_offset(ctx, view, seq);
+		ctx->new_msg = seq >= first_new_seq;
+
+		/* both the view and msgs are sorted by UID. messages only
+		   disappear from the view, so anything not yet in msgs must
+		   have been appended after the previous copying. */
+		msgs = array_get_modifiable(&ctx->msgs, &count);
+		while (idx < count && msgs[idx].uid < uid)
+			idx++;
+		if (idx < count && msgs[idx].uid == uid) {
+			msg = &msgs[idx];
+			if (msg->src_offset != src_offset) {
+				/* more data was cached for the message after
+				   it was copied. copy it again. */
+				if (msg->dest_offset != 0)
+					ctx->hdr.deleted_record_count++;
+				if (ctx->field_column_map != NULL)
+					mail_cache_compress_reset_row(ctx, msg->row);
+				msg->src_offset = src_offset;
+				msg->dest_offset =
+					mail_cache_copy_seq(ctx, cache_view, seq);
+			}
+		} else if (idx < count) {
+			/* the message is older than the ones we've already
+			   copied, but we didn't see it before. */
+			ret = -1;
+			break;
+		} else {
+			msg = array_append_space(&ctx->msgs);
+			msg->uid = uid;
+			msg->src_offset = src_offset;
+			if (ctx->field_column_map != NULL) {
+				mail_cache_compress_add_row(ctx, uid);
+				msg->row = ctx->row;
+			}
+			msg->dest_offset =
+				mail_cache_copy_seq(ctx, cache_view, seq);
+		}
+		idx++;
+		if (ctx->fields_changed) {
+			ret = -1;
+			break;
 		}
 
-		memset(&cache_rec, 0, sizeof(cache_rec));
-		buffer_append(ctx.buffer, &cache_rec, sizeof(cache_rec));
+		if (ext_offsets != NULL)
+			array_append(ext_offsets, &msg->dest_offset, 1);
+	}
+	mail_cache_view_close(&cache_view);
+	return ret;
+}
 
-		mail_cache_lookup_iter_init(cache_view, seq, &iter);
-		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_compress_field(&ctx, &field);
+static int mail_cache_copy_finish(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache *cache = ctx->cache;
+	struct ostream *output = ctx->output;
 
-		if (ctx.buffer->used == sizeof(cache_rec) ||
-		    ctx.buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
-			/* nothing cached */
-			ext_offset = 0;
-		} else {
-			cache_rec.size = ctx.buffer->used;
-			ext_offset = output->offset;
-			buffer_write(ctx.buffer, 0, &cache_rec,
-				     sizeof(cache_rec));
-			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
-			record_count++;
-		}
+	i_assert(ctx->orig_fields_count == cache->fields_count);
 
-		array_append(ext_offsets, &ext_offset, 1);
+	if (ctx->field_column_map != NULL) {
+		mail_cache_compress_write_columns(ctx, output, ctx->column_buf);
+		mail_cache_compress_deinit_columns(ctx);
 	}
-	i_assert(orig_fields_count == cache->fields_count);
-
-	hdr.record_count = record_count;
-	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
-	mail_cache_compress_get_fields(&ctx, used_fields_count);
-	o_stream_nsend(output, ctx.buffer->data, ctx.buffer->used);
+	ctx->hdr.field_header_offset =
+		mail_index_uint32_to_offset(output->offset);
+	mail_cache_compress_get_fields(ctx, ctx->used_fields_count);
+	o_stream_nsend(output, ctx->buffer->data, ctx->buffer->used);
 
-	hdr.backwards_compat_used_file_size = output->offset;
-	buffer_free(&ctx.buffer);
-	buffer_free(&ctx.field_seen);
+	ctx->hdr.backwards_compat_used_file_size = output->offset;
 
 	(void)o_stream_seek(output, 0);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
-
-	mail_cache_view_close(&cache_view);
+	o_stream_nsend(output, &ctx->hdr, sizeof(ctx->hdr));
+	if (ctx->column_buf != NULL) {
+		o_stream_nsend(output, ctx->column_buf->data,
+			       ctx->column_buf->used);
+	}
 
 	if (o_stream_nfinish(output) < 0) {
 		mail_cache_set_syscall_error(cache, "write()");
-		o_stream_destroy(&output);
-		array_free(ext_offsets);
 		return -1;
 	}
-	o_stream_destroy(&output);
+	o_stream_destroy(&ctx->output);
 
 	if (cache->index->fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(fd) < 0) {
+		if (fdatasync(ctx->fd) < 0) {
 			mail_cache_set_syscall_error(cache, "fdatasync()");
-			array_free(ext_offsets);
 			return -1;
 		}
 	}
-
-	*file_seq_r = hdr.file_seq;
 	return 0;
 }
 
+static struct mail_cache_copy_context *
+mail_cache_copy_ctx_new(struct mail_cache *cache, int fd,
+			const char *temp_path)
+{
+	struct mail_cache_copy_context *ctx;
+
+	ctx = i_new(struct mail_cache_copy_context, 1);
+	ctx->cache = cache;
+	ctx->fd = fd;
+	ctx->temp_path = i_strdup(temp_path);
+	return ctx;
+}
+
+static void mail_cache_copy_ctx_free(struct mail_cache_copy_context **_ctx)
+{
+	struct mail_cache_copy_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+
+	if (ctx->output != NULL) {
+		/* the copy is being thrown away */
+		o_stream_ignore_last_errors(ctx->output);
+		o_stream_destroy(&ctx->output);
+	}
+	if (ctx->dotlock != NULL)
+		file_dotlock_delete(&ctx->dotlock);
+	mail_cache_compress_deinit_columns(ctx);
+	if (ctx->column_buf != NULL)
+		buffer_free(&ctx->column_buf);
+	if (ctx->initialized) {
+		buffer_free(&ctx->buffer);
+		buffer_free(&ctx->field_seen);
+		array_free(&ctx->bitmask_pos);
+		array_free(&ctx->msgs);
+	}
+	i_free(ctx->field_file_map);
+	i_free(ctx->field_bytes);
+	i_free(ctx->fields_before);
+	i_free(ctx->fields_after);
+	i_free(ctx->temp_path);
+	i_free(ctx);
+}
+
+static void
+mail_cache_copy_ctx_discard(struct mail_cache_copy_context **_ctx)
+{
+	struct mail_cache_copy_context *ctx = *_ctx;
+
+	if (ctx->output != NULL) {
+		o_stream_ignore_last_errors(ctx->output);
+		o_stream_destroy(&ctx->output);
+	}
+	i_close_fd(&ctx->fd);
+	if (unlink(ctx->temp_path) < 0)
+		i_error("unlink(%s) failed: %m", ctx->temp_path);
+	mail_cache_copy_ctx_free(_ctx);
+}
+
 static int
 mail_cache_compress_write(struct mail_cache *cache,
 			  struct mail_index_transaction *trans,
-			  int fd, const char *temp_path, bool *unlock)
+			  struct mail_cache_copy_context *ctx, bool *unlock)
 {
+	struct mail_index_view *view;
 	struct stat st;
-	uint32_t file_seq, old_offset;
+	uint32_t old_offset;
 	ARRAY_TYPE(uint32_t) ext_offsets;
 	const uint32_t *offsets;
 	unsigned int i, count;
 
-	if (mail_cache_copy(cache, trans, fd, &file_seq, &ext_offsets) < 0)
+	view = mail_index_transaction_get_view(trans);
+	if (!ctx->initialized) {
+		/* get the latest info on fields */
+		if (mail_cache_header_fields_read(cache) < 0)
+			return -1;
+		mail_cache_copy_init(ctx, view);
+	}
+
+	i_array_init(&ext_offsets, mail_index_view_get_messages_count(view));
+	if (mail_cache_copy_msgs(ctx, view, trans, &ext_offsets) < 0) {
+		mail_index_set_error(cache->index,
+			"Compressing cache file %s failed: "
+			"%s changed unexpectedly", cache->filepath,
+			ctx->fields_changed ? "Fields" : "Messages");
+		array_free(&ext_offsets);
+		return -1;
+	}
+	if (mail_cache_copy_finish(ctx) < 0) {
+		array_free(&ext_offsets);
 		return -1;
+	}
 
-	if (fstat(fd, &st) < 0) {
+	if (fstat(ctx->fd, &st) < 0) {
 		mail_cache_set_syscall_error(cache, "fstat()");
 		array_free(&ext_offsets);
 		return -1;
 	}
-	if (rename(temp_path, cache->filepath) < 0) {
+	if (rename(ctx->temp_path, cache->filepath) < 0) {
 		mail_cache_set_syscall_error(cache, "rename()");
 		array_free(&ext_offsets);
 		return -1;
@@ -347,7 +761,7 @@ mail_cache_compress_write(struct mail_cache *cache,
 
 	/* once we're sure that the compression was successful,
 	   update the offsets */
-	mail_index_ext_reset(trans, cache->ext_id, file_seq, TRUE);
+	mail_index_ext_reset(trans, cache->ext_id, ctx->hdr.file_seq, TRUE);
 	offsets = array_get(&ext_offsets, &count);
 	for (i = 0; i < count; i++) {
 		if (offsets[i] != 0) {
@@ -363,7 +777,8 @@ mail_cache_compress_write(struct mail_cache *cache,
 	}
 
 	mail_cache_file_close(cache);
-	cache->fd = fd;
+	cache->fd = ctx->fd;
+	ctx->fd = -1;
 	cache->st_ino = st.st_ino;
 	cache->st_dev = st.st_dev;
 	cache->field_header_write_pending = FALSE;
@@ -417,10 +832,58 @@ static int mail_cache_compress_dotlock(struct mail_cache *cache,
 	return 0;
 }
 
+static void
+mail_cache_copy_set_decisions(struct mail_cache *cache,
+			      const struct mail_cache_field_private *fields,
+			      unsigned int fields_count)
+{
+	unsigned int i;
+
+	i_assert(fields_count <= cache->fields_count);
+	for (i = 0; i < fields_count; i++) {
+		cache->fields[i].field.decision = fields[i].field.decision;
+		cache->fields[i].field.last_used = fields[i].field.last_used;
+		cache->fields[i].used = fields[i].used;
+		cache->fields[i].prefetch = fields[i].prefetch;
+	}
+}
+
+static bool
+mail_cache_compress_prepared_usable(struct mail_cache *cache,
+				    struct mail_cache_copy_context *ctx)
+{
+	unsigned int i;
+
+	/* the copying was done from the same file that we're now
+	   replacing, and the fields haven't changed meanwhile */
+	if (MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    cache->hdr->file_seq != ctx->src_file_seq ||
+	    cache->need_compress_file_seq != ctx->src_file_seq)
+		return FALSE;
+	if (mail_cache_header_fields_read(cache) < 0 ||
+	    cache->fields_count != ctx->orig_fields_count ||
+	    cache->file_fields_count != ctx->src_file_fields_count)
+		return FALSE;
+	/* the copy used decisions based on the ones we had before copying.
+	   if someone else has changed them since, the copy may have dropped
+	   fields that are now wanted or kept ones that aren't. */
+	for (i = 0; i < ctx->orig_fields_count; i++) {
+		if (cache->fields[i].field.decision !=
+		    ctx->fields_before[i].field.decision)
+			return FALSE;
+	}
+
+	/* use the same decisions as when copying */
+	mail_cache_copy_set_decisions(cache, ctx->fields_after,
+				      ctx->orig_fields_count);
+	return TRUE;
+}
+
 static int mail_cache_compress_locked(struct mail_cache *cache,
 				      struct mail_index_transaction *trans,
 				      bool *unlock, struct dotlock **dotlock_r)
 {
+	struct mail_cache_copy_context *ctx = cache->compress_ctx;
 	const char *temp_path;
 	const void *data;
 	int fd, ret;
@@ -432,11 +895,19 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 	   separate dotlock to guard against two processes compressing the
 	   cache at the same time. */
 
-	if (mail_cache_compress_dotlock(cache, dotlock_r) < 0)
+	if (ctx != NULL) {
+		/* mail_cache_compress_prepare() already copied most of the
+		   file while holding only the compression dotlock */
+		cache->compress_ctx = NULL;
+		*dotlock_r = ctx->dotlock;
+		ctx->dotlock = NULL;
+	} else if (mail_cache_compress_dotlock(cache, dotlock_r) < 0)
 		return -1;
 	/* we've locked the cache compression now. if somebody else had just
 	   recreated the cache, reopen the cache and return success. */
 	if ((ret = mail_cache_compress_has_file_changed(cache)) != 0) {
+		if (ctx != NULL)
+			mail_cache_copy_ctx_discard(&ctx);
 		if (ret < 0)
 			return -1;
 
@@ -451,17 +922,23 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 
 		return mail_cache_reopen(cache) < 0 ? -1 : 0;
 	}
-
-	/* we want to recreate the cache. write it first to a temporary file */
-	fd = mail_index_create_tmp_file(cache->index, cache->filepath, &temp_path);
-	if (fd == -1)
-		return -1;
-	if (mail_cache_compress_write(cache, trans, fd, temp_path, unlock) < 0) {
-		i_close_fd(&fd);
-		if (unlink(temp_path) < 0)
-			i_error("unlink(%s) failed: %m", temp_path);
+	if (ctx != NULL && !mail_cache_compress_prepared_usable(cache, ctx))
+		mail_cache_copy_ctx_discard(&ctx);
+
+	if (ctx == NULL) {
+		/* we want to recreate the cache. write it first to a
+		   temporary file */
+		fd = mail_index_create_tmp_file(cache->index, cache->filepath,
+						&temp_path);
+		if (fd == -1)
+			return -1;
+		ctx = mail_cache_copy_ctx_new(cache, fd, temp_path);
+	}
+	if (mail_cache_compress_write(cache, trans, ctx, unlock) < 0) {
+		mail_cache_copy_ctx_discard(&ctx);
 		return -1;
 	}
+	mail_cache_copy_ctx_free(&ctx);
 	if (cache->file_cache != NULL)
 		file_cache_set_fd(cache->file_cache, cache->fd);
 
@@ -474,6 +951,91 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 	return 0;
 }
 
+static void mail_cache_compress_disable_read_map(struct mail_cache *cache)
+{
+	/* compression isn't very efficient with small read()s */
+	if (cache->map_with_read) {
+		cache->map_with_read = FALSE;
+		if (cache->read_buf != NULL)
+			buffer_set_used_size(cache->read_buf, 0);
+		cache->hdr = NULL;
+		cache->mmap_length = 0;
+	}
+}
+
+void mail_cache_compress_prepare(struct mail_cache *cache)
+{
+	struct mail_cache_copy_context *ctx;
+	struct mail_index_view *view;
+	struct dotlock *dotlock;
+	const char *temp_path;
+	const void *data;
+	int fd, ret;
+
+	if (cache->compress_ctx != NULL || !mail_cache_need_compress(cache) ||
+	    MAIL_INDEX_IS_IN_MEMORY(cache->index) ||
+	    cache->index->lock_method == FILE_LOCK_METHOD_DOTLOCK)
+		return;
+
+	if (mail_cache_compress_dotlock(cache, &dotlock) < 0)
+		return;
+	mail_cache_compress_disable_read_map(cache);
+	if (mail_cache_compress_has_file_changed(cache) != 0 ||
+	    mail_index_refresh(cache->index) < 0 ||
+	    mail_cache_reopen(cache) < 0 || cache->fd == -1 ||
+	    mail_cache_map(cache, 0, 0, &data) < 0 ||
+	    MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    cache->hdr->file_seq != cache->need_compress_file_seq ||
+	    mail_cache_header_fields_read(cache) < 0) {
+		/* let mail_cache_compress() figure it out */
+		file_dotlock_delete(&dotlock);
+		return;
+	}
+
+	fd = mail_index_create_tmp_file(cache->index, cache->filepath,
+					&temp_path);
+	if (fd == -1) {
+		file_dotlock_delete(&dotlock);
+		return;
+	}
+	ctx = mail_cache_copy_ctx_new(cache, fd, temp_path);
+	ctx->dotlock = dotlock;
+	ctx->fields_before = i_new(struct mail_cache_field_private,
+				   cache->fields_count);
+	memcpy(ctx->fields_before, cache->fields,
+	       sizeof(*cache->fields) * cache->fields_count);
+
+	/* copy all the messages without locking. others can keep appending
+	   to the cache file meanwhile. */
+	view = mail_index_view_open(cache->index);
+	mail_cache_copy_init(ctx, view);
+	ret = mail_cache_copy_msgs(ctx, view, NULL, NULL);
+	mail_index_view_close(&view);
+
+	/* the copying may have taken a while. copy also what was added
+	   meanwhile, so there's less left to do while locked. */
+	if (ret == 0 && mail_index_refresh(cache->index) == 0) {
+		view = mail_index_view_open(cache->index);
+		ret = mail_cache_copy_msgs(ctx, view, NULL, NULL);
+		mail_index_view_close(&view);
+	}
+
+	/* the new decisions are used only once the compression finishes */
+	mail_cache_copy_set_decisions(cache, ctx->fields_before,
+				      ctx->orig_fields_count);
+
+	if (ret < 0 || cache->fields_count != ctx->orig_fields_count)
+		mail_cache_copy_ctx_discard(&ctx);
+	else
+		cache->compress_ctx = ctx;
+}
+
+void mail_cache_compress_discard(struct mail_cache *cache)
+{
+	if (cache->compress_ctx != NULL)
+		mail_cache_copy_ctx_discard(&cache->compress_ctx);
+}
+
 int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans,
 			struct mail_cache_compress_lock **lock_r)
@@ -491,14 +1053,7 @@ int mail_cache_compress(struct mail_cache *cache,
 		return 0;
 	}
 
-	/* compression isn't very efficient with small read()s */
-	if (cache->map_with_read) {
-		cache->map_with_read = FALSE;
-		if (cache->read_buf != NULL)
-			buffer_set_used_size(cache->read_buf, 0);
-		cache->hdr = NULL;
-		cache->mmap_length = 0;
-	}
+	mail_cache_compress_disable_read_map(cache);
 
 	if (cache->index->lock_method == FILE_LOCK_METHOD_DOTLOCK) {
 		/* we're using dotlocking, cache file creation itself creates
@@ -509,7 +1064,10 @@ int mail_cache_compress(struct mail_cache *cache,
 						    FALSE);
 		}
 	} else {
-		switch (mail_cache_try_lock(cache)) {
+		/* if the file was already copied, the rest is quick enough
+		   that it's worth waiting for the writers to finish */
+		switch (cache->compress_ctx != NULL ? mail_cache_lock(cache) :
+			mail_cache_try_lock(cache)) {
 		case -1:
 			/* already locked or some other error */
 			return -1;
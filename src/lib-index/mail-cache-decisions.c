@@ -64,6 +64,17 @@
    months, it's changed. I picked two months because people go to at least
    one month vacations where they might still be reading mails, but with
    different clients.
+
+   The above rules don't know how much each field costs. So we also count
+   how many times each field was found from cache or not (hits/misses)
+   and how many bytes it takes in the cache file. These statistics are
+   stored in the cache file's field header. When compressing the cache
+   file after collecting the statistics for a week, large fields that
+   nobody looked up are dropped, and large fields with only a few lookups
+   are kept only for the new messages. Small fixed size fields which are
+   looked up more often from messages that don't have them cached than
+   from ones that do are cached permanently, so they're added also to
+   older messages.
 */
 
 #include "lib.h"
@@ -151,3 +162,109 @@ void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 	mail_index_lookup_uid(view->view, seq, &uid);
 	cache->fields[field].uid_highwater = uid;
 }
+
+void mail_cache_decision_lookup_stats(struct mail_cache_view *view,
+				      unsigned int field, bool found)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_field_stats *stats;
+
+	i_assert(field < cache->fields_count);
+
+	if (view->no_decision_updates)
+		return;
+
+	stats = &cache->fields[field].new_stats;
+	if (found)
+		stats->hits++;
+	else
+		stats->misses++;
+
+	if (++cache->field_stats_pending_count >=
+	    MAIL_CACHE_FIELD_STATS_WRITE_COUNT &&
+	    !MAIL_CACHE_IS_UNUSABLE(cache))
+		cache->field_header_write_pending = TRUE;
+}
+
+void mail_cache_decision_add_bytes(struct mail_cache *cache,
+				   unsigned int field, size_t size)
+{
+	struct mail_cache_field_stats *stats;
+
+	i_assert(field < cache->fields_count);
+
+	stats = &cache->fields[field].new_stats;
+	if (size > (uint32_t)-1 - stats->bytes)
+		stats->bytes = (uint32_t)-1;
+	else
+		stats->bytes += size;
+	/* the caller is writing to the cache file, which writes the
+	   statistics once enough of these have been counted */
+	cache->field_stats_pending_count++;
+}
+
+void mail_cache_decision_get_stats(struct mail_cache *cache, unsigned int field,
+				   struct mail_cache_field_stats *stats_r)
+{
+	const struct mail_cache_field_private *priv;
+
+	i_assert(field < cache->fields_count);
+
+	priv = &cache->fields[field];
+	stats_r->hits = I_MAX(priv->file_stats.hits + priv->new_stats.hits,
+			      priv->file_stats.hits);
+	stats_r->misses = I_MAX(priv->file_stats.misses + priv->new_stats.misses,
+				priv->file_stats.misses);
+	stats_r->bytes = I_MAX(priv->file_stats.bytes + priv->new_stats.bytes,
+			       priv->file_stats.bytes);
+}
+
+bool mail_cache_decisions_compress(struct mail_cache *cache)
+{
+	struct mail_cache_field_private *priv;
+	struct mail_cache_field_stats stats;
+	enum mail_cache_decision_type dec;
+	unsigned int i;
+	bool evaluate_usage;
+
+	if (cache->field_stats_since == 0)
+		return FALSE;
+
+	/* the fields' usage can be evaluated only after the statistics have
+	   been collected for a while. */
+	evaluate_usage = ioloop_time - cache->field_stats_since >=
+		MAIL_CACHE_FIELD_STATS_MIN_SECS;
+
+	for (i = 0; i < cache->fields_count; i++) {
+		priv = &cache->fields[i];
+		dec = priv->field.decision;
+		priv->prefetch = FALSE;
+		if ((dec & MAIL_CACHE_DECISION_FORCED) != 0 ||
+		    dec == MAIL_CACHE_DECISION_NO || priv->adding)
+			continue;
+
+		mail_cache_decision_get_stats(cache, i, &stats);
+		if (stats.misses > stats.hits &&
+		    priv->field.field_size <= MAIL_CACHE_FIELD_CHEAP_SIZE) {
+			/* the field is cheap to store, but clients keep
+			   looking it up from messages that don't have it
+			   cached. cache it permanently, so it gets added
+			   also to the older messages. */
+			priv->field.decision = MAIL_CACHE_DECISION_YES;
+			priv->prefetch = TRUE;
+		} else if (!evaluate_usage ||
+			   stats.bytes < MAIL_CACHE_FIELD_EXPENSIVE_BYTES) {
+			/* keep the decision */
+		} else if (stats.hits == 0 && stats.misses == 0) {
+			/* an expensive field that nobody has looked up */
+			priv->field.decision = MAIL_CACHE_DECISION_NO;
+		} else if (dec == MAIL_CACHE_DECISION_YES &&
+			   stats.hits < stats.bytes /
+			   MAIL_CACHE_FIELD_MAX_BYTES_PER_HIT) {
+			/* too few lookups for its size. keep the field only
+			   for the new messages. */
+			priv->field.decision = MAIL_CACHE_DECISION_TEMP;
+		}
+	}
+	return evaluate_usage;
+}
@@ -313,6 +313,38 @@ mail_cache_header_fields_get_offset(struct mail_cache *cache,
 	return 0;
 }
 
+static void
+mail_cache_header_fields_read_stats(struct mail_cache *cache,
+			const struct mail_cache_header_fields *field_hdr,
+			const char *names_end)
+{
+	const uint32_t *stats, *hits, *misses, *bytes;
+	struct mail_cache_field_private *priv;
+	uint32_t i, count = field_hdr->fields_count, offset;
+
+	offset = (names_end - (const char *)field_hdr + 3) & ~3U;
+	if (field_hdr->size < offset ||
+	    field_hdr->size - offset < MAIL_CACHE_FIELD_STATS_SIZE(count)) {
+		/* written by an older version */
+		cache->field_stats_offset = 0;
+		cache->field_stats_since = 0;
+		return;
+	}
+	stats = CONST_PTR_OFFSET(field_hdr, offset);
+	hits = stats + 1;
+	misses = hits + count;
+	bytes = misses + count;
+
+	cache->field_stats_offset = offset;
+	cache->field_stats_since = stats[0];
+	for (i = 0; i < count; i++) {
+		priv = &cache->fields[cache->file_field_map[i]];
+		priv->file_stats.hits = hits[i];
+		priv->file_stats.misses = misses[i];
+		priv->file_stats.bytes = bytes[i];
+	}
+}
+
 int mail_cache_header_fields_read(struct mail_cache *cache)
 {
 	const struct mail_cache_header_fields *field_hdr;
@@ -368,8 +400,11 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 	i_assert(names <= end);
 
 	/* clear the old mapping */
-	for (i = 0; i < cache->fields_count; i++)
+	for (i = 0; i < cache->fields_count; i++) {
 		cache->field_file_map[i] = (uint32_t)-1;
+		memset(&cache->fields[i].file_stats, 0,
+		       sizeof(cache->fields[i].file_stats));
+	}
 
 	max_drop_time = cache->index->map->hdr.day_stamp == 0 ? 0 :
 		cache->index->map->hdr.day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
@@ -438,6 +473,7 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 
                 names = p + 1;
 	}
+	mail_cache_header_fields_read_stats(cache, field_hdr, names);
 	return 0;
 }
 
@@ -492,6 +528,57 @@ static void copy_to_buf_byte(struct mail_cache *cache, buffer_t *dest,
 	}
 }
 
+static uint32_t stats_add(uint32_t num1, uint32_t num2)
+{
+	return num1 + num2 < num1 ? (uint32_t)-1 : num1 + num2;
+}
+
+static void mail_cache_field_stats_flush(struct mail_cache_field_private *priv)
+{
+	priv->file_stats.hits =
+		stats_add(priv->file_stats.hits, priv->new_stats.hits);
+	priv->file_stats.misses =
+		stats_add(priv->file_stats.misses, priv->new_stats.misses);
+	priv->file_stats.bytes =
+		stats_add(priv->file_stats.bytes, priv->new_stats.bytes);
+	memset(&priv->new_stats, 0, sizeof(priv->new_stats));
+}
+
+static void
+copy_stats_to_buf(struct mail_cache *cache, buffer_t *dest, bool add_new)
+{
+	unsigned int i, field;
+	uint32_t since;
+
+	/* the written statistics include our changes */
+	for (i = 0; i < cache->file_fields_count; i++) {
+		field = cache->file_field_map[i];
+		mail_cache_field_stats_flush(&cache->fields[field]);
+	}
+	if (add_new) {
+		for (i = 0; i < cache->fields_count; i++) {
+			if (CACHE_FIELD_IS_NEWLY_WANTED(cache, i))
+				mail_cache_field_stats_flush(&cache->fields[i]);
+		}
+	}
+	cache->field_stats_pending_count = 0;
+
+	if (cache->field_stats_since == 0)
+		cache->field_stats_since = ioloop_time;
+	since = cache->field_stats_since;
+	buffer_append(dest, &since, sizeof(since));
+
+	copy_to_buf(cache, dest, add_new,
+		    offsetof(struct mail_cache_field_private, file_stats.hits),
+		    sizeof(uint32_t));
+	copy_to_buf(cache, dest, add_new,
+		    offsetof(struct mail_cache_field_private, file_stats.misses),
+		    sizeof(uint32_t));
+	copy_to_buf(cache, dest, add_new,
+		    offsetof(struct mail_cache_field_private, file_stats.bytes),
+		    sizeof(uint32_t));
+}
+
 static int mail_cache_header_fields_update_locked(struct mail_cache *cache)
 {
 	buffer_t *buffer;
@@ -523,6 +610,15 @@ static int mail_cache_header_fields_update_locked(struct mail_cache *cache)
 				cache->fields[i].decision_dirty = FALSE;
 		}
 	}
+	if (ret == 0 && cache->field_stats_offset != 0) {
+		buffer_set_used_size(buffer, 0);
+		copy_stats_to_buf(cache, buffer, FALSE);
+		ret = mail_cache_write(cache, buffer->data, buffer->used,
+				       offset + cache->field_stats_offset);
+	} else {
+		/* the statistics get written when the header is rewritten */
+		cache->field_stats_pending_count = 0;
+	}
 
 	if (ret == 0)
 		cache->field_header_write_pending = FALSE;
@@ -595,11 +691,13 @@ void mail_cache_header_fields_get(struct mail_cache *cache, buffer_t *dest)
 		}
 	}
 
+	/* add the lookup statistics */
+	if ((dest->used & 3) != 0)
+		buffer_append_zero(dest, 4 - (dest->used & 3));
+	copy_stats_to_buf(cache, dest, TRUE);
+
 	hdr.size = dest->used;
 	buffer_write(dest, 0, &hdr, sizeof(hdr));
-
-	if ((hdr.size & 3) != 0)
-		buffer_append_zero(dest, 4 - (hdr.size & 3));
 }
 
 int mail_cache_header_fields_get_next_offset(struct mail_cache *cache,
@@ -136,7 +136,9 @@ bool mail_cache_track_loops(struct mail_cache_loop_track *loop_track,
 		(loop_track->max_offset - loop_track->min_offset);
 }
 
-void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
+static void
+mail_cache_lookup_iter_init_full(struct mail_cache_view *view, uint32_t seq,
+				 bool columns,
 				 struct mail_cache_lookup_iterate_ctx *ctx_r)
 {
 	struct mail_cache_lookup_iterate_ctx *ctx = ctx_r;
@@ -148,6 +150,7 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 	memset(ctx, 0, sizeof(*ctx));
 	ctx->view = view;
 	ctx->seq = seq;
+	ctx->column_row = (uint32_t)-1;
 
 	if (!MAIL_CACHE_IS_UNUSABLE(view->cache)) {
 		/* look up the first offset */
@@ -158,11 +161,27 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 			ctx->failed = ret < 0;
 		}
 	}
+	if (columns && !ctx->failed && !MAIL_CACHE_IS_UNUSABLE(view->cache)) {
+		/* the fixed size fields may be in columns. this is done
+		   after the offset lookup, since it may reopen the file. */
+		ret = mail_cache_columns_lookup_row(view, seq,
+						    &ctx->column_row);
+		if (ret <= 0) {
+			ctx->column_row = (uint32_t)-1;
+			ctx->failed = ret < 0;
+		}
+	}
 	ctx->remap_counter = view->cache->remap_counter;
 
 	memset(&view->loop_track, 0, sizeof(view->loop_track));
 }
 
+void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
+				 struct mail_cache_lookup_iterate_ctx *ctx_r)
+{
+	mail_cache_lookup_iter_init_full(view, seq, TRUE, ctx_r);
+}
+
 static bool
 mail_cache_lookup_iter_transaction(struct mail_cache_lookup_iterate_ctx *ctx)
 {
@@ -233,6 +252,36 @@ mail_cache_lookup_iter_next_record(struct mail_cache_lookup_iterate_ctx *ctx)
 	return 1;
 }
 
+static int
+mail_cache_lookup_iter_next_column(struct mail_cache_lookup_iterate_ctx *ctx,
+				   struct mail_cache_iterate_field *field_r)
+{
+	struct mail_cache *cache = ctx->view->cache;
+	const struct mail_cache_column *column;
+	const void *data;
+	int ret;
+
+	while (ctx->column_idx < cache->column_hdr.columns_count) {
+		column = &cache->columns[ctx->column_idx++];
+		ret = mail_cache_column_lookup(cache, column, ctx->column_row,
+					       &data);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			continue;
+
+		field_r->field_idx = cache->file_field_map[column->file_field];
+		field_r->data = data;
+		field_r->size = column->field_size;
+		field_r->offset = column->data_offset +
+			ctx->column_row * column->field_size;
+		ctx->remap_counter = cache->remap_counter;
+		return 1;
+	}
+	ctx->remap_counter = cache->remap_counter;
+	return 0;
+}
+
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r)
 {
@@ -244,6 +293,13 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 
 	i_assert(ctx->remap_counter == cache->remap_counter);
 
+	if (ctx->column_row != (uint32_t)-1) {
+		if ((ret = mail_cache_lookup_iter_next_column(ctx, field_r)) != 0)
+			return ret;
+		/* continue with the records */
+		ctx->column_row = (uint32_t)-1;
+	}
+
 	if (ctx->pos + sizeof(uint32_t) > ctx->rec_size) {
 		if (ctx->pos != ctx->rec_size) {
 			mail_cache_set_corrupted(cache,
@@ -319,7 +375,8 @@ static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 	}
 	view->cached_exists_seq = seq;
 
-	mail_cache_lookup_iter_init(view, seq, &iter);
+	/* fields in columns are checked separately */
+	mail_cache_lookup_iter_init_full(view, seq, FALSE, &iter);
 	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 		buffer_write(view->cached_exists_buf, field.field_idx,
 			     &view->cached_exists_value, 1);
@@ -334,19 +391,255 @@ mail_cache_file_has_field(struct mail_cache *cache, unsigned int field)
 	return cache->field_file_map[field] != (uint32_t)-1;
 }
 
+struct mail_cache_batch_seq {
+	uint32_t offset, seq;
+};
+
+static int mail_cache_batch_seq_cmp(const struct mail_cache_batch_seq *s1,
+				    const struct mail_cache_batch_seq *s2)
+{
+	if (s1->offset < s2->offset)
+		return -1;
+	if (s1->offset > s2->offset)
+		return 1;
+	return s1->seq < s2->seq ? -1 :
+		(s1->seq > s2->seq ? 1 : 0);
+}
+
+static struct mail_cache_batch_value *
+mail_cache_batch_get_value(struct mail_cache_batch *batch, uint32_t seq,
+			   unsigned int field_idx)
+{
+	unsigned int pos;
+
+	if (seq < batch->seq1 || seq > batch->seq2 ||
+	    field_idx >= batch->field_pos_count)
+		return NULL;
+	pos = batch->field_pos[field_idx];
+	if (pos == 0)
+		return NULL;
+	return &batch->values[(seq - batch->seq1) * batch->fields_count +
+			      pos - 1];
+}
+
+static const struct mail_cache_batch_value *
+mail_cache_batch_lookup(struct mail_cache_view *view, uint32_t seq,
+			unsigned int field_idx)
+{
+	const struct mail_cache_batch_value *value;
+
+	if (view->batch == NULL)
+		return NULL;
+	value = mail_cache_batch_get_value(view->batch, seq, field_idx);
+	return value == NULL || value->state == MAIL_CACHE_BATCH_STATE_UNKNOWN ?
+		NULL : value;
+}
+
+static void
+mail_cache_batch_add_field(struct mail_cache_batch *batch,
+			   const struct mail_cache_field *field_def,
+			   struct mail_cache_batch_value *value,
+			   const struct mail_cache_iterate_field *field)
+{
+	unsigned char *dest;
+	const unsigned char *src;
+	unsigned int i;
+
+	if (field_def->type != MAIL_CACHE_FIELD_BITMASK) {
+		/* use the first one that's found. if there are multiple
+		   they're all identical. */
+		if (value->state != MAIL_CACHE_BATCH_STATE_FOUND) {
+			value->data = p_memdup(batch->pool, field->data,
+					       field->size);
+			value->size = field->size;
+			value->state = MAIL_CACHE_BATCH_STATE_FOUND;
+		}
+		return;
+	}
+
+	/* merge all bits */
+	if (value->state != MAIL_CACHE_BATCH_STATE_FOUND) {
+		value->size = I_MAX(field_def->field_size, field->size);
+		value->data = p_malloc(batch->pool, value->size);
+		value->state = MAIL_CACHE_BATCH_STATE_FOUND;
+	} else if (field->size > value->size) {
+		value->data = p_realloc(batch->pool, (void *)value->data,
+					value->size, field->size);
+		value->size = field->size;
+	}
+	dest = (void *)value->data;
+	src = field->data;
+	for (i = 0; i < field->size; i++)
+		dest[i] |= src[i];
+}
+
+static int
+mail_cache_batch_lookup_seq(struct mail_cache_view *view,
+			    struct mail_cache_batch *batch, uint32_t seq)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_batch_value *value;
+	int ret;
+
+	mail_cache_lookup_iter_init(view, seq, &iter);
+	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+		value = mail_cache_batch_get_value(batch, seq, field.field_idx);
+		/* fields that don't exist in the file yet aren't found by
+		   normal lookups either */
+		if (value != NULL &&
+		    mail_cache_file_has_field(cache, field.field_idx)) {
+			mail_cache_batch_add_field(batch,
+				&cache->fields[field.field_idx].field,
+				value, &field);
+		}
+	}
+	return ret;
+}
+
+int mail_cache_lookup_batch(struct mail_cache_view *view,
+			    uint32_t seq1, uint32_t seq2,
+			    const unsigned int field_idxs[],
+			    unsigned int fields_count)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_batch *batch;
+	ARRAY(struct mail_cache_batch_seq) seqs;
+	const struct mail_cache_batch_seq *s;
+	struct mail_cache_batch_seq *new_s;
+	unsigned int i, values_count;
+	uint32_t seq, reset_id;
+	pool_t pool;
+	int ret = 0;
+
+	i_assert(seq1 > 0 && seq1 <= seq2);
+
+	mail_cache_lookup_batch_free(view);
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (MAIL_CACHE_IS_UNUSABLE(cache) || fields_count == 0)
+		return 0;
+
+	pool = pool_alloconly_create("mail cache batch", 1024*16);
+	batch = p_new(pool, struct mail_cache_batch, 1);
+	batch->pool = pool;
+	batch->seq1 = seq1;
+	batch->seq2 = seq2;
+	batch->field_pos_count = cache->fields_count;
+	batch->field_pos = p_new(pool, unsigned int, cache->fields_count);
+	for (i = 0; i < fields_count; i++) {
+		i_assert(field_idxs[i] < cache->fields_count);
+		if (batch->field_pos[field_idxs[i]] == 0)
+			batch->field_pos[field_idxs[i]] = ++batch->fields_count;
+	}
+	values_count = (seq2 - seq1 + 1) * batch->fields_count;
+	batch->values = p_new(pool, struct mail_cache_batch_value,
+			      values_count);
+	for (i = 0; i < values_count; i++)
+		batch->values[i].state = MAIL_CACHE_BATCH_STATE_MISSING;
+
+	/* go through the messages in the order of their latest records'
+	   offsets. the older records are mostly at lower offsets, but this
+	   still avoids jumping back and forth in the file. */
+	i_array_init(&seqs, seq2 - seq1 + 1);
+	for (seq = seq1; seq <= seq2; seq++) {
+		new_s = array_append_space(&seqs);
+		new_s->offset = mail_cache_lookup_cur_offset(view->view, seq,
+							     &reset_id);
+		new_s->seq = seq;
+	}
+	array_sort(&seqs, mail_cache_batch_seq_cmp);
+
+	array_foreach(&seqs, s) {
+		if (mail_cache_batch_lookup_seq(view, batch, s->seq) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	array_free(&seqs);
+
+	if (ret < 0)
+		pool_unref(&pool);
+	else
+		view->batch = batch;
+	return ret;
+}
+
+void mail_cache_lookup_batch_free(struct mail_cache_view *view)
+{
+	if (view->batch != NULL) {
+		pool_t pool = view->batch->pool;
+
+		view->batch = NULL;
+		pool_unref(&pool);
+	}
+}
+
+void mail_cache_batch_forget_seq(struct mail_cache_view *view, uint32_t seq)
+{
+	struct mail_cache_batch *batch = view->batch;
+	unsigned int i;
+
+	if (batch == NULL || seq < batch->seq1 || seq > batch->seq2)
+		return;
+
+	for (i = 0; i < batch->fields_count; i++) {
+		batch->values[(seq - batch->seq1) * batch->fields_count + i].state =
+			MAIL_CACHE_BATCH_STATE_UNKNOWN;
+	}
+}
+
+static int
+mail_cache_lookup_column_field(struct mail_cache_view *view, uint32_t seq,
+			       unsigned int field, const void **data_r)
+{
+	struct mail_cache *cache = view->cache;
+	const struct mail_cache_column *column;
+	uint32_t row;
+	int ret;
+
+	if (MAIL_CACHE_IS_UNUSABLE(cache))
+		return 0;
+	if (mail_cache_columns_read(cache) < 0)
+		return -1;
+	column = mail_cache_column_get(cache, cache->field_file_map[field]);
+	if (column == NULL)
+		return 0;
+
+	if ((ret = mail_cache_columns_lookup_row(view, seq, &row)) <= 0)
+		return ret;
+	return mail_cache_column_lookup(cache, column, row, data_r);
+}
+
 int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 			    unsigned int field)
 {
+	const struct mail_cache_batch_value *batch_value;
 	const uint8_t *data;
+	const void *column_data;
+	int ret;
 
 	i_assert(seq > 0);
 
+	batch_value = mail_cache_batch_lookup(view, seq, field);
+	if (batch_value != NULL)
+		return batch_value->state == MAIL_CACHE_BATCH_STATE_FOUND ? 1 : 0;
+
 	if (!view->cache->opened)
 		(void)mail_cache_open_and_verify(view->cache);
 
 	if (!mail_cache_file_has_field(view->cache, field))
 		return 0;
 
+	/* fixed size fields are usually found from columns without going
+	   through the message's records. if the column doesn't have it, the
+	   field may still have been added to the records afterwards. */
+	ret = mail_cache_lookup_column_field(view, seq, field, &column_data);
+	if (ret != 0)
+		return ret < 0 ? -1 : 1;
+
 	/* FIXME: we should discard the cache if view has been synced */
 	if (view->cached_exists_seq != seq) {
 		if (mail_cache_seq(view, seq) < 0)
@@ -360,9 +653,25 @@ int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 
 bool mail_cache_field_exists_any(struct mail_cache_view *view, uint32_t seq)
 {
-	uint32_t reset_id;
+	struct mail_cache *cache = view->cache;
+	const void *data;
+	uint32_t reset_id, row;
+	unsigned int i;
+
+	if (mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0)
+		return TRUE;
 
-	return mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0;
+	/* the message may have only fields that are in columns */
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (mail_cache_columns_lookup_row(view, seq, &row) <= 0)
+		return FALSE;
+	for (i = 0; i < cache->column_hdr.columns_count; i++) {
+		if (mail_cache_column_lookup(cache, &cache->columns[i],
+					     row, &data) > 0)
+			return TRUE;
+	}
+	return FALSE;
 }
 
 enum mail_cache_decision_type
@@ -405,19 +714,53 @@ mail_cache_lookup_bitmask(struct mail_cache_lookup_iterate_ctx *iter,
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx)
 {
+	const struct mail_cache_batch_value *value;
 	const struct mail_cache_field *field_def;
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
+	const void *data;
 	int ret;
 
+	if (!view->cache->opened)
+		(void)mail_cache_open_and_verify(view->cache);
+
+	field_def = &view->cache->fields[field_idx].field;
+	value = mail_cache_batch_lookup(view, seq, field_idx);
+	if (value != NULL) {
+		mail_cache_decision_state_update(view, seq, field_idx);
+		if (value->state != MAIL_CACHE_BATCH_STATE_FOUND) {
+			mail_cache_decision_lookup_stats(view, field_idx, FALSE);
+			return 0;
+		}
+		mail_cache_decision_lookup_stats(view, field_idx, TRUE);
+		if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
+			buffer_write_zero(dest_buf, 0, field_def->field_size);
+			buffer_write(dest_buf, 0, value->data, value->size);
+		} else {
+			buffer_append(dest_buf, value->data, value->size);
+		}
+		return 1;
+	}
+
+	ret = mail_cache_lookup_column_field(view, seq, field_idx, &data);
+	if (ret != 0) {
+		mail_cache_decision_state_update(view, seq, field_idx);
+		if (ret > 0) {
+			mail_cache_decision_lookup_stats(view, field_idx, TRUE);
+			buffer_append(dest_buf, data, field_def->field_size);
+		}
+		return ret;
+	}
+
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
+	if (ret >= 0)
+		mail_cache_decision_lookup_stats(view, field_idx, ret > 0);
 	if (ret <= 0)
 		return ret;
 
-	/* the field should exist */
-	mail_cache_lookup_iter_init(view, seq, &iter);
-	field_def = &view->cache->fields[field_idx].field;
+	/* the field should exist in the records */
+	mail_cache_lookup_iter_init_full(view, seq, FALSE, &iter);
 	if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
 		return mail_cache_lookup_bitmask(&iter, field_idx,
 						 field_def->field_size,
@@ -545,7 +888,8 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 	ctx.pool = *pool_r = pool_alloconly_create(MEMPOOL_GROWING"mail cache headers", 1024);
 	t_array_init(&ctx.lines, 32);
 
-	mail_cache_lookup_iter_init(view, seq, &iter);
+	/* headers are never in columns */
+	mail_cache_lookup_iter_init_full(view, seq, FALSE, &iter);
 	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 		if (field.field_idx > max_field ||
 		    field_state[field.field_idx] != HDR_FIELD_STATE_WANT) {
@@ -599,6 +943,7 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      unsigned int fields_count)
 {
 	pool_t pool;
+	unsigned int i;
 	int ret;
 
 	T_BEGIN {
@@ -608,5 +953,11 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 		if (pool != NULL)
 			pool_unref(&pool);
 	} T_END;
+	if (ret >= 0) {
+		for (i = 0; i < fields_count; i++) {
+			mail_cache_decision_lookup_stats(view, field_idxs[i],
+							 ret > 0);
+		}
+	}
 	return ret;
 }
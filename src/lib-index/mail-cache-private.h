@@ -7,10 +7,28 @@
 
 #define MAIL_CACHE_MAJOR_VERSION 1
 #define MAIL_CACHE_MINOR_VERSION 1
+/* Files with this minor version have struct mail_cache_column_header
+   immediately after struct mail_cache_header. Older versions ignore it and
+   just don't see the fields stored in columns. */
+#define MAIL_CACHE_MINOR_VERSION_COLUMNS 2
 
 /* Drop fields that haven't been accessed for n seconds */
 #define MAIL_CACHE_FIELD_DROP_SECS (3600*24*30)
 
+/* Re-evaluate the decisions based on the lookup statistics when
+   compressing, if they have been collected for at least this long */
+#define MAIL_CACHE_FIELD_STATS_MIN_SECS (3600*24*7)
+/* Write the lookup statistics after this many lookups */
+#define MAIL_CACHE_FIELD_STATS_WRITE_COUNT 1000
+/* Drop fields using at least this many bytes if nothing looked them up */
+#define MAIL_CACHE_FIELD_EXPENSIVE_BYTES (1024*64)
+/* Keep only new messages' data for expensive fields with fewer lookups
+   than one per this many bytes */
+#define MAIL_CACHE_FIELD_MAX_BYTES_PER_HIT 4096
+/* Fixed size fields up to this size are cheap enough to be cached
+   permanently if they're missed more often than found */
+#define MAIL_CACHE_FIELD_CHEAP_SIZE 16
+
 /* Never compress the file if it's smaller than this */
 #define MAIL_CACHE_COMPRESS_MIN_SIZE (1024*32)
 
@@ -33,6 +51,8 @@
 
 #define MAIL_CACHE_IS_UNUSABLE(cache) \
 	((cache)->hdr == NULL)
+#define MAIL_CACHE_HAS_COLUMNS(hdr) \
+	((hdr)->minor_version >= MAIL_CACHE_MINOR_VERSION_COLUMNS)
 
 struct mail_cache_header {
 	/* version is increased only when you can't have backwards
@@ -73,6 +93,16 @@ struct mail_cache_header_fields {
 	uint8_t decision[fields_count];
 	/* NUL-separated list of field names */
 	char name[fields_count][];
+
+	/* v2.2.18+: padded to 32bit boundary and followed by lookup
+	   statistics, if size is large enough. Older versions ignore them.
+	   The statistics were reset at stats_since. */
+	uint32_t stats_since;
+	/* number of lookups that found / didn't find the field */
+	uint32_t hits[fields_count];
+	uint32_t misses[fields_count];
+	/* approximate number of bytes stored for the field */
+	uint32_t bytes[fields_count];
 #endif
 };
 
@@ -86,6 +116,30 @@ struct mail_cache_header_fields {
 	(MAIL_CACHE_FIELD_TYPE(count) + sizeof(uint8_t) * (count))
 #define MAIL_CACHE_FIELD_NAMES(count) \
 	(MAIL_CACHE_FIELD_DECISION(count) + sizeof(uint8_t) * (count))
+#define MAIL_CACHE_FIELD_STATS_SIZE(count) \
+	(sizeof(uint32_t) + sizeof(uint32_t) * 3 * (count))
+
+struct mail_cache_column_header {
+	/* Number of messages when the file was compressed. Row n contains
+	   the n'th non-expunged message at that time. */
+	uint32_t rows_count;
+	/* uint32_t uids[rows_count] in ascending order */
+	uint32_t uids_offset;
+	uint32_t columns_count;
+	uint32_t unused;
+#if 0
+	struct mail_cache_column columns[columns_count];
+#endif
+};
+
+struct mail_cache_column {
+	uint32_t file_field;
+	uint32_t field_size;
+	/* uint8_t bitmap[(rows_count+7)/8], bit is set if row has the field */
+	uint32_t bitmap_offset;
+	/* uint8_t data[rows_count][field_size] */
+	uint32_t data_offset;
+};
 
 struct mail_cache_record {
 	uint32_t prev_offset;
@@ -93,15 +147,26 @@ struct mail_cache_record {
 	/* array of { uint32_t field; [ uint32_t size; ] { .. } } */
 };
 
+struct mail_cache_field_stats {
+	uint32_t hits, misses, bytes;
+};
+
 struct mail_cache_field_private {
 	struct mail_cache_field field;
 
 	uint32_t uid_highwater;
 
+	/* Lookup statistics in the cache file and the changes to them that
+	   haven't been written yet */
+	struct mail_cache_field_stats file_stats, new_stats;
+
 	/* Unused fields aren't written to cache file */
 	unsigned int used:1;
 	unsigned int adding:1;
 	unsigned int decision_dirty:1;
+	/* Cheap field that is often missed. Keep it permanently cached
+	   after compression. */
+	unsigned int prefetch:1;
 };
 
 struct mail_cache {
@@ -144,14 +209,30 @@ struct mail_cache {
 	unsigned int fields_count;
 	HASH_TABLE(char *, void *) field_name_hash; /* name -> idx */
 	uint32_t last_field_header_offset;
+	/* Offset to the lookup statistics in the latest field header,
+	   0 if it doesn't have them. */
+	uint32_t field_stats_offset;
+	uint32_t field_stats_since;
+	/* Number of lookups not yet written to field_stats */
+	unsigned int field_stats_pending_count;
 
 	/* 0 is no need for compression, otherwise the file sequence number
 	   which we want compressed. */
 	uint32_t need_compress_file_seq;
+	/* Cache file copied by mail_cache_compress_prepare(), waiting for
+	   mail_cache_compress() to finish it. */
+	struct mail_cache_copy_context *compress_ctx;
 
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
 
+	/* Columns in the current file, read by mail_cache_columns_read() */
+	struct mail_cache_column_header column_hdr;
+	struct mail_cache_column *columns;
+	/* row - (seq-1) for the latest row lookup. Rows only shift
+	   backwards with expunges, so this makes sequential lookups fast. */
+	uint32_t column_row_skip;
+
 	unsigned int opened:1;
 	unsigned int locked:1;
 	unsigned int last_lock_failed:1;
@@ -159,6 +240,9 @@ struct mail_cache {
 	unsigned int field_header_write_pending:1;
 	unsigned int compressing:1;
 	unsigned int map_with_read:1;
+	/* Write fixed size fields into columns when compressing */
+	unsigned int write_columns:1;
+	unsigned int columns_read:1;
 };
 
 struct mail_cache_loop_track {
@@ -167,6 +251,30 @@ struct mail_cache_loop_track {
 	uoff_t size_sum;
 };
 
+enum mail_cache_batch_state {
+	/* not looked up or forgotten - do a normal lookup */
+	MAIL_CACHE_BATCH_STATE_UNKNOWN = 0,
+	MAIL_CACHE_BATCH_STATE_MISSING,
+	MAIL_CACHE_BATCH_STATE_FOUND
+};
+
+struct mail_cache_batch_value {
+	const void *data;
+	uint32_t size;
+	uint8_t state; /* enum mail_cache_batch_state */
+};
+
+struct mail_cache_batch {
+	pool_t pool;
+	uint32_t seq1, seq2;
+
+	/* field_idx -> position in values + 1, or 0 if not looked up */
+	unsigned int *field_pos;
+	unsigned int field_pos_count, fields_count;
+	/* [(seq - seq1) * fields_count + position] */
+	struct mail_cache_batch_value *values;
+};
+
 struct mail_cache_view {
 	struct mail_cache *cache;
 	struct mail_index_view *view, *trans_view;
@@ -183,6 +291,9 @@ struct mail_cache_view {
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
 
+	/* values looked up by mail_cache_lookup_batch() */
+	struct mail_cache_batch *batch;
+
 	unsigned int no_decision_updates:1;
 };
 
@@ -198,6 +309,11 @@ struct mail_cache_lookup_iterate_ctx {
 	unsigned int remap_counter;
 	uint32_t seq;
 
+	/* Row in columns, or (uint32_t)-1. Column fields are returned
+	   before the records. */
+	uint32_t column_row;
+	unsigned int column_idx;
+
 	const struct mail_cache_record *rec;
 	unsigned int pos, rec_size;
 	uint32_t offset;
@@ -246,6 +362,10 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 /* Returns 1 if field was returned, 0 if end of fields, or -1 if error */
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r);
+/* Forget the batch looked up values for the message, because new fields
+   are being added to it. */
+void mail_cache_batch_forget_seq(struct mail_cache_view *view, uint32_t seq);
+
 const struct mail_cache_record *
 mail_cache_transaction_lookup_rec(struct mail_cache_transaction_ctx *ctx,
 				  unsigned int seq,
@@ -256,12 +376,42 @@ int mail_cache_map(struct mail_cache *cache, size_t offset, size_t size,
 void mail_cache_file_close(struct mail_cache *cache);
 int mail_cache_reopen(struct mail_cache *cache);
 
+/* Read the column header if it hasn't been read yet for the current file.
+   Returns 0 if ok, -1 if error/corrupted. */
+int mail_cache_columns_read(struct mail_cache *cache);
+void mail_cache_columns_free(struct mail_cache *cache);
+/* Returns 1 and the message's row if it's in the columns, 0 if not,
+   -1 if error. */
+int mail_cache_columns_lookup_row(struct mail_cache_view *view, uint32_t seq,
+				  uint32_t *row_r);
+/* Returns the column for the file field, or NULL if it's not in columns. */
+const struct mail_cache_column *
+mail_cache_column_get(struct mail_cache *cache, unsigned int file_field);
+/* Look up the column's data for the row. Returns 1 if found, 0 if the row
+   doesn't have the field, -1 if error. */
+int mail_cache_column_lookup(struct mail_cache *cache,
+			     const struct mail_cache_column *column,
+			     uint32_t row, const void **data_r);
+
 /* Notify the decision handling code that field was looked up for seq.
    This should be called even for fields that aren't currently in cache file */
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field);
 void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 			     unsigned int field);
+/* Update the field's lookup statistics after it was looked up. */
+void mail_cache_decision_lookup_stats(struct mail_cache_view *view,
+				      unsigned int field, bool found);
+/* Update the field's stored bytes statistics. */
+void mail_cache_decision_add_bytes(struct mail_cache *cache,
+				   unsigned int field, size_t size);
+/* Returns the field's current lookup statistics. */
+void mail_cache_decision_get_stats(struct mail_cache *cache, unsigned int field,
+				   struct mail_cache_field_stats *stats_r);
+/* Update the decisions based on the lookup statistics before the cache
+   file is compressed. Returns TRUE if the statistics were used and should
+   be reset. */
+bool mail_cache_decisions_compress(struct mail_cache *cache);
 
 int mail_cache_expunge_handler(struct mail_index_sync_map_ctx *sync_ctx,
 			       uint32_t seq, const void *data,
@@ -442,6 +442,12 @@ mail_cache_transaction_flush(struct mail_cache_transaction_ctx *ctx)
 		ctx->records_written++;
 		ret = mail_cache_transaction_update_index(ctx, write_offset);
 	}
+	/* we're already locked, so write the statistics while we're at it
+	   if enough lookups have been counted since the last write */
+	if (ctx->cache->field_stats_offset != 0 &&
+	    ctx->cache->field_stats_pending_count >=
+	    MAIL_CACHE_FIELD_STATS_WRITE_COUNT)
+		ctx->cache->field_header_write_pending = TRUE;
 	if (mail_cache_unlock(ctx->cache) < 0)
 		ret = -1;
 
@@ -709,6 +715,8 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	i_assert(ctx->cache_file_seq != 0);
 
 	mail_cache_decision_add(ctx->view, seq, field_idx);
+	mail_cache_decision_add_bytes(ctx->cache, field_idx, data_size);
+	mail_cache_batch_forget_seq(ctx->view, seq);
 
 	fixed_size = ctx->cache->fields[field_idx].field.field_size;
 	i_assert(fixed_size == UINT_MAX || fixed_size == data_size);
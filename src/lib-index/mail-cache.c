@@ -65,6 +65,7 @@ void mail_cache_file_close(struct mail_cache *cache)
 	cache->hdr = NULL;
 	cache->mmap_length = 0;
 	cache->last_field_header_offset = 0;
+	mail_cache_columns_free(cache);
 
 	if (cache->file_lock != NULL)
 		file_lock_free(&cache->file_lock);
@@ -255,6 +256,11 @@ static void mail_cache_update_need_compress(struct mail_cache *cache)
 		want_compress = TRUE;
 	}
 
+	if (cache->write_columns && !MAIL_CACHE_HAS_COLUMNS(hdr)) {
+		/* columns were just enabled, compress to create them */
+		want_compress = TRUE;
+	}
+
 	if (want_compress) {
 		if (fstat(cache->fd, &st) < 0) {
 			if (!ESTALE_FSTAT(errno))
@@ -545,6 +551,7 @@ void mail_cache_free(struct mail_cache **_cache)
 	if (cache->file_cache != NULL)
 		file_cache_free(&cache->file_cache);
 
+	mail_cache_compress_discard(cache);
 	mail_index_unregister_expunge_handler(cache->index, cache->ext_id);
 	mail_cache_file_close(cache);
 
@@ -776,6 +783,13 @@ int mail_cache_append(struct mail_cache *cache, const void *data, size_t size,
 	return 0;
 }
 
+void mail_cache_set_columns(struct mail_cache *cache, bool set)
+{
+	cache->write_columns = set;
+	if (!MAIL_CACHE_IS_UNUSABLE(cache))
+		mail_cache_update_need_compress(cache);
+}
+
 bool mail_cache_exists(struct mail_cache *cache)
 {
 	return !MAIL_CACHE_IS_UNUSABLE(cache);
@@ -806,6 +820,7 @@ void mail_cache_view_close(struct mail_cache_view **_view)
 	    !view->cache->compressing)
                 (void)mail_cache_header_fields_update(view->cache);
 
+	mail_cache_lookup_batch_free(view);
 	buffer_free(&view->cached_exists_buf);
 	i_free(view);
 }
@@ -74,6 +74,18 @@ int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans,
 			struct mail_cache_compress_lock **lock_r);
 void mail_cache_compress_unlock(struct mail_cache_compress_lock **lock);
+/* If the cache needs compression, copy it to a temporary file without
+   locking the cache or the index. The following mail_cache_compress() then
+   only needs to copy the messages that changed meanwhile while it's locked.
+   Does nothing if the copying can't be done now. */
+void mail_cache_compress_prepare(struct mail_cache *cache);
+/* Forget the copy made by mail_cache_compress_prepare() if it wasn't used. */
+void mail_cache_compress_discard(struct mail_cache *cache);
+/* Write fixed size fields that are wanted for all messages into per-field
+   columns when compressing the cache file. Looking up such a field for many
+   messages (e.g. SORT or FETCH 1:* RFC822.SIZE) then reads the file
+   sequentially instead of following each message's record list. */
+void mail_cache_set_columns(struct mail_cache *cache, bool set);
 /* Returns TRUE if there is at least something in the cache. */
 bool mail_cache_exists(struct mail_cache *cache);
 /* Open and read cache header. Returns 0 if ok, -1 if error/corrupted. */
@@ -130,6 +142,20 @@ mail_cache_field_get_decision(struct mail_cache *cache, unsigned int field_idx);
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx);
 
+/* Look up the given fields for all the messages in seq1..seq2 with a single
+   pass through the cache file. The messages are read in the order of their
+   cache offsets, so the file is accessed mostly sequentially. The values are
+   kept in the view until mail_cache_lookup_batch_free() is called or the next
+   batch is looked up, so the following mail_cache_lookup_field() and
+   mail_cache_field_exists() calls for them don't need to access the cache
+   file. The batch must be freed before the view's sequences change.
+   Returns 0 if ok, -1 if error. */
+int mail_cache_lookup_batch(struct mail_cache_view *view,
+			    uint32_t seq1, uint32_t seq2,
+			    const unsigned int field_idxs[],
+			    unsigned int fields_count);
+void mail_cache_lookup_batch_free(struct mail_cache_view *view);
+
 /* Return specified cached headers. Returns 1 if all fields were found,
    0 if not, -1 if error. dest is updated only if all fields were found. */
 int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
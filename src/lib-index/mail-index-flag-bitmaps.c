@@ -0,0 +1,441 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Searching e.g. UNSEEN or KEYWORD $Junk would normally need to look up the
+   flags of every record in the map. Instead each searched flag and keyword
+   gets a bitmap of the sequences that have it set. The bitmaps live in the
+   record map, so they're shared the same way as the records themselves.
+   Syncing updates them whenever the flags or keywords change, and expunges
+   shift the following sequences down. Appended records are added lazily
+   the next time the bitmaps are used. */
+
+#include "lib.h"
+#include "array.h"
+#include "seq-bitmap.h"
+#include "mail-index-private.h"
+#include "mail-index-flag-bitmaps.h"
+
+/* MAIL_ANSWERED .. MAIL_DRAFT. \Recent flags aren't kept in the records. */
+#define FLAG_BITMAPS_FLAG_COUNT 5
+
+struct mail_index_flag_bitmaps {
+	/* the bitmaps are up to date for records 1..valid_count */
+	uint32_t valid_count;
+	/* flag bit number -> sequences with the flag, NULL if not used */
+	struct seq_bitmap *flags[FLAG_BITMAPS_FLAG_COUNT];
+	/* keyword's bit number in keywords extension record -> sequences
+	   with the keyword, NULL if not used */
+	ARRAY(struct seq_bitmap *) keywords;
+};
+
+static struct seq_bitmap *flag_bitmap_dup(const struct seq_bitmap *src)
+{
+	struct seq_bitmap *bitmap;
+
+	bitmap = i_new(struct seq_bitmap, 1);
+	seq_bitmap_init(bitmap);
+	if (src != NULL)
+		seq_bitmap_merge(bitmap, src);
+	return bitmap;
+}
+
+static void flag_bitmap_free(struct seq_bitmap **_bitmap)
+{
+	struct seq_bitmap *bitmap = *_bitmap;
+
+	if (bitmap == NULL)
+		return;
+	*_bitmap = NULL;
+
+	seq_bitmap_deinit(bitmap);
+	i_free(bitmap);
+}
+
+static const struct mail_index_ext *
+flag_bitmaps_get_keywords_ext(struct mail_index_map *map)
+{
+	uint32_t idx;
+
+	if (!mail_index_map_get_ext_idx(map, map->index->keywords_ext_id, &idx))
+		return NULL;
+	return array_idx(&map->extensions, idx);
+}
+
+static void
+flag_bitmap_fill_flag(struct mail_index_map *map, struct seq_bitmap *bitmap,
+		      uint8_t flag, uint32_t seq1, uint32_t seq2)
+{
+	const struct mail_index_record *rec;
+	uint32_t seq, run_seq1 = 0;
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		if ((rec->flags & flag) != 0) {
+			if (run_seq1 == 0)
+				run_seq1 = seq;
+		} else if (run_seq1 != 0) {
+			seq_bitmap_add_range(bitmap, run_seq1, seq - 1);
+			run_seq1 = 0;
+		}
+	}
+	if (run_seq1 != 0)
+		seq_bitmap_add_range(bitmap, run_seq1, seq2);
+}
+
+static void
+flag_bitmap_fill_keyword(struct mail_index_map *map,
+			 const struct mail_index_ext *ext,
+			 struct seq_bitmap *bitmap, unsigned int keyword_idx,
+			 uint32_t seq1, uint32_t seq2)
+{
+	const struct mail_index_record *rec;
+	const unsigned char *data;
+	unsigned int data_offset = keyword_idx / CHAR_BIT;
+	unsigned char data_mask = 1 << (keyword_idx % CHAR_BIT);
+	uint32_t seq, run_seq1 = 0;
+
+	if (ext == NULL || data_offset >= ext->record_size) {
+		/* none of the messages have this keyword */
+		return;
+	}
+	data_offset += ext->record_offset;
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		data = CONST_PTR_OFFSET(rec, data_offset);
+		if ((*data & data_mask) != 0) {
+			if (run_seq1 == 0)
+				run_seq1 = seq;
+		} else if (run_seq1 != 0) {
+			seq_bitmap_add_range(bitmap, run_seq1, seq - 1);
+			run_seq1 = 0;
+		}
+	}
+	if (run_seq1 != 0)
+		seq_bitmap_add_range(bitmap, run_seq1, seq2);
+}
+
+static void
+flag_bitmaps_extend(struct mail_index_map *map,
+		    struct mail_index_flag_bitmaps *bitmaps,
+		    const struct mail_index_ext *kw_ext, uint32_t seq2)
+{
+	struct seq_bitmap *const *bitmapp;
+	uint32_t seq1 = bitmaps->valid_count + 1;
+	unsigned int i;
+
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if (bitmaps->flags[i] != NULL) {
+			flag_bitmap_fill_flag(map, bitmaps->flags[i], 1 << i,
+					      seq1, seq2);
+		}
+	}
+	array_foreach(&bitmaps->keywords, bitmapp) {
+		if (*bitmapp != NULL) {
+			flag_bitmap_fill_keyword(map, kw_ext, *bitmapp,
+				array_foreach_idx(&bitmaps->keywords, bitmapp),
+				seq1, seq2);
+		}
+	}
+	bitmaps->valid_count = seq2;
+}
+
+static struct seq_bitmap *
+flag_bitmaps_get_flag(struct mail_index_map *map,
+		      struct mail_index_flag_bitmaps *bitmaps, unsigned int bit)
+{
+	if (bitmaps->flags[bit] == NULL) {
+		bitmaps->flags[bit] = flag_bitmap_dup(NULL);
+		flag_bitmap_fill_flag(map, bitmaps->flags[bit], 1 << bit,
+				      1, bitmaps->valid_count);
+	}
+	return bitmaps->flags[bit];
+}
+
+static struct seq_bitmap *
+flag_bitmaps_get_keyword(struct mail_index_map *map,
+			 struct mail_index_flag_bitmaps *bitmaps,
+			 const struct mail_index_ext *kw_ext,
+			 unsigned int index_idx)
+{
+	struct seq_bitmap *bitmap, *const *bitmapp;
+	const unsigned int *idx_map;
+	unsigned int i, count;
+
+	if (kw_ext == NULL || !array_is_created(&map->keyword_idx_map))
+		return NULL;
+
+	/* the bitmaps are indexed by the keyword's position in the map */
+	idx_map = array_get(&map->keyword_idx_map, &count);
+	for (i = 0; i < count; i++) {
+		if (idx_map[i] == index_idx)
+			break;
+	}
+	if (i == count)
+		return NULL;
+
+	if (i < array_count(&bitmaps->keywords)) {
+		bitmapp = array_idx(&bitmaps->keywords, i);
+		if (*bitmapp != NULL)
+			return *bitmapp;
+	}
+	bitmap = flag_bitmap_dup(NULL);
+	flag_bitmap_fill_keyword(map, kw_ext, bitmap, i,
+				 1, bitmaps->valid_count);
+	array_idx_set(&bitmaps->keywords, i, &bitmap);
+	return bitmap;
+}
+
+static void
+flag_bitmaps_intersect(struct seq_bitmap *result, bool *first,
+		       const struct seq_bitmap *bitmap)
+{
+	if (*first) {
+		seq_bitmap_merge(result, bitmap);
+		*first = FALSE;
+	} else {
+		(void)seq_bitmap_intersect(result, bitmap);
+	}
+}
+
+void mail_index_map_lookup_flags_seqs(struct mail_index_map *map,
+				      enum mail_flags flags,
+				      const struct mail_keywords *keywords,
+				      bool match_not,
+				      ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	struct mail_index_flag_bitmaps *bitmaps;
+	const struct mail_index_ext *kw_ext;
+	struct seq_bitmap result, *bitmap;
+	ARRAY_TYPE(seq_range) matches;
+	uint32_t messages_count = map->hdr.messages_count;
+	unsigned int i;
+	bool first = TRUE;
+
+	i_assert((flags & ~MAIL_FLAGS_NONRECENT) == 0);
+	i_assert(messages_count <= rec_map->records_count);
+
+	if (messages_count == 0)
+		return;
+
+	if (rec_map->flag_bitmaps == NULL) {
+		rec_map->flag_bitmaps = i_new(struct mail_index_flag_bitmaps, 1);
+		i_array_init(&rec_map->flag_bitmaps->keywords, 8);
+	}
+	bitmaps = rec_map->flag_bitmaps;
+	kw_ext = flag_bitmaps_get_keywords_ext(map);
+	if (bitmaps->valid_count < messages_count)
+		flag_bitmaps_extend(map, bitmaps, kw_ext, messages_count);
+
+	seq_bitmap_init(&result);
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if ((flags & (1 << i)) != 0) {
+			bitmap = flag_bitmaps_get_flag(map, bitmaps, i);
+			flag_bitmaps_intersect(&result, &first, bitmap);
+		}
+	}
+	for (i = 0; keywords != NULL && i < keywords->count; i++) {
+		bitmap = flag_bitmaps_get_keyword(map, bitmaps, kw_ext,
+						  keywords->idx[i]);
+		if (bitmap == NULL) {
+			/* keyword isn't used by any of the messages */
+			seq_bitmap_clear(&result);
+			first = FALSE;
+			break;
+		}
+		flag_bitmaps_intersect(&result, &first, bitmap);
+	}
+	if (first) {
+		/* no flags or keywords - everything matches */
+		seq_bitmap_add_range(&result, 1, messages_count);
+	} else if (bitmaps->valid_count > messages_count) {
+		/* another map sharing the records has more messages */
+		(void)seq_bitmap_remove_range(&result, messages_count + 1,
+					      (uint32_t)-1);
+	}
+
+	i_array_init(&matches, 128);
+	seq_bitmap_to_array(&result, &matches);
+	seq_bitmap_deinit(&result);
+	if (match_not)
+		seq_range_array_invert(&matches, 1, messages_count);
+	seq_range_array_merge(seqs, &matches);
+	array_free(&matches);
+}
+
+void
+mail_index_flag_bitmaps_update_flags(struct mail_index_record_map *rec_map,
+				     uint32_t seq1, uint32_t seq2,
+				     uint8_t add_flags,
+				     uint8_t remove_flags)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	uint8_t flag;
+	unsigned int i;
+
+	if (bitmaps == NULL || seq1 > bitmaps->valid_count)
+		return;
+	seq2 = I_MIN(seq2, bitmaps->valid_count);
+
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if (bitmaps->flags[i] == NULL)
+			continue;
+
+		flag = 1 << i;
+		if ((add_flags & flag) != 0)
+			seq_bitmap_add_range(bitmaps->flags[i], seq1, seq2);
+		else if ((remove_flags & flag) != 0) {
+			(void)seq_bitmap_remove_range(bitmaps->flags[i],
+						      seq1, seq2);
+		}
+	}
+}
+
+void
+mail_index_flag_bitmaps_update_keyword(struct mail_index_record_map *rec_map,
+				       unsigned int keyword_idx,
+				       uint32_t seq1, uint32_t seq2,
+				       bool add)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	struct seq_bitmap *const *bitmapp;
+
+	if (bitmaps == NULL || seq1 > bitmaps->valid_count ||
+	    keyword_idx >= array_count(&bitmaps->keywords))
+		return;
+	bitmapp = array_idx(&bitmaps->keywords, keyword_idx);
+	if (*bitmapp == NULL)
+		return;
+
+	seq2 = I_MIN(seq2, bitmaps->valid_count);
+	if (add)
+		seq_bitmap_add_range(*bitmapp, seq1, seq2);
+	else
+		(void)seq_bitmap_remove_range(*bitmapp, seq1, seq2);
+}
+
+void
+mail_index_flag_bitmaps_reset_keywords(struct mail_index_record_map *rec_map,
+				       uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	struct seq_bitmap *const *bitmapp;
+
+	if (bitmaps == NULL || seq1 > bitmaps->valid_count)
+		return;
+	seq2 = I_MIN(seq2, bitmaps->valid_count);
+
+	array_foreach(&bitmaps->keywords, bitmapp) {
+		if (*bitmapp != NULL)
+			(void)seq_bitmap_remove_range(*bitmapp, seq1, seq2);
+	}
+}
+
+void
+mail_index_flag_bitmaps_drop_keywords(struct mail_index_record_map *rec_map)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	struct seq_bitmap **bitmapp;
+
+	if (bitmaps == NULL)
+		return;
+
+	array_foreach_modifiable(&bitmaps->keywords, bitmapp)
+		flag_bitmap_free(bitmapp);
+	array_clear(&bitmaps->keywords);
+}
+
+void
+mail_index_flag_bitmaps_expunge(struct mail_index_record_map *rec_map,
+				const ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	struct seq_bitmap **bitmapp;
+	const struct seq_range *range;
+	uint32_t removed = 0;
+	unsigned int i;
+
+	if (bitmaps == NULL)
+		return;
+
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if (bitmaps->flags[i] != NULL)
+			seq_bitmap_remove_shift(bitmaps->flags[i], seqs);
+	}
+	array_foreach_modifiable(&bitmaps->keywords, bitmapp) {
+		if (*bitmapp != NULL)
+			seq_bitmap_remove_shift(*bitmapp, seqs);
+	}
+	/* the records that aren't in the bitmaps yet stay that way */
+	array_foreach(seqs, range) {
+		if (range->seq1 > bitmaps->valid_count)
+			break;
+		removed += I_MIN(range->seq2, bitmaps->valid_count) -
+			range->seq1 + 1;
+	}
+	bitmaps->valid_count -= removed;
+}
+
+void
+mail_index_flag_bitmaps_truncate(struct mail_index_record_map *rec_map,
+				 uint32_t seq)
+{
+	struct mail_index_flag_bitmaps *bitmaps = rec_map->flag_bitmaps;
+	struct seq_bitmap **bitmapp;
+	unsigned int i;
+
+	if (bitmaps == NULL || seq >= bitmaps->valid_count)
+		return;
+
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if (bitmaps->flags[i] != NULL) {
+			(void)seq_bitmap_remove_range(bitmaps->flags[i],
+						      seq + 1, (uint32_t)-1);
+		}
+	}
+	array_foreach_modifiable(&bitmaps->keywords, bitmapp) {
+		if (*bitmapp != NULL) {
+			(void)seq_bitmap_remove_range(*bitmapp,
+						      seq + 1, (uint32_t)-1);
+		}
+	}
+	bitmaps->valid_count = seq;
+}
+
+struct mail_index_flag_bitmaps *
+mail_index_flag_bitmaps_clone(const struct mail_index_flag_bitmaps *bitmaps)
+{
+	struct mail_index_flag_bitmaps *new_bitmaps;
+	struct seq_bitmap *const *bitmapp, *bitmap;
+	unsigned int i;
+
+	new_bitmaps = i_new(struct mail_index_flag_bitmaps, 1);
+	new_bitmaps->valid_count = bitmaps->valid_count;
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++) {
+		if (bitmaps->flags[i] != NULL)
+			new_bitmaps->flags[i] = flag_bitmap_dup(bitmaps->flags[i]);
+	}
+	i_array_init(&new_bitmaps->keywords,
+		     array_count(&bitmaps->keywords) + 8);
+	array_foreach(&bitmaps->keywords, bitmapp) {
+		bitmap = *bitmapp == NULL ? NULL : flag_bitmap_dup(*bitmapp);
+		array_append(&new_bitmaps->keywords, &bitmap, 1);
+	}
+	return new_bitmaps;
+}
+
+void mail_index_flag_bitmaps_free(struct mail_index_flag_bitmaps **_bitmaps)
+{
+	struct mail_index_flag_bitmaps *bitmaps = *_bitmaps;
+	struct seq_bitmap **bitmapp;
+	unsigned int i;
+
+	*_bitmaps = NULL;
+
+	for (i = 0; i < FLAG_BITMAPS_FLAG_COUNT; i++)
+		flag_bitmap_free(&bitmaps->flags[i]);
+	array_foreach_modifiable(&bitmaps->keywords, bitmapp)
+		flag_bitmap_free(bitmapp);
+	array_free(&bitmaps->keywords);
+	i_free(bitmaps);
+}
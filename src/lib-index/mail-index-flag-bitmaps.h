@@ -0,0 +1,57 @@
+#ifndef MAIL_INDEX_FLAG_BITMAPS_H
+#define MAIL_INDEX_FLAG_BITMAPS_H
+
+#include "seq-range-array.h"
+#include "mail-types.h"
+
+struct mail_keywords;
+struct mail_index_map;
+struct mail_index_record_map;
+struct mail_index_flag_bitmaps;
+
+/* Add to seqs all the messages in the map that have all the flags and
+   keywords set, or with match_not the messages that are missing any of
+   them. The bitmaps are built when they're first needed and kept updated
+   by syncing after that. */
+void mail_index_map_lookup_flags_seqs(struct mail_index_map *map,
+				      enum mail_flags flags,
+				      const struct mail_keywords *keywords,
+				      bool match_not,
+				      ARRAY_TYPE(seq_range) *seqs);
+
+/* Flags were added/removed for records in seq1..seq2. */
+void
+mail_index_flag_bitmaps_update_flags(struct mail_index_record_map *rec_map,
+				     uint32_t seq1, uint32_t seq2,
+				     uint8_t add_flags,
+				     uint8_t remove_flags);
+/* The keyword (bit number in the keywords extension record) was added or
+   removed for records in seq1..seq2. */
+void
+mail_index_flag_bitmaps_update_keyword(struct mail_index_record_map *rec_map,
+				       unsigned int keyword_idx,
+				       uint32_t seq1, uint32_t seq2,
+				       bool add);
+/* All keywords were removed from records in seq1..seq2. */
+void
+mail_index_flag_bitmaps_reset_keywords(struct mail_index_record_map *rec_map,
+				       uint32_t seq1, uint32_t seq2);
+/* The keywords extension records were changed in some other way. */
+void
+mail_index_flag_bitmaps_drop_keywords(struct mail_index_record_map *rec_map);
+/* The records in seqs were expunged and the following records were moved
+   down to fill the gaps. */
+void
+mail_index_flag_bitmaps_expunge(struct mail_index_record_map *rec_map,
+				const ARRAY_TYPE(seq_range) *seqs);
+/* Records after seq were removed or changed in some other way. They're
+   looked up again the next time the bitmaps are used. */
+void
+mail_index_flag_bitmaps_truncate(struct mail_index_record_map *rec_map,
+				 uint32_t seq);
+
+struct mail_index_flag_bitmaps *
+mail_index_flag_bitmaps_clone(const struct mail_index_flag_bitmaps *bitmaps);
+void mail_index_flag_bitmaps_free(struct mail_index_flag_bitmaps **bitmaps);
+
+#endif
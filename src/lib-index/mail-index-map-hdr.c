@@ -226,7 +226,7 @@ static void mail_index_map_clear_recent_flags(struct mail_index_map *map)
 	uint32_t seq;
 
 	for (seq = 1; seq <= map->hdr.messages_count; seq++) {
-		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(map, seq);
 		rec->flags &= ~MAIL_RECENT;
 	}
 }
@@ -26,6 +26,8 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	map->hdr.unused_old_recent_messages_count = 0;
 }
 
+static int mail_index_read_map(struct mail_index_map *map, uoff_t file_size);
+
 static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
@@ -35,7 +37,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 
 	i_assert(rec_map->mmap_base == NULL);
 
-	buffer_free(&rec_map->buffer);
+	i_assert(array_count(&rec_map->pages) == 0);
 	if (file_size > SSIZE_T_MAX) {
 		/* too large file to map into memory */
 		mail_index_set_error(index, "Index file too large: %s",
@@ -50,9 +52,20 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 		mail_index_set_syscall_error(index, "mmap()");
 		return -1;
 	}
-	rec_map->mmap_size = file_size;
 
 	hdr = rec_map->mmap_base;
+	if (file_size > offsetof(struct mail_index_header, major_version) &&
+	    hdr->major_version == MAIL_INDEX_PACKED_MAJOR_VERSION) {
+		/* packed records can't be accessed directly from mmap */
+		if (munmap(rec_map->mmap_base, file_size) < 0)
+			mail_index_set_syscall_error(index, "munmap()");
+		rec_map->mmap_base = NULL;
+		return mail_index_read_map(map, file_size);
+	}
+	rec_map->mmap_size = file_size;
+	rec_map->mmap = mail_index_record_mmap_create(index, rec_map->mmap_base,
+						      rec_map->mmap_size);
+
 	if (rec_map->mmap_size >
 	    offsetof(struct mail_index_header, major_version) &&
 	    hdr->major_version != MAIL_INDEX_MAJOR_VERSION) {
@@ -94,7 +107,9 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	mail_index_map_copy_hdr(map, hdr);
 
 	map->hdr_base = rec_map->mmap_base;
-	rec_map->records = PTR_OFFSET(rec_map->mmap_base, map->hdr.header_size);
+	mail_index_record_map_init_mmap_pages(rec_map, map->hdr.header_size,
+					      rec_map->records_count,
+					      map->hdr.record_size);
 	return 1;
 }
 
@@ -122,6 +137,55 @@ static int mail_index_read_header(struct mail_index *index,
 	return ret;
 }
 
+static int
+mail_index_read_packed_records(struct mail_index_map *map,
+			       const struct mail_index_header *hdr,
+			       uoff_t file_size, const void *buf,
+			       size_t buf_size, unsigned int *records_count_r)
+{
+	struct mail_index *index = map->index;
+	buffer_t *packed_buf;
+	const char *error;
+	void *data;
+	size_t size, extra;
+	ssize_t ret = 1;
+
+	if (file_size - hdr->header_size > SSIZE_T_MAX) {
+		mail_index_set_error(index, "Index file too large: %s",
+				     index->filepath);
+		return 0;
+	}
+	size = file_size - hdr->header_size;
+	extra = buf_size <= hdr->header_size ? 0 :
+		I_MIN(buf_size - hdr->header_size, size);
+
+	packed_buf = buffer_create_dynamic(default_pool, size);
+	buffer_append(packed_buf, CONST_PTR_OFFSET(buf, hdr->header_size),
+		      extra);
+	if (size > extra) {
+		/* @UNSAFE: read the rest of the packed records */
+		data = buffer_append_space_unsafe(packed_buf, size - extra);
+		ret = pread_full(index->fd, data, size - extra,
+				 hdr->header_size + extra);
+	}
+	if (ret == 0) {
+		mail_index_set_error(index,
+			"Corrupted index file %s: File too small",
+			index->filepath);
+	} else if (ret > 0 &&
+		   mail_index_unpack_records(map->rec_map, hdr->messages_count,
+					     hdr->record_size, packed_buf->data,
+					     packed_buf->used, records_count_r,
+					     &error) < 0) {
+		/* use the records before the corruption, the same as
+		   with a truncated unpacked file */
+		mail_index_set_error(index, "Corrupted index file %s: %s",
+				     index->filepath, error);
+	}
+	buffer_free(&packed_buf);
+	return ret < 0 ? -1 : (ret == 0 ? 0 : 1);
+}
+
 static int
 mail_index_try_read_map(struct mail_index_map *map,
 			uoff_t file_size, bool *retry_r, bool try_retry)
@@ -134,7 +198,9 @@ mail_index_try_read_map(struct mail_index_map *map,
 	void *data = NULL;
 	ssize_t ret;
 	size_t pos, records_size, initial_buf_pos = 0;
-	unsigned int records_count = 0, extra;
+	size_t offset, page_size, copied;
+	unsigned int idx, records_count = 0, extra;
+	bool packed = FALSE;
 
 	i_assert(map->rec_map->mmap_base == NULL);
 
@@ -142,6 +208,14 @@ mail_index_try_read_map(struct mail_index_map *map,
 	ret = mail_index_read_header(index, read_buf, sizeof(read_buf), &pos);
 	buf = read_buf; hdr = buf;
 
+	if (pos > (ssize_t)offsetof(struct mail_index_header, major_version) &&
+	    hdr->major_version == MAIL_INDEX_PACKED_MAJOR_VERSION) {
+		/* the header is otherwise the same. the in-memory map is
+		   always unpacked. */
+		read_buf[offsetof(struct mail_index_header, major_version)] =
+			MAIL_INDEX_MAJOR_VERSION;
+		packed = TRUE;
+	}
 	if (pos > (ssize_t)offsetof(struct mail_index_header, major_version) &&
 	    hdr->major_version != MAIL_INDEX_MAJOR_VERSION) {
 		/* major version change - handle silently */
@@ -175,7 +249,13 @@ mail_index_try_read_map(struct mail_index_map *map,
 		}
 	}
 
-	if (ret > 0) {
+	if (ret > 0 && packed) {
+		ret = mail_index_read_packed_records(map, hdr, file_size,
+						     buf, initial_buf_pos,
+						     &records_count);
+		if (ret == 0)
+			return 0;
+	} else if (ret > 0) {
 		/* header read, read the records now. */
 		records_size = (size_t)hdr->messages_count * hdr->record_size;
 		records_count = hdr->messages_count;
@@ -192,27 +272,34 @@ mail_index_try_read_map(struct mail_index_map *map,
 				records_count);
 		}
 
-		if (map->rec_map->buffer == NULL) {
-			map->rec_map->buffer =
-				buffer_create_dynamic(default_pool,
-						      records_size);
-		}
-
-		/* @UNSAFE */
-		buffer_set_used_size(map->rec_map->buffer, 0);
-		if (initial_buf_pos <= hdr->header_size)
-			extra = 0;
-		else {
-			extra = initial_buf_pos - hdr->header_size;
-			buffer_append(map->rec_map->buffer,
-				      CONST_PTR_OFFSET(buf, hdr->header_size),
-				      extra);
-		}
-		if (records_size > extra) {
-			data = buffer_append_space_unsafe(map->rec_map->buffer,
-							  records_size - extra);
-			ret = pread_full(index->fd, data, records_size - extra,
-					 hdr->header_size + extra);
+		mail_index_record_map_alloc_pages(map->rec_map, records_count,
+						  hdr->record_size);
+		extra = initial_buf_pos <= hdr->header_size ? 0 :
+			initial_buf_pos - hdr->header_size;
+
+		/* @UNSAFE: read the records into the pages */
+		for (idx = 0; idx < records_count && ret > 0;
+		     idx += MAIL_INDEX_RECORD_PAGE_COUNT) {
+			page_size = I_MIN(records_count - idx,
+					  MAIL_INDEX_RECORD_PAGE_COUNT) *
+				(size_t)hdr->record_size;
+			offset = (size_t)idx * hdr->record_size;
+			data = mail_index_record_pages_idx(&map->rec_map->pages,
+							   idx, hdr->record_size);
+
+			copied = 0;
+			if (offset < extra) {
+				copied = I_MIN(extra - offset, page_size);
+				memcpy(data, CONST_PTR_OFFSET(buf,
+					hdr->header_size + offset), copied);
+			}
+			if (page_size > copied) {
+				ret = pread_full(index->fd,
+						 PTR_OFFSET(data, copied),
+						 page_size - copied,
+						 hdr->header_size + offset +
+						 copied);
+			}
 		}
 	}
 
@@ -232,8 +319,6 @@ mail_index_try_read_map(struct mail_index_map *map,
 		return 0;
 	}
 
-	map->rec_map->records =
-		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
 
 	mail_index_map_copy_hdr(map, hdr);
@@ -382,7 +467,6 @@ static int mail_index_map_latest_file(struct mail_index *index)
 		mail_index_unmap(&new_map);
 		return ret < 0 ? -1 : (unusable ? 0 : 1);
 	}
-	i_assert(new_map->rec_map->records != NULL);
 
 	index->last_read_log_file_seq = new_map->hdr.log_file_seq;
 	index->last_read_log_file_head_offset =
@@ -6,6 +6,21 @@
 #include "mmap-util.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
+#include "mail-index-flag-bitmaps.h"
+
+/* Initial number of records in a newly allocated last page. It's grown as
+   needed until it reaches MAIL_INDEX_RECORD_PAGE_COUNT. */
+#define MAIL_INDEX_RECORD_PAGE_MIN_COUNT 16
+#define MAIL_INDEX_RECORD_PAGE_HDR_SIZE \
+	MEM_ALIGN(sizeof(struct mail_index_record_page))
+
+struct mail_index_record_mmap {
+	struct mail_index *index;
+	int refcount;
+
+	void *base;
+	size_t size;
+};
 
 void mail_index_map_init_extbufs(struct mail_index_map *map,
 				 unsigned int initial_count)
@@ -263,21 +278,241 @@ struct mail_index_map *mail_index_map_alloc(struct mail_index *index)
 	return mail_index_map_clone(&tmp_map);
 }
 
-static void mail_index_record_map_free(struct mail_index_map *map,
-				       struct mail_index_record_map *rec_map)
+struct mail_index_record_mmap *
+mail_index_record_mmap_create(struct mail_index *index,
+			      void *base, size_t size)
+{
+	struct mail_index_record_mmap *rec_mmap;
+
+	rec_mmap = i_new(struct mail_index_record_mmap, 1);
+	rec_mmap->index = index;
+	rec_mmap->refcount = 1;
+	rec_mmap->base = base;
+	rec_mmap->size = size;
+	return rec_mmap;
+}
+
+static void
+mail_index_record_mmap_unref(struct mail_index_record_mmap **_rec_mmap)
+{
+	struct mail_index_record_mmap *rec_mmap = *_rec_mmap;
+
+	*_rec_mmap = NULL;
+	i_assert(rec_mmap->refcount > 0);
+	if (--rec_mmap->refcount > 0)
+		return;
+
+	if (munmap(rec_mmap->base, rec_mmap->size) < 0)
+		mail_index_set_syscall_error(rec_mmap->index, "munmap()");
+	i_free(rec_mmap);
+}
+
+static struct mail_index_record_page *
+mail_index_record_page_alloc(unsigned int capacity, size_t record_size)
+{
+	struct mail_index_record_page *page;
+
+	page = i_malloc(MAIL_INDEX_RECORD_PAGE_HDR_SIZE +
+			capacity * record_size);
+	page->refcount = 1;
+	page->capacity = capacity;
+	page->records = PTR_OFFSET(page, MAIL_INDEX_RECORD_PAGE_HDR_SIZE);
+	return page;
+}
+
+static void
+mail_index_record_page_unref(struct mail_index_record_page **_page)
+{
+	struct mail_index_record_page *page = *_page;
+
+	*_page = NULL;
+	i_assert(page->refcount > 0);
+	if (--page->refcount > 0)
+		return;
+
+	if (page->mmap != NULL)
+		mail_index_record_mmap_unref(&page->mmap);
+	i_free(page);
+}
+
+void mail_index_record_pages_free(ARRAY_TYPE(mail_index_record_page) *pages)
+{
+	struct mail_index_record_page **page;
+
+	array_foreach_modifiable(pages, page)
+		mail_index_record_page_unref(page);
+	array_free(pages);
+}
+
+static void
+mail_index_record_map_drop_pages(struct mail_index_record_map *rec_map,
+				 unsigned int records_count)
+{
+	struct mail_index_record_page **pages;
+	unsigned int i, count, needed;
+
+	needed = MAIL_INDEX_RECORD_PAGES_NEEDED(records_count);
+	pages = array_get_modifiable(&rec_map->pages, &count);
+	if (count <= needed)
+		return;
+
+	for (i = needed; i < count; i++)
+		mail_index_record_page_unref(&pages[i]);
+	array_delete(&rec_map->pages, needed, count - needed);
+}
+
+void mail_index_record_map_alloc_pages(struct mail_index_record_map *rec_map,
+				       unsigned int records_count,
+				       size_t record_size)
+{
+	struct mail_index_record_page *page;
+	unsigned int idx;
+
+	mail_index_record_map_drop_pages(rec_map, 0);
+	for (idx = 0; idx < records_count; idx += MAIL_INDEX_RECORD_PAGE_COUNT) {
+		page = mail_index_record_page_alloc(
+			I_MIN(records_count - idx, MAIL_INDEX_RECORD_PAGE_COUNT),
+			record_size);
+		array_append(&rec_map->pages, &page, 1);
+	}
+}
+
+void mail_index_record_map_init_mmap_pages(struct mail_index_record_map *rec_map,
+					   size_t records_offset,
+					   unsigned int records_count,
+					   size_t record_size)
 {
-	if (rec_map->buffer != NULL) {
-		i_assert(rec_map->mmap_base == NULL);
-		buffer_free(&rec_map->buffer);
-	} else if (rec_map->mmap_base != NULL) {
-		i_assert(rec_map->buffer == NULL);
-		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
-			mail_index_set_syscall_error(map->index, "munmap()");
+	struct mail_index_record_page *page;
+	unsigned int idx;
+
+	i_assert(rec_map->mmap != NULL);
+	i_assert(array_count(&rec_map->pages) == 0);
+
+	for (idx = 0; idx < records_count; idx += MAIL_INDEX_RECORD_PAGE_COUNT) {
+		page = i_new(struct mail_index_record_page, 1);
+		page->refcount = 1;
+		page->capacity = I_MIN(records_count - idx,
+				       MAIL_INDEX_RECORD_PAGE_COUNT);
+		page->records = PTR_OFFSET(rec_map->mmap_base, records_offset +
+					   (size_t)idx * record_size);
+		page->mmap = rec_map->mmap;
+		page->mmap->refcount++;
+		array_append(&rec_map->pages, &page, 1);
+	}
+}
+
+static struct mail_index_record_page *
+mail_index_record_map_get_private_page(struct mail_index_record_map *rec_map,
+				       unsigned int page_idx,
+				       unsigned int min_capacity,
+				       size_t record_size)
+{
+	struct mail_index_record_page **pagep, *page, *new_page;
+	unsigned int capacity;
+
+	pagep = array_idx_modifiable(&rec_map->pages, page_idx);
+	page = *pagep;
+	if (page->refcount == 1 && page->capacity >= min_capacity)
+		return page;
+
+	capacity = page->capacity;
+	if (capacity < min_capacity) {
+		/* only the last page can be grown */
+		i_assert(page_idx + 1 == array_count(&rec_map->pages));
+		capacity = I_MAX(nearest_power(min_capacity),
+				 MAIL_INDEX_RECORD_PAGE_MIN_COUNT);
+		capacity = I_MIN(capacity, MAIL_INDEX_RECORD_PAGE_COUNT);
+	}
+
+	if (page->refcount == 1 && page->mmap == NULL) {
+		page = i_realloc(page, MAIL_INDEX_RECORD_PAGE_HDR_SIZE +
+				 page->capacity * record_size,
+				 MAIL_INDEX_RECORD_PAGE_HDR_SIZE +
+				 capacity * record_size);
+		page->records = PTR_OFFSET(page,
+					   MAIL_INDEX_RECORD_PAGE_HDR_SIZE);
+		page->capacity = capacity;
+	} else {
+		/* the page is shared with other record maps, or it's in
+		   mmap and needs to grow. */
+		new_page = mail_index_record_page_alloc(capacity, record_size);
+		memcpy(new_page->records, page->records,
+		       page->capacity * record_size);
+		mail_index_record_page_unref(&page);
+		page = new_page;
+	}
+	*pagep = page;
+	return page;
+}
+
+struct mail_index_record *
+mail_index_map_idx_modifiable(struct mail_index_map *map, uint32_t idx)
+{
+	struct mail_index_record_page *page;
+	unsigned int page_pos = idx & MAIL_INDEX_RECORD_PAGE_MASK;
+
+	page = mail_index_record_map_get_private_page(map->rec_map,
+		idx >> MAIL_INDEX_RECORD_PAGE_SHIFT, page_pos + 1,
+		map->hdr.record_size);
+	return PTR_OFFSET(page->records, page_pos * map->hdr.record_size);
+}
+
+void *mail_index_map_append_record_space(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	struct mail_index_record_page *page;
+	uint32_t idx = rec_map->records_count;
+	unsigned int page_idx = idx >> MAIL_INDEX_RECORD_PAGE_SHIFT;
+
+	i_assert(page_idx <= array_count(&rec_map->pages));
+	if (page_idx == array_count(&rec_map->pages)) {
+		page = mail_index_record_page_alloc(
+			MAIL_INDEX_RECORD_PAGE_MIN_COUNT, map->hdr.record_size);
+		array_append(&rec_map->pages, &page, 1);
+	}
+	return mail_index_map_idx_modifiable(map, idx);
+}
+
+void mail_index_map_move_records(struct mail_index_map *map, uint32_t dest_idx,
+				 uint32_t src_idx, uint32_t count)
+{
+	size_t record_size = map->hdr.record_size;
+	unsigned int n;
+	void *dest;
+
+	i_assert(dest_idx < src_idx);
+	/* records_count may already have been lowered by expunges */
+	i_assert(src_idx + count <= array_count(&map->rec_map->pages) *
+		 MAIL_INDEX_RECORD_PAGE_COUNT);
+
+	/* move the records one page-contiguous block at a time */
+	while (count > 0) {
+		n = I_MIN(count, MAIL_INDEX_RECORD_PAGE_COUNT -
+			  (dest_idx & MAIL_INDEX_RECORD_PAGE_MASK));
+		n = I_MIN(n, MAIL_INDEX_RECORD_PAGE_COUNT -
+			  (src_idx & MAIL_INDEX_RECORD_PAGE_MASK));
+
+		/* get the destination first, because it may replace the
+		   page that also contains the source */
+		dest = MAIL_INDEX_MAP_IDX_MODIFIABLE(map, dest_idx);
+		memmove(dest, MAIL_INDEX_MAP_IDX(map, src_idx),
+			n * record_size);
+		dest_idx += n; src_idx += n; count -= n;
+	}
+}
+
+static void mail_index_record_map_free(struct mail_index_record_map *rec_map)
+{
+	mail_index_record_pages_free(&rec_map->pages);
+	if (rec_map->mmap != NULL) {
+		mail_index_record_mmap_unref(&rec_map->mmap);
 		rec_map->mmap_base = NULL;
 	}
 	array_free(&rec_map->maps);
 	if (rec_map->modseq != NULL)
 		mail_index_map_modseq_free(&rec_map->modseq);
+	if (rec_map->flag_bitmaps != NULL)
+		mail_index_flag_bitmaps_free(&rec_map->flag_bitmaps);
 	i_free(rec_map);
 }
 
@@ -296,7 +531,7 @@ static void mail_index_record_map_unlink(struct mail_index_map *map)
 
 	array_delete(&map->rec_map->maps, idx, 1);
 	if (array_count(&map->rec_map->maps) == 0) {
-		mail_index_record_map_free(map, map->rec_map);
+		mail_index_record_map_free(map->rec_map);
 		map->rec_map = NULL;
 	}
 }
@@ -321,17 +556,25 @@ void mail_index_unmap(struct mail_index_map **_map)
 }
 
 static void mail_index_map_copy_records(struct mail_index_record_map *dest,
-					const struct mail_index_record_map *src,
-					unsigned int record_size)
+					const struct mail_index_record_map *src)
 {
-	size_t size;
+	struct mail_index_record_page *const *pages;
+	unsigned int i, count, needed;
 
-	size = src->records_count * record_size;
-	dest->buffer = buffer_create_dynamic(default_pool, I_MIN(size, 1024));
-	buffer_append(dest->buffer, src->records, size);
+	/* share the pages. they're copied only when modified. */
+	needed = MAIL_INDEX_RECORD_PAGES_NEEDED(src->records_count);
+	pages = array_get(&src->pages, &count);
+	i_assert(needed <= count);
 
-	dest->records = buffer_get_modifiable_data(dest->buffer, NULL);
+	for (i = 0; i < needed; i++) {
+		pages[i]->refcount++;
+		array_append(&dest->pages, &pages[i], 1);
+	}
 	dest->records_count = src->records_count;
+	if (src->flag_bitmaps != NULL) {
+		dest->flag_bitmaps =
+			mail_index_flag_bitmaps_clone(src->flag_bitmaps);
+	}
 }
 
 static void mail_index_map_copy_header(struct mail_index_map *dest,
@@ -370,6 +613,7 @@ mail_index_record_map_alloc(struct mail_index_map *map)
 
 	rec_map = i_new(struct mail_index_record_map, 1);
 	i_array_init(&rec_map->maps, 4);
+	i_array_init(&rec_map->pages, 16);
 	array_append(&rec_map->maps, &map, 1);
 	return rec_map;
 }
@@ -383,11 +627,9 @@ struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map)
 	mem_map = i_new(struct mail_index_map, 1);
 	mem_map->index = map->index;
 	mem_map->refcount = 1;
-	if (map->rec_map == NULL) {
+	if (map->rec_map == NULL)
 		mem_map->rec_map = mail_index_record_map_alloc(mem_map);
-		mem_map->rec_map->buffer =
-			buffer_create_dynamic(default_pool, 1024);
-	} else {
+	else {
 		mem_map->rec_map = map->rec_map;
 		array_append(&mem_map->rec_map->maps, &mem_map, 1);
 	}
@@ -429,8 +671,7 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 
 	if (array_count(&map->rec_map->maps) > 1) {
 		new_map = mail_index_record_map_alloc(map);
-		mail_index_map_copy_records(new_map, map->rec_map,
-					    map->hdr.record_size);
+		mail_index_map_copy_records(new_map, map->rec_map);
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 		if (map->rec_map->modseq != NULL)
@@ -447,8 +688,10 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 			rec = MAIL_INDEX_REC_AT_SEQ(map, new_map->records_count);
 			new_map->last_appended_uid = rec->uid;
 		}
-		buffer_set_used_size(new_map->buffer, new_map->records_count *
-				     map->hdr.record_size);
+		mail_index_record_map_drop_pages(new_map,
+						 new_map->records_count);
+		mail_index_flag_bitmaps_truncate(new_map,
+						 new_map->records_count);
 	}
 }
 
@@ -459,25 +702,20 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 	if (map->rec_map->mmap_base == NULL)
 		return;
 
-	if (array_count(&map->rec_map->maps) == 1)
-		new_map = map->rec_map;
-	else {
+	mail_index_map_copy_header(map, map);
+
+	if (array_count(&map->rec_map->maps) == 1) {
+		/* the pages keep the mmap referenced until they're all
+		   modified or freed. */
+		mail_index_record_mmap_unref(&map->rec_map->mmap);
+		map->rec_map->mmap_base = NULL;
+	} else {
 		new_map = mail_index_record_map_alloc(map);
 		new_map->modseq = map->rec_map->modseq == NULL ? NULL :
 			mail_index_map_modseq_clone(map->rec_map->modseq);
-	}
-
-	mail_index_map_copy_records(new_map, map->rec_map,
-				    map->hdr.record_size);
-	mail_index_map_copy_header(map, map);
-
-	if (new_map != map->rec_map) {
+		mail_index_map_copy_records(new_map, map->rec_map);
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
-	} else {
-		if (munmap(new_map->mmap_base, new_map->mmap_size) < 0)
-			mail_index_set_syscall_error(map->index, "munmap()");
-		new_map->mmap_base = NULL;
 	}
 }
 
@@ -499,14 +737,11 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 				       uint32_t uid, uint32_t left_idx,
 				       int nearest_side)
 {
-	const struct mail_index_record *rec_base, *rec;
-	uint32_t idx, right_idx, record_size;
+	const struct mail_index_record *rec;
+	uint32_t idx, right_idx;
 
 	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
 
-	rec_base = map->rec_map->records;
-	record_size = map->hdr.record_size;
-
 	idx = left_idx;
 	right_idx = I_MIN(map->hdr.messages_count, uid);
 
@@ -514,7 +749,7 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	while (left_idx < right_idx) {
 		idx = (left_idx + right_idx) / 2;
 
-                rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
+		rec = MAIL_INDEX_MAP_IDX(map, idx);
 		if (rec->uid < uid)
 			left_idx = idx+1;
 		else if (rec->uid > uid)
@@ -524,7 +759,7 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	}
 	i_assert(idx < map->hdr.messages_count);
 
-	rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
+	rec = MAIL_INDEX_MAP_IDX(map, idx);
 	if (rec->uid != uid) {
 		if (nearest_side > 0) {
 			/* we want uid or larger */
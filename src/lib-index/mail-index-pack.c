@@ -0,0 +1,172 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "numpack.h"
+#include "ostream.h"
+#include "mail-index-private.h"
+#include "mail-index-modseq.h"
+
+/* Packed records begin with the modseq extension's record offset (0 if
+   there's no modseq extension). Each record is then written as:
+
+   - UID difference to the previous record's UID
+   - zigzag encoded modseq difference to the previous record's modseq
+     (only if there's a modseq extension)
+   - the rest of the record as-is
+
+   All the numbers are written with numpack_encode(). UIDs are always
+   growing and modseqs are usually close to each others, so these mostly
+   fit into 1-2 bytes instead of 4+8 bytes. */
+
+static uint64_t mail_index_pack_zigzag(uint64_t diff)
+{
+	return (diff << 1) ^ (uint64_t)((int64_t)diff >> 63);
+}
+
+static uint64_t mail_index_unpack_zigzag(uint64_t num)
+{
+	return (num >> 1) ^ (0 - (num & 1));
+}
+
+static uint32_t mail_index_pack_get_modseq_offset(struct mail_index_map *map)
+{
+	const struct mail_index_ext *ext;
+	uint32_t ext_map_idx;
+
+	if (!mail_index_map_lookup_ext(map, MAIL_INDEX_MODSEQ_EXT_NAME,
+				       &ext_map_idx))
+		return 0;
+	ext = array_idx(&map->extensions, ext_map_idx);
+	if (ext->record_size != sizeof(uint64_t))
+		return 0;
+	return ext->record_offset;
+}
+
+void mail_index_pack_records(struct mail_index_map *map,
+			     struct ostream *output)
+{
+	const struct mail_index_record *rec;
+	size_t record_size = map->hdr.record_size;
+	buffer_t *buf;
+	uint32_t idx, modseq_offset, prev_uid = 0;
+	uint64_t modseq, prev_modseq = 0;
+
+	modseq_offset = mail_index_pack_get_modseq_offset(map);
+	buf = buffer_create_dynamic(default_pool, IO_BLOCK_SIZE + record_size);
+	numpack_encode(buf, modseq_offset);
+
+	for (idx = 0; idx < map->rec_map->records_count; idx++) {
+		rec = MAIL_INDEX_MAP_IDX(map, idx);
+		numpack_encode(buf, (uint32_t)(rec->uid - prev_uid));
+		prev_uid = rec->uid;
+
+		if (modseq_offset == 0) {
+			buffer_append(buf, CONST_PTR_OFFSET(rec, sizeof(rec->uid)),
+				      record_size - sizeof(rec->uid));
+		} else {
+			memcpy(&modseq, CONST_PTR_OFFSET(rec, modseq_offset),
+			       sizeof(modseq));
+			numpack_encode(buf,
+				mail_index_pack_zigzag(modseq - prev_modseq));
+			prev_modseq = modseq;
+
+			buffer_append(buf, CONST_PTR_OFFSET(rec, sizeof(rec->uid)),
+				      modseq_offset - sizeof(rec->uid));
+			buffer_append(buf, CONST_PTR_OFFSET(rec, modseq_offset +
+							    sizeof(modseq)),
+				      record_size - modseq_offset - sizeof(modseq));
+		}
+		if (buf->used >= IO_BLOCK_SIZE) {
+			o_stream_nsend(output, buf->data, buf->used);
+			buffer_set_used_size(buf, 0);
+		}
+	}
+	o_stream_nsend(output, buf->data, buf->used);
+	buffer_free(&buf);
+}
+
+int mail_index_unpack_records(struct mail_index_record_map *rec_map,
+			      unsigned int records_count, size_t record_size,
+			      const void *data, size_t size,
+			      unsigned int *unpacked_count_r,
+			      const char **error_r)
+{
+	const uint8_t *p = data, *end = p + size;
+	struct mail_index_record *rec;
+	uint64_t modseq_offset, num, modseq = 0;
+	uint32_t uid_diff, uid = 0;
+	size_t head_size, tail_size, min_size;
+	unsigned int idx, max_count;
+
+	/* drop the old records also if the data turns out to be corrupted */
+	mail_index_record_map_alloc_pages(rec_map, 0, record_size);
+	*unpacked_count_r = 0;
+
+	if (record_size < sizeof(struct mail_index_record)) {
+		*error_r = "record_size too small";
+		return -1;
+	}
+	if (numpack_decode(&p, end, &modseq_offset) < 0) {
+		*error_r = "Packed records truncated";
+		return -1;
+	}
+	if (modseq_offset == 0) {
+		head_size = record_size - sizeof(rec->uid);
+		tail_size = 0;
+		min_size = 1 + head_size;
+	} else if (modseq_offset < sizeof(rec->uid) ||
+		   modseq_offset + sizeof(modseq) > record_size) {
+		*error_r = t_strdup_printf("Invalid modseq offset %llu",
+					   (unsigned long long)modseq_offset);
+		return -1;
+	} else {
+		head_size = modseq_offset - sizeof(rec->uid);
+		tail_size = record_size - modseq_offset - sizeof(modseq);
+		min_size = 2 + head_size + tail_size;
+	}
+	/* don't allocate more records than the data can contain */
+	max_count = I_MIN(records_count, (size_t)(end - p) / min_size);
+
+	mail_index_record_map_alloc_pages(rec_map, max_count, record_size);
+	for (idx = 0; idx < max_count; idx++) {
+		rec = mail_index_record_pages_idx(&rec_map->pages, idx,
+						  record_size);
+		if (numpack_decode32(&p, end, &uid_diff) < 0)
+			break;
+		uid += uid_diff;
+		rec->uid = uid;
+
+		if (modseq_offset != 0) {
+			if (numpack_decode(&p, end, &num) < 0)
+				break;
+			modseq += mail_index_unpack_zigzag(num);
+		}
+		if ((size_t)(end - p) < head_size + tail_size)
+			break;
+
+		memcpy(PTR_OFFSET(rec, sizeof(rec->uid)), p, head_size);
+		p += head_size;
+		if (modseq_offset != 0) {
+			memcpy(PTR_OFFSET(rec, modseq_offset),
+			       &modseq, sizeof(modseq));
+			memcpy(PTR_OFFSET(rec, modseq_offset + sizeof(modseq)),
+			       p, tail_size);
+			p += tail_size;
+		}
+	}
+	*unpacked_count_r = idx;
+	if (idx < max_count) {
+		*error_r = t_strdup_printf(
+			"Packed records truncated at record %u", idx);
+		return -1;
+	}
+	if (max_count < records_count) {
+		*error_r = t_strdup_printf(
+			"messages_count too large for packed records (%u > %u)",
+			records_count, max_count);
+		return -1;
+	}
+	return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef MAIL_INDEX_PRIVATE_H
 #define MAIL_INDEX_PRIVATE_H
 
+#include "array.h"
 #include "file-lock.h"
 #include "mail-index.h"
 #include "mail-index-util.h"
@@ -12,6 +13,8 @@
 struct mail_transaction_header;
 struct mail_transaction_log_view;
 struct mail_index_sync_map_ctx;
+struct mail_index_record_mmap;
+struct ostream;
 
 /* How large index files to mmap() instead of reading to memory. */
 #define MAIL_INDEX_MMAP_MIN_SIZE (1024*64)
@@ -28,18 +31,37 @@ struct mail_index_sync_map_ctx;
 #define MAIL_INDEX_MIN_WRITE_BYTES (1024*8)
 #define MAIL_INDEX_MAX_WRITE_BYTES (1024*128)
 
+/* How much of the beginning of the cache file to prefetch. It contains the
+   header and, for small caches, the field headers. */
+#define MAIL_INDEX_PREFETCH_CACHE_SIZE (1024*64)
+
 #define MAIL_INDEX_IS_IN_MEMORY(index) \
 	((index)->dir == NULL)
 
 #define MAIL_INDEX_MAP_IS_IN_MEMORY(map) \
 	((map)->rec_map->mmap_base == NULL)
 
+/* Records are stored in pages of this many records. The pages are shared
+   between record maps and copied only when they're modified. */
+#define MAIL_INDEX_RECORD_PAGE_SHIFT 8
+#define MAIL_INDEX_RECORD_PAGE_COUNT (1U << MAIL_INDEX_RECORD_PAGE_SHIFT)
+#define MAIL_INDEX_RECORD_PAGE_MASK (MAIL_INDEX_RECORD_PAGE_COUNT-1)
+#define MAIL_INDEX_RECORD_PAGES_NEEDED(records_count) \
+	(((records_count) + MAIL_INDEX_RECORD_PAGE_MASK) >> \
+	 MAIL_INDEX_RECORD_PAGE_SHIFT)
+
+/* Returned records are read-only. Use the _MODIFIABLE() versions to get
+   a private copy of the record's page that can be modified. */
 #define MAIL_INDEX_MAP_IDX(map, idx) \
-	((struct mail_index_record *) \
-	 PTR_OFFSET((map)->rec_map->records, (idx) * (map)->hdr.record_size))
-#define MAIL_INDEX_REC_AT_SEQ(map, seq)					\
-	((struct mail_index_record *)					\
-	 PTR_OFFSET((map)->rec_map->records, ((seq)-1) * (map)->hdr.record_size))
+	((const struct mail_index_record *) \
+	 mail_index_record_pages_idx(&(map)->rec_map->pages, idx, \
+				     (map)->hdr.record_size))
+#define MAIL_INDEX_REC_AT_SEQ(map, seq) \
+	MAIL_INDEX_MAP_IDX(map, (seq)-1)
+#define MAIL_INDEX_MAP_IDX_MODIFIABLE(map, idx) \
+	mail_index_map_idx_modifiable(map, idx)
+#define MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(map, seq) \
+	mail_index_map_idx_modifiable(map, (seq)-1)
 
 #define MAIL_TRANSACTION_FLAG_UPDATE_IS_INTERNAL(u) \
 	((((u)->add_flags | (u)->remove_flags) & MAIL_INDEX_FLAGS_MASK) == 0 && \
@@ -117,18 +139,29 @@ struct mail_index_registered_ext {
 	unsigned int expunge_handler_call_always:1;
 };
 
+struct mail_index_record_page {
+	int refcount;
+	/* Number of records that fit into this page. Only the last page may
+	   have less than MAIL_INDEX_RECORD_PAGE_COUNT. */
+	unsigned int capacity;
+	void *records; /* struct mail_index_record[] */
+	/* If non-NULL, records point to this mmaped index file */
+	struct mail_index_record_mmap *mmap;
+};
+ARRAY_DEFINE_TYPE(mail_index_record_page, struct mail_index_record_page *);
+
 struct mail_index_record_map {
 	ARRAY(struct mail_index_map *) maps;
 
 	void *mmap_base;
 	size_t mmap_size, mmap_used_size;
+	struct mail_index_record_mmap *mmap;
 
-	buffer_t *buffer;
-
-	void *records; /* struct mail_index_record[] */
+	ARRAY_TYPE(mail_index_record_page) pages;
 	unsigned int records_count;
 
 	struct mail_index_map_modseq *modseq;
+	struct mail_index_flag_bitmaps *flag_bitmaps;
 	uint32_t last_appended_uid;
 };
 
@@ -149,6 +182,17 @@ struct mail_index_map {
 	struct mail_index_record_map *rec_map;
 };
 
+static inline void *
+mail_index_record_pages_idx(const ARRAY_TYPE(mail_index_record_page) *pages,
+			    uint32_t idx, size_t record_size)
+{
+	struct mail_index_record_page *const *page =
+		array_idx(pages, idx >> MAIL_INDEX_RECORD_PAGE_SHIFT);
+
+	return PTR_OFFSET((*page)->records,
+			  (idx & MAIL_INDEX_RECORD_PAGE_MASK) * record_size);
+}
+
 struct mail_index_module_register {
 	unsigned int id;
 };
@@ -205,6 +249,8 @@ struct mail_index {
 	enum file_lock_method lock_method;
 	unsigned int max_lock_timeout_secs;
 
+	const struct compression_handler *log_compress_handler;
+
 	pool_t keywords_pool;
 	ARRAY_TYPE(keywords) keywords;
 	HASH_TABLE(char *, void *) keywords_hash; /* name -> unsigned int idx */
@@ -286,9 +332,49 @@ void mail_index_unmap(struct mail_index_map **map);
 
 /* Clone a map. The returned map is always in memory. */
 struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map);
+/* Give the map its own record map. The record pages are still shared with
+   the old record map until they're modified. */
 void mail_index_record_map_move_to_private(struct mail_index_map *map);
-/* Move a mmaped map to memory. */
+/* Move a mmaped map to memory. The records are copied from the mmap only
+   when they're modified. */
 void mail_index_map_move_to_memory(struct mail_index_map *map);
+
+/* Return a record that can be modified. If its page is shared with other
+   record maps, the page is copied first. */
+struct mail_index_record *
+mail_index_map_idx_modifiable(struct mail_index_map *map, uint32_t idx);
+/* Return space for appending a new record after rec_map->records_count.
+   The records_count isn't updated. */
+void *mail_index_map_append_record_space(struct mail_index_map *map);
+/* Move count records from src_idx to dest_idx, which must be before it. */
+void mail_index_map_move_records(struct mail_index_map *map, uint32_t dest_idx,
+				 uint32_t src_idx, uint32_t count);
+/* Replace the existing pages with private zero-filled pages for
+   records_count records. */
+void mail_index_record_map_alloc_pages(struct mail_index_record_map *rec_map,
+				       unsigned int records_count,
+				       size_t record_size);
+/* Create pages pointing to records_count records in the rec_map's mmap. */
+void mail_index_record_map_init_mmap_pages(struct mail_index_record_map *rec_map,
+					   size_t records_offset,
+					   unsigned int records_count,
+					   size_t record_size);
+void mail_index_record_pages_free(ARRAY_TYPE(mail_index_record_page) *pages);
+/* Write the map's records in the packed format. */
+void mail_index_pack_records(struct mail_index_map *map,
+			     struct ostream *output);
+/* Unpack records_count packed records from data into newly allocated
+   pages. Returns 0 if ok, -1 if the data is corrupted. The records before
+   the corruption are still unpacked, and unpacked_count_r is set to their
+   count. */
+int mail_index_unpack_records(struct mail_index_record_map *rec_map,
+			      unsigned int records_count, size_t record_size,
+			      const void *data, size_t size,
+			      unsigned int *unpacked_count_r,
+			      const char **error_r);
+struct mail_index_record_mmap *
+mail_index_record_mmap_create(struct mail_index *index,
+			      void *base, size_t size);
 void mail_index_fchown(struct mail_index *index, int fd, const char *path);
 
 bool mail_index_map_lookup_ext(struct mail_index_map *map, const char *name,
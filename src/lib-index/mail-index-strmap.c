@@ -18,6 +18,7 @@
 struct mail_index_strmap {
 	struct mail_index *index;
 	char *path;
+	uint8_t version;
 	int fd;
 	struct istream *input;
 
@@ -60,7 +61,7 @@ struct mail_index_strmap_read_context {
 	uint32_t uid_lookup_seq;
 	uint32_t lost_expunged_uid;
 
-	const unsigned char *data, *end, *str_idx_base;
+	const unsigned char *data, *end, *str_idx_base, *ref_index_base;
 	struct mail_index_strmap_rec rec;
 	uint32_t next_ref_index;
 	unsigned int rec_size;
@@ -94,8 +95,9 @@ static const struct dotlock_settings default_dotlock_settings = {
 	.stale_timeout = 30
 };
 
-struct mail_index_strmap *
-mail_index_strmap_init(struct mail_index *index, const char *suffix)
+static struct mail_index_strmap *
+mail_index_strmap_init_version(struct mail_index *index, const char *suffix,
+			       uint8_t version)
 {
 	struct mail_index_strmap *strmap;
 
@@ -104,6 +106,7 @@ mail_index_strmap_init(struct mail_index *index, const char *suffix)
 	strmap = i_new(struct mail_index_strmap, 1);
 	strmap->index = index;
 	strmap->path = i_strconcat(index->filepath, suffix, NULL);
+	strmap->version = version;
 	strmap->fd = -1;
 
 	strmap->dotlock_settings = default_dotlock_settings;
@@ -114,6 +117,20 @@ mail_index_strmap_init(struct mail_index *index, const char *suffix)
 	return strmap;
 }
 
+struct mail_index_strmap *
+mail_index_strmap_init(struct mail_index *index, const char *suffix)
+{
+	return mail_index_strmap_init_version(index, suffix,
+					      MAIL_INDEX_STRMAP_VERSION);
+}
+
+struct mail_index_strmap *
+mail_index_strmap_init_generic(struct mail_index *index, const char *suffix)
+{
+	return mail_index_strmap_init_version(index, suffix,
+					      MAIL_INDEX_STRMAP_VERSION_GENERIC);
+}
+
 static bool
 mail_index_strmap_read_rec_next(struct mail_index_strmap_read_context *ctx,
 				uint32_t *crc32_r);
@@ -281,7 +298,7 @@ static int mail_index_strmap_open(struct mail_index_strmap_view *view)
 	memcpy(&hdr, data, sizeof(hdr));
 
 	idx_hdr = mail_index_get_header(view->view);
-	if (hdr.version != MAIL_INDEX_STRMAP_VERSION ||
+	if (hdr.version != strmap->version ||
 	    hdr.uid_validity != idx_hdr->uid_validity) {
 		/* need to rebuild. if we already had something in the strmap,
 		   we can keep it. */
@@ -418,6 +435,7 @@ mail_index_strmap_read_rec_first(struct mail_index_strmap_read_context *ctx,
 {
 	size_t size;
 	uint32_t n, i, count, str_idx;
+	bool generic;
 	int ret;
 
 	/* <uid> <n> <crc32>*count <str_idx>*count
@@ -425,19 +443,38 @@ mail_index_strmap_read_rec_first(struct mail_index_strmap_read_context *ctx,
 	     n = 0 -> count=1 (only Message-ID:)
 	     n = 1 -> count=2 (Message-ID: + In-Reply-To:)
 	     n = 2+ -> count=n (Message-ID: + References:)
+
+	   or with the generic format:
+	   <uid> <count> <ref_index>*count <crc32>*count <str_idx>*count
 	*/
 	if (mail_index_strmap_read_packed(ctx, &n) <= 0)
 		return -1;
-	count = n < 2 ? n + 1 : n;
+	generic = ctx->view->strmap->version ==
+		MAIL_INDEX_STRMAP_VERSION_GENERIC;
+	if (generic) {
+		if (n == 0)
+			return -1;
+		count = n;
+	} else {
+		count = n < 2 ? n + 1 : n;
+	}
 	ctx->view->total_ref_count += count;
 
 	ctx->rec_size = count * (sizeof(ctx->rec.str_idx) + sizeof(*crc32_r));
+	if (generic)
+		ctx->rec_size += count * sizeof(ctx->rec.ref_index);
 	ret = mail_index_strmap_uid_exists(ctx, ctx->rec.uid);
 	if (ret < 0)
 		return -1;
 	if (i_stream_read_data(ctx->view->strmap->input, &ctx->data, &size,
 			       ctx->rec_size - 1) <= 0)
 		return -1;
+	if (generic) {
+		ctx->ref_index_base = ctx->data;
+		ctx->data += count * sizeof(ctx->rec.ref_index);
+	} else {
+		ctx->ref_index_base = NULL;
+	}
 	ctx->str_idx_base = ctx->data + count * sizeof(uint32_t);
 
 	if (ret == 0) {
@@ -453,9 +490,8 @@ mail_index_strmap_read_rec_first(struct mail_index_strmap_read_context *ctx,
 		return 0;
 	}
 
-	/* everything exists. save it. FIXME: these ref_index values
-	   are thread index specific, perhaps something more generic
-	   should be used some day */
+	/* everything exists. save it. with the non-generic format the
+	   ref_index values are thread index specific. */
 	ctx->end = ctx->data + count * sizeof(*crc32_r);
 
 	ctx->next_ref_index = 0;
@@ -482,7 +518,13 @@ mail_index_strmap_read_rec_next(struct mail_index_strmap_read_context *ctx,
 	memcpy(&ctx->rec.str_idx, ctx->str_idx_base, sizeof(ctx->rec.str_idx));
 	memcpy(crc32_r, ctx->data, sizeof(*crc32_r));
 
-	ctx->rec.ref_index = ctx->next_ref_index++;
+	if (ctx->ref_index_base == NULL) {
+		ctx->rec.ref_index = ctx->next_ref_index++;
+	} else {
+		memcpy(&ctx->rec.ref_index, ctx->ref_index_base,
+		       sizeof(ctx->rec.ref_index));
+		ctx->ref_index_base += sizeof(ctx->rec.ref_index);
+	}
 
 	if (ctx->highest_str_idx < ctx->rec.str_idx)
 		ctx->highest_str_idx = ctx->rec.str_idx;
@@ -810,6 +852,50 @@ void mail_index_strmap_view_sync_add_unique(struct mail_index_strmap_view_sync *
 	view->last_ref_index = ref_index;
 }
 
+static bool
+strmap_str_idx_find(const ARRAY_TYPE(uint32_t) *str_idxs, uint32_t str_idx)
+{
+	const uint32_t *idxp;
+
+	array_foreach(str_idxs, idxp) {
+		if (*idxp == str_idx)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void mail_index_strmap_view_lookup(struct mail_index_strmap_view *view,
+				   const char *key,
+				   ARRAY_TYPE(mail_index_strmap_rec) *recs)
+{
+	ARRAY_TYPE(uint32_t) matched, unmatched;
+	struct mail_index_strmap_rec *rec;
+	struct hash2_iter iter;
+	uint32_t crc32;
+
+	/* all the records with the same string share the same str_idx, so
+	   the (possibly expensive) key comparison needs to be done only once
+	   for each str_idx. there are normally only a few different strings
+	   with the same crc32. */
+	t_array_init(&matched, 4);
+	t_array_init(&unmatched, 4);
+
+	crc32 = crc32_str_nonzero(key);
+	memset(&iter, 0, sizeof(iter));
+	while ((rec = hash2_iterate(view->hash, crc32, &iter)) != NULL) {
+		if (strmap_str_idx_find(&unmatched, rec->str_idx))
+			continue;
+		if (!strmap_str_idx_find(&matched, rec->str_idx)) {
+			if (!view->key_compare(key, rec, view->cb_context)) {
+				array_append(&unmatched, &rec->str_idx, 1);
+				continue;
+			}
+			array_append(&matched, &rec->str_idx, 1);
+		}
+		array_append(recs, rec, 1);
+	}
+}
+
 static void
 mail_index_strmap_zero_terminate(struct mail_index_strmap_view *view)
 {
@@ -921,6 +1007,27 @@ static void mail_index_strmap_write_block(struct mail_index_strmap_view *view,
 		}
 		view->total_ref_count += uid_rec_count;
 
+		if (view->strmap->version == MAIL_INDEX_STRMAP_VERSION_GENERIC) {
+			/* <count> <ref_index>*count <crc32>*count
+			   <str_idx>*count */
+			mail_index_pack_num(&p, uid_rec_count);
+			o_stream_nsend(output, packed, p-packed);
+			for (j = 0; j < uid_rec_count; j++) {
+				o_stream_nsend(output, &recs[i+j].ref_index,
+					       sizeof(recs[i+j].ref_index));
+			}
+			for (j = 0; j < uid_rec_count; j++) {
+				o_stream_nsend(output, &crc32[i+j],
+					       sizeof(crc32[i+j]));
+			}
+			for (j = 0; j < uid_rec_count; j++) {
+				o_stream_nsend(output, &recs[i+j].str_idx,
+					       sizeof(recs[i+j].str_idx));
+			}
+			i += uid_rec_count;
+			continue;
+		}
+
 		/* <n> <crc32>*count <str_idx>*count -
 		   FIXME: thread index specific code */
 		i_assert(recs[i].ref_index == 0);
@@ -978,7 +1085,7 @@ mail_index_strmap_recreate_write(struct mail_index_strmap_view *view,
 
 	/* write header */
 	memset(&hdr, 0, sizeof(hdr));
-	hdr.version = MAIL_INDEX_STRMAP_VERSION;
+	hdr.version = view->strmap->version;
 	hdr.uid_validity = idx_hdr->uid_validity;
 	o_stream_nsend(output, &hdr, sizeof(hdr));
 
@@ -7,7 +7,10 @@ struct mail_index;
 struct mail_index_view;
 
 struct mail_index_strmap_header {
+/* ref_indexes are implicit and thread index specific */
 #define MAIL_INDEX_STRMAP_VERSION 1
+/* ref_indexes are stored for each record */
+#define MAIL_INDEX_STRMAP_VERSION_GENERIC 2
 	uint8_t version;
 	uint8_t unused[3];
 
@@ -41,6 +44,11 @@ typedef void mail_index_strmap_remap_t(const uint32_t *idx_map,
 
 struct mail_index_strmap *
 mail_index_strmap_init(struct mail_index *index, const char *suffix);
+/* Like mail_index_strmap_init(), but the ref_indexes can be any increasing
+   numbers for each UID. mail_index_strmap_init() uses a more compact format
+   that supports only the thread index's ref_indexes (0, 1 or 0, 2, 3, ..). */
+struct mail_index_strmap *
+mail_index_strmap_init_generic(struct mail_index *index, const char *suffix);
 void mail_index_strmap_deinit(struct mail_index_strmap **strmap);
 
 /* Returns strmap records and hash that can be used for read-only access.
@@ -58,6 +66,12 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 void mail_index_strmap_view_close(struct mail_index_strmap_view **view);
 void mail_index_strmap_view_set_corrupted(struct mail_index_strmap_view *view);
 
+/* Append all records whose string matches key to recs, in no particular
+   order. key_compare_cb is called only once for each unique string index. */
+void mail_index_strmap_view_lookup(struct mail_index_strmap_view *view,
+				   const char *key,
+				   ARRAY_TYPE(mail_index_strmap_rec) *recs);
+
 /* Return the highest used string index. */
 uint32_t mail_index_strmap_view_get_highest_idx(struct mail_index_strmap_view *view);
 
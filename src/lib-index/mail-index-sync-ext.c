@@ -6,6 +6,7 @@
 #include "mail-index-view-private.h"
 #include "mail-index-sync-private.h"
 #include "mail-index-modseq.h"
+#include "mail-index-flag-bitmaps.h"
 #include "mail-transaction-log.h"
 
 #include <stdlib.h>
@@ -146,15 +147,20 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 	uint16_t *old_offsets, *copy_sizes, min_align, max_align;
 	uint32_t offset, new_record_size, rec_idx;
 	unsigned int i, count;
+	ARRAY_TYPE(mail_index_record_page) old_pages;
 	const void *src;
-	buffer_t *new_buffer;
-	size_t new_buffer_size;
+	void *dest;
 
 	i_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(map) && map->refcount == 1);
 
 	ext = array_get_modifiable(&map->extensions, &count);
 	i_assert(ext_map_idx < count);
 
+	if (ext[ext_map_idx].index_idx == map->index->keywords_ext_id) {
+		/* keywords may have been dropped if the records shrank */
+		mail_index_flag_bitmaps_drop_keywords(map->rec_map);
+	}
+
 	/* @UNSAFE */
 	old_offsets = t_new(uint16_t, count);
 	copy_sizes = t_new(uint16_t, count);
@@ -215,37 +221,28 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 	}
 	new_record_size = offset;
 
-	/* copy the records to new buffer */
-	new_buffer_size = map->rec_map->records_count * new_record_size;
-	new_buffer = buffer_create_dynamic(default_pool, new_buffer_size);
-	src = map->rec_map->records;
-	offset = 0;
+	/* copy the records to new pages */
+	old_pages = map->rec_map->pages;
+	i_array_init(&map->rec_map->pages, array_count(&old_pages));
+	mail_index_record_map_alloc_pages(map->rec_map,
+					  map->rec_map->records_count,
+					  new_record_size);
 	for (rec_idx = 0; rec_idx < map->rec_map->records_count; rec_idx++) {
+		src = mail_index_record_pages_idx(&old_pages, rec_idx,
+						  map->hdr.record_size);
+		dest = mail_index_record_pages_idx(&map->rec_map->pages,
+						   rec_idx, new_record_size);
 		/* write the base record */
-		buffer_write(new_buffer, offset, src,
-			     sizeof(struct mail_index_record));
+		memcpy(dest, src, sizeof(struct mail_index_record));
 
 		/* write extensions */
 		for (i = 0; i < count; i++) {
-			buffer_write(new_buffer, offset + ext[i].record_offset,
-				     CONST_PTR_OFFSET(src, old_offsets[i]),
-				     copy_sizes[i]);
+			memcpy(PTR_OFFSET(dest, ext[i].record_offset),
+			       CONST_PTR_OFFSET(src, old_offsets[i]),
+			       copy_sizes[i]);
 		}
-		src = CONST_PTR_OFFSET(src, map->hdr.record_size);
-		offset += new_record_size;
 	}
-
-	if (new_buffer->used != new_buffer_size) {
-		/* we didn't fully write the last record */
-		size_t space = new_buffer_size - new_buffer->used;
-		i_assert(space < new_record_size);
-		buffer_append_zero(new_buffer, space);
-	}
-
-	buffer_free(&map->rec_map->buffer);
-	map->rec_map->buffer = new_buffer;
-	map->rec_map->records =
-		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
+	mail_index_record_pages_free(&old_pages);
 	map->hdr.record_size = new_record_size;
 
 	/* update record offsets in headers */
@@ -572,10 +569,12 @@ static void mail_index_sync_ext_clear(struct mail_index_view *view,
 	map->hdr_base = map->hdr_copy_buf->data;
 
 	for (seq = 1; seq <= view->map->rec_map->records_count; seq++) {
-		rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
+		rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(view->map, seq);
 		memset(PTR_OFFSET(rec, ext->record_offset), 0,
 		       ext->record_size);
 	}
+	if (ext->index_idx == view->index->keywords_ext_id)
+		mail_index_flag_bitmaps_drop_keywords(view->map->rec_map);
 }
 
 int mail_index_sync_ext_reset(struct mail_index_sync_map_ctx *ctx,
@@ -674,7 +673,7 @@ mail_index_sync_ext_rec_update(struct mail_index_sync_map_ctx *ctx,
 	i_assert(ext->record_offset + ext->record_size <=
 		 view->map->hdr.record_size);
 
-	rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
+	rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(view->map, seq);
 	old_data = PTR_OFFSET(rec, ext->record_offset);
 
 	rext = array_idx(&view->index->extensions, ext->index_idx);
@@ -723,7 +722,7 @@ mail_index_sync_ext_atomic_inc(struct mail_index_sync_map_ctx *ctx,
 	i_assert(ext->record_offset + ext->record_size <=
 		 view->map->hdr.record_size);
 
-	rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
+	rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(view->map, seq);
 	data = PTR_OFFSET(rec, ext->record_offset);
 
 	min_value = u->diff >= 0 ? 0 : (uint64_t)(-(int64_t)u->diff);
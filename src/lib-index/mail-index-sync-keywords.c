@@ -4,6 +4,7 @@
 #include "array.h"
 #include "buffer.h"
 #include "mail-index-modseq.h"
+#include "mail-index-flag-bitmaps.h"
 #include "mail-index-view-private.h"
 #include "mail-index-sync-private.h"
 #include "mail-transaction-log.h"
@@ -217,6 +218,8 @@ keywords_update_records(struct mail_index_sync_map_ctx *ctx,
 
 	mail_index_modseq_update_keyword(ctx->modseq_ctx, keyword_idx,
 					  seq1, seq2);
+	mail_index_flag_bitmaps_update_keyword(view->map->rec_map, keyword_idx,
+					       seq1, seq2, type == MODIFY_ADD);
 
 	data_offset = keyword_idx / CHAR_BIT;
 	data_mask = 1 << (keyword_idx % CHAR_BIT);
@@ -229,7 +232,7 @@ keywords_update_records(struct mail_index_sync_map_ctx *ctx,
 	switch (type) {
 	case MODIFY_ADD:
 		for (; seq1 <= seq2; seq1++) {
-			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq1);
+			rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(view->map, seq1);
 			data = PTR_OFFSET(rec, data_offset);
 			*data |= data_mask;
 		}
@@ -237,7 +240,7 @@ keywords_update_records(struct mail_index_sync_map_ctx *ctx,
 	case MODIFY_REMOVE:
 		data_mask = ~data_mask;
 		for (; seq1 <= seq2; seq1++) {
-			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq1);
+			rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(view->map, seq1);
 			data = PTR_OFFSET(rec, data_offset);
 			*data &= data_mask;
 		}
@@ -337,8 +340,9 @@ mail_index_sync_keywords_reset(struct mail_index_sync_map_ctx *ctx,
 			continue;
 
 		mail_index_modseq_reset_keywords(ctx->modseq_ctx, seq1, seq2);
+		mail_index_flag_bitmaps_reset_keywords(map->rec_map, seq1, seq2);
 		for (; seq1 <= seq2; seq1++) {
-			rec = MAIL_INDEX_REC_AT_SEQ(map, seq1);
+			rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(map, seq1);
 			memset(PTR_OFFSET(rec, ext->record_offset),
 			       0, ext->record_size);
 		}
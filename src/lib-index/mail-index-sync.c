@@ -506,6 +506,9 @@ int mail_index_sync_begin_to(struct mail_index *index,
 
 	i_assert(index->open_count > 0);
 
+	/* do the slow part of cache compression before locking anything */
+	mail_cache_compress_prepare(index->cache);
+
 	ret = mail_index_sync_begin_to2(index, ctx_r, view_r, trans_r,
 					log_file_seq, log_file_offset,
 					flags, &retry);
@@ -514,6 +517,8 @@ int mail_index_sync_begin_to(struct mail_index *index,
 						log_file_seq, log_file_offset,
 						flags, &retry);
 	}
+	if (ret <= 0)
+		mail_cache_compress_discard(index->cache);
 	return ret;
 }
 
@@ -742,6 +747,7 @@ static void mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
 	mail_index_transaction_rollback(&ctx->sync_trans);
 	if (array_is_created(&ctx->sync_list))
 		array_free(&ctx->sync_list);
+	mail_cache_compress_discard(ctx->index->cache);
 	i_free(ctx);
 }
 
@@ -260,6 +260,31 @@ static void tview_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static void
+tview_lookup_flags_seqs(struct mail_index_view *view, enum mail_flags flags,
+			const struct mail_keywords *keywords, bool match_not,
+			ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_view_transaction *tview =
+		(struct mail_index_view_transaction *)view;
+	struct mail_index_transaction *t = tview->t;
+
+	if (!t->reset) {
+		tview->super->lookup_flags_seqs(view, flags, keywords,
+						match_not, seqs);
+	}
+	/* the messages whose flags or keywords were changed by this
+	   transaction may or may not match. the caller has to check them. */
+	if (t->min_flagupdate_seq != 0) {
+		seq_range_array_add_range(seqs, t->min_flagupdate_seq,
+					  t->max_flagupdate_seq);
+	}
+	if (array_is_created(&t->appends) && array_count(&t->appends) > 0) {
+		seq_range_array_add_range(seqs, t->first_new_seq,
+					  t->last_new_seq);
+	}
+}
+
 static void keyword_index_add(ARRAY_TYPE(keyword_indexes) *keywords,
 			      unsigned int idx)
 {
@@ -483,6 +508,7 @@ static struct mail_index_view_vfuncs trans_view_vfuncs = {
 	tview_lookup_uid,
 	tview_lookup_seq_range,
 	tview_lookup_first,
+	tview_lookup_flags_seqs,
 	tview_lookup_keywords,
 	tview_lookup_ext_full,
 	tview_get_header_ext,
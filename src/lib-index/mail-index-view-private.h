@@ -26,6 +26,11 @@ struct mail_index_view_vfuncs {
 	void (*lookup_first)(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+	void (*lookup_flags_seqs)(struct mail_index_view *view,
+				  enum mail_flags flags,
+				  const struct mail_keywords *keywords,
+				  bool match_not,
+				  ARRAY_TYPE(seq_range) *seqs);
 	void (*lookup_keywords)(struct mail_index_view *view, uint32_t seq,
 				ARRAY_TYPE(keyword_indexes) *keyword_idx);
 	void (*lookup_ext_full)(struct mail_index_view *view, uint32_t seq,
@@ -5,6 +5,7 @@
 #include "buffer.h"
 #include "llist.h"
 #include "mail-index-view-private.h"
+#include "mail-index-flag-bitmaps.h"
 #include "mail-transaction-log.h"
 
 struct mail_index_view *
@@ -288,6 +289,15 @@ static void view_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static void
+view_lookup_flags_seqs(struct mail_index_view *view, enum mail_flags flags,
+		       const struct mail_keywords *keywords, bool match_not,
+		       ARRAY_TYPE(seq_range) *seqs)
+{
+	mail_index_map_lookup_flags_seqs(view->map, flags, keywords,
+					 match_not, seqs);
+}
+
 static void
 mail_index_data_lookup_keywords(struct mail_index_map *map,
 				const unsigned char *data,
@@ -529,6 +539,14 @@ void mail_index_lookup_first(struct mail_index_view *view,
 	view->v.lookup_first(view, flags, flags_mask, seq_r);
 }
 
+void mail_index_lookup_flags_seqs(struct mail_index_view *view,
+				  enum mail_flags flags,
+				  const struct mail_keywords *keywords,
+				  bool match_not, ARRAY_TYPE(seq_range) *seqs)
+{
+	view->v.lookup_flags_seqs(view, flags, keywords, match_not, seqs);
+}
+
 void mail_index_lookup_ext(struct mail_index_view *view, uint32_t seq,
 			   uint32_t ext_id, const void **data_r,
 			   bool *expunged_r)
@@ -596,6 +614,7 @@ static struct mail_index_view_vfuncs view_vfuncs = {
 	view_lookup_uid,
 	view_lookup_seq_range,
 	view_lookup_first,
+	view_lookup_flags_seqs,
 	view_lookup_keywords,
 	view_lookup_ext_full,
 	view_get_header_ext,
@@ -60,8 +60,9 @@ static int mail_index_create_backup(struct mail_index *index)
 static int mail_index_recreate(struct mail_index *index)
 {
 	struct mail_index_map *map = index->map;
+	struct mail_index_header hdr;
 	struct ostream *output;
-	unsigned int base_size;
+	unsigned int base_size, idx, count;
 	const char *path;
 	int ret = 0, fd;
 
@@ -75,12 +76,24 @@ static int mail_index_recreate(struct mail_index *index)
 	output = o_stream_create_fd_file(fd, 0, FALSE);
 	o_stream_cork(output);
 
+	hdr = map->hdr;
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_PACK_RECORDS) != 0)
+		hdr.major_version = MAIL_INDEX_PACKED_MAJOR_VERSION;
 	base_size = I_MIN(map->hdr.base_header_size, sizeof(map->hdr));
-	o_stream_nsend(output, &map->hdr, base_size);
+	o_stream_nsend(output, &hdr, base_size);
 	o_stream_nsend(output, CONST_PTR_OFFSET(map->hdr_base, base_size),
 		       map->hdr.header_size - base_size);
-	o_stream_nsend(output, map->rec_map->records,
-		       map->rec_map->records_count * map->hdr.record_size);
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_PACK_RECORDS) != 0)
+		mail_index_pack_records(map, output);
+	else {
+		for (idx = 0; idx < map->rec_map->records_count;
+		     idx += MAIL_INDEX_RECORD_PAGE_COUNT) {
+			count = I_MIN(map->rec_map->records_count - idx,
+				      MAIL_INDEX_RECORD_PAGE_COUNT);
+			o_stream_nsend(output, MAIL_INDEX_MAP_IDX(map, idx),
+				       count * map->hdr.record_size);
+		}
+	}
 	o_stream_nflush(output);
 	if (o_stream_nfinish(output) < 0) {
 		mail_index_file_set_syscall_error(index, path, "write()");
@@ -11,6 +11,7 @@
 #include "nfs-workarounds.h"
 #include "read-full.h"
 #include "write-full.h"
+#include "compression.h"
 #include "mail-index-alloc-cache.h"
 #include "mail-index-private.h"
 #include "mail-index-view-private.h"
@@ -22,6 +23,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 struct mail_index_module_register mail_index_module_register = { 0 };
@@ -112,6 +114,16 @@ void mail_index_set_lock_method(struct mail_index *index,
 	index->max_lock_timeout_secs = max_timeout_secs;
 }
 
+void mail_index_set_log_compression(struct mail_index *index,
+				    const struct compression_handler *handler)
+{
+	i_assert(handler == NULL ||
+		 (handler->create_ostream != NULL &&
+		  handler->is_compressed != NULL));
+
+	index->log_compress_handler = handler;
+}
+
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
 				  const void *data, size_t size)
 {
@@ -595,6 +607,41 @@ int mail_index_open(struct mail_index *index, enum mail_index_open_flags flags)
 	return 1;
 }
 
+static void
+mail_index_prefetch_file(const char *path, uoff_t len ATTR_UNUSED)
+{
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		/* opening the index will report the error if it matters */
+		return;
+	}
+	if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) < 0)
+		i_error("posix_fadvise(%s) failed: %m", path);
+	i_close_fd(&fd);
+#endif
+}
+
+void mail_index_prefetch(struct mail_index *index)
+{
+	const char *path;
+
+	if (index->open_count > 0 || MAIL_INDEX_IS_IN_MEMORY(index))
+		return;
+
+	path = t_strconcat(index->dir, "/", index->prefix, NULL);
+	mail_index_prefetch_file(path, 0);
+	mail_index_prefetch_file(t_strconcat(path,
+		MAIL_TRANSACTION_LOG_SUFFIX, NULL), 0);
+	/* the cache file can be large and only its beginning is read while
+	   opening it */
+	mail_index_prefetch_file(t_strconcat(path, MAIL_CACHE_FILE_SUFFIX, NULL),
+				 MAIL_INDEX_PREFETCH_CACHE_SIZE);
+}
+
 int mail_index_open_or_create(struct mail_index *index,
 			      enum mail_index_open_flags flags)
 {
@@ -9,6 +9,11 @@
 
 #define MAIL_INDEX_MAJOR_VERSION 7
 #define MAIL_INDEX_MINOR_VERSION 3
+/* dovecot.index files written with MAIL_INDEX_OPEN_FLAG_PACK_RECORDS use
+   this major version. The header is the same, but the records are packed
+   (see mail-index-pack.c). Older versions see an incompatible version and
+   recreate the index. */
+#define MAIL_INDEX_PACKED_MAJOR_VERSION 8
 
 #define MAIL_INDEX_HEADER_MIN_SIZE 120
 
@@ -34,7 +39,14 @@ enum mail_index_open_flags {
 	MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY	= 0x200,
 	/* We're only going to save new messages to the index.
 	   Avoid unnecessary reads. */
-	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400
+	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400,
+	/* Track the commit offset in newly created transaction log files
+	   (see mail_transaction_log_header.commit_offset). All processes
+	   writing to the index must support it. */
+	MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET	= 0x800,
+	/* Pack UIDs and modseqs when writing dovecot.index files. The records
+	   are unpacked into memory when the file is read. */
+	MAIL_INDEX_OPEN_FLAG_PACK_RECORDS	= 0x1000
 };
 
 enum mail_index_header_compat_flags {
@@ -222,6 +234,7 @@ struct mail_index_transaction_commit_result {
 struct mail_index;
 struct mail_index_map;
 struct mail_index_view;
+struct compression_handler;
 struct mail_index_transaction;
 struct mail_index_sync_ctx;
 struct mail_index_view_sync_ctx;
@@ -240,6 +253,11 @@ void mail_index_set_permissions(struct mail_index *index,
 void mail_index_set_lock_method(struct mail_index *index,
 				enum file_lock_method lock_method,
 				unsigned int max_timeout_secs);
+/* Compress the old transaction log file with the given handler when the
+   log is rotated to .log.2. The handler must support writing and its format
+   must be detectable. NULL (default) keeps it uncompressed. */
+void mail_index_set_log_compression(struct mail_index *index,
+				    const struct compression_handler *handler);
 /* When creating a new index file or reseting an existing one, add the given
    extension header data immediately to it. */
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
@@ -251,6 +269,12 @@ int mail_index_open(struct mail_index *index, enum mail_index_open_flags flags);
 /* Open or create index. Returns 0 if ok, -1 if error. */
 int mail_index_open_or_create(struct mail_index *index,
 			      enum mail_index_open_flags flags);
+/* Ask the kernel to start reading the index, transaction log and cache files
+   in the background, so that they're read concurrently instead of one after
+   another while mail_index_open() and the first cache lookup wait for them.
+   Call as early as possible before opening the index. Does nothing if the
+   index is already opened or in memory. */
+void mail_index_prefetch(struct mail_index *index);
 void mail_index_close(struct mail_index *index);
 /* unlink() all the index files. */
 int mail_index_unlink(struct mail_index *index);
@@ -450,6 +474,16 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Add to seqs the messages that may have all the given flags and keywords
+   (keywords may be NULL), or with match_not the messages that may be missing
+   any of them. This uses bitmaps that are kept updated while syncing, so
+   it's much faster than looking up each message. The result may also
+   contain messages that don't match (e.g. ones changed by the view's
+   transaction), so the caller still needs to check them. */
+void mail_index_lookup_flags_seqs(struct mail_index_view *view,
+				  enum mail_flags flags,
+				  const struct mail_keywords *keywords,
+				  bool match_not, ARRAY_TYPE(seq_range) *seqs);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
@@ -75,7 +75,17 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 		return 0;
 	}
 
-	if (write_full(file->fd, ctx->output->data, ctx->output->used) < 0) {
+	if (file->hdr.commit_offset != 0) {
+		/* the commit offset is updated with pwrite(), which
+		   doesn't work with O_APPEND. use it for the data as well. */
+		if (mail_transaction_log_file_pwrite(file, ctx->output->data,
+						     ctx->output->used,
+						     file->sync_offset) < 0) {
+			/* write failure, fallback to in-memory indexes. */
+			return log_buffer_move_to_memory(ctx);
+		}
+	} else if (write_full(file->fd, ctx->output->data,
+			      ctx->output->used) < 0) {
 		/* write failure, fallback to in-memory indexes. */
 		mail_index_file_set_syscall_error(ctx->log->index,
 						  file->filepath,
@@ -109,6 +119,13 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 			      ctx->output->used);
 	}
 	file->sync_offset += ctx->output->used;
+
+	if (file->hdr.commit_offset != 0) {
+		/* let readers see the transaction. if this fails, the
+		   offset gets fixed the next time the log is synced while
+		   locked. */
+		(void)mail_transaction_log_file_write_commit_offset(file);
+	}
 	return 0;
 }
 
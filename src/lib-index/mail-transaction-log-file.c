@@ -3,15 +3,20 @@
 #include "lib.h"
 #include "array.h"
 #include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "read-full.h"
 #include "write-full.h"
 #include "mmap-util.h"
+#include "compression.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 #include "mail-transaction-log-private.h"
 
+#include <stdio.h>
+
 #define LOG_PREFETCH IO_BLOCK_SIZE
 #define MEMORY_LOG_NAME "(in-memory transaction log file)"
 #define LOG_NEW_DOTLOCK_SUFFIX ".newlock"
@@ -27,36 +32,66 @@ log_file_set_syscall_error(struct mail_transaction_log_file *file,
 					  file->filepath, function);
 }
 
+int mail_transaction_log_file_pwrite(struct mail_transaction_log_file *file,
+				     const void *data, size_t size,
+				     uoff_t offset)
+{
+	int flags;
+
+	i_assert(!MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file));
+
+	if (!file->append_disabled) {
+		/* we opened the file with O_APPEND, and now we need to drop
+		   it for pwrite() to work (at least in Linux) */
+		flags = fcntl(file->fd, F_GETFL, 0);
+		if (flags < 0) {
+			log_file_set_syscall_error(file, "fcntl(F_GETFL)");
+			return -1;
+		}
+		if (fcntl(file->fd, F_SETFL, flags & ~O_APPEND) < 0) {
+			log_file_set_syscall_error(file, "fcntl(F_SETFL)");
+			return -1;
+		}
+		file->append_disabled = TRUE;
+	}
+	if (pwrite_full(file->fd, data, size, offset) < 0) {
+		log_file_set_syscall_error(file, "pwrite()");
+		return -1;
+	}
+	return 0;
+}
+
+int mail_transaction_log_file_write_commit_offset(struct mail_transaction_log_file
+						  *file)
+{
+	uint32_t commit_offset = file->sync_offset;
+
+	i_assert(file->locked);
+	i_assert(file->hdr.commit_offset != 0);
+
+	if (mail_transaction_log_file_pwrite(file, &commit_offset,
+			sizeof(commit_offset),
+			offsetof(struct mail_transaction_log_header,
+				 commit_offset)) < 0)
+		return -1;
+	file->hdr.commit_offset = commit_offset;
+	return 0;
+}
+
 static void
 mail_transaction_log_mark_corrupted(struct mail_transaction_log_file *file)
 {
 	unsigned int offset =
 		offsetof(struct mail_transaction_log_header, indexid);
-	int flags;
 
 	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) ||
 	    file->log->index->readonly)
 		return;
 
-	/* indexid=0 marks the log file as corrupted. we opened the file with
-	   O_APPEND, and now we need to drop it for pwrite() to work (at least
-	   in Linux) */
-	flags = fcntl(file->fd, F_GETFL, 0);
-	if (flags < 0) {
-		mail_index_file_set_syscall_error(file->log->index,
-			file->filepath, "fcntl(F_GETFL)");
-		return;
-	}
-	if (fcntl(file->fd, F_SETFL, flags & ~O_APPEND) < 0) {
-		mail_index_file_set_syscall_error(file->log->index,
-			file->filepath, "fcntl(F_SETFL)");
-		return;
-	}
-	if (pwrite_full(file->fd, &file->hdr.indexid,
-			sizeof(file->hdr.indexid), offset) < 0) {
-		mail_index_file_set_syscall_error(file->log->index,
-						  file->filepath, "pwrite()");
-	}
+	/* indexid=0 marks the log file as corrupted */
+	(void)mail_transaction_log_file_pwrite(file, &file->hdr.indexid,
+					       sizeof(file->hdr.indexid),
+					       offset);
 }
 
 void
@@ -491,6 +526,23 @@ mail_transaction_log_file_fail_dupe(struct mail_transaction_log_file *file)
 	return ret;
 }
 
+static bool
+mail_transaction_log_file_is_compressed_dupe(struct mail_transaction_log_file *file)
+{
+	struct mail_transaction_log_file *tmp;
+
+	if (!file->compressed)
+		return FALSE;
+
+	/* .log.2 was compressed after it was rotated from a .log that we
+	   still have open. this is the same as a duplicate inode. */
+	for (tmp = file->log->files; tmp != NULL; tmp = tmp->next) {
+		if (tmp->hdr.file_seq == file->hdr.file_seq)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 static int
 mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 				   bool ignore_estale)
@@ -509,7 +561,10 @@ mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 			log_file_set_syscall_error(file, "pread()");
 		return -1;
 	}
-	if (file->hdr.major_version != MAIL_TRANSACTION_LOG_MAJOR_VERSION) {
+	if (file->hdr.major_version ==
+	    MAIL_TRANSACTION_LOG_COMPRESSED_MAJOR_VERSION)
+		file->compressed = TRUE;
+	else if (file->hdr.major_version != MAIL_TRANSACTION_LOG_MAJOR_VERSION) {
 		/* incompatible version - fix silently */
 		return 0;
 	}
@@ -540,6 +595,11 @@ mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 			"Header size too small");
 		return 0;
 	}
+	if (file->compressed && file->hdr.hdr_size != sizeof(file->hdr)) {
+		mail_transaction_log_file_set_corrupted(file,
+			"Invalid header size for compressed log");
+		return 0;
+	}
 	if (file->hdr.hdr_size < sizeof(file->hdr)) {
 		/* @UNSAFE: smaller than we expected - zero out the fields we
 		   shouldn't have filled */
@@ -572,6 +632,9 @@ mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 		file->log->index->indexid = file->hdr.indexid;
 	}
 
+	if (mail_transaction_log_file_is_compressed_dupe(file))
+		return 0;
+
 	/* make sure we already don't have a file with the same sequence
 	   opened. it shouldn't happen unless the old log file was
 	   corrupted. */
@@ -587,6 +650,11 @@ mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 		}
 	}
 
+	if (file->compressed && file->buffer != NULL) {
+		/* we may have read the compressed data. it's decompressed
+		   when the file is mapped. */
+		buffer_free(&file->buffer);
+	}
 	file->sync_highest_modseq = file->hdr.initial_modseq;
 	return 1;
 }
@@ -759,6 +827,12 @@ mail_transaction_log_file_create2(struct mail_transaction_log_file *file,
 
 	if (index->ext_hdr_init_data != NULL && reset)
 		log_write_ext_hdr_init_data(index, writebuf);
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET) != 0) {
+		struct mail_transaction_log_header *hdr =
+			buffer_get_space_unsafe(writebuf, 0, sizeof(*hdr));
+
+		hdr->commit_offset = file->hdr.commit_offset = writebuf->used;
+	}
 	if (write_full(new_fd, writebuf->data, writebuf->used) < 0) {
 		log_file_set_syscall_error(file, "write_full()");
 		return -1;
@@ -914,7 +988,8 @@ int mail_transaction_log_file_open(struct mail_transaction_log_file *file)
 
 		if (ret == 0) {
 			/* corrupted */
-			if (index->readonly) {
+			if (index->readonly ||
+			    mail_transaction_log_file_is_compressed_dupe(file)) {
 				/* don't delete */
 			} else if (unlink(file->filepath) < 0 &&
 				   errno != ENOENT) {
@@ -1329,6 +1404,43 @@ log_file_track_sync(struct mail_transaction_log_file *file,
 	return 1;
 }
 
+static uoff_t
+mail_transaction_log_file_get_mmap_commit_offset(struct mail_transaction_log_file *file)
+{
+	const volatile struct mail_transaction_log_header *hdr =
+		file->mmap_base;
+	uoff_t commit_offset = hdr->commit_offset;
+
+#ifdef __GNUC__
+	/* make sure the transactions aren't read before the offset */
+	__sync_synchronize();
+#endif
+	return commit_offset;
+}
+
+static void
+mail_transaction_log_file_fix_commit_offset(struct mail_transaction_log_file *file)
+{
+	uint32_t commit_offset;
+	ssize_t ret;
+
+	/* a writer may have crashed after writing a transaction, but before
+	   updating the commit offset. readers won't see the transaction
+	   until the offset is fixed. */
+	ret = pread_full(file->fd, &commit_offset, sizeof(commit_offset),
+			 offsetof(struct mail_transaction_log_header,
+				  commit_offset));
+	if (ret <= 0) {
+		if (ret < 0)
+			log_file_set_syscall_error(file, "pread()");
+		return;
+	}
+	if (commit_offset >= file->sync_offset)
+		file->hdr.commit_offset = commit_offset;
+	else
+		(void)mail_transaction_log_file_write_commit_offset(file);
+}
+
 static int
 mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 {
@@ -1336,7 +1448,9 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 	const void *data;
 	struct stat st;
 	size_t size, avail;
+	uoff_t commit_offset;
 	uint32_t trans_size = 0;
+	bool use_commit_offset = FALSE;
 	int ret;
 
 	i_assert(file->sync_offset >= file->buffer_offset);
@@ -1348,6 +1462,18 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 			file->buffer_offset + (uoff_t)size, file->sync_offset);
 		return -1;
 	}
+	if (file->mmap_base != NULL && !file->locked &&
+	    file->hdr.commit_offset != 0) {
+		/* everything before the commit offset has been fully
+		   written. ignore the rest, so we don't have to check if the
+		   file changed while the pages were being faulted. */
+		commit_offset = mail_transaction_log_file_get_mmap_commit_offset(file);
+		if (commit_offset < file->sync_offset)
+			commit_offset = file->sync_offset;
+		if (commit_offset - file->buffer_offset < size)
+			size = commit_offset - file->buffer_offset;
+		use_commit_offset = TRUE;
+	}
 	while (file->sync_offset - file->buffer_offset + sizeof(*hdr) <= size) {
 		hdr = CONST_PTR_OFFSET(data, file->sync_offset -
 				       file->buffer_offset);
@@ -1375,7 +1501,7 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 		file->sync_offset += trans_size;
 	}
 
-	if (file->mmap_base != NULL && !file->locked) {
+	if (file->mmap_base != NULL && !file->locked && !use_commit_offset) {
 		/* Now that all the mmaped pages have page faulted, check if
 		   the file had changed while doing that. Only after the last
 		   page has faulted, the size returned by fstat() can be
@@ -1408,6 +1534,13 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 		/* The size field will be updated soon */
 		mail_index_flush_read_cache(file->log->index, file->filepath,
 					    file->fd, file->locked);
+	} else if (file->locked && file->hdr.commit_offset != 0 &&
+		   file->hdr.commit_offset < file->sync_offset &&
+		   !MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) &&
+		   !file->log->index->readonly) {
+		/* other processes have written to the file since we last
+		   saw the commit offset */
+		mail_transaction_log_file_fix_commit_offset(file);
 	}
 
 	if (file->next != NULL &&
@@ -1458,6 +1591,83 @@ mail_transaction_log_file_insert_read(struct mail_transaction_log_file *file,
 	}
 }
 
+static int
+mail_transaction_log_file_read_compressed(struct mail_transaction_log_file *file)
+{
+	const struct compression_handler *handler;
+	struct istream *input, *file_input;
+	const unsigned char *data;
+	size_t size;
+	ssize_t ret;
+
+	i_assert(file->buffer_offset == 0);
+
+	if (file->buffer->used > file->hdr.hdr_size) {
+		/* compressed files are never appended to, so we already
+		   have the whole file */
+		return 1;
+	}
+	buffer_set_used_size(file->buffer, 0);
+
+	file_input = i_stream_create_fd(file->fd, (size_t)-1, FALSE);
+	/* the header is uncompressed */
+	ret = i_stream_read_data(file_input, &data, &size,
+				 file->hdr.hdr_size - 1);
+	if (ret > 0) {
+		buffer_append(file->buffer, data, file->hdr.hdr_size);
+		i_stream_skip(file_input, file->hdr.hdr_size);
+	}
+	handler = ret <= 0 ? NULL : compression_detect_handler(file_input);
+	if (handler == NULL || handler->create_istream == NULL) {
+		if (file_input->stream_errno != 0) {
+			mail_index_set_error(file->log->index,
+				"read(%s) failed: %s", file->filepath,
+				i_stream_get_error(file_input));
+			ret = -1;
+		} else if (handler == NULL) {
+			mail_transaction_log_file_set_corrupted(file,
+				"Unknown compression format");
+			ret = 0;
+		} else {
+			mail_index_set_error(file->log->index,
+				"Transaction log file %s: "
+				"Support not compiled in for %s compression",
+				file->filepath, handler->name);
+			ret = 0;
+		}
+		i_stream_unref(&file_input);
+		buffer_set_used_size(file->buffer, 0);
+		return ret;
+	}
+
+	input = handler->create_istream(file_input, TRUE);
+	i_stream_unref(&file_input);
+	while ((ret = i_stream_read_data(input, &data, &size, 0)) > 0) {
+		buffer_append(file->buffer, data, size);
+		i_stream_skip(input, size);
+	}
+	i_assert(ret == -1);
+	if (input->stream_errno != 0) {
+		if (input->stream_errno == EINVAL) {
+			mail_transaction_log_file_set_corrupted(file,
+				"Corrupted compressed data: %s",
+				i_stream_get_error(input));
+			ret = 0;
+		} else {
+			mail_index_set_error(file->log->index,
+				"read(%s) failed: %s", file->filepath,
+				i_stream_get_error(input));
+		}
+		i_stream_unref(&input);
+		buffer_set_used_size(file->buffer, 0);
+		return ret;
+	}
+	i_stream_unref(&input);
+
+	file->last_size = file->buffer->used;
+	return 1;
+}
+
 static int
 mail_transaction_log_file_read_more(struct mail_transaction_log_file *file)
 {
@@ -1466,6 +1676,9 @@ mail_transaction_log_file_read_more(struct mail_transaction_log_file *file)
 	uint32_t read_offset;
 	ssize_t ret;
 
+	if (file->compressed)
+		return mail_transaction_log_file_read_compressed(file);
+
 	read_offset = file->buffer_offset + buffer_get_used_size(file->buffer);
 
 	do {
@@ -1532,6 +1745,10 @@ mail_transaction_log_file_read(struct mail_transaction_log_file *file,
 			nfs_flush_attr_cache_fd_locked(file->filepath, file->fd);
 	}
 
+	if (file->compressed) {
+		/* compressed files can only be read from the beginning */
+		start_offset = 0;
+	}
 	if (file->buffer != NULL && file->buffer_offset > start_offset) {
 		/* we have to insert missing data to beginning of buffer */
 		ret = mail_transaction_log_file_insert_read(file, start_offset);
@@ -1545,9 +1762,12 @@ mail_transaction_log_file_read(struct mail_transaction_log_file *file,
 		file->buffer_offset = start_offset;
 	}
 
-	if ((ret = mail_transaction_log_file_read_more(file)) <= 0)
-		;
-	else if (file->log->nfs_flush && !nfs_flush &&
+	if ((ret = mail_transaction_log_file_read_more(file)) <= 0) {
+		if (file->compressed) {
+			/* nothing was decompressed */
+			return ret;
+		}
+	} else if (file->log->nfs_flush && !nfs_flush &&
 		 mail_transaction_log_file_need_nfs_flush(file)) {
 		/* we didn't read enough data. flush and try again. */
 		return mail_transaction_log_file_read(file, start_offset, TRUE);
@@ -1744,7 +1964,8 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 		start_offset = file->sync_offset;
 	}
 
-	if ((file->log->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0)
+	if ((file->log->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0 &&
+	    !file->compressed)
 		ret = mail_transaction_log_file_map_mmap(file, start_offset);
 	else {
 		mail_transaction_log_file_munmap(file);
@@ -1794,3 +2015,110 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 	i_free(file->filepath);
 	file->filepath = i_strdup(file->log->filepath);
 }
+
+static int
+mail_transaction_log_file_write_compressed(struct mail_transaction_log_file *file,
+					   int fd, const char *temp_path)
+{
+	struct mail_index *index = file->log->index;
+	const struct compression_handler *handler = index->log_compress_handler;
+	struct mail_transaction_log_header hdr;
+	struct ostream *file_output, *output;
+	const void *data;
+	int ret = 0;
+
+	i_assert(file->buffer_offset <= file->hdr.hdr_size);
+	i_assert(file->buffer_offset + file->buffer->used >= file->sync_offset);
+
+	/* the header is left uncompressed, so it can be read without
+	   knowing anything about the compression */
+	hdr = file->hdr;
+	hdr.major_version = MAIL_TRANSACTION_LOG_COMPRESSED_MAJOR_VERSION;
+
+	data = CONST_PTR_OFFSET(file->buffer->data,
+				file->hdr.hdr_size - file->buffer_offset);
+	file_output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(file_output);
+	o_stream_nsend(file_output, &hdr, sizeof(hdr));
+	output = handler->create_ostream(file_output,
+					 MAIL_TRANSACTION_LOG_COMPRESS_LEVEL);
+	o_stream_nsend(output, data, file->sync_offset - file->hdr.hdr_size);
+	if (o_stream_nfinish(output) < 0) {
+		mail_index_set_error(index, "write(%s) failed: %s",
+				     temp_path, o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	if (ret == 0 && o_stream_nfinish(file_output) < 0) {
+		mail_index_set_error(index, "write(%s) failed: %s",
+				     temp_path, o_stream_get_error(file_output));
+		ret = -1;
+	}
+	o_stream_destroy(&file_output);
+
+	if (ret == 0 && index->fsync_mode == FSYNC_MODE_ALWAYS &&
+	    fdatasync(fd) < 0) {
+		mail_index_file_set_syscall_error(index, temp_path,
+						  "fdatasync()");
+		ret = -1;
+	}
+	return ret;
+}
+
+void mail_transaction_log_file_compress(struct mail_transaction_log_file *file,
+					const char *path)
+{
+	struct mail_index *index = file->log->index;
+	const char *temp_path;
+	struct stat st;
+	mode_t old_mask;
+	int fd, ret;
+
+	i_assert(file->locked);
+	i_assert(index->log_compress_handler != NULL);
+
+	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) || file->compressed ||
+	    file->hdr.hdr_size != sizeof(file->hdr))
+		return;
+
+	/* make sure the link to .log.2 was created */
+	if (nfs_safe_stat(path, &st) < 0) {
+		if (errno != ENOENT)
+			mail_index_file_set_syscall_error(index, path, "stat()");
+		return;
+	}
+	if (st.st_ino != file->st_ino || !CMP_DEV_T(st.st_dev, file->st_dev))
+		return;
+
+	/* the file is locked, so nothing more gets appended to it */
+	if (mail_transaction_log_file_map(file, file->hdr.hdr_size,
+					  (uoff_t)-1) <= 0)
+		return;
+
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	old_mask = umask(index->mode ^ 0666);
+	fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	umask(old_mask);
+	if (fd == -1) {
+		mail_index_file_set_syscall_error(index, temp_path, "open()");
+		return;
+	}
+	mail_index_fchown(index, fd, temp_path);
+
+	ret = mail_transaction_log_file_write_compressed(file, fd, temp_path);
+	if (close(fd) < 0) {
+		mail_index_file_set_syscall_error(index, temp_path, "close()");
+		ret = -1;
+	}
+	/* processes that still have the uncompressed file open keep using
+	   it. others will see the compressed file. */
+	if (ret == 0 && rename(temp_path, path) < 0) {
+		mail_index_set_error(index, "rename(%s, %s) failed: %m",
+				     temp_path, path);
+		ret = -1;
+	}
+	if (ret < 0 && unlink(temp_path) < 0 && errno != ENOENT) {
+		mail_index_set_error(index, "unlink(%s) failed: %m",
+				     temp_path);
+	}
+}
@@ -21,6 +21,10 @@ struct dotlock_settings;
    older files are useful for QRESYNC and dsync. */
 #define MAIL_TRANSACTION_LOG2_STALE_SECS (60*60*24*2)
 
+/* Compression level for rotated .log.2 files. The log is compressed while
+   it's still locked, so prefer speed. */
+#define MAIL_TRANSACTION_LOG_COMPRESS_LEVEL 1
+
 #define MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) ((file)->fd == -1)
 
 #define LOG_FILE_MODSEQ_CACHE_SIZE 10
@@ -79,6 +83,10 @@ struct mail_transaction_log_file {
 	unsigned int locked:1;
 	unsigned int locked_sync_offset_updated:1;
 	unsigned int corrupted:1;
+	/* file is a compressed .log.2. it's read entirely into buffer. */
+	unsigned int compressed:1;
+	/* O_APPEND has been removed from fd, so pwrite() works */
+	unsigned int append_disabled:1;
 };
 
 struct mail_transaction_log {
@@ -131,6 +139,19 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 				  uoff_t start_offset, uoff_t end_offset);
 void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 					      *file);
+/* Write data to the given offset in the log file. Returns 0 if ok, -1 if
+   error. */
+int mail_transaction_log_file_pwrite(struct mail_transaction_log_file *file,
+				     const void *data, size_t size,
+				     uoff_t offset);
+/* Update the header's commit_offset to sync_offset. The file must be locked
+   and use commit offsets. Returns 0 if ok, -1 if error. */
+int mail_transaction_log_file_write_commit_offset(struct mail_transaction_log_file
+						  *file);
+/* Replace path (the .log.2) with a compressed copy of the locked file,
+   if path is still a link to it. Errors are logged, but otherwise ignored. */
+void mail_transaction_log_file_compress(struct mail_transaction_log_file *file,
+					const char *path);
 
 void mail_transaction_logs_clean(struct mail_transaction_log *log);
 
@@ -272,6 +272,12 @@ int mail_transaction_log_rotate(struct mail_transaction_log *log, bool reset)
 			return -1;
 		}
 		i_assert(file->locked);
+
+		if (log->index->log_compress_handler != NULL && !reset) {
+			/* the old log is now sealed in .log.2 */
+			mail_transaction_log_file_compress(log->head,
+							   log->filepath2);
+		}
 	}
 
 	if (--log->head->refcount == 0)
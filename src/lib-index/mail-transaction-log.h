@@ -8,6 +8,11 @@
 #define MAIL_TRANSACTION_LOG_MAJOR_VERSION 1
 #define MAIL_TRANSACTION_LOG_MINOR_VERSION 2
 #define MAIL_TRANSACTION_LOG_HEADER_MIN_SIZE 24
+/* Rotated .log.2 files may be compressed. The header is written
+   uncompressed with this major version, followed by the compressed
+   transactions. Older versions see an incompatible version and drop the
+   file. */
+#define MAIL_TRANSACTION_LOG_COMPRESSED_MAJOR_VERSION 2
 
 struct mail_transaction_log_header {
 	uint8_t major_version;
@@ -23,7 +28,11 @@ struct mail_transaction_log_header {
 
 	uint8_t compat_flags; /* enum mail_index_header_compat_flags, v1.2+ */
 	uint8_t unused[3];
-	uint32_t unused2; /* so that this struct is 64bit aligned */
+	/* v2.2.18+: If non-zero, all the transactions before this offset
+	   have been fully written. Writers update it after each write, so
+	   readers can use the file without checking if a write is still in
+	   progress. */
+	uint32_t commit_offset;
 };
 
 enum mail_transaction_type {
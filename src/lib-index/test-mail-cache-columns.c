@@ -0,0 +1,632 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-cache-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_MESSAGES_COUNT 200
+#define TEST_NEW_MESSAGES_COUNT 5
+
+enum test_field {
+	TEST_FIELD_FIXED,
+	TEST_FIELD_FIXED64,
+	TEST_FIELD_STRING,
+	TEST_FIELD_NEW,
+
+	TEST_FIELD_COUNT
+};
+
+static const struct mail_cache_field test_cache_fields[TEST_FIELD_COUNT] = {
+	{ .name = "fixed",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "fixed64",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint64_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "string",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "new",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+/* fields were added to the records after the compression */
+static bool test_fields_added;
+static unsigned int test_error_count;
+
+static void ATTR_FORMAT(2, 0)
+test_error_handler(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_error_count++;
+}
+
+static struct mail_index *
+test_index_open(struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, test_cache_fields, sizeof(test_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   TEST_FIELD_COUNT);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static const char *test_cache_path(void)
+{
+	return t_strconcat(index_dir, "/dovecot.index"MAIL_CACHE_FILE_SUFFIX,
+			   NULL);
+}
+
+static bool test_want_field(enum test_field field, uint32_t uid)
+{
+	switch (field) {
+	case TEST_FIELD_FIXED:
+		return uid % 5 != 0 || test_fields_added;
+	case TEST_FIELD_FIXED64:
+		return uid % 2 == 0;
+	case TEST_FIELD_STRING:
+		return uid % 3 == 0;
+	case TEST_FIELD_NEW:
+		return uid % 4 == 0 && test_fields_added;
+	case TEST_FIELD_COUNT:
+		break;
+	}
+	i_unreached();
+}
+
+static void
+test_get_value(enum test_field field, uint32_t uid, buffer_t *dest)
+{
+	uint32_t value32;
+	uint64_t value64;
+
+	buffer_set_used_size(dest, 0);
+	switch (field) {
+	case TEST_FIELD_FIXED:
+		value32 = uid * 3;
+		buffer_append(dest, &value32, sizeof(value32));
+		break;
+	case TEST_FIELD_FIXED64:
+		value64 = ((uint64_t)uid << 32) | uid;
+		buffer_append(dest, &value64, sizeof(value64));
+		break;
+	case TEST_FIELD_STRING:
+		str_printfa(dest, "string %u", uid);
+		buffer_append_c(dest, '\0');
+		break;
+	case TEST_FIELD_NEW:
+		value32 = uid + 1;
+		buffer_append(dest, &value32, sizeof(value32));
+		break;
+	case TEST_FIELD_COUNT:
+		i_unreached();
+	}
+}
+
+static void test_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_header *hdr;
+	uint32_t uid_validity = 1234, seq;
+	unsigned int i;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	trans = mail_index_transaction_begin(view, 0);
+	if (hdr->uid_validity == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(trans, hdr->next_uid + i, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+/* Cache the wanted fields for UIDs uid1..uid2, except for the ones that
+   were cached already */
+static void
+test_cache_add(struct mail_index *index,
+	       const struct mail_cache_field fields[TEST_FIELD_COUNT],
+	       uint32_t uid1, uint32_t uid2)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	enum test_field field;
+	uint32_t seq, seq1, seq2, uid;
+	buffer_t *buf;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	buf = buffer_create_dynamic(default_pool, 64);
+	if (!mail_index_lookup_seq_range(view, uid1, uid2, &seq1, &seq2))
+		i_unreached();
+	for (seq = seq1; seq <= seq2; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		for (field = 0; field < TEST_FIELD_COUNT; field++) {
+			if (!test_want_field(field, uid) ||
+			    mail_cache_field_exists(cache_view, seq,
+						    fields[field].idx) != 0)
+				continue;
+			test_get_value(field, uid, buf);
+			mail_cache_add(cache_trans, seq, fields[field].idx,
+				       buf->data, buf->used);
+		}
+	}
+	buffer_free(&buf);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_compress(struct mail_index *index)
+{
+	struct mail_cache *cache = mail_index_get_cache(index);
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	if (mail_cache_open_and_verify(cache) < 0)
+		i_fatal("mail_cache_open_and_verify() failed");
+	mail_cache_set_columns(cache, TRUE);
+	cache->need_compress_file_seq = cache->hdr->file_seq;
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	test_assert(MAIL_CACHE_HAS_COLUMNS(cache->hdr));
+}
+
+static void test_fill(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-cache-columns.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	test_fields_added = FALSE;
+	index = test_index_open(fields);
+	test_append(index, TEST_MESSAGES_COUNT);
+	test_cache_add(index, fields, 1, TEST_MESSAGES_COUNT);
+	test_compress(index);
+	test_index_close(&index);
+}
+
+static void test_cleanup(void)
+{
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+}
+
+/* Verify all the fields of seq. Returns FALSE if anything was wrong. */
+static bool
+test_verify_seq(struct mail_cache_view *cache_view,
+		const struct mail_cache_field fields[TEST_FIELD_COUNT],
+		uint32_t seq, buffer_t *buf, buffer_t *expected)
+{
+	enum test_field field;
+	uint32_t uid;
+	int ret;
+
+	mail_index_lookup_uid(cache_view->view, seq, &uid);
+	for (field = 0; field < TEST_FIELD_COUNT; field++) {
+		buffer_set_used_size(buf, 0);
+		ret = mail_cache_lookup_field(cache_view, buf, seq,
+					      fields[field].idx);
+		if (ret != (test_want_field(field, uid) ? 1 : 0))
+			return FALSE;
+		if (mail_cache_field_exists(cache_view, seq,
+					    fields[field].idx) != ret)
+			return FALSE;
+		if (ret > 0) {
+			test_get_value(field, uid, expected);
+			if (!buffer_cmp(buf, expected))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Look up the messages in the order of seqs (or all of them, if NULL) */
+static void
+test_verify(const uint32_t *seqs, unsigned int seqs_count)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf, *expected;
+	uint32_t i, seq, count;
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 64);
+	expected = buffer_create_dynamic(default_pool, 64);
+
+	count = seqs == NULL ? mail_index_view_get_messages_count(view) :
+		seqs_count;
+	for (i = 0; i < count; i++) {
+		seq = seqs == NULL ? i + 1 : seqs[i];
+		test_assert_idx(test_verify_seq(cache_view, fields, seq,
+						buf, expected), seq);
+	}
+
+	buffer_free(&buf);
+	buffer_free(&expected);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+}
+
+static void test_expunge(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (uid <= 3 || uid % 7 == 0 || (uid > 100 && uid < 120))
+			mail_index_expunge(trans, seq);
+	}
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static void test_mail_cache_columns_expunges(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache *cache;
+	uint32_t *seqs, i, seq, count, uid, row;
+	const uint32_t *uids;
+	const void *data;
+
+	test_begin("mail cache columns after expunges");
+	test_fill();
+
+	index = test_index_open(fields);
+	test_expunge(index);
+	test_append(index, TEST_NEW_MESSAGES_COUNT);
+	test_cache_add(index, fields, TEST_MESSAGES_COUNT + 1,
+		       TEST_MESSAGES_COUNT + TEST_NEW_MESSAGES_COUNT);
+
+	/* the rows stay where they were, but the messages' sequences have
+	   moved. the new messages aren't in the columns. */
+	cache = mail_index_get_cache(index);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	count = mail_index_view_get_messages_count(view);
+	test_assert(mail_cache_columns_read(cache) == 0);
+	test_assert(cache->column_hdr.rows_count == TEST_MESSAGES_COUNT);
+	test_assert(cache->column_hdr.columns_count == 3);
+	test_assert(mail_cache_map(cache, cache->column_hdr.uids_offset,
+				   TEST_MESSAGES_COUNT * sizeof(uint32_t),
+				   &data) > 0);
+	uids = data;
+	for (seq = count; seq > 0; seq--) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (uid > TEST_MESSAGES_COUNT) {
+			test_assert_idx(mail_cache_columns_lookup_row(cache_view,
+						seq, &row) == 0, seq);
+		} else {
+			test_assert_idx(mail_cache_columns_lookup_row(cache_view,
+						seq, &row) == 1 &&
+					row < TEST_MESSAGES_COUNT &&
+					uids[row] == uid, seq);
+		}
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+
+	/* in order, backwards and skipping around */
+	test_verify(NULL, 0);
+	seqs = i_new(uint32_t, count);
+	for (i = 0; i < count; i++)
+		seqs[i] = count - i;
+	test_verify(seqs, count);
+	for (i = 0; i < count; i++)
+		seqs[i] = 1 + (i * 37) % count;
+	test_verify(seqs, count);
+	i_free(seqs);
+
+	test_cleanup();
+	test_end();
+}
+
+/* Returns TRUE if the field is set in seq's column row */
+static bool
+test_column_has_field(struct mail_index *index, unsigned int field_idx,
+		      uint32_t seq)
+{
+	struct mail_cache *cache = mail_index_get_cache(index);
+	const struct mail_cache_column *column;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	const void *data;
+	uint32_t row;
+	bool ret = FALSE;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	if (mail_cache_columns_read(cache) == 0 &&
+	    mail_cache_columns_lookup_row(cache_view, seq, &row) > 0) {
+		column = mail_cache_column_get(cache,
+					       cache->field_file_map[field_idx]);
+		ret = column != NULL &&
+			mail_cache_column_lookup(cache, column, row, &data) > 0;
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	return ret;
+}
+
+static void test_mail_cache_columns_added_fields(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+
+	test_begin("mail cache columns with fields added later");
+	test_fill();
+
+	/* add the fixed field for the messages whose column doesn't have it
+	   and a new field that isn't in the columns at all */
+	test_fields_added = TRUE;
+	index = test_index_open(fields);
+	test_cache_add(index, fields, 1, TEST_MESSAGES_COUNT);
+	test_index_close(&index);
+	test_verify(NULL, 0);
+
+	/* the next compression moves them to the columns */
+	index = test_index_open(fields);
+	test_compress(index);
+	test_assert(test_column_has_field(index, fields[TEST_FIELD_FIXED].idx, 5));
+	test_assert(test_column_has_field(index, fields[TEST_FIELD_NEW].idx, 4));
+	test_assert(!test_column_has_field(index, fields[TEST_FIELD_NEW].idx, 5));
+	test_index_close(&index);
+	test_verify(NULL, 0);
+
+	test_cleanup();
+	test_end();
+}
+
+static void
+test_corrupt_columns_count(struct mail_cache_column_header *hdr,
+			   struct mail_cache_column *columns ATTR_UNUSED)
+{
+	hdr->columns_count = TEST_FIELD_COUNT + 1;
+}
+
+static void
+test_corrupt_uids_offset(struct mail_cache_column_header *hdr,
+			 struct mail_cache_column *columns ATTR_UNUSED)
+{
+	hdr->uids_offset++;
+}
+
+static void
+test_corrupt_uids_outside(struct mail_cache_column_header *hdr,
+			  struct mail_cache_column *columns ATTR_UNUSED)
+{
+	hdr->uids_offset = (uint32_t)-4;
+}
+
+static void
+test_corrupt_file_field(struct mail_cache_column_header *hdr ATTR_UNUSED,
+			struct mail_cache_column *columns)
+{
+	columns[0].file_field = TEST_FIELD_COUNT;
+}
+
+static void
+test_corrupt_duplicate(struct mail_cache_column_header *hdr ATTR_UNUSED,
+		       struct mail_cache_column *columns)
+{
+	columns[1].file_field = columns[0].file_field;
+	columns[1].field_size = columns[0].field_size;
+}
+
+static void
+test_corrupt_field_size(struct mail_cache_column_header *hdr ATTR_UNUSED,
+			struct mail_cache_column *columns)
+{
+	columns[0].field_size++;
+}
+
+static void
+test_corrupt_data_overflow(struct mail_cache_column_header *hdr ATTR_UNUSED,
+			   struct mail_cache_column *columns)
+{
+	columns[0].data_offset = (uint32_t)-16;
+}
+
+static void
+test_corrupt_data_outside(struct mail_cache_column_header *hdr ATTR_UNUSED,
+			  struct mail_cache_column *columns)
+{
+	columns[0].data_offset = (uint32_t)-1 / 2;
+	columns[1].data_offset = (uint32_t)-1 / 2;
+}
+
+static void
+test_corrupt_bitmap_outside(struct mail_cache_column_header *hdr ATTR_UNUSED,
+			    struct mail_cache_column *columns)
+{
+	columns[0].bitmap_offset = (uint32_t)-1 / 2;
+	columns[1].bitmap_offset = (uint32_t)-1 / 2;
+}
+
+static void test_write_cache_file(const buffer_t *data)
+{
+	const char *path = test_cache_path();
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, data->data, data->used) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+/* Returns the lowest return value of looking up the fixed size fields */
+static int test_lookup_columns(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	int ret, ret2;
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 64);
+	/* UID 2 has both fields */
+	ret = mail_cache_lookup_field(cache_view, buf, 2,
+				      fields[TEST_FIELD_FIXED].idx);
+	ret2 = mail_cache_lookup_field(cache_view, buf, 2,
+				       fields[TEST_FIELD_FIXED64].idx);
+	if (ret2 < ret)
+		ret = ret2;
+	if (ret < 0)
+		test_assert(MAIL_CACHE_IS_UNUSABLE(mail_index_get_cache(index)));
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+	return ret;
+}
+
+static void test_mail_cache_columns_corrupted(void)
+{
+	static void (*const corrupt_funcs[])(struct mail_cache_column_header *,
+					    struct mail_cache_column *) = {
+		test_corrupt_columns_count,
+		test_corrupt_uids_offset,
+		test_corrupt_uids_outside,
+		test_corrupt_file_field,
+		test_corrupt_duplicate,
+		test_corrupt_field_size,
+		test_corrupt_data_overflow,
+		test_corrupt_data_outside,
+		test_corrupt_bitmap_outside
+	};
+	failure_callback_t *fatal_callback, *error_callback;
+	failure_callback_t *info_callback, *debug_callback;
+	struct mail_cache_column_header *column_hdr;
+	buffer_t *orig, *data;
+	struct stat st;
+	const char *path;
+	unsigned int i;
+	int fd;
+
+	test_begin("mail cache columns corrupted");
+	test_fill();
+
+	path = test_cache_path();
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	orig = buffer_create_dynamic(default_pool, st.st_size);
+	if (read(fd, buffer_append_space_unsafe(orig, st.st_size),
+		 st.st_size) != st.st_size)
+		i_fatal("read(%s) failed", path);
+	i_close_fd(&fd);
+	data = buffer_create_dynamic(default_pool, st.st_size);
+
+	test_assert(test_lookup_columns() == 1);
+
+	i_get_failure_handlers(&fatal_callback, &error_callback,
+			       &info_callback, &debug_callback);
+	i_set_error_handler(test_error_handler);
+	for (i = 0; i < N_ELEMENTS(corrupt_funcs); i++) {
+		buffer_set_used_size(data, 0);
+		buffer_append_buf(data, orig, 0, (size_t)-1);
+		column_hdr = buffer_get_space_unsafe(data,
+			sizeof(struct mail_cache_header), sizeof(*column_hdr));
+		i_assert(column_hdr->columns_count >= 2);
+		corrupt_funcs[i](column_hdr, (void *)(column_hdr + 1));
+		test_write_cache_file(data);
+
+		test_error_count = 0;
+		test_assert_idx(test_lookup_columns() < 0, i);
+		test_assert_idx(test_error_count > 0, i);
+	}
+	i_set_error_handler(error_callback);
+
+	/* the original file is still fine */
+	test_write_cache_file(orig);
+	test_assert(test_lookup_columns() == 1);
+
+	buffer_free(&orig);
+	buffer_free(&data);
+	test_cleanup();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_columns_expunges,
+		test_mail_cache_columns_added_fields,
+		test_mail_cache_columns_corrupted,
+		NULL
+	};
+	return test_run(test_functions);
+}
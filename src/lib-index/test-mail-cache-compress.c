@@ -0,0 +1,532 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-cache-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_MESSAGES_COUNT 1000
+#define TEST_NEW_MESSAGES_COUNT 100
+#define TEST_DATA_SIZE 40
+/* how many new fields the writer process adds during the copying */
+#define TEST_WRITER_FIELDS_COUNT 50
+
+enum test_field {
+	TEST_FIELD_DATA,
+	TEST_FIELD_EXTRA,
+
+	TEST_FIELD_COUNT
+};
+
+static const struct mail_cache_field test_cache_fields[TEST_FIELD_COUNT] = {
+	{ .name = "data",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "extra",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+
+static struct mail_index *
+test_index_open(struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, test_cache_fields, sizeof(test_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   TEST_FIELD_COUNT);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_get_data(const char *prefix, uint32_t uid,
+			  char data[TEST_DATA_SIZE])
+{
+	memset(data, 0, TEST_DATA_SIZE);
+	i_snprintf(data, TEST_DATA_SIZE, "%s %u", prefix, uid);
+}
+
+static void test_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_header *hdr;
+	uint32_t uid_validity = 1234, seq;
+	unsigned int i;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	trans = mail_index_transaction_begin(view, 0);
+	if (hdr->uid_validity == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(trans, hdr->next_uid + i, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+/* Cache the data field for the messages with UIDs uid1..uid2, and the extra
+   field for the ones where uid % extra_mod == extra_rem. */
+static void
+test_cache_add(struct mail_index *index,
+	       const struct mail_cache_field fields[TEST_FIELD_COUNT],
+	       uint32_t uid1, uint32_t uid2,
+	       unsigned int extra_mod, unsigned int extra_rem)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	char data[TEST_DATA_SIZE];
+	uint32_t seq, seq1, seq2, uid;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	if (!mail_index_lookup_seq_range(view, uid1, uid2, &seq1, &seq2))
+		i_unreached();
+	for (seq = seq1; seq <= seq2; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (mail_cache_field_exists(cache_view, seq,
+					    fields[TEST_FIELD_DATA].idx) == 0) {
+			test_get_data("data", uid, data);
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_DATA].idx,
+				       data, sizeof(data));
+		}
+		if (uid % extra_mod == extra_rem) {
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_EXTRA].idx,
+				       &uid, sizeof(uid));
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_fill(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-cache-compress.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = test_index_open(fields);
+	test_append(index, TEST_MESSAGES_COUNT);
+	test_cache_add(index, fields, 1, TEST_MESSAGES_COUNT, 10, 0);
+	test_index_close(&index);
+}
+
+static void test_cleanup(void)
+{
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+}
+
+static struct mail_index *
+test_compress_begin(struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	if (mail_cache_open_and_verify(cache) < 0)
+		i_fatal("mail_cache_open_and_verify() failed");
+
+	/* copy also the columns, and pretend that the cache is fragmented
+	   enough to be compressed */
+	mail_cache_set_columns(cache, TRUE);
+	cache->need_compress_file_seq = cache->hdr->file_seq;
+	test_assert(mail_cache_need_compress(cache));
+	mail_cache_compress_prepare(cache);
+	return index;
+}
+
+static void test_compress_finish(struct mail_index **_index)
+{
+	struct mail_index *index = *_index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) <= 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	test_assert(!mail_cache_need_compress(mail_index_get_cache(index)));
+	test_index_close(_index);
+}
+
+static int
+test_lookup(struct mail_cache_view *cache_view, buffer_t *buf,
+	    uint32_t seq, unsigned int field_idx)
+{
+	int ret;
+
+	buffer_set_used_size(buf, 0);
+	ret = mail_cache_lookup_field(cache_view, buf, seq, field_idx);
+	test_assert(ret >= 0);
+	return ret;
+}
+
+/* Verify that all messages have the data field cached, and that the extra
+   field is cached exactly for the messages that extra_want() returns TRUE
+   for. */
+static void test_verify(bool (*extra_want)(uint32_t uid))
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	char data[TEST_DATA_SIZE];
+	uint32_t seq, count, uid, extra;
+	buffer_t *buf;
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 64);
+
+	count = mail_index_view_get_messages_count(view);
+	for (seq = 1; seq <= count; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		test_get_data("data", uid, data);
+		test_assert_idx(test_lookup(cache_view, buf, seq,
+					    fields[TEST_FIELD_DATA].idx) > 0 &&
+				buf->used == sizeof(data) &&
+				memcmp(buf->data, data, sizeof(data)) == 0,
+				uid);
+
+		if (test_lookup(cache_view, buf, seq,
+				fields[TEST_FIELD_EXTRA].idx) == 0)
+			test_assert_idx(!extra_want(uid), uid);
+		else {
+			test_assert_idx(extra_want(uid), uid);
+			test_assert_idx(buf->used == sizeof(extra), uid);
+			memcpy(&extra, buf->data, sizeof(extra));
+			test_assert_idx(extra == uid, uid);
+		}
+	}
+
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+}
+
+static bool test_extra_want_filled(uint32_t uid)
+{
+	return uid % 10 == 0;
+}
+
+static bool test_extra_want_appends(uint32_t uid)
+{
+	return uid % 10 == 0 || uid % 10 == 5 || uid > TEST_MESSAGES_COUNT;
+}
+
+static bool test_extra_want_none(uint32_t uid ATTR_UNUSED)
+{
+	return FALSE;
+}
+
+static void test_mail_cache_compress_appends(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT], wfields[TEST_FIELD_COUNT];
+	struct mail_index *index, *windex;
+
+	test_begin("mail cache compress prepared with appends");
+	test_fill();
+	index = test_compress_begin(fields);
+
+	/* another process appends new messages and caches more fields for
+	   the existing ones after the copying was already done */
+	windex = test_index_open(wfields);
+	test_append(windex, TEST_NEW_MESSAGES_COUNT);
+	test_cache_add(windex, wfields, 1, TEST_MESSAGES_COUNT, 10, 5);
+	test_cache_add(windex, wfields, TEST_MESSAGES_COUNT + 1,
+		       TEST_MESSAGES_COUNT + TEST_NEW_MESSAGES_COUNT, 1, 0);
+	test_index_close(&windex);
+
+	test_compress_finish(&index);
+	test_verify(test_extra_want_appends);
+	test_cleanup();
+	test_end();
+}
+
+static void test_mail_cache_compress_new_field(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT], wfields[TEST_FIELD_COUNT];
+	struct mail_cache_field new_field = {
+		.name = "new",
+		.type = MAIL_CACHE_FIELD_FIXED_SIZE,
+		.field_size = sizeof(uint32_t),
+		.decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED
+	};
+	struct mail_index *index, *windex;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, uid, value;
+	buffer_t *buf;
+
+	test_begin("mail cache compress prepared with a new field");
+	test_fill();
+	index = test_compress_begin(fields);
+
+	/* another process adds a field that didn't exist when the copying
+	   was done */
+	windex = test_index_open(wfields);
+	mail_cache_register_fields(mail_index_get_cache(windex),
+				   &new_field, 1);
+	view = mail_index_view_open(windex);
+	cache_view = mail_cache_view_open(mail_index_get_cache(windex), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq += 3) {
+		mail_index_lookup_uid(view, seq, &uid);
+		value = uid * 2;
+		mail_cache_add(cache_trans, seq, new_field.idx,
+			       &value, sizeof(value));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&windex);
+
+	test_compress_finish(&index);
+	test_verify(test_extra_want_filled);
+
+	/* the new field must have been copied as well */
+	index = test_index_open(fields);
+	new_field.idx = 0;
+	mail_cache_register_fields(mail_index_get_cache(index), &new_field, 1);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 64);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (test_lookup(cache_view, buf, seq, new_field.idx) == 0)
+			test_assert_idx(seq % 3 != 1, seq);
+		else {
+			test_assert_idx(seq % 3 == 1, seq);
+			memcpy(&value, buf->data, sizeof(value));
+			test_assert_idx(buf->used == sizeof(value) &&
+					value == uid * 2, seq);
+		}
+	}
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+
+	test_cleanup();
+	test_end();
+}
+
+static void test_mail_cache_compress_decision_change(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT], wfields[TEST_FIELD_COUNT];
+	struct mail_index *index, *windex;
+	struct mail_cache *wcache;
+
+	test_begin("mail cache compress prepared with changed decisions");
+	test_fill();
+	index = test_compress_begin(fields);
+
+	/* another process decides that the extra field isn't wanted
+	   anymore. the copy still has it, so it can't be used. */
+	windex = test_index_open(wfields);
+	wcache = mail_index_get_cache(windex);
+	if (mail_cache_open_and_verify(wcache) < 0)
+		i_fatal("mail_cache_open_and_verify() failed");
+	wfields[TEST_FIELD_EXTRA].decision =
+		MAIL_CACHE_DECISION_NO | MAIL_CACHE_DECISION_FORCED;
+	mail_cache_register_fields(wcache, &wfields[TEST_FIELD_EXTRA], 1);
+	test_append(windex, 1);
+	test_cache_add(windex, wfields, TEST_MESSAGES_COUNT + 1,
+		       TEST_MESSAGES_COUNT + 1, 2, 2);
+	test_index_close(&windex);
+
+	test_compress_finish(&index);
+	test_verify(test_extra_want_none);
+	test_cleanup();
+	test_end();
+}
+
+static void ATTR_NORETURN
+test_fields_writer(int fd)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_cache_field field;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	char data[TEST_DATA_SIZE];
+	uint32_t seq, uid, pair[2];
+	unsigned int i;
+
+	index = test_index_open(fields);
+	for (i = 0; i < TEST_WRITER_FIELDS_COUNT; i++) {
+		memset(&field, 0, sizeof(field));
+		field.name = t_strdup_printf("writer%u", i);
+		field.type = MAIL_CACHE_FIELD_STRING;
+		field.field_size = UINT_MAX;
+		field.decision = MAIL_CACHE_DECISION_YES |
+			MAIL_CACHE_DECISION_FORCED;
+		mail_cache_register_fields(mail_index_get_cache(index),
+					   &field, 1);
+
+		if (mail_index_refresh(index) < 0)
+			i_fatal("mail_index_refresh() failed");
+		view = mail_index_view_open(index);
+		cache_view = mail_cache_view_open(mail_index_get_cache(index),
+						  view);
+		trans = mail_index_transaction_begin(view, 0);
+		cache_trans = mail_cache_get_transaction(cache_view, trans);
+		seq = 1 + (i * 7919) % mail_index_view_get_messages_count(view);
+		mail_index_lookup_uid(view, seq, &uid);
+		test_get_data(field.name, uid, data);
+		mail_cache_add(cache_trans, seq, field.idx, data, sizeof(data));
+		if (mail_index_transaction_commit(&trans) < 0)
+			i_fatal("mail_index_transaction_commit() failed");
+		mail_cache_view_close(&cache_view);
+		mail_index_view_close(&view);
+
+		pair[0] = i; pair[1] = uid;
+		if (write(fd, pair, sizeof(pair)) != sizeof(pair))
+			i_fatal("write(pipe) failed: %m");
+		usleep(1000);
+	}
+	test_index_close(&index);
+	_exit(0);
+}
+
+static void test_mail_cache_compress_fields_race(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_cache_field field;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	char data[TEST_DATA_SIZE];
+	uint32_t seq, pair[2];
+	unsigned int compress_count = 0;
+	buffer_t *buf;
+	int fd[2], status;
+	pid_t pid;
+
+	test_begin("mail cache compress prepared with fields added meanwhile");
+	test_fill();
+
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		i_close_fd(&fd[0]);
+		test_fields_writer(fd[1]);
+	}
+	i_close_fd(&fd[1]);
+
+	/* keep compressing while the writer adds new fields. the copying
+	   must notice the fields it doesn't know about instead of writing
+	   them with the wrong field numbers. */
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		index = test_compress_begin(fields);
+		test_compress_finish(&index);
+		compress_count++;
+	}
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	test_assert(compress_count > 0);
+	test_verify(test_extra_want_filled);
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	buf = buffer_create_dynamic(default_pool, 64);
+	while (read(fd[0], pair, sizeof(pair)) == sizeof(pair)) {
+		memset(&field, 0, sizeof(field));
+		field.name = t_strdup_printf("writer%u", pair[0]);
+		field.type = MAIL_CACHE_FIELD_STRING;
+		field.field_size = UINT_MAX;
+		mail_cache_register_fields(mail_index_get_cache(index),
+					   &field, 1);
+		if (!mail_index_lookup_seq(view, pair[1], &seq))
+			i_unreached();
+		/* the value may have been lost if the writer's transaction
+		   was committed after the compression, but it must never be
+		   wrong */
+		test_get_data(field.name, pair[1], data);
+		if (test_lookup(cache_view, buf, seq, field.idx) > 0) {
+			test_assert_idx(buf->used == sizeof(data) &&
+					memcmp(buf->data, data,
+					       sizeof(data)) == 0, pair[0]);
+		}
+	}
+	i_close_fd(&fd[0]);
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+
+	test_cleanup();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_compress_appends,
+		test_mail_cache_compress_new_field,
+		test_mail_cache_compress_decision_change,
+		test_mail_cache_compress_fields_race,
+		NULL
+	};
+	return test_run(test_functions);
+}
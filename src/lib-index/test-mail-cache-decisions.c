@@ -0,0 +1,562 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-cache-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_MESSAGES_COUNT 10
+
+enum test_field {
+	TEST_FIELD_FIXED,
+	TEST_FIELD_STRING,
+
+	TEST_FIELD_COUNT
+};
+
+static const struct mail_cache_field test_cache_fields[TEST_FIELD_COUNT] = {
+	{ .name = "fixed",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "string",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+
+static struct mail_index *
+test_index_open(struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, test_cache_fields, sizeof(test_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   TEST_FIELD_COUNT);
+	if (mail_cache_open_and_verify(mail_index_get_cache(index)) < 0)
+		i_fatal("mail_cache_open_and_verify() failed");
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static const char *test_get_string(uint32_t seq)
+{
+	return t_strdup_printf("string %u", seq);
+}
+
+static void test_fill(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t uid_validity = 1234, seq;
+
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-cache-decisions.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++)
+		mail_index_append(trans, seq, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	test_index_close(&index);
+}
+
+/* Cache the fixed field for all messages and the string field for the odd
+   sequences. Returns the bytes added for the string field. */
+static uint32_t
+test_cache_add(struct mail_cache_view *cache_view,
+	       struct mail_index_view *view,
+	       const struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const char *str;
+	uint32_t seq, string_bytes = 0;
+
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) {
+		mail_cache_add(cache_trans, seq, fields[TEST_FIELD_FIXED].idx,
+			       &seq, sizeof(seq));
+		if (seq % 2 == 1) {
+			str = test_get_string(seq);
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_STRING].idx,
+				       str, strlen(str) + 1);
+			string_bytes += strlen(str) + 1;
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	return string_bytes;
+}
+
+static void test_cleanup(void)
+{
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+}
+
+/* Look up both fields for all the messages count times */
+static void test_lookup_all(struct mail_cache_view *cache_view,
+			    const struct mail_cache_field fields[TEST_FIELD_COUNT],
+			    unsigned int count)
+{
+	buffer_t *buf;
+	unsigned int i;
+	uint32_t seq;
+
+	buf = buffer_create_dynamic(default_pool, 64);
+	for (i = 0; i < count; i++) {
+		for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) {
+			buffer_set_used_size(buf, 0);
+			(void)mail_cache_lookup_field(cache_view, buf, seq,
+					fields[TEST_FIELD_FIXED].idx);
+			buffer_set_used_size(buf, 0);
+			(void)mail_cache_lookup_field(cache_view, buf, seq,
+					fields[TEST_FIELD_STRING].idx);
+		}
+	}
+	buffer_free(&buf);
+}
+
+/* Read the statistics that another process would see from the file */
+static void test_read_file_stats(enum test_field test_field,
+				 struct mail_cache_field_stats *stats_r)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_cache *cache;
+
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	mail_cache_decision_get_stats(cache, fields[test_field].idx, stats_r);
+	test_index_close(&index);
+}
+
+static const struct mail_cache_header_fields *
+test_read_field_header(buffer_t *buf, uint32_t offset)
+{
+	const char *path;
+	struct stat st;
+	int fd;
+
+	path = t_strconcat(index_dir, "/dovecot.index"MAIL_CACHE_FILE_SUFFIX,
+			   NULL);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	buffer_set_used_size(buf, 0);
+	if (read(fd, buffer_append_space_unsafe(buf, st.st_size),
+		 st.st_size) != st.st_size)
+		i_fatal("read(%s) failed", path);
+	i_close_fd(&fd);
+	i_assert(offset + sizeof(struct mail_cache_header_fields) <= buf->used);
+	return CONST_PTR_OFFSET(buf->data, offset);
+}
+
+static void test_mail_cache_field_stats_layout(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_cache_field_stats stats;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache *cache;
+	const struct mail_cache_header_fields *field_hdr;
+	const uint32_t *file_stats;
+	const char *names, *name;
+	buffer_t *buf;
+	uint32_t string_bytes, offset, i, count;
+	time_t start_time = ioloop_time;
+
+	test_begin("mail cache field stats layout");
+	test_fill();
+
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	string_bytes = test_cache_add(cache_view, view, fields);
+	test_lookup_all(cache_view, fields, 1);
+	test_assert(mail_cache_lock(cache) > 0);
+	test_assert(mail_cache_header_fields_update(cache) == 0);
+	test_assert(mail_cache_unlock(cache) == 0);
+	test_assert(cache->field_stats_offset != 0);
+
+	/* the statistics come after the names, aligned to 32 bits */
+	buf = buffer_create_dynamic(default_pool, 1024);
+	field_hdr = test_read_field_header(buf, cache->last_field_header_offset);
+	count = field_hdr->fields_count;
+	test_assert(count == TEST_FIELD_COUNT);
+	names = CONST_PTR_OFFSET(field_hdr, MAIL_CACHE_FIELD_NAMES(count));
+	name = names;
+	for (i = 0; i < count; i++)
+		name += strlen(name) + 1;
+	offset = ((name - (const char *)field_hdr) + 3) & ~3U;
+	test_assert(offset == cache->field_stats_offset);
+	test_assert(field_hdr->size == offset +
+		    MAIL_CACHE_FIELD_STATS_SIZE(count));
+
+	file_stats = CONST_PTR_OFFSET(field_hdr, offset);
+	test_assert(file_stats[0] >= start_time &&
+		    file_stats[0] <= ioloop_time);
+	for (i = 0, name = names; i < count; i++, name += strlen(name) + 1) {
+		uint32_t hits = file_stats[1 + i];
+		uint32_t misses = file_stats[1 + count + i];
+		uint32_t bytes = file_stats[1 + count*2 + i];
+
+		if (strcmp(name, "fixed") == 0) {
+			test_assert(hits == TEST_MESSAGES_COUNT);
+			test_assert(misses == 0);
+			test_assert(bytes == TEST_MESSAGES_COUNT *
+				    sizeof(uint32_t));
+		} else {
+			test_assert(strcmp(name, "string") == 0);
+			test_assert(hits == TEST_MESSAGES_COUNT / 2);
+			test_assert(misses == TEST_MESSAGES_COUNT / 2);
+			test_assert(bytes == string_bytes);
+		}
+	}
+	buffer_free(&buf);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+
+	/* reopening reads them back */
+	test_read_file_stats(TEST_FIELD_STRING, &stats);
+	test_assert(stats.hits == TEST_MESSAGES_COUNT / 2);
+	test_assert(stats.misses == TEST_MESSAGES_COUNT / 2);
+	test_assert(stats.bytes == string_bytes);
+
+	test_cleanup();
+	test_end();
+}
+
+static void test_mail_cache_field_stats_write_count(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_cache_field_stats stats;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache *cache;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	unsigned int lookup_rounds;
+	uint32_t seq = 2, value = 0;
+
+	test_begin("mail cache field stats write count");
+	test_fill();
+
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	(void)test_cache_add(cache_view, view, fields);
+	/* the first lookups update last_used, which writes the header */
+	test_lookup_all(cache_view, fields, 1);
+	test_assert(mail_cache_lock(cache) > 0);
+	test_assert(mail_cache_unlock(cache) == 0);
+	test_read_file_stats(TEST_FIELD_FIXED, &stats);
+	test_assert(stats.hits == TEST_MESSAGES_COUNT);
+
+	/* flushing a transaction doesn't write a few lookups' statistics */
+	test_lookup_all(cache_view, fields, 1);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, seq, fields[TEST_FIELD_STRING].idx,
+		       "", 1);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	test_read_file_stats(TEST_FIELD_FIXED, &stats);
+	test_assert(stats.hits == TEST_MESSAGES_COUNT);
+
+	/* but it writes them after enough lookups */
+	lookup_rounds = MAIL_CACHE_FIELD_STATS_WRITE_COUNT /
+		(TEST_MESSAGES_COUNT * TEST_FIELD_COUNT);
+	test_lookup_all(cache_view, fields, lookup_rounds);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, seq, fields[TEST_FIELD_FIXED].idx,
+		       &value, sizeof(value));
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	test_assert(!cache->field_header_write_pending);
+	test_read_file_stats(TEST_FIELD_FIXED, &stats);
+	test_assert(stats.hits == TEST_MESSAGES_COUNT * (2 + lookup_rounds));
+
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+	test_cleanup();
+	test_end();
+}
+
+static void test_mail_cache_field_stats_old_header(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_cache_field_stats stats;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache *cache;
+	uint32_t offset, old_size;
+	buffer_t *buf;
+	const char *path;
+	int fd;
+
+	test_begin("mail cache field header without stats");
+	test_fill();
+
+	/* make the field header look like it was written by an older
+	   version */
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	(void)test_cache_add(cache_view, view, fields);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	offset = cache->last_field_header_offset;
+	old_size = cache->field_stats_offset;
+	test_assert(old_size != 0);
+	test_index_close(&index);
+
+	path = t_strconcat(index_dir, "/dovecot.index"MAIL_CACHE_FILE_SUFFIX,
+			   NULL);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pwrite(fd, &old_size, sizeof(old_size), offset +
+		   offsetof(struct mail_cache_header_fields, size)) !=
+	    sizeof(old_size))
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	/* the fields can still be used, but there are no statistics */
+	index = test_index_open(fields);
+	cache = mail_index_get_cache(index);
+	test_assert(!MAIL_CACHE_IS_UNUSABLE(cache));
+	test_assert(cache->field_stats_offset == 0);
+	test_assert(cache->field_stats_since == 0);
+	mail_cache_decision_get_stats(cache, fields[TEST_FIELD_FIXED].idx,
+				      &stats);
+	test_assert(stats.hits == 0 && stats.misses == 0 && stats.bytes == 0);
+
+	/* updating the header doesn't write the statistics over the
+	   following data */
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(cache, view);
+	test_lookup_all(cache_view, fields, 1);
+	test_assert(mail_cache_lock(cache) > 0);
+	test_assert(mail_cache_header_fields_update(cache) == 0);
+	test_assert(mail_cache_unlock(cache) == 0);
+	buf = buffer_create_dynamic(default_pool, 1024);
+	test_assert(test_read_field_header(buf, offset)->size == old_size);
+	test_assert(cache->field_stats_offset == 0);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+
+	/* compression writes a header with the statistics */
+	cache->need_compress_file_seq = cache->hdr->file_seq;
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	test_assert(cache->field_stats_offset != 0);
+	test_assert(test_read_field_header(buf,
+		cache->last_field_header_offset)->size ==
+		cache->field_stats_offset +
+		MAIL_CACHE_FIELD_STATS_SIZE(TEST_FIELD_COUNT));
+	buffer_free(&buf);
+	test_index_close(&index);
+
+	test_cleanup();
+	test_end();
+}
+
+static void
+test_decision_set(struct mail_cache *cache, unsigned int field_idx,
+		  enum mail_cache_decision_type dec,
+		  uint32_t hits, uint32_t misses, uint32_t bytes)
+{
+	struct mail_cache_field_private *priv = &cache->fields[field_idx];
+
+	priv->field.decision = dec;
+	priv->prefetch = FALSE;
+	memset(&priv->new_stats, 0, sizeof(priv->new_stats));
+	priv->file_stats.hits = hits;
+	priv->file_stats.misses = misses;
+	priv->file_stats.bytes = bytes;
+}
+
+static void test_mail_cache_decisions_compress(void)
+{
+	static struct mail_cache_field test_fields[] = {
+		{ .name = "cheap", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+		  .field_size = sizeof(uint32_t) },
+		{ .name = "cheap-found", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+		  .field_size = sizeof(uint32_t) },
+		{ .name = "large-fixed", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+		  .field_size = MAIL_CACHE_FIELD_CHEAP_SIZE + 1 },
+		{ .name = "unused", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX },
+		{ .name = "rare", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX },
+		{ .name = "rare-temp", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX },
+		{ .name = "popular", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX },
+		{ .name = "small", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX },
+		{ .name = "forced", .type = MAIL_CACHE_FIELD_STRING,
+		  .field_size = UINT_MAX }
+	};
+	enum {
+		CHEAP, CHEAP_FOUND, LARGE_FIXED, UNUSED, RARE, RARE_TEMP,
+		POPULAR, SMALL, FORCED
+	};
+	const uint32_t expensive = MAIL_CACHE_FIELD_EXPENSIVE_BYTES;
+	const uint32_t rare_hits =
+		expensive / MAIL_CACHE_FIELD_MAX_BYTES_PER_HIT - 1;
+	struct ioloop *ioloop;
+	struct mail_index *index;
+	struct mail_cache *cache;
+	struct mail_cache_field_private *f;
+
+	test_begin("mail cache decisions on compression");
+	ioloop = io_loop_create();
+	index = mail_index_alloc(NULL, "test.dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+	cache = mail_index_get_cache(index);
+	mail_cache_register_fields(cache, test_fields,
+				   N_ELEMENTS(test_fields));
+	f = cache->fields;
+
+	/* no statistics collected yet */
+	cache->field_stats_since = 0;
+	test_decision_set(cache, test_fields[UNUSED].idx,
+			  MAIL_CACHE_DECISION_YES, 0, 0, expensive);
+	test_assert(!mail_cache_decisions_compress(cache));
+	test_assert(f[test_fields[UNUSED].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+
+	/* with the statistics collected for a while */
+	cache->field_stats_since = ioloop_time -
+		MAIL_CACHE_FIELD_STATS_MIN_SECS;
+	test_decision_set(cache, test_fields[CHEAP].idx,
+			  MAIL_CACHE_DECISION_TEMP, 10, 20, 40);
+	test_decision_set(cache, test_fields[CHEAP_FOUND].idx,
+			  MAIL_CACHE_DECISION_TEMP, 20, 10, 40);
+	test_decision_set(cache, test_fields[LARGE_FIXED].idx,
+			  MAIL_CACHE_DECISION_TEMP, 10, 20, 40);
+	test_decision_set(cache, test_fields[UNUSED].idx,
+			  MAIL_CACHE_DECISION_YES, 0, 0, expensive);
+	test_decision_set(cache, test_fields[RARE].idx,
+			  MAIL_CACHE_DECISION_YES, rare_hits, 0, expensive);
+	test_decision_set(cache, test_fields[RARE_TEMP].idx,
+			  MAIL_CACHE_DECISION_TEMP, rare_hits, 0, expensive);
+	test_decision_set(cache, test_fields[POPULAR].idx,
+			  MAIL_CACHE_DECISION_YES, rare_hits + 1, 0, expensive);
+	test_decision_set(cache, test_fields[SMALL].idx,
+			  MAIL_CACHE_DECISION_YES, 0, 0, expensive - 1);
+	test_decision_set(cache, test_fields[FORCED].idx,
+			  MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED,
+			  0, 0, expensive);
+	test_assert(mail_cache_decisions_compress(cache));
+
+	/* cheap fields missed more often than found are prefetched */
+	test_assert(f[test_fields[CHEAP].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+	test_assert(f[test_fields[CHEAP].idx].prefetch);
+	test_assert(f[test_fields[CHEAP_FOUND].idx].field.decision ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(!f[test_fields[CHEAP_FOUND].idx].prefetch);
+	test_assert(f[test_fields[LARGE_FIXED].idx].field.decision ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(!f[test_fields[LARGE_FIXED].idx].prefetch);
+	/* expensive fields nobody looked up are dropped */
+	test_assert(f[test_fields[UNUSED].idx].field.decision ==
+		    MAIL_CACHE_DECISION_NO);
+	/* expensive fields with few lookups are kept only for new mails */
+	test_assert(f[test_fields[RARE].idx].field.decision ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(f[test_fields[RARE_TEMP].idx].field.decision ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(f[test_fields[POPULAR].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+	test_assert(f[test_fields[SMALL].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+	test_assert(f[test_fields[FORCED].idx].field.decision ==
+		    (MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED));
+
+	/* the unwritten lookups are counted too, but only the prefetching
+	   happens before the statistics are old enough */
+	cache->field_stats_since = ioloop_time - 60;
+	test_decision_set(cache, test_fields[CHEAP].idx,
+			  MAIL_CACHE_DECISION_TEMP, 10, 5, 40);
+	f[test_fields[CHEAP].idx].new_stats.misses = 10;
+	test_decision_set(cache, test_fields[UNUSED].idx,
+			  MAIL_CACHE_DECISION_YES, 0, 0, expensive);
+	test_assert(!mail_cache_decisions_compress(cache));
+	test_assert(f[test_fields[CHEAP].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+	test_assert(f[test_fields[CHEAP].idx].prefetch);
+	test_assert(f[test_fields[UNUSED].idx].field.decision ==
+		    MAIL_CACHE_DECISION_YES);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_field_stats_layout,
+		test_mail_cache_field_stats_write_count,
+		test_mail_cache_field_stats_old_header,
+		test_mail_cache_decisions_compress,
+		NULL
+	};
+	return test_run(test_functions);
+}
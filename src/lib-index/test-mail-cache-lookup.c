@@ -0,0 +1,367 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-cache-private.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_MESSAGES_COUNT 60
+#define TEST_BITMASK_SIZE 4
+
+enum test_field {
+	TEST_FIELD_FIXED,
+	TEST_FIELD_STRING,
+	TEST_FIELD_VARIABLE,
+	TEST_FIELD_BITMASK,
+
+	TEST_FIELD_COUNT
+};
+
+static const struct mail_cache_field test_cache_fields[TEST_FIELD_COUNT] = {
+	{ .name = "fixed",
+	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t),
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "string",
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "variable",
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .field_size = UINT_MAX,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+	{ .name = "bitmask",
+	  .type = MAIL_CACHE_FIELD_BITMASK,
+	  .field_size = TEST_BITMASK_SIZE,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED }
+};
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+
+static struct mail_index *
+test_index_open(struct mail_cache_field fields[TEST_FIELD_COUNT])
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+
+	memcpy(fields, test_cache_fields, sizeof(test_cache_fields));
+	mail_cache_register_fields(mail_index_get_cache(index), fields,
+				   TEST_FIELD_COUNT);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+/* Add the fields that the given pass caches for uid. Each pass is a
+   separate transaction, so the messages get several records. */
+static void
+test_cache_add_uid(struct mail_cache_transaction_ctx *cache_trans,
+		   const struct mail_cache_field fields[TEST_FIELD_COUNT],
+		   uint32_t seq, uint32_t uid, unsigned int pass)
+{
+	uint8_t bitmask[TEST_BITMASK_SIZE];
+	uint32_t value;
+	const char *str;
+
+	memset(bitmask, 0, sizeof(bitmask));
+	if (pass == 0) {
+		if (uid % 2 == 0) {
+			value = uid * 3;
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_FIXED].idx,
+				       &value, sizeof(value));
+		}
+		if (uid % 3 == 0) {
+			str = t_strdup_printf("string %u", uid);
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_STRING].idx,
+				       str, strlen(str) + 1);
+		}
+		bitmask[0] = 1 << (uid % 8);
+		mail_cache_add(cache_trans, seq, fields[TEST_FIELD_BITMASK].idx,
+			       bitmask, sizeof(bitmask));
+	} else {
+		if (uid % 7 == 0 && uid % 2 != 0) {
+			value = uid * 3;
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_FIXED].idx,
+				       &value, sizeof(value));
+		}
+		if (uid % 5 == 0) {
+			str = t_strdup_printf("variable %u", uid);
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_VARIABLE].idx,
+				       str, strlen(str));
+		}
+		if (uid % 2 == 0) {
+			/* merged with the bits added by the first pass */
+			bitmask[1] = 1 << (uid % 5);
+			bitmask[TEST_BITMASK_SIZE-1] = 0x80;
+			mail_cache_add(cache_trans, seq,
+				       fields[TEST_FIELD_BITMASK].idx,
+				       bitmask, sizeof(bitmask));
+		}
+	}
+}
+
+static void
+test_cache_add(struct mail_index *index,
+	       const struct mail_cache_field fields[TEST_FIELD_COUNT],
+	       unsigned int pass)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, uid;
+
+	if (mail_index_refresh(index) < 0)
+		i_fatal("mail_index_refresh() failed");
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		test_cache_add_uid(cache_trans, fields, seq, uid, pass);
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_fill(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_cache *cache;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	uint32_t uid_validity = 1234, seq;
+
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-cache-lookup.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++)
+		mail_index_append(trans, seq, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	/* the first pass's fixed size fields are moved to columns */
+	test_cache_add(index, fields, 0);
+	cache = mail_index_get_cache(index);
+	if (mail_cache_open_and_verify(cache) < 0)
+		i_fatal("mail_cache_open_and_verify() failed");
+	mail_cache_set_columns(cache, TRUE);
+	cache->need_compress_file_seq = cache->hdr->file_seq;
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	test_assert(MAIL_CACHE_HAS_COLUMNS(cache->hdr));
+
+	test_cache_add(index, fields, 1);
+	test_index_close(&index);
+}
+
+static void test_cleanup(void)
+{
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+}
+
+/* Returns TRUE if the field's lookups return the same in both views */
+static bool
+test_lookup_equal(struct mail_cache_view *cache_view,
+		  struct mail_cache_view *cmp_cache_view,
+		  uint32_t seq, unsigned int field_idx)
+{
+	string_t *value, *cmp_value;
+	int ret;
+
+	value = t_str_new(64);
+	cmp_value = t_str_new(64);
+	ret = mail_cache_lookup_field(cache_view, value, seq, field_idx);
+	if (ret < 0 ||
+	    ret != mail_cache_lookup_field(cmp_cache_view, cmp_value,
+					   seq, field_idx))
+		return FALSE;
+	if (!buffer_cmp(value, cmp_value))
+		return FALSE;
+	return mail_cache_field_exists(cache_view, seq, field_idx) == ret &&
+		mail_cache_field_exists(cmp_cache_view, seq, field_idx) == ret;
+}
+
+static void test_mail_cache_lookup_batch(void)
+{
+	static const struct {
+		uint32_t seq1, seq2;
+		unsigned int fields[TEST_FIELD_COUNT];
+		unsigned int fields_count;
+	} tests[] = {
+		{ 1, TEST_MESSAGES_COUNT,
+		  { TEST_FIELD_FIXED, TEST_FIELD_STRING,
+		    TEST_FIELD_VARIABLE, TEST_FIELD_BITMASK }, 4 },
+		{ 10, 30, { TEST_FIELD_BITMASK }, 1 },
+		{ 5, 5, { TEST_FIELD_STRING, TEST_FIELD_FIXED }, 2 },
+		{ 2, 50, { TEST_FIELD_FIXED, TEST_FIELD_FIXED }, 2 },
+		{ 1, TEST_MESSAGES_COUNT, { TEST_FIELD_VARIABLE }, 1 }
+	};
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view, *cmp_cache_view;
+	unsigned int field_idxs[TEST_FIELD_COUNT];
+	unsigned int i, j;
+	uint32_t seq;
+
+	test_begin("mail cache lookup batch");
+	test_fill();
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	cmp_cache_view = mail_cache_view_open(mail_index_get_cache(index),
+					      view);
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		for (j = 0; j < tests[i].fields_count; j++)
+			field_idxs[j] = fields[tests[i].fields[j]].idx;
+		test_assert_idx(mail_cache_lookup_batch(cache_view,
+				tests[i].seq1, tests[i].seq2, field_idxs,
+				tests[i].fields_count) == 0, i);
+		test_assert_idx(cache_view->batch != NULL, i);
+
+		/* the fields and messages outside the batch are looked up
+		   normally */
+		for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) T_BEGIN {
+			for (j = 0; j < TEST_FIELD_COUNT; j++) {
+				test_assert_idx(test_lookup_equal(cache_view,
+					cmp_cache_view, seq, fields[j].idx),
+					i * 1000 + seq);
+			}
+		} T_END;
+	}
+	mail_cache_lookup_batch_free(cache_view);
+	test_assert(cache_view->batch == NULL);
+
+	mail_cache_view_close(&cache_view);
+	mail_cache_view_close(&cmp_cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+	test_cleanup();
+	test_end();
+}
+
+static void test_mail_cache_lookup_batch_add(void)
+{
+	struct mail_cache_field fields[TEST_FIELD_COUNT];
+	struct mail_index *index;
+	struct mail_index_view *view, *cmp_view;
+	struct mail_cache_view *cache_view, *cmp_cache_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_transaction_ctx *cache_trans;
+	unsigned int field_idxs[TEST_FIELD_COUNT];
+	uint8_t bitmask[TEST_BITMASK_SIZE];
+	string_t *value;
+	unsigned int i;
+	uint32_t seq;
+
+	test_begin("mail cache lookup batch with added fields");
+	test_fill();
+
+	index = test_index_open(fields);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	for (i = 0; i < TEST_FIELD_COUNT; i++)
+		field_idxs[i] = fields[i].idx;
+	test_assert(mail_cache_lookup_batch(cache_view, 1, TEST_MESSAGES_COUNT,
+					    field_idxs, TEST_FIELD_COUNT) == 0);
+
+	/* UID 1 has only the first bitmask bit and no string. the batch
+	   must not hide the values added after it was looked up. */
+	value = t_str_new(64);
+	seq = 1;
+	test_assert(mail_cache_lookup_field(cache_view, value, seq,
+					    fields[TEST_FIELD_STRING].idx) == 0);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, seq, fields[TEST_FIELD_STRING].idx,
+		       "added", 6);
+	memset(bitmask, 0, sizeof(bitmask));
+	bitmask[2] = 0x10;
+	mail_cache_add(cache_trans, seq, fields[TEST_FIELD_BITMASK].idx,
+		       bitmask, sizeof(bitmask));
+
+	test_assert(mail_cache_field_exists(cache_view, seq,
+					    fields[TEST_FIELD_STRING].idx) == 1);
+	str_truncate(value, 0);
+	test_assert(mail_cache_lookup_field(cache_view, value, seq,
+					    fields[TEST_FIELD_STRING].idx) == 1);
+	test_assert(strcmp(str_c(value), "added") == 0);
+	str_truncate(value, 0);
+	test_assert(mail_cache_lookup_field(cache_view, value, seq,
+					    fields[TEST_FIELD_BITMASK].idx) == 1);
+	test_assert(value->used == TEST_BITMASK_SIZE &&
+		    ((const uint8_t *)value->data)[0] == (1 << 1) &&
+		    ((const uint8_t *)value->data)[2] == 0x10);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+
+	/* after the commit the batch view still agrees with a view that
+	   never had a batch */
+	cmp_view = mail_index_view_open(index);
+	cmp_cache_view = mail_cache_view_open(mail_index_get_cache(index),
+					      cmp_view);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) T_BEGIN {
+		for (i = 0; i < TEST_FIELD_COUNT; i++) {
+			test_assert_idx(test_lookup_equal(cache_view,
+				cmp_cache_view, seq, fields[i].idx), seq);
+		}
+	} T_END;
+
+	mail_cache_view_close(&cache_view);
+	mail_cache_view_close(&cmp_cache_view);
+	mail_index_view_close(&view);
+	mail_index_view_close(&cmp_view);
+	test_index_close(&index);
+	test_cleanup();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_lookup_batch,
+		test_mail_cache_lookup_batch_add,
+		NULL
+	};
+	return test_run(test_functions);
+}
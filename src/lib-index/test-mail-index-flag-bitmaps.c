@@ -0,0 +1,181 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-flag-bitmaps.h"
+
+#define TEST_MESSAGES_COUNT 300
+
+static const char *test_keyword_names[] = { "$Junk", NULL };
+
+static void test_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_keywords *keywords;
+	uint32_t seq, uid;
+
+	keywords = mail_index_keywords_create(index, test_keyword_names);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	uid = mail_index_get_header(view)->next_uid;
+	for (; count > 0; count--, uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (uid % 2 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		if (uid % 3 == 0 || (uid >= 100 && uid <= 150)) {
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_FLAGGED);
+		}
+		if (uid % 5 == 0) {
+			mail_index_update_keywords(trans, seq, MODIFY_ADD,
+						   keywords);
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	mail_index_keywords_unref(&keywords);
+}
+
+static struct mail_index *test_index_create(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t uid_validity = 1234;
+
+	index = mail_index_alloc(NULL, "test.dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	test_append(index, TEST_MESSAGES_COUNT);
+	return index;
+}
+
+static bool
+test_lookup_matches(struct mail_index *index, enum mail_flags flags,
+		    bool keyword, bool match_not)
+{
+	struct mail_index_map *map = index->map;
+	struct mail_keywords *keywords = NULL;
+	ARRAY_TYPE(seq_range) seqs, expected_seqs;
+	ARRAY_TYPE(keyword_indexes) kw_indexes;
+	const struct mail_index_record *rec;
+	uint32_t seq;
+	bool match, ret;
+
+	if (keyword)
+		keywords = mail_index_keywords_create(index, test_keyword_names);
+	t_array_init(&seqs, 8);
+	t_array_init(&expected_seqs, 8);
+	t_array_init(&kw_indexes, 4);
+	mail_index_map_lookup_flags_seqs(map, flags, keywords, match_not, &seqs);
+	for (seq = 1; seq <= map->hdr.messages_count; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		match = (rec->flags & flags) == flags;
+		if (keyword) {
+			array_clear(&kw_indexes);
+			mail_index_map_lookup_keywords(map, seq, &kw_indexes);
+			if (array_count(&kw_indexes) != 1 ||
+			    *array_idx(&kw_indexes, 0) != keywords->idx[0])
+				match = FALSE;
+		}
+		if (match != match_not)
+			seq_range_array_add(&expected_seqs, seq);
+	}
+	ret = array_cmp(&seqs, &expected_seqs);
+	if (keywords != NULL)
+		mail_index_keywords_unref(&keywords);
+	return ret;
+}
+
+static bool test_lookups_match(struct mail_index *index)
+{
+	return test_lookup_matches(index, MAIL_SEEN, FALSE, FALSE) &&
+		test_lookup_matches(index, MAIL_SEEN, FALSE, TRUE) &&
+		test_lookup_matches(index, MAIL_FLAGGED, FALSE, FALSE) &&
+		test_lookup_matches(index, MAIL_SEEN | MAIL_FLAGGED,
+				    FALSE, FALSE) &&
+		test_lookup_matches(index, 0, TRUE, FALSE) &&
+		test_lookup_matches(index, MAIL_FLAGGED, TRUE, TRUE);
+}
+
+static void test_expunge(struct mail_index *index,
+			 const uint32_t *seqs, unsigned int count)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	unsigned int i;
+	uint32_t seq;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	for (i = 0; i < count; i += 2) {
+		for (seq = seqs[i]; seq <= seqs[i+1]; seq++)
+			mail_index_expunge(trans, seq);
+	}
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static void test_mail_index_flag_bitmaps_expunge(void)
+{
+	/* seq1, seq2 pairs. these include the first and the last message
+	   and a range spanning the \Flagged run. */
+	static const uint32_t expunges[] = {
+		1, 1, 10, 20, 99, 160, 222, 222, 299, 300
+	};
+	static const uint32_t expunge_all[] = { 1, 273 };
+	struct ioloop *ioloop;
+	struct mail_index *index;
+
+	test_begin("mail index flag bitmaps expunge");
+	ioloop = io_loop_create();
+	index = test_index_create();
+
+	/* build the bitmaps */
+	test_assert(test_lookups_match(index));
+
+	test_expunge(index, expunges, N_ELEMENTS(expunges));
+	test_assert(index->map->hdr.messages_count ==
+		    TEST_MESSAGES_COUNT - 1 - 11 - 62 - 1 - 2);
+	test_assert(test_lookups_match(index));
+
+	/* appended messages are still added to the shifted bitmaps */
+	test_append(index, 50);
+	test_assert(test_lookups_match(index));
+
+	/* expunging everything */
+	test_expunge(index, expunge_all, N_ELEMENTS(expunge_all));
+	test_assert(index->map->hdr.messages_count == 0);
+	test_append(index, 10);
+	test_assert(test_lookups_match(index));
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_flag_bitmaps_expunge,
+		NULL
+	};
+	return test_run(test_functions);
+}
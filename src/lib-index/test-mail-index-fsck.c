@@ -0,0 +1,119 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-flag-bitmaps.h"
+
+#define TEST_MESSAGES_COUNT 20
+
+static unsigned int test_log_count;
+
+static void ATTR_FORMAT(2, 0)
+test_log_handler(const struct failure_context *ctx ATTR_UNUSED,
+		 const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_log_count++;
+}
+
+static struct mail_index *test_index_create(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t uid_validity = 1234, seq;
+
+	index = mail_index_alloc(NULL, "test.dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= TEST_MESSAGES_COUNT; seq++) {
+		mail_index_append(trans, seq, &seq);
+		/* \Seen for even UIDs, \Flagged for every third */
+		if (seq % 2 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		if (seq % 3 == 0) {
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_FLAGGED);
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	return index;
+}
+
+static bool
+test_flags_seqs_match(struct mail_index_map *map, enum mail_flags flag)
+{
+	ARRAY_TYPE(seq_range) seqs, expected_seqs;
+	const struct mail_index_record *rec;
+	uint32_t seq;
+
+	t_array_init(&seqs, 8);
+	t_array_init(&expected_seqs, 8);
+	mail_index_map_lookup_flags_seqs(map, flag, NULL, FALSE, &seqs);
+	for (seq = 1; seq <= map->rec_map->records_count; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		if ((rec->flags & flag) != 0)
+			seq_range_array_add(&expected_seqs, seq);
+	}
+	return array_cmp(&seqs, &expected_seqs);
+}
+
+static void test_mail_index_fsck_drop_records(void)
+{
+	failure_callback_t *fatal_callback, *error_callback;
+	failure_callback_t *info_callback, *debug_callback;
+	struct ioloop *ioloop;
+	struct mail_index *index;
+	struct mail_index_record *rec;
+
+	test_begin("mail index fsck dropping records");
+	ioloop = io_loop_create();
+	index = test_index_create();
+
+	/* build the bitmaps for all the records */
+	test_assert(test_flags_seqs_match(index->map, MAIL_SEEN));
+	test_assert(test_flags_seqs_match(index->map, MAIL_FLAGGED));
+
+	/* duplicate and zero UIDs in the middle get dropped by fsck */
+	rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(index->map, 5);
+	rec->uid = 4;
+	rec = MAIL_INDEX_REC_AT_SEQ_MODIFIABLE(index->map, 12);
+	rec->uid = 0;
+
+	i_get_failure_handlers(&fatal_callback, &error_callback,
+			       &info_callback, &debug_callback);
+	i_set_error_handler(test_log_handler);
+	test_log_count = 0;
+	test_assert(mail_index_fsck(index) == 0);
+	i_set_error_handler(error_callback);
+	test_assert(test_log_count > 0);
+
+	test_assert(index->map->rec_map->records_count ==
+		    TEST_MESSAGES_COUNT - 2);
+	test_assert(test_flags_seqs_match(index->map, MAIL_SEEN));
+	test_assert(test_flags_seqs_match(index->map, MAIL_FLAGGED));
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_fsck_drop_records,
+		NULL
+	};
+	return test_run(test_functions);
+}
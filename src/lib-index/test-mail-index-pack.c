@@ -0,0 +1,482 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "ostream.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-modseq.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* flags + 4 bytes of other extensions before the modseq */
+#define TEST_MODSEQ_OFFSET (sizeof(struct mail_index_record) + 4)
+#define TEST_RECORD_SIZE (TEST_MODSEQ_OFFSET + sizeof(uint64_t) + 4)
+/* large enough header that it doesn't fit into the initial read buffer */
+#define TEST_BIG_HDR_SIZE (IO_BLOCK_SIZE * 3 + 123)
+#define TEST_FILE_MESSAGES_COUNT 500
+
+static struct ioloop *ioloop;
+static struct mail_index *mem_index;
+static char index_dir[128];
+static unsigned int test_error_count;
+
+static void ATTR_FORMAT(2, 0)
+test_error_handler(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_error_count++;
+}
+
+static void test_records_init(void)
+{
+	ioloop = io_loop_create();
+	mem_index = mail_index_alloc(NULL, "test.dovecot.index");
+	if (mail_index_open_or_create(mem_index,
+				      MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+}
+
+static void test_records_deinit(void)
+{
+	mail_index_close(mem_index);
+	mail_index_free(&mem_index);
+	io_loop_destroy(&ioloop);
+}
+
+static struct mail_index_map *
+test_map_create(const uint32_t *uids, const uint64_t *modseqs,
+		unsigned int count)
+{
+	struct mail_index_map *map;
+	struct mail_index_ext_header ext_hdr;
+	struct mail_index_record *rec;
+	unsigned int i, j;
+
+	map = mail_index_map_alloc(mem_index);
+	map->hdr.record_size = modseqs == NULL ?
+		sizeof(struct mail_index_record) + 4 : TEST_RECORD_SIZE;
+	if (modseqs != NULL) {
+		memset(&ext_hdr, 0, sizeof(ext_hdr));
+		ext_hdr.record_offset = TEST_MODSEQ_OFFSET;
+		ext_hdr.record_size = sizeof(uint64_t);
+		ext_hdr.record_align = sizeof(uint64_t);
+		(void)mail_index_map_register_ext(map,
+			MAIL_INDEX_MODSEQ_EXT_NAME, (uint32_t)-1, &ext_hdr);
+	}
+
+	mail_index_record_map_alloc_pages(map->rec_map, count,
+					  map->hdr.record_size);
+	map->rec_map->records_count = count;
+	for (i = 0; i < count; i++) {
+		rec = mail_index_record_pages_idx(&map->rec_map->pages, i,
+						  map->hdr.record_size);
+		/* fill the whole record with something that identifies
+		   the record */
+		for (j = 0; j < map->hdr.record_size; j++)
+			((uint8_t *)rec)[j] = (i * 7 + j) & 0xff;
+		rec->uid = uids[i];
+		if (modseqs != NULL) {
+			memcpy(PTR_OFFSET(rec, TEST_MODSEQ_OFFSET),
+			       &modseqs[i], sizeof(modseqs[i]));
+		}
+	}
+	return map;
+}
+
+static buffer_t *test_pack(struct mail_index_map *map)
+{
+	struct ostream *output;
+	buffer_t *buf;
+
+	buf = buffer_create_dynamic(default_pool, 1024);
+	output = o_stream_create_buffer(buf);
+	mail_index_pack_records(map, output);
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	return buf;
+}
+
+static bool
+test_unpack_equals(struct mail_index_map *map, const buffer_t *buf)
+{
+	struct mail_index_map *map2;
+	const char *error;
+	unsigned int i, unpacked_count, count = map->rec_map->records_count;
+	bool ret = TRUE;
+
+	map2 = mail_index_map_alloc(mem_index);
+	if (mail_index_unpack_records(map2->rec_map, count,
+				      map->hdr.record_size,
+				      buf->data, buf->used,
+				      &unpacked_count, &error) < 0 ||
+	    unpacked_count != count)
+		ret = FALSE;
+	for (i = 0; i < count && ret; i++) {
+		if (memcmp(MAIL_INDEX_MAP_IDX(map, i),
+			   mail_index_record_pages_idx(&map2->rec_map->pages,
+						       i, map->hdr.record_size),
+			   map->hdr.record_size) != 0)
+			ret = FALSE;
+	}
+	mail_index_unmap(&map2);
+	return ret;
+}
+
+static void test_mail_index_pack_round_trip(void)
+{
+	static const uint32_t uids[] = {
+		1, 2, 3, 10, 9, 9, 0, 1000000, 5, (uint32_t)-1, 1, 2
+	};
+	static const uint64_t modseqs[] = {
+		1, 100, 50, 50, 0, (uint64_t)-1, 1, (uint64_t)-2, 123456789,
+		(1ULL << 63), (1ULL << 63) - 1, 2
+	};
+	struct mail_index_map *map;
+	buffer_t *buf;
+
+	test_begin("mail index pack round trip");
+	test_records_init();
+
+	/* UIDs going backwards and modseqs decreasing */
+	map = test_map_create(uids, modseqs, N_ELEMENTS(uids));
+	buf = test_pack(map);
+	test_assert(test_unpack_equals(map, buf));
+	buffer_free(&buf);
+	mail_index_unmap(&map);
+
+	/* without the modseq extension */
+	map = test_map_create(uids, NULL, N_ELEMENTS(uids));
+	buf = test_pack(map);
+	test_assert(test_unpack_equals(map, buf));
+	buffer_free(&buf);
+	mail_index_unmap(&map);
+
+	/* no records */
+	map = test_map_create(uids, modseqs, 0);
+	buf = test_pack(map);
+	test_assert(test_unpack_equals(map, buf));
+	buffer_free(&buf);
+	mail_index_unmap(&map);
+
+	test_records_deinit();
+	test_end();
+}
+
+static void test_mail_index_pack_many(void)
+{
+	uint32_t *uids;
+	uint64_t *modseqs;
+	unsigned int i, count = 10000;
+	struct mail_index_map *map;
+	buffer_t *buf;
+
+	test_begin("mail index pack many records");
+	test_records_init();
+
+	/* more than IO_BLOCK_SIZE of packed records and more than one
+	   record page */
+	uids = i_new(uint32_t, count);
+	modseqs = i_new(uint64_t, count);
+	for (i = 0; i < count; i++) {
+		uids[i] = (i == 0 ? 0 : uids[i-1]) + 1 + rand() % 100;
+		modseqs[i] = rand() % 3 == 0 ? (uint64_t)rand() : (uint64_t)i * 2;
+	}
+	map = test_map_create(uids, modseqs, count);
+	buf = test_pack(map);
+	test_assert(buf->used > IO_BLOCK_SIZE);
+	test_assert(test_unpack_equals(map, buf));
+	buffer_free(&buf);
+	mail_index_unmap(&map);
+	i_free(uids);
+	i_free(modseqs);
+
+	test_records_deinit();
+	test_end();
+}
+
+static void test_mail_index_pack_corrupted(void)
+{
+	static const uint32_t uids[] = { 1, 5, 3, 1000, 1001 };
+	static const uint64_t modseqs[] = { 10, 5, 100000, 1, 1 };
+	struct mail_index_map *map, *map2;
+	buffer_t *buf, *buf2;
+	const char *error;
+	unsigned char *data;
+	unsigned int i, unpacked_count, count = N_ELEMENTS(uids);
+	size_t size;
+	bool success = TRUE;
+
+	test_begin("mail index pack corrupted");
+	test_records_init();
+
+	map = test_map_create(uids, modseqs, count);
+	buf = test_pack(map);
+	map2 = mail_index_map_alloc(mem_index);
+
+	/* all truncations are detected, and the records before the
+	   truncation are still unpacked */
+	for (size = 0; size < buf->used; size++) {
+		if (mail_index_unpack_records(map2->rec_map, count,
+					      TEST_RECORD_SIZE, buf->data,
+					      size, &unpacked_count,
+					      &error) == 0 ||
+		    unpacked_count >= count)
+			success = FALSE;
+		for (i = 0; i < unpacked_count && success; i++) {
+			if (memcmp(MAIL_INDEX_MAP_IDX(map, i),
+				   mail_index_record_pages_idx(
+					&map2->rec_map->pages, i,
+					TEST_RECORD_SIZE),
+				   TEST_RECORD_SIZE) != 0)
+				success = FALSE;
+		}
+	}
+	test_assert(success);
+	test_assert(unpacked_count == count - 1);
+
+	/* messages_count is larger than the packed data */
+	test_assert(mail_index_unpack_records(map2->rec_map, count + 1,
+					      TEST_RECORD_SIZE, buf->data,
+					      buf->used, &unpacked_count,
+					      &error) < 0);
+	test_assert(unpacked_count == count);
+	test_assert(mail_index_unpack_records(map2->rec_map, (unsigned int)-1,
+					      TEST_RECORD_SIZE, buf->data,
+					      buf->used, &unpacked_count,
+					      &error) < 0);
+	test_assert(unpacked_count == count);
+	/* record_size doesn't match the modseq offset */
+	test_assert(mail_index_unpack_records(map2->rec_map, count,
+					      TEST_MODSEQ_OFFSET + 4,
+					      buf->data, buf->used,
+					      &unpacked_count, &error) < 0);
+	test_assert(mail_index_unpack_records(map2->rec_map, count, 4,
+					      buf->data, buf->used,
+					      &unpacked_count, &error) < 0);
+	/* UID difference that doesn't fit into 32 bits */
+	buf2 = buffer_create_dynamic(default_pool, 64);
+	buffer_append_c(buf2, 0);
+	buffer_append(buf2, "\xff\xff\xff\xff\x7f", 5);
+	buffer_append_zero(buf2, sizeof(struct mail_index_record) + 4);
+	test_assert(mail_index_unpack_records(map2->rec_map, 1,
+			sizeof(struct mail_index_record) + 4 + 4,
+			buf2->data, buf2->used, &unpacked_count, &error) < 0);
+	buffer_free(&buf2);
+
+	/* random corruption may produce garbage records, but it mustn't
+	   crash or read outside the data */
+	data = i_malloc(buf->used);
+	for (i = 0; i < 1000; i++) {
+		memcpy(data, buf->data, buf->used);
+		data[rand() % buf->used] = rand() & 0xff;
+		data[rand() % buf->used] = rand() & 0xff;
+		(void)mail_index_unpack_records(map2->rec_map, count,
+						TEST_RECORD_SIZE, data,
+						buf->used, &unpacked_count,
+						&error);
+	}
+	i_free(data);
+
+	mail_index_unmap(&map2);
+	buffer_free(&buf);
+	mail_index_unmap(&map);
+	test_records_deinit();
+	test_end();
+}
+
+static struct mail_index *
+test_file_index_open(enum mail_index_open_flags flags, uint32_t *ext_id_r)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	*ext_id_r = mail_index_ext_register(index, "big", TEST_BIG_HDR_SIZE,
+					    sizeof(uint32_t),
+					    sizeof(uint32_t));
+	if (mail_index_open_or_create(index, flags) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void test_file_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_file_fill(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_sync_ctx *sync_ctx;
+	unsigned char hdr_data[TEST_BIG_HDR_SIZE];
+	uint32_t ext_id, seq, uid, uid_validity = 1234;
+	unsigned int i;
+
+	index = test_file_index_open(MAIL_INDEX_OPEN_FLAG_CREATE |
+				     MAIL_INDEX_OPEN_FLAG_PACK_RECORDS,
+				     &ext_id);
+	mail_index_modseq_enable(index);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (i = 0; i < sizeof(hdr_data); i++)
+		hdr_data[i] = i % 251;
+	mail_index_update_header_ext(trans, ext_id, 0,
+				     hdr_data, sizeof(hdr_data));
+	for (uid = 1; uid <= TEST_FILE_MESSAGES_COUNT; uid++) {
+		mail_index_append(trans, uid * 3, &seq);
+		mail_index_update_ext(trans, seq, ext_id, &uid, NULL);
+		if (uid % 2 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_SEEN);
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	/* grow the modseqs of some of the earlier messages */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+					     MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	for (seq = 1; seq <= TEST_FILE_MESSAGES_COUNT; seq += 7)
+		mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_FLAGGED);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+
+	/* rewrite dovecot.index in the packed format */
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	mail_index_write(index, FALSE);
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	test_file_index_close(&index);
+}
+
+static bool test_file_index_verify(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	const unsigned char *hdr_data;
+	const void *data;
+	size_t i, size;
+	uint32_t ext_id, seq;
+	uint64_t base_modseq;
+	bool expunged, ret = TRUE;
+
+	index = test_file_index_open(0, &ext_id);
+	view = mail_index_view_open(index);
+	if (mail_index_view_get_messages_count(view) != TEST_FILE_MESSAGES_COUNT)
+		ret = FALSE;
+
+	mail_index_get_header_ext(view, ext_id, &data, &size);
+	hdr_data = data;
+	if (size != TEST_BIG_HDR_SIZE)
+		ret = FALSE;
+	for (i = 0; i < size && ret; i++) {
+		if (hdr_data[i] != i % 251)
+			ret = FALSE;
+	}
+
+	/* the flag changes were done after the appends */
+	base_modseq = mail_index_modseq_lookup(view, 2);
+	for (seq = 1; seq <= TEST_FILE_MESSAGES_COUNT && ret; seq++) {
+		rec = mail_index_lookup(view, seq);
+		if (rec->uid != seq * 3 ||
+		    ((rec->flags & MAIL_SEEN) != 0) != (seq % 2 == 0) ||
+		    ((rec->flags & MAIL_FLAGGED) != 0) != (seq % 7 == 1))
+			ret = FALSE;
+		mail_index_lookup_ext(view, seq, ext_id, &data, &expunged);
+		if (data == NULL || *(const uint32_t *)data != seq)
+			ret = FALSE;
+		if (seq % 7 == 1 ?
+		    mail_index_modseq_lookup(view, seq) <= base_modseq :
+		    mail_index_modseq_lookup(view, seq) != base_modseq)
+			ret = FALSE;
+	}
+	mail_index_view_close(&view);
+	test_file_index_close(&index);
+	return ret;
+}
+
+static bool test_file_is_packed(const char *path)
+{
+	struct mail_index_header hdr;
+	int fd;
+	bool ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	ret = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		hdr.major_version == MAIL_INDEX_PACKED_MAJOR_VERSION &&
+		hdr.header_size > IO_BLOCK_SIZE;
+	i_close_fd(&fd);
+	return ret;
+}
+
+static void test_mail_index_pack_file(void)
+{
+	failure_callback_t *fatal_callback, *error_callback;
+	failure_callback_t *info_callback, *debug_callback;
+	const char *path;
+	struct stat st;
+
+	test_begin("mail index pack file");
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-index-pack.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	path = t_strconcat(index_dir, "/dovecot.index", NULL);
+
+	/* a header larger than the initial read buffer */
+	test_file_fill();
+	test_assert(test_file_is_packed(path));
+	test_assert(test_file_index_verify());
+
+	/* truncated packed records are detected. the records before the
+	   truncation are kept and the rest are read from the transaction
+	   log. */
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	if (truncate(path, st.st_size - 10) < 0)
+		i_fatal("truncate(%s) failed: %m", path);
+	i_get_failure_handlers(&fatal_callback, &error_callback,
+			       &info_callback, &debug_callback);
+	i_set_error_handler(test_error_handler);
+	test_error_count = 0;
+	test_assert(test_file_index_verify());
+	i_set_error_handler(error_callback);
+	test_assert(test_error_count > 0);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_pack_round_trip,
+		test_mail_index_pack_many,
+		test_mail_index_pack_corrupted,
+		test_mail_index_pack_file,
+		NULL
+	};
+	return test_run(test_functions);
+}
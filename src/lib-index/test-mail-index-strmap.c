@@ -0,0 +1,323 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-strmap.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_STRMAP_SUFFIX ".test-strmap"
+#define TEST_MESSAGES_COUNT 100
+#define TEST_NEW_MESSAGES_COUNT 10
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+
+/* The keys of each message. ref_indexes don't need to be contiguous with
+   the generic format. */
+static const char *test_get_key(uint32_t uid, uint32_t ref_index)
+{
+	switch (ref_index) {
+	case 0:
+		return t_strdup_printf("id%u", uid % 30);
+	case 3:
+		return uid % 2 != 0 ? NULL : t_strdup_printf("list%u", uid % 7);
+	case 5:
+		return t_strdup_printf("unique%u", uid);
+	case 6:
+		/* many messages share the same empty key */
+		return uid % 4 != 0 ? NULL : "";
+	}
+	return NULL;
+}
+
+static bool
+test_key_cmp(const char *key, const struct mail_index_strmap_rec *rec,
+	     void *context ATTR_UNUSED)
+{
+	const char *rec_key = test_get_key(rec->uid, rec->ref_index);
+
+	return rec_key != NULL && strcmp(key, rec_key) == 0;
+}
+
+static int
+test_rec_cmp(const struct mail_index_strmap_rec *rec1,
+	     const struct mail_index_strmap_rec *rec2,
+	     void *context ATTR_UNUSED)
+{
+	const char *key1 = test_get_key(rec1->uid, rec1->ref_index);
+	const char *key2 = test_get_key(rec2->uid, rec2->ref_index);
+
+	return key1 != NULL && key2 != NULL && strcmp(key1, key2) == 0;
+}
+
+static void
+test_remap(const uint32_t *idx_map ATTR_UNUSED,
+	   unsigned int old_count ATTR_UNUSED,
+	   unsigned int new_count ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+}
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_header *hdr;
+	uint32_t uid_validity = 1234, seq;
+	unsigned int i;
+
+	view = mail_index_view_open(index);
+	hdr = mail_index_get_header(view);
+	trans = mail_index_transaction_begin(view, 0);
+	if (hdr->uid_validity == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(trans, hdr->next_uid + i, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+static void test_expunge(struct mail_index *index, unsigned int uid_mod)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid;
+
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (uid % uid_mod == 0)
+			mail_index_expunge(trans, seq);
+	}
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+/* Add the keys of all the messages that aren't in the strmap yet */
+static void test_strmap_update(struct mail_index *index)
+{
+	struct mail_index_strmap *strmap;
+	struct mail_index_strmap_view *strmap_view;
+	struct mail_index_strmap_view_sync *sync;
+	struct mail_index_view *view;
+	const ARRAY_TYPE(mail_index_strmap_rec) *recs;
+	const struct hash2_table *hash;
+	const char *key;
+	uint32_t seq, uid, last_uid, ref_index;
+
+	(void)mail_index_refresh(index);
+	view = mail_index_view_open(index);
+	strmap = mail_index_strmap_init_generic(index, TEST_STRMAP_SUFFIX);
+	strmap_view = mail_index_strmap_view_open(strmap, view, test_key_cmp,
+						  test_rec_cmp, test_remap,
+						  NULL, &recs, &hash);
+	sync = mail_index_strmap_view_sync_init(strmap_view, &last_uid);
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		if (uid <= last_uid)
+			continue;
+		for (ref_index = 0; ref_index < 8; ref_index++) {
+			key = test_get_key(uid, ref_index);
+			if (key != NULL) {
+				mail_index_strmap_view_sync_add(sync, uid,
+								ref_index, key);
+			}
+		}
+	}
+	mail_index_strmap_view_sync_commit(&sync);
+	mail_index_strmap_view_close(&strmap_view);
+	mail_index_strmap_deinit(&strmap);
+	mail_index_view_close(&view);
+}
+
+static int
+test_rec_sort_cmp(const struct mail_index_strmap_rec *rec1,
+		  const struct mail_index_strmap_rec *rec2)
+{
+	if (rec1->uid != rec2->uid)
+		return rec1->uid < rec2->uid ? -1 : 1;
+	if (rec1->ref_index != rec2->ref_index)
+		return rec1->ref_index < rec2->ref_index ? -1 : 1;
+	return 0;
+}
+
+static bool
+test_strmap_lookup_key(struct mail_index_view *view,
+		       struct mail_index_strmap_view *strmap_view,
+		       const char *key)
+{
+	ARRAY_TYPE(mail_index_strmap_rec) recs, expected_recs;
+	struct mail_index_strmap_rec rec;
+	const struct mail_index_strmap_rec *found, *expected;
+	const char *rec_key;
+	uint32_t seq, uid, ref_index;
+	unsigned int i, count, expected_count;
+
+	t_array_init(&recs, 32);
+	mail_index_strmap_view_lookup(strmap_view, key, &recs);
+	array_sort(&recs, test_rec_sort_cmp);
+
+	t_array_init(&expected_recs, 32);
+	memset(&rec, 0, sizeof(rec));
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		for (ref_index = 0; ref_index < 8; ref_index++) {
+			rec_key = test_get_key(uid, ref_index);
+			if (rec_key != NULL && strcmp(rec_key, key) == 0) {
+				rec.uid = uid;
+				rec.ref_index = ref_index;
+				array_append(&expected_recs, &rec, 1);
+			}
+		}
+	}
+
+	found = array_get(&recs, &count);
+	expected = array_get(&expected_recs, &expected_count);
+	if (count != expected_count)
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (found[i].uid != expected[i].uid ||
+		    found[i].ref_index != expected[i].ref_index)
+			return FALSE;
+		/* all the records with the same key share the string index */
+		if (found[i].str_idx != found[0].str_idx)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool test_strmap_verify(struct mail_index *index)
+{
+	static const char *const keys[] = {
+		"id0", "id1", "id29", "list0", "list6", "unique1", "unique60",
+		"unique100", "unique105", "", "id30", "list7", "nonexistent"
+	};
+	struct mail_index_strmap *strmap;
+	struct mail_index_strmap_view *strmap_view;
+	struct mail_index_strmap_view_sync *sync;
+	struct mail_index_view *view;
+	const ARRAY_TYPE(mail_index_strmap_rec) *recs;
+	const struct hash2_table *hash;
+	uint32_t last_uid;
+	unsigned int i;
+	bool ret = TRUE;
+
+	(void)mail_index_refresh(index);
+	view = mail_index_view_open(index);
+	strmap = mail_index_strmap_init_generic(index, TEST_STRMAP_SUFFIX);
+	strmap_view = mail_index_strmap_view_open(strmap, view, test_key_cmp,
+						  test_rec_cmp, test_remap,
+						  NULL, &recs, &hash);
+	/* read the records from the file */
+	sync = mail_index_strmap_view_sync_init(strmap_view, &last_uid);
+	mail_index_strmap_view_sync_commit(&sync);
+
+	for (i = 0; i < N_ELEMENTS(keys) && ret; i++) {
+		if (!test_strmap_lookup_key(view, strmap_view, keys[i]))
+			ret = FALSE;
+	}
+	mail_index_strmap_view_close(&strmap_view);
+	mail_index_strmap_deinit(&strmap);
+	mail_index_view_close(&view);
+	return ret;
+}
+
+static uint8_t test_strmap_file_version(void)
+{
+	struct mail_index_strmap_header hdr;
+	const char *path;
+	int fd;
+
+	path = t_strconcat(index_dir, "/dovecot.index"TEST_STRMAP_SUFFIX, NULL);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		hdr.version = 0;
+	i_close_fd(&fd);
+	return hdr.version;
+}
+
+static void test_mail_index_strmap_generic(void)
+{
+	struct mail_index *index;
+
+	test_begin("mail index strmap generic");
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-mail-index-strmap.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+
+	index = test_index_open();
+	test_append(index, TEST_MESSAGES_COUNT);
+	test_strmap_update(index);
+	test_assert(test_strmap_file_version() ==
+		    MAIL_INDEX_STRMAP_VERSION_GENERIC);
+	test_assert(test_strmap_verify(index));
+	test_index_close(&index);
+
+	/* appending a new block after reopening */
+	index = test_index_open();
+	test_assert(test_strmap_verify(index));
+	test_append(index, TEST_NEW_MESSAGES_COUNT);
+	test_strmap_update(index);
+	test_assert(test_strmap_verify(index));
+	test_index_close(&index);
+
+	/* expunged messages' records are dropped */
+	index = test_index_open();
+	test_expunge(index, 3);
+	test_assert(test_strmap_verify(index));
+	test_append(index, TEST_NEW_MESSAGES_COUNT);
+	test_strmap_update(index);
+	test_assert(test_strmap_verify(index));
+	test_index_close(&index);
+
+	index = test_index_open();
+	test_assert(test_strmap_verify(index));
+	test_index_close(&index);
+
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_strmap_generic,
+		NULL
+	};
+	return test_run(test_functions);
+}
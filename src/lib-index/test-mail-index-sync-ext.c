@@ -5,6 +5,7 @@
 #include "test-common.h"
 #include "mail-index-sync-private.h"
 #include "mail-index-modseq.h"
+#include "mail-index-flag-bitmaps.h"
 
 #include <stdlib.h>
 
@@ -32,12 +33,24 @@ bool mail_index_lookup_seq(struct mail_index_view *view ATTR_UNUSED,
 	*seq_r = uid;
 	return TRUE;
 }
+struct mail_index_record *
+mail_index_map_idx_modifiable(struct mail_index_map *map, uint32_t idx) {
+	return mail_index_record_pages_idx(&map->rec_map->pages, idx,
+					   map->hdr.record_size);
+}
+void mail_index_record_map_alloc_pages(struct mail_index_record_map *rec_map ATTR_UNUSED,
+				       unsigned int records_count ATTR_UNUSED,
+				       size_t record_size ATTR_UNUSED) {}
+void mail_index_record_pages_free(ARRAY_TYPE(mail_index_record_page) *pages ATTR_UNUSED) {}
+void mail_index_flag_bitmaps_drop_keywords(struct mail_index_record_map *rec_map ATTR_UNUSED) {}
 
 static void test_mail_index_sync_ext_atomic_inc(void)
 {
 	struct mail_index_sync_map_ctx ctx;
 	struct mail_transaction_ext_atomic_inc u;
 	struct mail_index_ext *ext;
+	struct mail_index_record_page page;
+	struct mail_index_record_page *pagep = &page;
 	void *ptr;
 
 	test_begin("mail index sync ext atomic inc");
@@ -48,12 +61,16 @@ static void test_mail_index_sync_ext_atomic_inc(void)
 	ctx.view->map->hdr.next_uid = 2;
 	ctx.view->map->hdr.record_size = sizeof(struct mail_index_record) + 16;
 	ctx.view->map->rec_map = t_new(struct mail_index_record_map, 1);
-	ctx.view->map->rec_map->records =
-		t_malloc(ctx.view->map->hdr.record_size);
+	memset(&page, 0, sizeof(page));
+	page.refcount = 1;
+	page.capacity = 1;
+	page.records = t_malloc(ctx.view->map->hdr.record_size);
+	t_array_init(&ctx.view->map->rec_map->pages, 1);
+	array_append(&ctx.view->map->rec_map->pages, &pagep, 1);
 	t_array_init(&ctx.view->map->extensions, 4);
 	ext = array_append_space(&ctx.view->map->extensions);
 	ext->record_offset = sizeof(struct mail_index_record);
-	ptr = PTR_OFFSET(ctx.view->map->rec_map->records, ext->record_offset);
+	ptr = PTR_OFFSET(page.records, ext->record_offset);
 
 	memset(&u, 0, sizeof(u));
 	test_assert(mail_index_sync_ext_atomic_inc(&ctx, &u) == -1);
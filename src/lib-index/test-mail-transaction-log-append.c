@@ -38,6 +38,19 @@ int mail_index_move_to_memory(struct mail_index *index ATTR_UNUSED)
 	return -1;
 }
 
+int mail_transaction_log_file_pwrite(struct mail_transaction_log_file *file ATTR_UNUSED,
+				     const void *data ATTR_UNUSED,
+				     size_t size ATTR_UNUSED,
+				     uoff_t offset ATTR_UNUSED)
+{
+	return -1;
+}
+
+int mail_transaction_log_file_write_commit_offset(struct mail_transaction_log_file *file ATTR_UNUSED)
+{
+	return -1;
+}
+
 static void test_append_expunge(struct mail_transaction_log *log)
 {
 	static unsigned int buf[] = { 0x12345678, 0xabcdef09 };
@@ -0,0 +1,135 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure dot ostream encoding and dot istream decoding throughput with
+   SMTP DATA style text. The message is written to the dot ostream and read
+   from the dot istream in <block> sized pieces, and the decoded result is
+   verified to match the original message.
+
+   Usage: bench-dot-stream [<kbytes> [<rounds> [<block>]]] */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "ostream.h"
+#include "istream-dot.h"
+#include "ostream-dot.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_DOT_MAX_LINE_LEN 78
+
+static void bench_fill_message(buffer_t *dest, size_t size)
+{
+	unsigned char *line;
+	unsigned int i, len;
+
+	srand(1);
+	while (dest->used < size) {
+		len = rand() % (BENCH_DOT_MAX_LINE_LEN + 1);
+		line = buffer_append_space_unsafe(dest, len + 2);
+		for (i = 0; i < len; i++)
+			line[i] = rand() % 8 == 0 ? ' ' : 'a' + rand() % 26;
+		if (len > 0 && rand() % 20 == 0)
+			line[0] = '.';
+		line[len] = '\r';
+		line[len+1] = '\n';
+	}
+}
+
+static void
+bench_encode(const buffer_t *message, buffer_t *encoded, size_t block_size)
+{
+	struct ostream *buf_output, *output;
+	size_t pos, len;
+
+	buffer_set_used_size(encoded, 0);
+	buf_output = o_stream_create_buffer(encoded);
+	output = o_stream_create_dot(buf_output, FALSE);
+	for (pos = 0; pos < message->used; pos += len) {
+		len = I_MIN(message->used - pos, block_size);
+		if (o_stream_send(output, CONST_PTR_OFFSET(message->data, pos),
+				  len) != (ssize_t)len)
+			i_fatal("o_stream_send() failed");
+	}
+	if (o_stream_flush(output) <= 0)
+		i_fatal("o_stream_flush() failed");
+	o_stream_unref(&output);
+	o_stream_unref(&buf_output);
+}
+
+static void
+bench_decode(const buffer_t *encoded, buffer_t *decoded, size_t block_size)
+{
+	struct istream *data_input, *input;
+	const unsigned char *data;
+	size_t size;
+	ssize_t ret;
+
+	buffer_set_used_size(decoded, 0);
+	data_input = i_stream_create_from_data(encoded->data, encoded->used);
+	input = i_stream_create_dot(data_input, TRUE);
+	i_stream_set_max_buffer_size(input, block_size);
+	while ((ret = i_stream_read(input)) > 0) {
+		data = i_stream_get_data(input, &size);
+		buffer_append(decoded, data, size);
+		i_stream_skip(input, size);
+	}
+	if (ret != -1 || input->stream_errno != 0)
+		i_fatal("i_stream_read() failed");
+	i_stream_unref(&input);
+	i_stream_unref(&data_input);
+}
+
+static void bench_print(const char *name, long long usecs, size_t size,
+			unsigned int rounds)
+{
+	printf("%-8s %12lld %10.1f\n", name, usecs,
+	       bench_mbytes_per_sec((uoff_t)size * rounds, usecs));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int kbytes = 8192, rounds = 10, block_size = 8192, i;
+	buffer_t *message, *encoded, *decoded;
+	struct bench_timer timer;
+	size_t size;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "kbytes", 1, UINT_MAX / 1024, &kbytes);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+	bench_arg_uint(argc, argv, 3, "block", 1, UINT_MAX, &block_size);
+	size = (size_t)kbytes * 1024;
+
+	message = buffer_create_dynamic(default_pool,
+					size + BENCH_DOT_MAX_LINE_LEN + 2);
+	bench_fill_message(message, size);
+	encoded = buffer_create_dynamic(default_pool, message->used * 2);
+	decoded = buffer_create_dynamic(default_pool, message->used);
+
+	printf("%u kB, %u rounds, %u byte blocks\n", kbytes, rounds,
+	       block_size);
+	printf("%-8s %12s %10s\n", "op", "usecs", "MB/s");
+
+	bench_timer_start(&timer);
+	for (i = 0; i < rounds; i++)
+		bench_encode(message, encoded, block_size);
+	bench_print("encode", bench_timer_lap(&timer), message->used, rounds);
+
+	bench_timer_start(&timer);
+	for (i = 0; i < rounds; i++)
+		bench_decode(encoded, decoded, block_size);
+	bench_print("decode", bench_timer_lap(&timer), message->used, rounds);
+
+	if (decoded->used != message->used ||
+	    memcmp(decoded->data, message->data, message->used) != 0)
+		i_fatal("Decoded data doesn't match the original");
+
+	buffer_free(&message);
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+	lib_deinit();
+	return 0;
+}
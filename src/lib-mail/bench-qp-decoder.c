@@ -0,0 +1,143 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure qp_decoder throughput. The input is mostly plain text with some
+   8bit characters, like in non-English mails, encoded into soft-wrapped
+   76 character lines. The input is fed to the decoder in <block> sized
+   pieces like istream-qp does, and the decoded result is verified to match
+   the original data.
+
+   Usage: bench-qp-decoder [<kbytes> [<rounds> [<block>]]] */
+
+#include "lib.h"
+#include "buffer.h"
+#include "qp-decoder.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_QP_LINE_LEN 76
+
+static void bench_qp_encode(const unsigned char *data, size_t size,
+			    buffer_t *dest)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char esc[3] = { '=', 0, 0 };
+	unsigned int line_len = 0, len;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n') {
+			buffer_append(dest, "\r\n", 2);
+			line_len = 0;
+			continue;
+		}
+		if (data[i] == ' ') {
+			/* trailing whitespace would be stripped */
+			len = i + 1 == size || data[i+1] == '\n' ? 3 : 1;
+		} else {
+			len = data[i] >= 33 && data[i] <= 126 &&
+				data[i] != '=' ? 1 : 3;
+		}
+		if (line_len + len > BENCH_QP_LINE_LEN - 1) {
+			buffer_append(dest, "=\r\n", 3);
+			line_len = 0;
+		}
+		if (len == 1)
+			buffer_append_c(dest, data[i]);
+		else {
+			esc[1] = hex[data[i] >> 4];
+			esc[2] = hex[data[i] & 0x0f];
+			buffer_append(dest, esc, sizeof(esc));
+		}
+		line_len += len;
+	}
+}
+
+static void bench_fill_text(unsigned char *data, size_t size)
+{
+	size_t i;
+	int r;
+
+	srand(1);
+	for (i = 0; i < size; i++) {
+		r = rand() % 100;
+		if (r < 80)
+			data[i] = 'a' + r % 26;
+		else if (r < 92)
+			data[i] = ' ';
+		else if (r < 93)
+			data[i] = '\n';
+		else
+			data[i] = 0xc0 + r - 93;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int kbytes = 8192, rounds = 10, block_size = 8192, i;
+	unsigned char *data;
+	const unsigned char *src;
+	buffer_t *encoded, *decoded;
+	struct qp_decoder *qp;
+	struct bench_timer timer;
+	const char *error;
+	size_t size, pos, len, invalid_pos;
+	long long usecs;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "kbytes", 1, UINT_MAX / 1024, &kbytes);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+	bench_arg_uint(argc, argv, 3, "block", 1, UINT_MAX, &block_size);
+	size = (size_t)kbytes * 1024;
+
+	data = i_malloc(size);
+	bench_fill_text(data, size);
+	encoded = buffer_create_dynamic(default_pool, size * 2);
+	bench_qp_encode(data, size, encoded);
+	src = encoded->data;
+	/* the decoder returns LFs as CRLFs */
+	decoded = buffer_create_dynamic(default_pool, size * 2);
+	qp = qp_decoder_init(decoded);
+
+	bench_timer_start(&timer);
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		for (pos = 0; pos < encoded->used; pos += len) {
+			len = I_MIN(encoded->used - pos, block_size);
+			if (qp_decoder_more(qp, src + pos, len,
+					    &invalid_pos, &error) < 0)
+				i_fatal("qp_decoder_more() failed: %s", error);
+		}
+		if (qp_decoder_finish(qp, &error) < 0)
+			i_fatal("qp_decoder_finish() failed: %s", error);
+	}
+	usecs = bench_timer_lap(&timer);
+
+	for (pos = len = 0; pos < decoded->used; pos++) {
+		const unsigned char *d = decoded->data;
+
+		if (d[pos] == '\r' && pos + 1 < decoded->used &&
+		    d[pos + 1] == '\n')
+			continue;
+		if (len == size || d[pos] != data[len])
+			break;
+		len++;
+	}
+	if (pos != decoded->used || len != size)
+		i_fatal("Decoded data doesn't match the original");
+
+	printf("%u kB (%"PRIuSIZE_T" kB encoded), %u rounds, %u byte blocks\n",
+	       kbytes, encoded->used / 1024, rounds, block_size);
+	printf("%-8s %12s %10s\n", "op", "usecs", "MB/s");
+	printf("%-8s %12lld %10.1f\n", "decode", usecs,
+	       bench_mbytes_per_sec((uoff_t)encoded->used * rounds, usecs));
+
+	qp_decoder_deinit(&qp);
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+	i_free(data);
+	lib_deinit();
+	return 0;
+}
@@ -106,12 +106,24 @@ i_stream_dot_return(struct istream_private *stream, size_t dest, ssize_t ret)
 	return ret;
 }
 
+/* Returns the number of bytes before the first CR or LF. */
+static size_t dot_find_eol(const unsigned char *data, size_t size)
+{
+	const unsigned char *p;
+
+	if ((p = memchr(data, '\n', size)) != NULL)
+		size = p - data;
+	if ((p = memchr(data, '\r', size)) != NULL)
+		size = p - data;
+	return size;
+}
+
 static ssize_t i_stream_dot_read(struct istream_private *stream)
 {
 	/* @UNSAFE */
 	struct dot_istream *dstream = (struct dot_istream *)stream;
 	const unsigned char *data;
-	size_t i, dest, size, avail;
+	size_t i, dest, size, avail, len;
 	ssize_t ret, ret1;
 
 	if (dstream->pending[0] != '\0') {
@@ -201,7 +213,13 @@ static ssize_t i_stream_dot_read(struct istream_private *stream)
 				dstream->state = 2;
 				dstream->state_no_cr = TRUE;
 			} else {
-				stream->w_buffer[dest++] = data[i];
+				/* copy everything until the next CR or LF */
+				len = dot_find_eol(data + i,
+					I_MIN(size - i, stream->buffer_size - dest));
+				memcpy(stream->w_buffer + dest, data + i, len);
+				dest += len;
+				/* the loop increments i once more */
+				i += len - 1;
 			}
 		}
 	}
@@ -20,6 +20,18 @@ struct dot_ostream {
 	bool force_extra_crlf;
 };
 
+/* Returns the number of bytes before the first CR or LF. */
+static size_t dot_find_eol(const char *data, size_t size)
+{
+	const char *p;
+
+	if ((p = memchr(data, '\n', size)) != NULL)
+		size = p - data;
+	if ((p = memchr(data, '\r', size)) != NULL)
+		size = p - data;
+	return size;
+}
+
 static int
 o_stream_dot_flush(struct ostream_private *stream)
 {
@@ -97,6 +109,15 @@ o_stream_dot_sendv(struct ostream_private *stream,
 		for (; p < pend && (size_t)(p-data) < (max_bytes-2); p++) {
 			char add = 0;
 
+			if (dstream->state == STREAM_STATE_NONE) {
+				/* skip directly to the end of the line */
+				p += dot_find_eol(p, I_MIN((size_t)(pend - p),
+					max_bytes - 2 - (size_t)(p - data)));
+				if (p == pend ||
+				    (size_t)(p-data) >= (max_bytes-2))
+					break;
+			}
+
 			switch (dstream->state) {
 			/* none */
 			case STREAM_STATE_NONE:
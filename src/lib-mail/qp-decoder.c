@@ -2,7 +2,6 @@
 
 #include "lib.h"
 #include "buffer.h"
-#include "hex-binary.h"
 #include "qp-decoder.h"
 
 /* quoted-printable lines can be max 76 characters. if we've seen more than
@@ -48,11 +47,24 @@ void qp_decoder_deinit(struct qp_decoder **_qp)
 	i_free(qp);
 }
 
+static inline int qp_hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	/* lowercase hex isn't strictly valid, but allow */
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
 static size_t
 qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		     size_t src_size)
 {
-	size_t i, start = 0, ret = src_size;
+	size_t i, j, start = 0, ret = src_size;
+	int hex1, hex2;
 
 	for (i = 0; i < src_size; i++) {
 		if (src[i] > '=') {
@@ -61,6 +73,17 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		}
 		switch (src[i]) {
 		case '=':
+			if (i+2 < src_size &&
+			    (hex1 = qp_hex_value(src[i+1])) >= 0 &&
+			    (hex2 = qp_hex_value(src[i+2])) >= 0) {
+				/* =<hex><hex> fully in this block - decode it
+				   without leaving the text loop */
+				buffer_append(qp->dest, src+start, i-start);
+				buffer_append_c(qp->dest, (hex1 << 4) | hex2);
+				i += 2;
+				start = i+1;
+				continue;
+			}
 			qp->state = STATE_EQUALS;
 			break;
 		case '\r':
@@ -74,6 +97,17 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 			continue;
 		case ' ':
 		case '\t':
+			for (j = i+1; j < src_size; j++) {
+				if (!QP_IS_TRAILING_WHITESPACE(src[j]))
+					break;
+			}
+			if (j < src_size && src[j] != '\r' && src[j] != '\n' &&
+			    j-i <= QP_MAX_WHITESPACE_LEN) {
+				/* followed by text in this block, so it's not
+				   trailing whitespace */
+				i = j-1;
+				continue;
+			}
 			i_assert(qp->whitespace->used == 0);
 			qp->state = STATE_WHITESPACE;
 			buffer_append_c(qp->whitespace, src[i]);
@@ -133,6 +167,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 {
 	const char *error;
 	size_t i;
+	int hex1, hex2;
 
 	*invalid_src_pos_r = (size_t)-1;
 	*error_r = NULL;
@@ -175,10 +210,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_EQUALS:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    /* lowercase hex isn't strictly valid, but allow */
-			    (src[i] >= 'a' && src[i] <= 'f')) {
+			if (qp_hex_value(src[i]) >= 0) {
 				qp->hexchar = src[i];
 				qp->state = STATE_HEX2;
 			} else if (QP_IS_TRAILING_WHITESPACE(src[i])) {
@@ -200,16 +232,9 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_HEX2:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    (src[i] >= 'a' && src[i] <= 'f')) {
-				char data[3];
-
-				data[0] = qp->hexchar;
-				data[1] = src[i];
-				data[2] = '\0';
-				if (hex_to_binary(data, qp->dest) < 0)
-					i_unreached();
+			if ((hex2 = qp_hex_value(src[i])) >= 0) {
+				hex1 = qp_hex_value(qp->hexchar);
+				buffer_append_c(qp->dest, (hex1 << 4) | hex2);
 				qp->state = STATE_TEXT;
 			} else {
 				/* invalid input */
@@ -2,18 +2,26 @@
 
 #include "lib.h"
 #include "buffer.h"
-#include "hex-binary.h"
 #include "quoted-printable.h"
 
+static int q_hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
 int quoted_printable_q_decode(const unsigned char *src, size_t src_size,
 			      buffer_t *dest)
 {
-	char hexbuf[3];
 	size_t src_pos, next;
+	int hex1, hex2;
 	bool errors = FALSE;
 
-	hexbuf[2] = '\0';
-
 	next = 0;
 	for (src_pos = 0; src_pos < src_size; src_pos++) {
 		if (src[src_pos] != '_' && src[src_pos] != '=')
@@ -32,10 +40,9 @@ int quoted_printable_q_decode(const unsigned char *src, size_t src_size,
 			break;
 
 		/* =<hex> */
-		hexbuf[0] = src[src_pos+1];
-		hexbuf[1] = src[src_pos+2];
-
-		if (hex_to_binary(hexbuf, dest) == 0) {
+		if ((hex1 = q_hex_value(src[src_pos+1])) >= 0 &&
+		    (hex2 = q_hex_value(src[src_pos+2])) >= 0) {
+			buffer_append_c(dest, (hex1 << 4) | hex2);
 			src_pos += 2;
 			next = src_pos+1;
 		} else {
@@ -55,6 +55,7 @@ static void test_ostream_dot(void)
 		{ "foo\n.\n", "foo\r\n..\r\n.\r\n" },
 		{ ".foo\r\n.\r\nfoo\r\n", "..foo\r\n..\r\nfoo\r\n.\r\n" },
 		{ ".foo\n.\nfoo\n", "..foo\r\n..\r\nfoo\r\n.\r\n" },
+		{ "first line\r\nsecond\rline\n.third", "first line\r\nsecond\rline\r\n..third\r\n.\r\n" },
 		{ "\r\n", "\r\n.\r\n" },
 		{ "\n", "\r\n.\r\n" },
 		{ "", "\r\n.\r\n" },
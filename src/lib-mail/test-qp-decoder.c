@@ -25,8 +25,11 @@ static void test_qp_decoder(void)
 		{ "foo  \nbar=\r\n", "foo\r\nbar", 0, 0 },
 		{ "=0A=0D  ", "\n\r", 0, 0 },
 		{ "foo_bar", "foo_bar", 0, 0 },
+		{ "=c3=A4=3D=3d\n", "\xc3\xa4==\r\n", 0, 0 },
 		{ "\n\n", "\r\n\r\n", 0, 0 },
 		{ "\r\n\n\n\r\n", "\r\n\r\n\r\n\r\n", 0, 0 },
+		{ "foo bar \t baz\r\n", "foo bar \t baz\r\n", 0, 0 },
+		{ "a b=20c \t=\r\nd  =41 \n", "a b c \td  A\r\n", 0, 0 },
 
 		{ "foo=", "foo=", 4, -1 },
 		{ "foo= \t", "foo= \t", 6, -1 },
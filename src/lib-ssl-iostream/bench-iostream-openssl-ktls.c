@@ -0,0 +1,323 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Send a file over a loopback TLS v1.2 connection with the SSL ostream,
+   first encrypting it with OpenSSL and then with kernel TLS, where the
+   ostream can use sendfile(). The client is a forked process that reads
+   the data with plain OpenSSL. The kernel TLS run is skipped if it can't
+   be enabled, e.g. because the tls ULP isn't available.
+
+   Usage: bench-iostream-openssl-ktls [<mbytes> [<cipher>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "net.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "iostream-openssl.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#define BENCH_BUF_SIZE (64*1024)
+
+extern const struct iostream_ssl_vfuncs ssl_vfuncs;
+
+struct bench_ctx {
+	struct ssl_iostream_settings set;
+	struct ssl_iostream_context *ssl_ctx;
+	const char *cipher;
+	struct ip_addr ip;
+	unsigned int port;
+	int listen_fd;
+	int file_fd;
+	uoff_t size;
+};
+
+struct bench_conn {
+	struct bench_ctx *ctx;
+	struct ssl_iostream *ssl_io;
+	struct istream *input, *file_input;
+	struct ostream *output;
+	struct io *io;
+};
+
+static const char *bench_pem(EVP_PKEY *pkey, X509 *cert)
+{
+	BIO *bio;
+	char *data;
+	long len;
+	const char *pem;
+
+	bio = BIO_new(BIO_s_mem());
+	if ((pkey != NULL &&
+	     PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0,
+				      NULL, NULL) <= 0) ||
+	    (cert != NULL && PEM_write_bio_X509(bio, cert) <= 0))
+		i_fatal("PEM_write_bio() failed");
+	len = BIO_get_mem_data(bio, &data);
+	pem = t_strndup(data, len);
+	BIO_free(bio);
+	return pem;
+}
+
+static void bench_cert_init(struct ssl_iostream_settings *set)
+{
+	EVP_PKEY_CTX *pctx;
+	EVP_PKEY *pkey = NULL;
+	X509 *cert;
+	X509_NAME *name;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (pctx == NULL || EVP_PKEY_keygen_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+						   NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(pctx, &pkey) <= 0)
+		i_fatal("EC key generation failed");
+	EVP_PKEY_CTX_free(pctx);
+
+	cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_get_notBefore(cert), 0);
+	X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+	name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+				   (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	if (X509_set_pubkey(cert, pkey) <= 0 ||
+	    X509_sign(cert, pkey, EVP_sha256()) <= 0)
+		i_fatal("Certificate generation failed");
+
+	set->key = bench_pem(pkey, NULL);
+	set->cert = bench_pem(NULL, cert);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+}
+
+static int bench_file_create(uoff_t size)
+{
+	unsigned char buf[BENCH_BUF_SIZE];
+	string_t *path = t_str_new(128);
+	uoff_t pos;
+	size_t n;
+	int fd;
+
+	str_append(path, "/tmp/bench-ktls.");
+	fd = safe_mkstemp(path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1)
+		i_fatal("safe_mkstemp(%s) failed: %m", str_c(path));
+	if (unlink(str_c(path)) < 0)
+		i_fatal("unlink(%s) failed: %m", str_c(path));
+
+	memset(buf, 'x', sizeof(buf));
+	for (pos = 0; pos < size; pos += n) {
+		n = I_MIN(sizeof(buf), size - pos);
+		if (write_full(fd, buf, n) < 0)
+			i_fatal("write(%s) failed: %m", str_c(path));
+	}
+	return fd;
+}
+
+/* Read size bytes with OpenSSL from a blocking socket. Runs in the child
+   process. */
+static int bench_client(struct bench_ctx *ctx)
+{
+	unsigned char buf[BENCH_BUF_SIZE];
+	SSL_CTX *ssl_ctx;
+	SSL *ssl;
+	uoff_t received = 0;
+	int fd, ret;
+
+	fd = net_connect_ip_blocking(&ctx->ip, ctx->port, NULL);
+	if (fd == -1) {
+		i_error("net_connect_ip_blocking() failed: %m");
+		return 1;
+	}
+	ssl_ctx = SSL_CTX_new(TLS_method());
+	if (ssl_ctx == NULL ||
+	    SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION) <= 0 ||
+	    SSL_CTX_set_cipher_list(ssl_ctx, ctx->cipher) <= 0) {
+		i_error("SSL_CTX setup failed: %s", openssl_iostream_error());
+		return 1;
+	}
+	ssl = SSL_new(ssl_ctx);
+	SSL_set_fd(ssl, fd);
+	if (SSL_connect(ssl) <= 0) {
+		i_error("SSL_connect() failed: %s", openssl_iostream_error());
+		return 1;
+	}
+	while (received < ctx->size) {
+		ret = SSL_read(ssl, buf, sizeof(buf));
+		if (ret <= 0)
+			return 1;
+		received += ret;
+	}
+	SSL_free(ssl);
+	SSL_CTX_free(ssl_ctx);
+	i_close_fd(&fd);
+	return 0;
+}
+
+static void bench_handshake_input(struct bench_conn *conn)
+{
+	if (i_stream_read(conn->input) < 0) {
+		i_fatal("SSL handshake failed: %s",
+			i_stream_get_error(conn->input));
+	}
+	if (ssl_iostream_is_handshaked(conn->ssl_io))
+		io_loop_stop(current_ioloop);
+}
+
+static int bench_output(struct bench_conn *conn)
+{
+	int ret;
+
+	if (o_stream_send_istream(conn->output, conn->file_input) < 0) {
+		i_fatal("o_stream_send_istream() failed: %s",
+			o_stream_get_error(conn->output));
+	}
+	if (conn->file_input->v_offset < conn->ctx->size)
+		return 0;
+	if ((ret = o_stream_flush(conn->output)) < 0) {
+		i_fatal("o_stream_flush() failed: %s",
+			o_stream_get_error(conn->output));
+	}
+	if (ret > 0)
+		io_loop_stop(current_ioloop);
+	return ret;
+}
+
+static long long
+bench_send(struct bench_conn *conn, pid_t pid)
+{
+	struct bench_timer timer;
+	long long usecs;
+	int status;
+
+	conn->file_input = i_stream_create_fd(conn->ctx->file_fd,
+					      BENCH_BUF_SIZE, FALSE);
+	bench_timer_start(&timer);
+	o_stream_set_flush_callback(conn->output, bench_output, conn);
+	o_stream_set_flush_pending(conn->output, TRUE);
+	io_loop_run(current_ioloop);
+	/* the client exits after it has received everything */
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	usecs = bench_timer_lap(&timer);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		i_fatal("Client failed");
+	i_stream_unref(&conn->file_input);
+	return usecs;
+}
+
+/* Returns the usecs it took to send the file and for the client to receive
+   all of it, or -1 if kernel TLS was wanted but couldn't be enabled. */
+static long long bench_run(struct bench_ctx *ctx, bool ktls)
+{
+	struct bench_conn conn;
+	const char *error;
+	long long usecs = -1;
+	pid_t pid;
+	int fd, status;
+
+	pid = fork();
+	if (pid < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0)
+		_exit(bench_client(ctx));
+
+	fd = net_accept(ctx->listen_fd, NULL, NULL);
+	if (fd < 0)
+		i_fatal("net_accept() failed: %m");
+	net_set_nonblock(fd, TRUE);
+	memset(&conn, 0, sizeof(conn));
+	conn.ctx = ctx;
+	conn.input = i_stream_create_fd(fd, (size_t)-1, FALSE);
+	conn.output = o_stream_create_fd(fd, (size_t)-1, FALSE);
+	if (io_stream_create_ssl_server(ctx->ssl_ctx, &ctx->set,
+					&conn.input, &conn.output,
+					&conn.ssl_io, &error) < 0)
+		i_fatal("SSL iostream creation failed: %s", error);
+	if (!ktls)
+		conn.ssl_io->ktls_checked = TRUE;
+
+	conn.io = io_add_istream(conn.input, bench_handshake_input, &conn);
+	io_loop_run(current_ioloop);
+	io_remove(&conn.io);
+	if (!ktls || conn.ssl_io->ktls_tx) {
+		usecs = bench_send(&conn, pid);
+		pid = -1;
+	}
+
+	ssl_iostream_destroy(&conn.ssl_io);
+	i_stream_unref(&conn.input);
+	o_stream_unref(&conn.output);
+	i_close_fd(&fd);
+	/* if nothing was sent, the client fails when it sees EOF */
+	if (pid != -1 && waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	return usecs;
+}
+
+static void
+bench_print(const char *name, long long usecs, uoff_t size)
+{
+	if (usecs < 0) {
+		printf("%-8s skipped: kernel TLS couldn't be enabled "
+		       "(tls ULP not available?)\n", name);
+	} else {
+		printf("%-8s %12lld %10.1f\n", name, usecs,
+		       bench_mbytes_per_sec(size, usecs));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	struct bench_ctx ctx;
+	unsigned int mbytes = 256;
+	const char *error;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	memset(&ctx, 0, sizeof(ctx));
+	bench_arg_uint(argc, argv, 1, "mbytes", 1, UINT_MAX, &mbytes);
+	ctx.cipher = argc > 2 ? argv[2] : "ECDHE-ECDSA-AES128-GCM-SHA256";
+	ctx.size = (uoff_t)mbytes * 1024*1024;
+
+	bench_cert_init(&ctx.set);
+	ctx.set.cipher_list = ctx.cipher;
+	iostream_ssl_module_init(&ssl_vfuncs);
+	if (ssl_iostream_context_init_server(&ctx.set, &ctx.ssl_ctx,
+					     &error) < 0)
+		i_fatal("SSL context initialization failed: %s", error);
+	ctx.file_fd = bench_file_create(ctx.size);
+
+	if (net_addr2ip("127.0.0.1", &ctx.ip) < 0)
+		i_unreached();
+	ctx.listen_fd = net_listen(&ctx.ip, &ctx.port, 1);
+	if (ctx.listen_fd == -1)
+		i_fatal("net_listen() failed: %m");
+
+	printf("%u MB with %s\n", mbytes, ctx.cipher);
+	printf("%-8s %12s %10s\n", "output", "usecs", "MB/s");
+	bench_print("openssl", bench_run(&ctx, FALSE), ctx.size);
+	bench_print("ktls", bench_run(&ctx, TRUE), ctx.size);
+
+	i_close_fd(&ctx.listen_fd);
+	i_close_fd(&ctx.file_fd);
+	ssl_iostream_context_deinit(&ctx.ssl_ctx);
+	ssl_vfuncs.global_deinit();
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
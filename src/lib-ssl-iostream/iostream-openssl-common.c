@@ -5,6 +5,12 @@
 
 #include <openssl/x509v3.h>
 
+/* OpenSSL v1.1+ doesn't support SSLv2, but it can still be disabled
+   (e.g. the default ssl_protocols=!SSLv2) */
+#ifndef SSL_TXT_SSLV2
+#  define SSL_TXT_SSLV2 "SSLv2"
+#endif
+
 enum {
 	DOVECOT_SSL_PROTO_SSLv2		= 0x01,
 	DOVECOT_SSL_PROTO_SSLv3		= 0x02,
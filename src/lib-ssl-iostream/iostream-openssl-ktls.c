@@ -0,0 +1,237 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "safe-memset.h"
+#include "iostream-openssl.h"
+
+#ifdef HAVE_OPENSSL_KTLS
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef TCP_ULP
+#  define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#  define SOL_TLS 282
+#endif
+
+#define KTLS_TLS12_SALT_SIZE 4
+#define KTLS_MAX_KEY_SIZE 32
+#define KTLS_TLS12_KEY_BLOCK_MAX_SIZE \
+	(2*KTLS_MAX_KEY_SIZE + 2*KTLS_TLS12_SALT_SIZE)
+#define KTLS_TLS12_KEY_EXPANSION_LABEL "key expansion"
+#define KTLS_RECORD_TYPE_ALERT 21
+
+static int
+openssl_ktls_tls12_key_block(SSL *ssl, const EVP_MD *md,
+			     unsigned char *key_block, size_t size,
+			     const char **error_r)
+{
+	unsigned char master_key[SSL_MAX_MASTER_KEY_LENGTH];
+	unsigned char client_random[SSL3_RANDOM_SIZE];
+	unsigned char server_random[SSL3_RANDOM_SIZE];
+	EVP_PKEY_CTX *pctx;
+	size_t master_key_len;
+	int ret = -1;
+
+	master_key_len = SSL_SESSION_get_master_key(SSL_get_session(ssl),
+						    master_key,
+						    sizeof(master_key));
+	if (master_key_len == 0 ||
+	    SSL_get_client_random(ssl, client_random,
+				  sizeof(client_random)) != sizeof(client_random) ||
+	    SSL_get_server_random(ssl, server_random,
+				  sizeof(server_random)) != sizeof(server_random)) {
+		*error_r = "Session keys not available";
+		return -1;
+	}
+
+	/* key_block = PRF(master_secret, "key expansion",
+	                   server_random + client_random) */
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+	if (pctx != NULL &&
+	    EVP_PKEY_derive_init(pctx) > 0 &&
+	    EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+	    EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master_key,
+					      master_key_len) > 0 &&
+	    EVP_PKEY_CTX_add1_tls1_prf_seed(pctx,
+			(const unsigned char *)KTLS_TLS12_KEY_EXPANSION_LABEL,
+			strlen(KTLS_TLS12_KEY_EXPANSION_LABEL)) > 0 &&
+	    EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random,
+					    sizeof(server_random)) > 0 &&
+	    EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random,
+					    sizeof(client_random)) > 0 &&
+	    EVP_PKEY_derive(pctx, key_block, &size) > 0)
+		ret = 0;
+	else {
+		*error_r = t_strdup_printf("TLS PRF failed: %s",
+					   openssl_iostream_error());
+	}
+	EVP_PKEY_CTX_free(pctx);
+	safe_memset(master_key, 0, sizeof(master_key));
+	return ret;
+}
+
+static void
+openssl_ktls_fill_crypto_info(union openssl_ktls_crypto_info *crypto,
+			      const unsigned char *key, size_t key_size,
+			      const unsigned char *salt)
+{
+	/* The handshake's Finished message was the only record sent with
+	   these keys, so the next record's sequence number is 1. The explicit
+	   nonce only needs to be unique, so use the sequence number for it
+	   like the kernel does for the following records. */
+	static const unsigned char rec_seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+	memset(crypto, 0, sizeof(*crypto));
+	crypto->info.version = TLS_1_2_VERSION;
+	if (key_size == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+		struct tls12_crypto_info_aes_gcm_128 *info =
+			&crypto->aes_gcm_128;
+
+		crypto->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info->key, key, key_size);
+		memcpy(info->salt, salt, sizeof(info->salt));
+		memcpy(info->iv, rec_seq, sizeof(info->iv));
+		memcpy(info->rec_seq, rec_seq, sizeof(info->rec_seq));
+	}
+#ifdef TLS_CIPHER_AES_GCM_256
+	else {
+		struct tls12_crypto_info_aes_gcm_256 *info =
+			&crypto->aes_gcm_256;
+
+		i_assert(key_size == TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+		crypto->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info->key, key, key_size);
+		memcpy(info->salt, salt, sizeof(info->salt));
+		memcpy(info->iv, rec_seq, sizeof(info->iv));
+		memcpy(info->rec_seq, rec_seq, sizeof(info->rec_seq));
+	}
+#endif
+}
+
+int openssl_ktls_get_tx_crypto_info(SSL *ssl, bool client,
+				    union openssl_ktls_crypto_info *crypto_r,
+				    size_t *size_r, const char **error_r)
+{
+	unsigned char key_block[KTLS_TLS12_KEY_BLOCK_MAX_SIZE];
+	const unsigned char *key, *salt;
+	const EVP_MD *md;
+	size_t key_size;
+
+	/* only TLS v1.2 AES-GCM is supported for now. The keys of other
+	   versions and ciphers can't be exported the same way. */
+	if (SSL_version(ssl) != TLS1_2_VERSION)
+		return 0;
+	switch (SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl))) {
+	case NID_aes_128_gcm:
+		key_size = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		*size_r = sizeof(crypto_r->aes_gcm_128);
+		md = EVP_sha256();
+		break;
+#ifdef TLS_CIPHER_AES_GCM_256
+	case NID_aes_256_gcm:
+		key_size = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		*size_r = sizeof(crypto_r->aes_gcm_256);
+		md = EVP_sha384();
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	/* key_block = client_write_key + server_write_key +
+	               client_write_IV + server_write_IV */
+	if (openssl_ktls_tls12_key_block(ssl, md, key_block,
+					 2*key_size + 2*KTLS_TLS12_SALT_SIZE,
+					 error_r) < 0)
+		return -1;
+	key = key_block + (client ? 0 : key_size);
+	salt = key_block + 2*key_size + (client ? 0 : KTLS_TLS12_SALT_SIZE);
+	openssl_ktls_fill_crypto_info(crypto_r, key, key_size, salt);
+	safe_memset(key_block, 0, sizeof(key_block));
+	return 1;
+}
+
+int openssl_ktls_enable_tx(SSL *ssl, int fd, bool client,
+			   const char **error_r)
+{
+	union openssl_ktls_crypto_info crypto;
+	size_t crypto_size;
+	int ret;
+
+	if ((ret = openssl_ktls_get_tx_crypto_info(ssl, client, &crypto,
+						   &crypto_size, error_r)) <= 0)
+		return ret;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		/* ENOENT: tls module isn't loaded,
+		   ENOTSOCK/EOPNOTSUPP: not a TCP socket */
+		if (errno == ENOENT || errno == ENOTSOCK ||
+		    errno == EOPNOTSUPP || errno == ENOPROTOOPT)
+			ret = 0;
+		else {
+			*error_r = t_strdup_printf(
+				"setsockopt(TCP_ULP, tls) failed: %m");
+			ret = -1;
+		}
+	} else if (setsockopt(fd, SOL_TLS, TLS_TX, &crypto, crypto_size) == 0)
+		ret = 1;
+	else if (errno == EINVAL || errno == EOPNOTSUPP ||
+		 errno == ENOPROTOOPT) {
+		/* the kernel doesn't support this cipher */
+		ret = 0;
+	} else {
+		*error_r = t_strdup_printf("setsockopt(TLS_TX) failed: %m");
+		ret = -1;
+	}
+	safe_memset(&crypto, 0, sizeof(crypto));
+	return ret;
+}
+
+int openssl_ktls_send_close_notify(int fd)
+{
+	static const unsigned char alert[2] = {
+		1 /* warning */, 0 /* close_notify */
+	};
+	unsigned char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = (void *)alert;
+	iov.iov_len = sizeof(alert);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = KTLS_RECORD_TYPE_ALERT;
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT) < 0)
+		return -1;
+	return 0;
+}
+#else
+int openssl_ktls_enable_tx(SSL *ssl ATTR_UNUSED, int fd ATTR_UNUSED,
+			   bool client ATTR_UNUSED,
+			   const char **error_r ATTR_UNUSED)
+{
+	return 0;
+}
+
+int openssl_ktls_send_close_notify(int fd ATTR_UNUSED)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
@@ -109,7 +109,7 @@ openssl_iostream_verify_client_cert(int preverify_ok, X509_STORE_CTX *ctx)
 	ssl_io = SSL_get_ex_data(ssl, dovecot_ssl_extdata_index);
 	ssl_io->cert_received = TRUE;
 
-	subject = X509_get_subject_name(ctx->current_cert);
+	subject = X509_get_subject_name(X509_STORE_CTX_get_current_cert(ctx));
 	if (subject == NULL ||
 	    X509_NAME_oneline(subject, certname, sizeof(certname)) == NULL)
 		certname[0] = '\0';
@@ -118,7 +118,8 @@ openssl_iostream_verify_client_cert(int preverify_ok, X509_STORE_CTX *ctx)
 	if (!preverify_ok) {
 		openssl_iostream_set_error(ssl_io, t_strdup_printf(
 			"Received invalid SSL certificate: %s: %s",
-			X509_verify_cert_error_string(ctx->error), certname));
+			X509_verify_cert_error_string(
+				X509_STORE_CTX_get_error(ctx)), certname));
 		if (ssl_io->verbose_invalid_cert)
 			i_info("%s", ssl_io->last_error);
 	} else if (ssl_io->verbose) {
@@ -291,9 +292,16 @@ static void openssl_iostream_unref(struct ssl_iostream *ssl_io)
 
 static void openssl_iostream_destroy(struct ssl_iostream *ssl_io)
 {
-	(void)SSL_shutdown(ssl_io->ssl);
-	(void)openssl_iostream_more(ssl_io);
-	(void)o_stream_flush(ssl_io->plain_output);
+	if (!ssl_io->ktls_tx) {
+		(void)SSL_shutdown(ssl_io->ssl);
+		(void)openssl_iostream_more(ssl_io);
+		(void)o_stream_flush(ssl_io->plain_output);
+	} else if (o_stream_flush(ssl_io->plain_output) > 0) {
+		/* OpenSSL can't write anything anymore, so send the
+		   close_notify via the kernel */
+		(void)openssl_ktls_send_close_notify(
+			o_stream_get_fd(ssl_io->plain_output));
+	}
 	/* close the plain i/o streams, because their fd may be closed soon,
 	   but we may still keep this ssl-iostream referenced until later. */
 	i_stream_close(ssl_io->plain_input);
@@ -310,6 +318,25 @@ static bool openssl_iostream_bio_output(struct ssl_iostream *ssl_io)
 	bool bytes_sent = FALSE;
 	int ret;
 
+	if (ssl_io->ktls_tx) {
+		/* the kernel has the output state now. OpenSSL is only
+		   expected to write alerts (or renegotiation replies) that
+		   we can't send anymore. */
+		if (BIO_ctrl_pending(ssl_io->bio_ext) == 0)
+			return FALSE;
+		while ((bytes = BIO_ctrl_pending(ssl_io->bio_ext)) > 0)
+			(void)BIO_read(ssl_io->bio_ext, buffer,
+				       I_MIN(bytes, sizeof(buffer)));
+		if (ssl_io->closed)
+			return FALSE;
+		i_free(ssl_io->plain_stream_errstr);
+		ssl_io->plain_stream_errstr =
+			i_strdup("SSL: OpenSSL tried to write after kernel TLS was enabled");
+		ssl_io->plain_stream_errno = EINVAL;
+		ssl_io->closed = TRUE;
+		return FALSE;
+	}
+
 	o_stream_cork(ssl_io->plain_output);
 	while ((bytes = BIO_ctrl_pending(ssl_io->bio_ext)) > 0) {
 		/* bytes contains how many SSL encrypted bytes we should be
@@ -354,6 +381,43 @@ static bool openssl_iostream_bio_output(struct ssl_iostream *ssl_io)
 	return bytes_sent;
 }
 
+void openssl_iostream_ktls_try(struct ssl_iostream *ssl_io)
+{
+	const char *error;
+	int ret;
+
+	i_assert(ssl_io->handshaked);
+
+	if (ssl_io->ktls_checked)
+		return;
+	ssl_io->ktls_checked = TRUE;
+
+	/* everything OpenSSL has encrypted must be in the socket before the
+	   kernel starts encrypting */
+	if (BIO_ctrl_pending(ssl_io->bio_ext) > 0 ||
+	    o_stream_flush(ssl_io->plain_output) <= 0)
+		return;
+
+	ret = openssl_ktls_enable_tx(ssl_io->ssl,
+				     o_stream_get_fd(ssl_io->plain_output),
+				     ssl_io->ctx->client_ctx, &error);
+	if (ret < 0) {
+		/* the socket is still usable without kernel TLS */
+		i_warning("%sCan't enable kernel TLS: %s",
+			  ssl_io->log_prefix, error);
+		return;
+	}
+	if (ret == 0)
+		return;
+#ifdef SSL_OP_NO_RENEGOTIATION
+	SSL_set_options(ssl_io->ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
+	if (ssl_io->verbose)
+		i_debug("%sSSL: Kernel TLS enabled for output",
+			ssl_io->log_prefix);
+	ssl_io->ktls_tx = TRUE;
+}
+
 static ssize_t
 openssl_iostream_read_more(struct ssl_iostream *ssl_io,
 			   const unsigned char **data_r, size_t *size_r)
@@ -595,6 +659,7 @@ static int openssl_iostream_handshake(struct ssl_iostream *ssl_io)
 	}
 	i_free_and_null(ssl_io->last_error);
 	ssl_io->handshaked = TRUE;
+	openssl_iostream_ktls_try(ssl_io);
 
 	if (ssl_io->ssl_output != NULL)
 		(void)o_stream_flush(ssl_io->ssl_output);
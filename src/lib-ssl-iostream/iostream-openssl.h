@@ -5,6 +5,19 @@
 
 #include <openssl/ssl.h>
 
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_SSL_SESSION_GET_MASTER_KEY)
+#  define HAVE_OPENSSL_KTLS
+#  include <linux/tls.h>
+
+union openssl_ktls_crypto_info {
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+#ifdef TLS_CIPHER_AES_GCM_256
+	struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#endif
+};
+#endif
+
 struct ssl_iostream_context {
 	SSL_CTX *ssl_ctx;
 
@@ -50,6 +63,10 @@ struct ssl_iostream {
 	unsigned int input_handler:1;
 	unsigned int ostream_flush_waiting_input:1;
 	unsigned int closed:1;
+	/* kernel TLS has been tried (or it can no longer be tried) */
+	unsigned int ktls_checked:1;
+	/* the kernel encrypts all output written to plain_output's fd */
+	unsigned int ktls_tx:1;
 };
 
 extern int dovecot_ssl_extdata_index;
@@ -90,6 +107,27 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 int openssl_iostream_handle_write_error(struct ssl_iostream *ssl_io, int ret,
 					const char *func_name);
 
+/* Try to move the encryption of output to kernel if it's possible for this
+   connection. Must be called after handshake before any application data is
+   written via SSL_write(). */
+void openssl_iostream_ktls_try(struct ssl_iostream *ssl_io);
+/* Install the SSL connection's TX keys to the TCP socket fd. Returns 1 if
+   successful, 0 if kernel TLS isn't supported for this connection (kernel,
+   socket, protocol version or cipher), -1 if error. */
+int openssl_ktls_enable_tx(SSL *ssl, int fd, bool client,
+			   const char **error_r);
+#ifdef HAVE_OPENSSL_KTLS
+/* Get the SSL connection's TX keys and record state in the form that
+   setsockopt(TLS_TX) wants. *size_r is set to the size of the used union
+   member. Returns 1 if successful, 0 if the protocol version or cipher isn't
+   supported, -1 if error. */
+int openssl_ktls_get_tx_crypto_info(SSL *ssl, bool client,
+				    union openssl_ktls_crypto_info *crypto_r,
+				    size_t *size_r, const char **error_r);
+#endif
+/* Send close_notify alert via the kernel TLS socket. */
+int openssl_ktls_send_close_notify(int fd);
+
 const char *openssl_iostream_error(void);
 const char *openssl_iostream_key_load_error(void);
 
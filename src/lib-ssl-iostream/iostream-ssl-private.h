@@ -42,4 +42,8 @@ struct iostream_ssl_vfuncs {
 	const char *(*get_last_error)(struct ssl_iostream *ssl_io);
 };
 
+/* Use the given vfuncs instead of loading the SSL module. This is for
+   programs that link the module statically, such as tests. */
+void iostream_ssl_module_init(const struct iostream_ssl_vfuncs *vfuncs);
+
 #endif
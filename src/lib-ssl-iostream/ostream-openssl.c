@@ -82,11 +82,39 @@ o_stream_ssl_buffer(struct ssl_ostream *sstream, const struct const_iovec *iov,
 	return bytes_sent;
 }
 
+static void o_stream_ssl_copy_plain_error(struct ssl_ostream *sstream)
+{
+	struct ostream *plain_output = sstream->ssl_io->plain_output;
+
+	io_stream_set_error(&sstream->ostream.iostream, "%s",
+			    o_stream_get_error(plain_output));
+	sstream->ostream.ostream.stream_errno = plain_output->stream_errno;
+}
+
+static int o_stream_ssl_ktls_flush_buffer(struct ssl_ostream *sstream)
+{
+	ssize_t ret;
+
+	/* the kernel encrypts the data written to plain_output */
+	ret = o_stream_send(sstream->ssl_io->plain_output,
+			    sstream->buffer->data, sstream->buffer->used);
+	if (ret < 0) {
+		o_stream_ssl_copy_plain_error(sstream);
+		return -1;
+	}
+	buffer_delete(sstream->buffer, 0, ret);
+	return sstream->buffer->used == 0 ? 1 : 0;
+}
+
 static int o_stream_ssl_flush_buffer(struct ssl_ostream *sstream)
 {
 	size_t pos = 0;
 	int ret = 1;
 
+	openssl_iostream_ktls_try(sstream->ssl_io);
+	if (sstream->ssl_io->ktls_tx)
+		return o_stream_ssl_ktls_flush_buffer(sstream);
+
 	while (pos < sstream->buffer->used) {
 		/* we're writing plaintext data to OpenSSL, which it encrypts
 		   and writes to bio_int's buffer. ssl_iostream_bio_sync()
@@ -129,6 +157,10 @@ static int o_stream_ssl_flush(struct ostream_private *stream)
 		/* we can try to send some of our buffered data */
 		ret = o_stream_ssl_flush_buffer(sstream);
 	}
+	if (ret > 0 && sstream->ssl_io->ktls_tx) {
+		if ((ret = o_stream_flush(sstream->ssl_io->plain_output)) < 0)
+			o_stream_ssl_copy_plain_error(sstream);
+	}
 
 	if (ret == 0 && sstream->ssl_io->want_read) {
 		/* we need to read more data until we can continue. */
@@ -146,6 +178,20 @@ o_stream_ssl_sendv(struct ostream_private *stream,
 {
 	struct ssl_ostream *sstream = (struct ssl_ostream *)stream;
 	size_t bytes_sent = 0;
+	ssize_t ret;
+
+	if (sstream->ssl_io->ktls_tx &&
+	    (sstream->buffer == NULL || sstream->buffer->used == 0)) {
+		/* no need to buffer, plain_output does it */
+		ret = o_stream_sendv(sstream->ssl_io->plain_output,
+				     iov, iov_count);
+		if (ret < 0) {
+			o_stream_ssl_copy_plain_error(sstream);
+			return -1;
+		}
+		stream->ostream.offset += ret;
+		return ret;
+	}
 
 	bytes_sent = o_stream_ssl_buffer(sstream, iov, iov_count, bytes_sent);
 	if (sstream->ssl_io->handshaked &&
@@ -158,6 +204,28 @@ o_stream_ssl_sendv(struct ostream_private *stream,
 	return bytes_sent;
 }
 
+static off_t
+o_stream_ssl_send_istream(struct ostream_private *stream,
+			  struct istream *instream)
+{
+	struct ssl_ostream *sstream = (struct ssl_ostream *)stream;
+	off_t ret;
+
+	if (!sstream->ssl_io->ktls_tx ||
+	    (sstream->buffer != NULL && sstream->buffer->used > 0))
+		return io_stream_copy(&stream->ostream, instream);
+
+	/* with kernel TLS plain_output can use sendfile() */
+	ret = o_stream_send_istream(sstream->ssl_io->plain_output, instream);
+	if (ret < 0) {
+		if (sstream->ssl_io->plain_output->stream_errno != 0)
+			o_stream_ssl_copy_plain_error(sstream);
+		return -1;
+	}
+	stream->ostream.offset += ret;
+	return ret;
+}
+
 static void o_stream_ssl_switch_ioloop(struct ostream_private *stream)
 {
 	struct ssl_ostream *sstream = (struct ssl_ostream *)stream;
@@ -226,6 +294,7 @@ struct ostream *openssl_o_stream_create_ssl(struct ssl_iostream *ssl_io)
 	sstream->ostream.iostream.destroy = o_stream_ssl_destroy;
 	sstream->ostream.sendv = o_stream_ssl_sendv;
 	sstream->ostream.flush = o_stream_ssl_flush;
+	sstream->ostream.send_istream = o_stream_ssl_send_istream;
 	sstream->ostream.switch_ioloop = o_stream_ssl_switch_ioloop;
 
 	sstream->ostream.get_used_size = o_stream_ssl_get_used_size;
@@ -0,0 +1,267 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "iostream-openssl.h"
+
+#ifdef HAVE_OPENSSL_KTLS
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#define TEST_RECORD_TYPE_APPLICATION_DATA 23
+#define TEST_RECORD_HEADER_SIZE 5
+#define TEST_EXPLICIT_NONCE_SIZE 8
+#define TEST_GCM_TAG_SIZE 16
+
+struct test_ktls_crypto {
+	const EVP_CIPHER *cipher;
+	const unsigned char *key, *salt, *rec_seq;
+};
+
+static const char *test_ciphers[] = {
+	"ECDHE-ECDSA-AES128-GCM-SHA256",
+#ifdef TLS_CIPHER_AES_GCM_256
+	"ECDHE-ECDSA-AES256-GCM-SHA384",
+#endif
+};
+
+static EVP_PKEY *test_pkey;
+static X509 *test_cert;
+
+static void test_ktls_cert_init(void)
+{
+	EVP_PKEY_CTX *pctx;
+	X509_NAME *name;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (pctx == NULL || EVP_PKEY_keygen_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+						   NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(pctx, &test_pkey) <= 0)
+		i_fatal("EC key generation failed");
+	EVP_PKEY_CTX_free(pctx);
+
+	test_cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(test_cert), 1);
+	X509_gmtime_adj(X509_get_notBefore(test_cert), 0);
+	X509_gmtime_adj(X509_get_notAfter(test_cert), 3600);
+	name = X509_get_subject_name(test_cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+				   (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(test_cert, name);
+	if (X509_set_pubkey(test_cert, test_pkey) <= 0 ||
+	    X509_sign(test_cert, test_pkey, EVP_sha256()) <= 0)
+		i_fatal("Certificate generation failed");
+}
+
+static SSL_CTX *test_ktls_ssl_ctx(bool server, const char *cipher)
+{
+	SSL_CTX *ssl_ctx;
+
+	ssl_ctx = SSL_CTX_new(TLS_method());
+	if (ssl_ctx == NULL ||
+	    SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION) <= 0 ||
+	    SSL_CTX_set_cipher_list(ssl_ctx, cipher) <= 0)
+		i_fatal("SSL_CTX setup failed: %s", openssl_iostream_error());
+	if (server) {
+		if (SSL_CTX_use_certificate(ssl_ctx, test_cert) <= 0 ||
+		    SSL_CTX_use_PrivateKey(ssl_ctx, test_pkey) <= 0 ||
+		    SSL_CTX_set_session_id_context(ssl_ctx,
+				(const unsigned char *)"test", 4) <= 0)
+			i_fatal("SSL_CTX setup failed: %s",
+				openssl_iostream_error());
+	}
+	return ssl_ctx;
+}
+
+/* Connect client and server via a BIO pair and do the handshake. The BIO
+   that the client reads from is returned in *client_bio_r and the one the
+   server reads from in *server_bio_r. */
+static void
+test_ktls_handshake(SSL *client, SSL *server,
+		    BIO **client_bio_r, BIO **server_bio_r)
+{
+	int client_ret = 0, server_ret = 0, i;
+
+	if (BIO_new_bio_pair(client_bio_r, 0, server_bio_r, 0) <= 0)
+		i_fatal("BIO_new_bio_pair() failed");
+	SSL_set_bio(client, *client_bio_r, *client_bio_r);
+	SSL_set_bio(server, *server_bio_r, *server_bio_r);
+	SSL_set_connect_state(client);
+	SSL_set_accept_state(server);
+
+	for (i = 0; i < 100 && (client_ret != 1 || server_ret != 1); i++) {
+		if (client_ret != 1)
+			client_ret = SSL_do_handshake(client);
+		if (server_ret != 1)
+			server_ret = SSL_do_handshake(server);
+	}
+	if (client_ret != 1 || server_ret != 1)
+		i_fatal("Handshake failed: %s", openssl_iostream_error());
+}
+
+static void
+test_ktls_crypto_get(const union openssl_ktls_crypto_info *crypto,
+		     struct test_ktls_crypto *crypto_r)
+{
+	switch (crypto->info.cipher_type) {
+	case TLS_CIPHER_AES_GCM_128:
+		crypto_r->cipher = EVP_aes_128_gcm();
+		crypto_r->key = crypto->aes_gcm_128.key;
+		crypto_r->salt = crypto->aes_gcm_128.salt;
+		crypto_r->rec_seq = crypto->aes_gcm_128.rec_seq;
+		break;
+#ifdef TLS_CIPHER_AES_GCM_256
+	case TLS_CIPHER_AES_GCM_256:
+		crypto_r->cipher = EVP_aes_256_gcm();
+		crypto_r->key = crypto->aes_gcm_256.key;
+		crypto_r->salt = crypto->aes_gcm_256.salt;
+		crypto_r->rec_seq = crypto->aes_gcm_256.rec_seq;
+		break;
+#endif
+	default:
+		i_unreached();
+	}
+}
+
+/* Decrypt the record that OpenSSL wrote to bio using the keys that would
+   have been given to the kernel. seq_offset is the number of records that
+   were written after the handshake before this one. */
+static bool
+test_ktls_decrypt_record(const union openssl_ktls_crypto_info *crypto,
+			 unsigned int seq_offset, BIO *bio,
+			 const char *plaintext)
+{
+	size_t plain_size = strlen(plaintext);
+	unsigned char record[TEST_RECORD_HEADER_SIZE +
+			     TEST_EXPLICIT_NONCE_SIZE + 128 +
+			     TEST_GCM_TAG_SIZE];
+	unsigned char aad[13], nonce[12], output[128];
+	const unsigned char *ciphertext;
+	struct test_ktls_crypto c;
+	EVP_CIPHER_CTX *ctx;
+	size_t record_size;
+	unsigned int i, carry;
+	int len, ret;
+
+	i_assert(plain_size <= sizeof(output));
+	record_size = TEST_RECORD_HEADER_SIZE + TEST_EXPLICIT_NONCE_SIZE +
+		plain_size + TEST_GCM_TAG_SIZE;
+	if (BIO_read(bio, record, sizeof(record)) != (int)record_size ||
+	    record[0] != TEST_RECORD_TYPE_APPLICATION_DATA)
+		return FALSE;
+	test_ktls_crypto_get(crypto, &c);
+
+	/* additional data: seq_num + type + version + length */
+	memcpy(aad, c.rec_seq, 8);
+	for (i = 8, carry = seq_offset; i > 0 && carry > 0; i--) {
+		carry += aad[i-1];
+		aad[i-1] = carry & 0xff;
+		carry >>= 8;
+	}
+	memcpy(aad + 8, record, 3);
+	aad[11] = plain_size >> 8;
+	aad[12] = plain_size & 0xff;
+	/* nonce: salt + explicit nonce from the record */
+	memcpy(nonce, c.salt, 4);
+	memcpy(nonce + 4, record + TEST_RECORD_HEADER_SIZE,
+	       TEST_EXPLICIT_NONCE_SIZE);
+	ciphertext = record + TEST_RECORD_HEADER_SIZE +
+		TEST_EXPLICIT_NONCE_SIZE;
+
+	ctx = EVP_CIPHER_CTX_new();
+	ret = EVP_DecryptInit_ex(ctx, c.cipher, NULL, NULL, NULL) > 0 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+				    sizeof(nonce), NULL) > 0 &&
+		EVP_DecryptInit_ex(ctx, NULL, NULL, c.key, nonce) > 0 &&
+		EVP_DecryptUpdate(ctx, NULL, &len, aad, sizeof(aad)) > 0 &&
+		EVP_DecryptUpdate(ctx, output, &len, ciphertext,
+				  plain_size) > 0 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+				    TEST_GCM_TAG_SIZE,
+				    (void *)(ciphertext + plain_size)) > 0 &&
+		EVP_DecryptFinal_ex(ctx, output + len, &len) > 0;
+	EVP_CIPHER_CTX_free(ctx);
+	return ret && memcmp(output, plaintext, plain_size) == 0;
+}
+
+static void
+test_ktls_check_side(SSL *ssl, bool client, BIO *peer_bio)
+{
+	static const char *records[] = { "first record", "second record" };
+	union openssl_ktls_crypto_info crypto;
+	size_t crypto_size;
+	const char *error;
+	unsigned int i;
+
+	test_assert(openssl_ktls_get_tx_crypto_info(ssl, client, &crypto,
+						    &crypto_size, &error) == 1);
+	test_assert(crypto.info.version == TLS_1_2_VERSION);
+	for (i = 0; i < N_ELEMENTS(records); i++) {
+		if (SSL_write(ssl, records[i], strlen(records[i])) <= 0)
+			i_fatal("SSL_write() failed");
+		test_assert_idx(test_ktls_decrypt_record(&crypto, i, peer_bio,
+							 records[i]), i);
+	}
+}
+
+static void test_ktls_tx_crypto_info(void)
+{
+	SSL_CTX *client_ctx, *server_ctx;
+	SSL *client, *server;
+	SSL_SESSION *session = NULL;
+	BIO *client_bio, *server_bio;
+	unsigned int i, resume;
+
+	test_begin("ktls tx crypto info");
+	test_ktls_cert_init();
+	for (i = 0; i < N_ELEMENTS(test_ciphers); i++) {
+		client_ctx = test_ktls_ssl_ctx(FALSE, test_ciphers[i]);
+		server_ctx = test_ktls_ssl_ctx(TRUE, test_ciphers[i]);
+		/* full handshake first, then a resumed one */
+		for (resume = 0; resume < 2; resume++) {
+			client = SSL_new(client_ctx);
+			server = SSL_new(server_ctx);
+			if (session != NULL)
+				SSL_set_session(client, session);
+			test_ktls_handshake(client, server,
+					    &client_bio, &server_bio);
+			test_assert_idx(SSL_session_reused(client) ==
+					(int)resume, i);
+
+			/* the peer's BIO has what the SSL object wrote */
+			test_ktls_check_side(server, FALSE, client_bio);
+			test_ktls_check_side(client, TRUE, server_bio);
+
+			if (session == NULL)
+				session = SSL_get1_session(client);
+			/* without a shutdown SSL_free() removes the session
+			   from the cache */
+			SSL_set_shutdown(client, SSL_SENT_SHUTDOWN |
+					 SSL_RECEIVED_SHUTDOWN);
+			SSL_set_shutdown(server, SSL_SENT_SHUTDOWN |
+					 SSL_RECEIVED_SHUTDOWN);
+			SSL_free(client);
+			SSL_free(server);
+		}
+		SSL_SESSION_free(session);
+		session = NULL;
+		SSL_CTX_free(client_ctx);
+		SSL_CTX_free(server_ctx);
+	}
+	X509_free(test_cert);
+	EVP_PKEY_free(test_pkey);
+	test_end();
+}
+#endif
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+#ifdef HAVE_OPENSSL_KTLS
+		test_ktls_tx_crypto_info,
+#endif
+		NULL
+	};
+	return test_run(test_functions);
+}
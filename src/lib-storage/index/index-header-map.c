@@ -0,0 +1,509 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash2.h"
+#include "message-id.h"
+#include "message-address.h"
+#include "message-header-parser.h"
+#include "mail-index-strmap.h"
+#include "mail-search-build.h"
+#include "mail-header-map.h"
+#include "index-storage.h"
+
+#define HEADER_MAP_CONTEXT(obj) \
+	MODULE_CONTEXT(obj, header_map_storage_module)
+
+#define MAIL_HEADER_MAP_INDEX_SUFFIX ".hdrmap"
+
+/* Each header field has two ref_indexes: one for the field's key and one for
+   a "complex" marker record with an empty key. The marker is added when
+   the header may contain "<id>" strings that don't match the key, so that
+   searches know to look at those messages also. */
+#define HEADER_MAP_REF_KEY(field) ((field) * 2)
+#define HEADER_MAP_REF_COMPLEX(field) ((field) * 2 + 1)
+#define HEADER_MAP_REF_IS_COMPLEX(ref_index) (((ref_index) & 1) != 0)
+#define HEADER_MAP_REF_FIELD(ref_index) ((ref_index) / 2)
+
+struct header_map_mailbox {
+	union mailbox_module_context module_ctx;
+
+	struct mail_index_strmap *strmap;
+	struct mail_index_strmap_view *strmap_view;
+	/* sorted by UID, ref_index */
+	const ARRAY_TYPE(mail_index_strmap_rec) *recs;
+	const struct hash2_table *hash;
+	uint32_t last_uid;
+
+	/* set only temporarily while needed */
+	struct mailbox_transaction_context *t;
+	struct mail *tmp_mail;
+
+	unsigned int failed:1;
+	unsigned int corrupted:1;
+};
+
+static const char *header_map_field_names[MAIL_HEADER_MAP_FIELD_COUNT+1] = {
+	"Message-ID",
+	"In-Reply-To",
+	"List-Id",
+	"From",
+	NULL
+};
+
+static MODULE_CONTEXT_DEFINE_INIT(header_map_storage_module,
+				  &mail_storage_module_register);
+
+bool mail_header_map_field_find(const char *hdr_name,
+				enum mail_header_map_field *field_r)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAIL_HEADER_MAP_FIELD_COUNT; i++) {
+		if (strcasecmp(header_map_field_names[i], hdr_name) == 0) {
+			*field_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+const char *mail_header_map_field_get_name(enum mail_header_map_field field)
+{
+	i_assert(field < MAIL_HEADER_MAP_FIELD_COUNT);
+
+	return header_map_field_names[field];
+}
+
+static const char *header_map_trim(const char *value)
+{
+	const char *end;
+
+	while (IS_LWSP(*value) || *value == '\r' || *value == '\n')
+		value++;
+	end = value + strlen(value);
+	while (end > value && (IS_LWSP(end[-1]) || end[-1] == '\r' ||
+			       end[-1] == '\n'))
+		end--;
+	return t_strdup_until(value, end);
+}
+
+static const char *
+header_map_get_value_key(enum mail_header_map_field field, const char *value,
+			 bool *multiple_r)
+{
+	struct message_address *addr;
+	const char *p, *end, *key = NULL;
+
+	*multiple_r = FALSE;
+	switch (field) {
+	case MAIL_HEADER_MAP_FIELD_MESSAGE_ID:
+	case MAIL_HEADER_MAP_FIELD_IN_REPLY_TO:
+		p = value;
+		key = message_id_get_next(&p);
+		break;
+	case MAIL_HEADER_MAP_FIELD_LIST_ID:
+		/* phrase <list-id> */
+		p = strchr(value, '<');
+		if (p != NULL && (end = strchr(p, '>')) != NULL)
+			key = t_strdup_until(p + 1, end);
+		break;
+	case MAIL_HEADER_MAP_FIELD_FROM:
+		addr = message_address_parse(pool_datastack_create(),
+					     (const unsigned char *)value,
+					     strlen(value), 2, FALSE);
+		if (addr != NULL && !addr->invalid_syntax &&
+		    addr->mailbox != NULL && addr->domain != NULL) {
+			key = t_strconcat(addr->mailbox, "@",
+					  addr->domain, NULL);
+		}
+		*multiple_r = addr != NULL && addr->next != NULL;
+		break;
+	case MAIL_HEADER_MAP_FIELD_COUNT:
+		i_unreached();
+	}
+	if (key == NULL || *key == '\0') {
+		/* unparseable, use the whole value so that identical
+		   values still get the same key */
+		key = header_map_trim(value);
+		if (*key == '\0')
+			return NULL;
+	}
+	return t_str_lcase(key);
+}
+
+static bool header_map_value_is_simple(const char *value, const char *key)
+{
+	const char *p, *start = NULL, *end;
+
+	/* the value is simple if the only "<...>" it contains is the key.
+	   MIME encoded words and 8bit data are matched by searches after
+	   decoding and normalizing them, so they're never simple. */
+	for (p = value; *p != '\0'; p++) {
+		if ((unsigned char)*p >= 0x80)
+			return FALSE;
+		if (p[0] == '=' && p[1] == '?')
+			return FALSE;
+		if (*p == '<') {
+			if (start != NULL)
+				return FALSE;
+			start = p + 1;
+		}
+	}
+	if (start == NULL || (end = strchr(start, '>')) == NULL)
+		return TRUE;
+	return strlen(key) == (size_t)(end - start) &&
+		strncasecmp(start, key, end - start) == 0;
+}
+
+/* Returns the key for the header's first value, or NULL if there isn't any.
+   complex_r is set to TRUE if the header may contain "<id>" that doesn't
+   match the key. */
+static const char *
+header_map_get_key(enum mail_header_map_field field,
+		   const char *const *values, bool *complex_r)
+{
+	const char *key;
+	bool multiple;
+
+	if (values[0] == NULL) {
+		*complex_r = FALSE;
+		return NULL;
+	}
+	key = header_map_get_value_key(field, values[0], &multiple);
+	*complex_r = values[1] != NULL || multiple ||
+		(key != NULL && !header_map_value_is_simple(values[0], key));
+	return key;
+}
+
+static int
+header_map_rec_get_key(struct header_map_mailbox *hbox,
+		       const struct mail_index_strmap_rec *rec,
+		       const char **key_r)
+{
+	struct mail *mail = hbox->tmp_mail;
+	enum mail_header_map_field field;
+	const char *const *values;
+	bool complex;
+
+	if (!mail_set_uid(mail, rec->uid))
+		return 0;
+
+	field = HEADER_MAP_REF_FIELD(rec->ref_index);
+	if (field < MAIL_HEADER_MAP_FIELD_COUNT) {
+		if (mail_get_headers(mail, header_map_field_names[field],
+				     &values) < 0) {
+			if (mail->expunged) {
+				/* treat it as if it didn't exist */
+				return 0;
+			}
+			hbox->failed = TRUE;
+			return -1;
+		}
+		*key_r = header_map_get_key(field, values, &complex);
+	} else {
+		*key_r = NULL;
+	}
+	if (*key_r == NULL) {
+		/* shouldn't have happened, probably corrupted */
+		mail_storage_set_critical(mail->box->storage,
+			"Corrupted header map index for mailbox %s: "
+			"UID %u lost header %u",
+			mail->box->vname, mail->uid, rec->ref_index);
+		hbox->failed = TRUE;
+		hbox->corrupted = TRUE;
+		return -1;
+	}
+	return 1;
+}
+
+static bool
+header_map_hash_key_cmp(const char *key,
+			const struct mail_index_strmap_rec *rec,
+			void *context)
+{
+	struct header_map_mailbox *hbox = context;
+	const char *rec_key;
+	bool cmp_ret;
+
+	/* complex markers all have an empty key */
+	if (HEADER_MAP_REF_IS_COMPLEX(rec->ref_index))
+		return key[0] == '\0';
+	if (key[0] == '\0')
+		return FALSE;
+
+	/* either a match or a collision, need to look closer */
+	T_BEGIN {
+		cmp_ret = header_map_rec_get_key(hbox, rec, &rec_key) > 0 &&
+			strcmp(rec_key, key) == 0;
+	} T_END;
+	return cmp_ret;
+}
+
+static int
+header_map_hash_rec_cmp(const struct mail_index_strmap_rec *rec1,
+			const struct mail_index_strmap_rec *rec2,
+			void *context)
+{
+	struct header_map_mailbox *hbox = context;
+	const char *key1, *key2;
+	bool complex1, complex2;
+	int ret;
+
+	complex1 = HEADER_MAP_REF_IS_COMPLEX(rec1->ref_index);
+	complex2 = HEADER_MAP_REF_IS_COMPLEX(rec2->ref_index);
+	if (complex1 || complex2)
+		return complex1 && complex2 ? 1 : 0;
+
+	T_BEGIN {
+		ret = header_map_rec_get_key(hbox, rec1, &key1);
+		if (ret > 0)
+			ret = header_map_rec_get_key(hbox, rec2, &key2);
+		ret = ret <= 0 ? -1 :
+			strcmp(key1, key2) == 0;
+	} T_END;
+	return ret;
+}
+
+static void
+header_map_strmap_remap(const uint32_t *idx_map ATTR_UNUSED,
+			unsigned int old_count ATTR_UNUSED,
+			unsigned int new_count ATTR_UNUSED,
+			void *context ATTR_UNUSED)
+{
+	/* nothing is indexed by the string indexes */
+}
+
+static int
+header_map_add_mail(struct header_map_mailbox *hbox,
+		    struct mail_index_strmap_view_sync *sync,
+		    struct mail *mail)
+{
+	enum mail_header_map_field field;
+	const char *const *values, *key;
+	bool complex;
+
+	for (field = 0; field < MAIL_HEADER_MAP_FIELD_COUNT; field++) {
+		if (mail_get_headers(mail, header_map_field_names[field],
+				     &values) < 0) {
+			if (!mail->expunged)
+				return -1;
+			/* Message is expunged. Instead of failing, just
+			   leave out its remaining headers. */
+			return 0;
+		}
+		key = header_map_get_key(field, values, &complex);
+		if (key != NULL) {
+			mail_index_strmap_view_sync_add(sync, mail->uid,
+				HEADER_MAP_REF_KEY(field), key);
+		}
+		if (complex) {
+			mail_index_strmap_view_sync_add(sync, mail->uid,
+				HEADER_MAP_REF_COMPLEX(field), "");
+		}
+	}
+	if (hbox->failed) {
+		/* header lookup failed in hash compare */
+		return -1;
+	}
+	return 0;
+}
+
+static int header_map_update(struct mailbox *box,
+			     struct header_map_mailbox *hbox)
+{
+	struct mailbox_header_lookup_ctx *headers_ctx;
+	struct mail_index_strmap_view_sync *sync;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	uint32_t seq1, seq2;
+	int ret = 0;
+
+	if (hbox->strmap_view == NULL) {
+		hbox->strmap_view =
+			mail_index_strmap_view_open(hbox->strmap, box->view,
+						    header_map_hash_key_cmp,
+						    header_map_hash_rec_cmp,
+						    header_map_strmap_remap,
+						    hbox, &hbox->recs,
+						    &hbox->hash);
+	}
+
+	headers_ctx = mailbox_header_lookup_init(box, header_map_field_names);
+	hbox->tmp_mail = mail_alloc(hbox->t, 0, headers_ctx);
+
+	/* add all missing UIDs */
+	sync = mail_index_strmap_view_sync_init(hbox->strmap_view,
+						&hbox->last_uid);
+	mailbox_get_seq_range(box, hbox->last_uid + 1, (uint32_t)-1,
+			      &seq1, &seq2);
+	if (seq1 == 0) {
+		/* nothing is missing */
+		mail_index_strmap_view_sync_commit(&sync);
+		mailbox_header_lookup_unref(&headers_ctx);
+		return 0;
+	}
+
+	search_args = mail_search_build_init();
+	mail_search_build_add_seqset(search_args, seq1, seq2);
+	search_ctx = mailbox_search_init(hbox->t, search_args, NULL,
+					 0, headers_ctx);
+	mailbox_header_lookup_unref(&headers_ctx);
+	mail_search_args_unref(&search_args);
+
+	while (mailbox_search_next(search_ctx, &mail)) {
+		if (header_map_add_mail(hbox, sync, mail) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0)
+		ret = -1;
+	mail_index_lookup_uid(box->view, seq2, &hbox->last_uid);
+
+	if (ret < 0)
+		mail_index_strmap_view_sync_rollback(&sync);
+	else
+		mail_index_strmap_view_sync_commit(&sync);
+	return ret;
+}
+
+static struct header_map_mailbox *header_map_begin(struct mailbox *box)
+{
+	struct header_map_mailbox *hbox = HEADER_MAP_CONTEXT(box);
+
+	if (hbox == NULL)
+		return NULL;
+
+	i_assert(hbox->t == NULL);
+	hbox->t = mailbox_transaction_begin(box, 0);
+	hbox->failed = FALSE;
+	hbox->corrupted = FALSE;
+	return hbox;
+}
+
+static int header_map_end(struct header_map_mailbox *hbox, int ret)
+{
+	if (hbox->tmp_mail != NULL)
+		mail_free(&hbox->tmp_mail);
+	(void)mailbox_transaction_commit(&hbox->t);
+
+	if (hbox->failed) {
+		ret = -1;
+		if (hbox->corrupted)
+			mail_index_strmap_view_set_corrupted(hbox->strmap_view);
+	}
+	return ret;
+}
+
+int mail_header_map_lookup(struct mailbox *box,
+			   enum mail_header_map_field field, const char *id,
+			   ARRAY_TYPE(seq_range) *uids)
+{
+	struct header_map_mailbox *hbox;
+	ARRAY_TYPE(mail_index_strmap_rec) recs;
+	const struct mail_index_strmap_rec *rec;
+
+	i_assert(field < MAIL_HEADER_MAP_FIELD_COUNT);
+
+	if ((hbox = header_map_begin(box)) == NULL)
+		return 0;
+
+	if (header_map_update(box, hbox) < 0)
+		return header_map_end(hbox, -1);
+
+	t_array_init(&recs, 32);
+	mail_index_strmap_view_lookup(hbox->strmap_view, t_str_lcase(id),
+				      &recs);
+	mail_index_strmap_view_lookup(hbox->strmap_view, "", &recs);
+	array_foreach(&recs, rec) {
+		if (rec->ref_index == HEADER_MAP_REF_KEY(field) ||
+		    rec->ref_index == HEADER_MAP_REF_COMPLEX(field))
+			seq_range_array_add(uids, rec->uid);
+	}
+
+	if (hbox->last_uid < (uint32_t)-1) {
+		seq_range_array_add_range(uids, hbox->last_uid + 1,
+					  (uint32_t)-1);
+	}
+	return header_map_end(hbox, 1);
+}
+
+int mail_header_map_get_duplicates(struct mailbox *box,
+				   enum mail_header_map_field field,
+				   ARRAY_TYPE(seq_range) *uids)
+{
+	struct header_map_mailbox *hbox;
+	const struct mail_index_strmap_rec *recs;
+	unsigned int i, count, highest_idx;
+	uint8_t *str_counts;
+
+	i_assert(field < MAIL_HEADER_MAP_FIELD_COUNT);
+
+	if ((hbox = header_map_begin(box)) == NULL)
+		return 0;
+
+	if (header_map_update(box, hbox) < 0)
+		return header_map_end(hbox, -1);
+
+	recs = array_get(hbox->recs, &count);
+	highest_idx = mail_index_strmap_view_get_highest_idx(hbox->strmap_view);
+	str_counts = i_new(uint8_t, highest_idx + 1);
+	for (i = 0; i < count; i++) {
+		if (recs[i].ref_index == HEADER_MAP_REF_KEY(field) &&
+		    str_counts[recs[i].str_idx] < 2)
+			str_counts[recs[i].str_idx]++;
+	}
+	for (i = 0; i < count; i++) {
+		if (recs[i].ref_index == HEADER_MAP_REF_KEY(field) &&
+		    str_counts[recs[i].str_idx] > 1)
+			seq_range_array_add(uids, recs[i].uid);
+	}
+	i_free(str_counts);
+
+	if (hbox->last_uid < (uint32_t)-1) {
+		seq_range_array_add_range(uids, hbox->last_uid + 1,
+					  (uint32_t)-1);
+	}
+	return header_map_end(hbox, 1);
+}
+
+static void header_map_mailbox_close(struct mailbox *box)
+{
+	struct header_map_mailbox *hbox = HEADER_MAP_CONTEXT(box);
+
+	i_assert(hbox->t == NULL);
+
+	if (hbox->strmap_view != NULL)
+		mail_index_strmap_view_close(&hbox->strmap_view);
+	hbox->module_ctx.super.close(box);
+}
+
+static void header_map_mailbox_free(struct mailbox *box)
+{
+	struct header_map_mailbox *hbox = HEADER_MAP_CONTEXT(box);
+
+	mail_index_strmap_deinit(&hbox->strmap);
+	hbox->module_ctx.super.free(box);
+	i_free(hbox);
+}
+
+void index_header_map_mailbox_opened(struct mailbox *box)
+{
+	struct header_map_mailbox *hbox = HEADER_MAP_CONTEXT(box);
+
+	if (hbox != NULL) {
+		/* mailbox was already opened+closed once. */
+		return;
+	}
+
+	hbox = i_new(struct header_map_mailbox, 1);
+	hbox->module_ctx.super = box->v;
+	box->v.close = header_map_mailbox_close;
+	box->v.free = header_map_mailbox_free;
+
+	hbox->strmap = mail_index_strmap_init_generic(box->index,
+						MAIL_HEADER_MAP_INDEX_SUFFIX);
+	MODULE_CONTEXT_SET(box, header_map_storage_module, hbox);
+}
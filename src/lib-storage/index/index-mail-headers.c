@@ -629,6 +629,7 @@ index_mail_get_raw_headers(struct index_mail *mail, const char *field,
 	if (mail_cache_lookup_headers(_mail->transaction->cache_view, dest,
 				      _mail->seq, &field_idx, 1) <= 0) {
 		/* not in cache / error - first see if it's already parsed */
+		_mail->transaction->stats.cache_miss_count++;
 		p_free(mail->mail.data_pool, dest);
 
 		if (mail->header_seq != mail->data.seq ||
@@ -879,6 +880,7 @@ int index_mail_get_header_stream(struct mail *_mail,
 		return 0;
 	}
 	/* not in cache / error */
+	_mail->transaction->stats.cache_miss_count++;
 	p_free(mail->mail.data_pool, dest);
 
 	if (mail_get_hdr_stream(_mail, NULL, &input) < 0)
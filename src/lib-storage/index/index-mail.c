@@ -16,6 +16,7 @@
 #include "mail-index-modseq.h"
 #include "index-storage.h"
 #include "istream-mail.h"
+#include "index-sort.h"
 #include "index-mail.h"
 
 #include <fcntl.h>
@@ -63,9 +64,53 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
 };
 
+static const struct {
+	enum mail_fetch_field fetch_field;
+	enum index_cache_field cache_field;
+} index_mail_fetch_cache_fields[] = {
+	{ MAIL_FETCH_NUL_STATE, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_IMAP_BODYSTRUCTURE, MAIL_CACHE_FLAGS },
+	{ MAIL_FETCH_DATE, MAIL_CACHE_SENT_DATE },
+	{ MAIL_FETCH_RECEIVED_DATE, MAIL_CACHE_RECEIVED_DATE },
+	{ MAIL_FETCH_SAVE_DATE, MAIL_CACHE_SAVE_DATE },
+	{ MAIL_FETCH_VIRTUAL_SIZE, MAIL_CACHE_VIRTUAL_FULL_SIZE },
+	{ MAIL_FETCH_PHYSICAL_SIZE, MAIL_CACHE_PHYSICAL_FULL_SIZE },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_IMAP_BODY },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_IMAP_BODYSTRUCTURE },
+	{ MAIL_FETCH_IMAP_BODYSTRUCTURE, MAIL_CACHE_IMAP_BODYSTRUCTURE },
+	{ MAIL_FETCH_IMAP_ENVELOPE, MAIL_CACHE_IMAP_ENVELOPE },
+	{ MAIL_FETCH_GUID, MAIL_CACHE_GUID },
+	{ MAIL_FETCH_POP3_ORDER, MAIL_CACHE_POP3_ORDER },
+	{ MAIL_FETCH_MESSAGE_PARTS, MAIL_CACHE_MESSAGE_PARTS },
+	{ MAIL_FETCH_BODY_SNIPPET, MAIL_CACHE_BODY_SNIPPET }
+};
+
 static int index_mail_parse_body(struct index_mail *mail,
 				 enum index_cache_field field);
 
+void index_mail_get_wanted_cache_fields(struct mailbox *box,
+					enum mail_fetch_field wanted_fields,
+					ARRAY_TYPE(uint) *cache_fields)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
+	uint32_t added = 0;
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(index_mail_fetch_cache_fields); i++) {
+		enum index_cache_field field =
+			index_mail_fetch_cache_fields[i].cache_field;
+
+		if ((wanted_fields &
+		     index_mail_fetch_cache_fields[i].fetch_field) != 0 &&
+		    (added & (1 << field)) == 0) {
+			added |= 1 << field;
+			array_append(cache_fields,
+				     &ibox->cache_fields[field].idx, 1);
+		}
+	}
+}
+
 int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 				  unsigned int field_idx)
 {
@@ -75,6 +120,8 @@ int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 				      buf, mail->data.seq, field_idx);
 	if (ret > 0)
 		mail->mail.mail.transaction->stats.cache_hit_count++;
+	else if (ret == 0)
+		mail->mail.mail.transaction->stats.cache_miss_count++;
 	return ret;
 }
 
@@ -2144,12 +2191,22 @@ void index_mail_set_cache_corrupted(struct mail *mail,
 		imail->data.body = NULL;
 		imail->data.bodystructure = NULL;
 		break;
+	case MAIL_FETCH_RECEIVED_DATE:
+		field_name = "received date";
+		imail->data.received_date = (time_t)-1;
+		break;
+	case MAIL_FETCH_DATE:
+		field_name = "sent date";
+		imail->data.sent_date.time = (uint32_t)-1;
+		break;
 	default:
 		field_name = t_strdup_printf("#%x", field);
 	}
 
 	/* make sure we don't cache invalid values */
 	mail_cache_transaction_reset(mail->transaction->cache_trans);
+	/* nor sort by them */
+	index_sort_numbers_reset(mail, field);
 	imail->data.no_caching = TRUE;
 	imail->data.forced_no_caching = TRUE;
 	mail_cache_set_corrupted(mail->box->cache,
@@ -260,6 +260,10 @@ void index_mail_cache_parse_deinit(struct mail *mail, time_t received_date,
 
 int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 				  unsigned int field_idx);
+/* Add the cache fields that are looked up for wanted_fields. */
+void index_mail_get_wanted_cache_fields(struct mailbox *box,
+					enum mail_fetch_field wanted_fields,
+					ARRAY_TYPE(uint) *cache_fields);
 void index_mail_save_finish(struct mail_save_context *ctx);
 
 #endif
@@ -19,6 +19,18 @@ struct index_search_context {
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
+	/* if created, only these sequences can match the root level
+	   args that were looked up from the header map or flag bitmaps */
+	ARRAY_TYPE(seq_range) limit_seqs;
+	unsigned int limit_seqs_idx;
+
+	/* wanted cache fields are looked up in batches up to
+	   cache_batch_seq2 */
+	ARRAY_TYPE(uint) cache_batch_fields;
+	uint32_t cache_batch_seq2;
+
+	/* worker processes check body searches in advance */
+	struct index_search_workers *workers;
 
 	ARRAY(struct mail *) mails;
 	unsigned int unused_mail_idx;
@@ -33,8 +45,31 @@ struct index_search_context {
 	unsigned int have_seqsets:1;
 	unsigned int have_index_args:1;
 	unsigned int have_mailbox_args:1;
+	unsigned int workers_checked:1;
+	/* the workers haven't yet checked the next message */
+	unsigned int workers_pending:1;
 };
 
 struct mail *index_search_get_mail(struct index_search_context *ctx);
 
+/* Returns FALSE if the message can't match the search args. This is called
+   by the search worker processes. */
+bool index_search_seq_may_match(struct index_search_context *ctx,
+				struct mail *mail, uint32_t seq);
+
+/* Start worker processes to search the seq1..ctx->seq2 range. Returns NULL if
+   they couldn't be started. */
+struct index_search_workers *
+index_search_workers_init(struct index_search_context *ctx, uint32_t seq1,
+			  unsigned int worker_count);
+void index_search_workers_deinit(struct index_search_workers **workers);
+/* Returns 1 if the message may match, 0 if the workers found that it can't
+   match, or -1 if the workers haven't checked it yet and didn't finish
+   within timeout_msecs. The sequences must be given in ascending order. */
+int index_search_workers_seq_may_match(struct index_search_workers *workers,
+				       uint32_t seq, unsigned int timeout_msecs);
+/* Reap the stopped worker processes that have exited since. Returns the
+   number of workers that are still running. */
+unsigned int index_search_workers_reap(void);
+
 #endif
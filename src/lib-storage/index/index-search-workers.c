@@ -0,0 +1,370 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Body searches are mostly CPU bound: each message has to be parsed, decoded
+   and matched. The search code isn't thread-safe, so the work is split to
+   forked worker processes instead. Each worker gets a copy of the search
+   context and checks every Nth batch of messages in the seq1..seq2 range.
+   The results are sent back through a pipe as one byte per message: 0 if
+   the message can't match, 1 if it may match. The main process reads the
+   results in order and fully searches only the messages that may match, so
+   any problems with the workers simply mean that more messages need to be
+   searched by the main process. The main process never blocks for longer
+   than the caller wants while waiting for the results.
+
+   The workers must not modify anything, since they may be stopped at any
+   time: the main process stops them by closing the pipe, and they exit
+   before checking the next message. The main process doesn't wait for them
+   to exit, they're reaped later with index_search_workers_reap(). */
+
+#include "lib.h"
+#include "array.h"
+#include "lib-signals.h"
+#include "fd-close-on-exec.h"
+#include "fd-set-nonblock.h"
+#include "write-full.h"
+#include "index-storage.h"
+#include "index-search-private.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/* how many messages each worker checks at a time */
+#define SEARCH_WORKER_BATCH_COUNT 64
+
+struct index_search_worker {
+	pid_t pid;
+	int fd;
+	/* next batch that this worker is going to send */
+	unsigned int next_batch;
+	/* the next batch is read here */
+	unsigned char results[SEARCH_WORKER_BATCH_COUNT];
+	unsigned int results_pos;
+};
+
+struct index_search_workers {
+	struct index_search_context *ctx;
+	uint32_t seq1, seq2;
+	unsigned int batch_count;
+
+	ARRAY(struct index_search_worker) workers;
+
+	/* results for the batch_seq1..batch_seq2 range */
+	uint32_t batch_seq1, batch_seq2;
+	unsigned char results[SEARCH_WORKER_BATCH_COUNT];
+
+	unsigned int failed:1;
+};
+
+/* workers that have been stopped, but which hadn't exited yet */
+static ARRAY(pid_t) stopped_worker_pids;
+
+static bool index_search_worker_is_stopped(int fd)
+{
+	struct pollfd pfd;
+
+	/* the write side of a pipe gets POLLERR once the read side is
+	   closed */
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR) != 0;
+}
+
+static void ATTR_NORETURN
+index_search_worker_run(struct index_search_workers *workers,
+			unsigned int worker_idx, int fd)
+{
+	struct index_search_context *ctx = workers->ctx;
+	unsigned char results[SEARCH_WORKER_BATCH_COUNT];
+	unsigned int batch, worker_count = array_count(&workers->workers);
+	struct mail *mail;
+	uint32_t seq, seq1, seq2;
+
+	/* this process never commits anything, so don't waste time adding
+	   anything to the cache either. it also must not sync the mailbox
+	   (e.g. maildir does that when a file has been renamed), because
+	   it could be stopped while holding locks or writing files. */
+	ctx->box->mail_cache_disabled = TRUE;
+	ctx->box->sync_disabled = TRUE;
+	/* write() fails with EPIPE if the main process stops us while
+	   we're sending results */
+	lib_signals_ignore(SIGPIPE, TRUE);
+
+	mail = mail_alloc(ctx->mail_ctx.transaction, 0, NULL);
+	for (batch = worker_idx; batch < workers->batch_count;
+	     batch += worker_count) {
+		seq1 = workers->seq1 + batch * SEARCH_WORKER_BATCH_COUNT;
+		seq2 = I_MIN(seq1 + SEARCH_WORKER_BATCH_COUNT - 1,
+			     workers->seq2);
+
+		memset(results, 0, sizeof(results));
+		for (seq = seq1; seq <= seq2; seq++) {
+			if (index_search_worker_is_stopped(fd))
+				break;
+			T_BEGIN {
+				results[seq - seq1] =
+					index_search_seq_may_match(ctx, mail,
+								   seq) ? 1 : 0;
+			} T_END;
+		}
+		if (seq <= seq2 ||
+		    write_full(fd, results, sizeof(results)) < 0) {
+			/* the main process doesn't want any more results */
+			break;
+		}
+	}
+	/* don't run any of the main process's deinitialization code */
+	_exit(0);
+}
+
+/* Returns TRUE if the worker process is gone, FALSE if it's still
+   running. */
+static bool index_search_worker_reap(pid_t pid)
+{
+	pid_t ret;
+	int status;
+
+	while ((ret = waitpid(pid, &status, WNOHANG)) < 0) {
+		if (errno != EINTR) {
+			/* ECHILD if something else already waited for it */
+			if (errno != ECHILD)
+				i_error("waitpid(%s) failed: %m", dec2str(pid));
+			return TRUE;
+		}
+	}
+	if (ret == 0)
+		return FALSE;
+
+	if (WIFSIGNALED(status)) {
+		i_error("Search worker process %s was killed by signal %d",
+			dec2str(pid), WTERMSIG(status));
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		i_error("Search worker process %s exited with status %d",
+			dec2str(pid), WEXITSTATUS(status));
+	}
+	return TRUE;
+}
+
+unsigned int index_search_workers_reap(void)
+{
+	const pid_t *pids;
+	unsigned int i, count;
+
+	if (!array_is_created(&stopped_worker_pids))
+		return 0;
+
+	pids = array_get(&stopped_worker_pids, &count);
+	for (i = count; i > 0; i--) {
+		if (index_search_worker_reap(pids[i-1]))
+			array_delete(&stopped_worker_pids, i-1, 1);
+	}
+	count = array_count(&stopped_worker_pids);
+	if (count == 0)
+		array_free(&stopped_worker_pids);
+	return count;
+}
+
+static void index_search_worker_stop(struct index_search_worker *worker)
+{
+	if (worker->fd != -1) {
+		if (close(worker->fd) < 0)
+			i_error("close(search worker pipe) failed: %m");
+		worker->fd = -1;
+	}
+	if (worker->pid == -1)
+		return;
+
+	/* closing the pipe stopped the worker. it finishes the message it's
+	   currently searching and exits, but that could take a while. */
+	if (!index_search_worker_reap(worker->pid)) {
+		if (!array_is_created(&stopped_worker_pids))
+			i_array_init(&stopped_worker_pids, 8);
+		array_append(&stopped_worker_pids, &worker->pid, 1);
+	}
+	worker->pid = -1;
+}
+
+static int
+index_search_worker_start(struct index_search_workers *workers,
+			  unsigned int worker_idx)
+{
+	struct index_search_worker *worker, *other;
+	int fd[2];
+
+	if (pipe(fd) < 0) {
+		i_error("pipe() failed: %m");
+		return -1;
+	}
+	worker = array_idx_modifiable(&workers->workers, worker_idx);
+	worker->next_batch = worker_idx;
+	if ((worker->pid = fork()) < 0) {
+		i_error("fork() failed: %m");
+		i_close_fd(&fd[0]);
+		i_close_fd(&fd[1]);
+		return -1;
+	}
+	if (worker->pid == 0) {
+		/* child */
+		array_foreach_modifiable(&workers->workers, other) {
+			if (other->fd != -1)
+				i_close_fd(&other->fd);
+		}
+		i_close_fd(&fd[0]);
+		index_search_worker_run(workers, worker_idx, fd[1]);
+	}
+	i_close_fd(&fd[1]);
+	fd_close_on_exec(fd[0], TRUE);
+	fd_set_nonblock(fd[0], TRUE);
+	worker->fd = fd[0];
+	return 0;
+}
+
+struct index_search_workers *
+index_search_workers_init(struct index_search_context *ctx, uint32_t seq1,
+			  unsigned int worker_count)
+{
+	struct index_search_workers *workers;
+	struct index_search_worker *worker;
+	unsigned int i;
+
+	i_assert(seq1 <= ctx->seq2);
+
+	/* the workers from the previous searches have most likely exited
+	   by now */
+	(void)index_search_workers_reap();
+
+	workers = i_new(struct index_search_workers, 1);
+	workers->ctx = ctx;
+	workers->seq1 = seq1;
+	workers->seq2 = ctx->seq2;
+	workers->batch_count = (ctx->seq2 - seq1) /
+		SEARCH_WORKER_BATCH_COUNT + 1;
+	if (worker_count > workers->batch_count)
+		worker_count = workers->batch_count;
+
+	i_array_init(&workers->workers, worker_count);
+	for (i = 0; i < worker_count; i++) {
+		worker = array_append_space(&workers->workers);
+		worker->pid = -1;
+		worker->fd = -1;
+	}
+	for (i = 0; i < worker_count; i++) {
+		if (index_search_worker_start(workers, i) < 0) {
+			index_search_workers_deinit(&workers);
+			return NULL;
+		}
+	}
+	return workers;
+}
+
+static void index_search_workers_fail(struct index_search_workers *workers)
+{
+	struct index_search_worker *worker;
+
+	workers->failed = TRUE;
+	array_foreach_modifiable(&workers->workers, worker)
+		index_search_worker_stop(worker);
+}
+
+/* Returns 1 if the batch was read, 0 if the worker didn't send it within
+   timeout_msecs, or -1 if the worker failed. */
+static int
+index_search_workers_read_batch(struct index_search_workers *workers,
+				unsigned int batch, unsigned int timeout_msecs)
+{
+	struct index_search_worker *worker;
+	unsigned int worker_count = array_count(&workers->workers);
+	struct pollfd pfd;
+	ssize_t ret;
+
+	worker = array_idx_modifiable(&workers->workers, batch % worker_count);
+	i_assert(worker->next_batch <= batch);
+
+	/* skip over the batches whose messages were already skipped */
+	while (worker->next_batch <= batch) {
+		ret = read(worker->fd, worker->results + worker->results_pos,
+			   sizeof(worker->results) - worker->results_pos);
+		if (ret > 0) {
+			worker->results_pos += ret;
+			if (worker->results_pos == sizeof(worker->results)) {
+				worker->results_pos = 0;
+				worker->next_batch += worker_count;
+			}
+			continue;
+		}
+		if (ret == 0) {
+			i_error("Search worker process %s died unexpectedly",
+				dec2str(worker->pid));
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN) {
+			i_error("read(search worker pipe) failed: %m");
+			return -1;
+		}
+
+		/* wait for more results, but only once so that the timeout
+		   isn't exceeded */
+		if (timeout_msecs == 0)
+			return 0;
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = worker->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout_msecs) < 0 && errno != EINTR) {
+			i_error("poll(search worker pipe) failed: %m");
+			return -1;
+		}
+		timeout_msecs = 0;
+	}
+	memcpy(workers->results, worker->results, sizeof(workers->results));
+	workers->batch_seq1 = workers->seq1 + batch * SEARCH_WORKER_BATCH_COUNT;
+	workers->batch_seq2 = I_MIN(workers->batch_seq1 +
+				    SEARCH_WORKER_BATCH_COUNT - 1,
+				    workers->seq2);
+	if (worker->next_batch >= workers->batch_count) {
+		/* the worker has nothing more to do */
+		index_search_worker_stop(worker);
+	}
+	return 1;
+}
+
+int index_search_workers_seq_may_match(struct index_search_workers *workers,
+				       uint32_t seq, unsigned int timeout_msecs)
+{
+	int ret;
+
+	if (workers->failed || seq < workers->seq1 || seq > workers->seq2)
+		return 1;
+
+	if (seq < workers->batch_seq1 || seq > workers->batch_seq2) {
+		/* sequences are always looked up in ascending order */
+		i_assert(workers->batch_seq2 == 0 ||
+			 seq > workers->batch_seq2);
+		ret = index_search_workers_read_batch(workers,
+				(seq - workers->seq1) /
+				SEARCH_WORKER_BATCH_COUNT, timeout_msecs);
+		if (ret == 0)
+			return -1;
+		if (ret < 0) {
+			index_search_workers_fail(workers);
+			return 1;
+		}
+	}
+	return workers->results[seq - workers->batch_seq1] != 0 ? 1 : 0;
+}
+
+void index_search_workers_deinit(struct index_search_workers **_workers)
+{
+	struct index_search_workers *workers = *_workers;
+	struct index_search_worker *worker;
+
+	*_workers = NULL;
+
+	array_foreach_modifiable(&workers->workers, worker)
+		index_search_worker_stop(worker);
+	array_free(&workers->workers);
+	i_free(workers);
+}
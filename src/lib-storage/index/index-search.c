@@ -18,6 +18,7 @@
 #include "index-mail.h"
 #include "index-sort.h"
 #include "mail-search.h"
+#include "mail-header-map.h"
 #include "mailbox-search-result-private.h"
 #include "index-search-private.h"
 
@@ -36,6 +37,10 @@
 #define SEARCH_MAX_NONBLOCK_USECS 250000
 #define SEARCH_INITIAL_MAX_COST 30000
 #define SEARCH_RECALC_MIN_USECS 50000
+/* how many messages' wanted cache fields to look up at a time */
+#define SEARCH_CACHE_BATCH_COUNT 1000
+/* don't bother starting search workers for fewer messages */
+#define SEARCH_WORKERS_MIN_MESSAGES 256
 
 struct search_header_context {
         struct index_search_context *index_ctx;
@@ -1008,6 +1013,158 @@ static bool search_limit_by_hdr(struct index_search_context *ctx,
 	return *seq1 <= *seq2;
 }
 
+static bool
+search_arg_get_hdr_map_id(const struct mail_search_arg *arg,
+			  enum mail_header_map_field *field_r,
+			  const char **id_r)
+{
+	const char *value = arg->value.str;
+	size_t i, len;
+
+	switch (arg->type) {
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		break;
+	default:
+		return FALSE;
+	}
+	if (arg->match_not ||
+	    !mail_header_map_field_find(arg->hdr_field_name, field_r))
+		return FALSE;
+
+	/* only complete "<id>" values can be looked up */
+	len = strlen(value);
+	if (len < 3 || value[0] != '<' || value[len-1] != '>')
+		return FALSE;
+	for (i = 1; i < len-1; i++) {
+		if (value[i] <= ' ' || (unsigned char)value[i] >= 0x7f ||
+		    value[i] == '<' || value[i] == '>')
+			return FALSE;
+	}
+	*id_r = t_strndup(value + 1, len - 2);
+	return TRUE;
+}
+
+static void search_limit_seqs_add(struct index_search_context *ctx,
+				  const ARRAY_TYPE(seq_range) *seqs)
+{
+	if (!array_is_created(&ctx->limit_seqs)) {
+		i_array_init(&ctx->limit_seqs, array_count(seqs) + 1);
+		array_append_array(&ctx->limit_seqs, seqs);
+	} else {
+		seq_range_array_intersect(&ctx->limit_seqs, seqs);
+	}
+}
+
+static void search_limit_by_hdr_map(struct index_search_context *ctx,
+				    struct mail_search_arg *args)
+{
+	ARRAY_TYPE(seq_range) uids, seqs;
+	const struct seq_range *range;
+	enum mail_header_map_field field;
+	const char *id;
+	uint32_t seq1, seq2;
+
+	if ((ctx->box->storage->class_flags &
+	     MAIL_STORAGE_CLASS_FLAG_NO_ROOT) != 0) {
+		/* remote storage. building the map would require fetching
+		   all the headers, which is slower than searching them. */
+		return;
+	}
+
+	/* Messages must match all the root level args, so each
+	   HEADER Message-ID <id> etc. limits the sequences that need to be
+	   looked at. The headers are still matched normally, since the map
+	   returns also some messages that don't match. */
+	for (; args != NULL; args = args->next) {
+		if (!search_arg_get_hdr_map_id(args, &field, &id))
+			continue;
+
+		t_array_init(&uids, 32);
+		if (mail_header_map_lookup(ctx->box, field, id, &uids) <= 0)
+			continue;
+
+		t_array_init(&seqs, array_count(&uids));
+		array_foreach(&uids, range) {
+			if (mail_index_lookup_seq_range(ctx->view, range->seq1,
+							range->seq2,
+							&seq1, &seq2))
+				seq_range_array_add_range(&seqs, seq1, seq2);
+		}
+		search_limit_seqs_add(ctx, &seqs);
+	}
+}
+
+static void search_limit_by_flags(struct index_search_context *ctx,
+				  struct mail_search_arg *args)
+{
+	ARRAY_TYPE(seq_range) seqs;
+	enum mail_flags flags, pvt_flags_mask;
+
+	pvt_flags_mask = ctx->box->view_pvt == NULL ? 0 :
+		mailbox_get_private_flags_mask(ctx->box);
+
+	/* Messages must match all the root level args, so the flag and
+	   keyword bitmaps can be used to skip over the messages that can't
+	   match. They're still matched normally, because e.g. the
+	   transaction's own changes aren't in the bitmaps. */
+	for (; args != NULL; args = args->next) {
+		if (args->match_always)
+			continue;
+		switch (args->type) {
+		case SEARCH_FLAGS:
+			flags = args->value.flags;
+			if ((flags & pvt_flags_mask) != 0)
+				continue;
+			if ((flags & MAIL_RECENT) != 0) {
+				/* \Recent isn't in the index records */
+				if (args->match_not)
+					continue;
+				flags &= ~MAIL_RECENT;
+			}
+			if (flags == 0)
+				continue;
+			t_array_init(&seqs, 128);
+			mail_index_lookup_flags_seqs(ctx->view, flags, NULL,
+						     args->match_not, &seqs);
+			break;
+		case SEARCH_KEYWORDS:
+			if (args->initialized.keywords == NULL)
+				continue;
+			t_array_init(&seqs, 128);
+			mail_index_lookup_flags_seqs(ctx->view, 0,
+						     args->initialized.keywords,
+						     args->match_not, &seqs);
+			break;
+		default:
+			continue;
+		}
+		search_limit_seqs_add(ctx, &seqs);
+	}
+}
+
+static void search_limit_by_seqs(struct index_search_context *ctx)
+{
+	const struct seq_range *range;
+	unsigned int count;
+
+	if (!array_is_created(&ctx->limit_seqs))
+		return;
+
+	range = array_get(&ctx->limit_seqs, &count);
+	if (count == 0) {
+		/* no matches */
+		ctx->seq1 = 1;
+		ctx->seq2 = 0;
+		return;
+	}
+	if (ctx->seq1 < range[0].seq1)
+		ctx->seq1 = range[0].seq1;
+	if (ctx->seq2 > range[count-1].seq2)
+		ctx->seq2 = range[count-1].seq2;
+}
+
 static void search_get_seqset(struct index_search_context *ctx,
 			      unsigned int messages_count,
 			      struct mail_search_arg *args)
@@ -1041,7 +1198,13 @@ static void search_get_seqset(struct index_search_context *ctx,
 		/* no matches */
 		ctx->seq1 = 1;
 		ctx->seq2 = 0;
+		return;
 	}
+	T_BEGIN {
+		search_limit_by_hdr_map(ctx, args);
+		search_limit_by_flags(ctx, args);
+	} T_END;
+	search_limit_by_seqs(ctx);
 }
 
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
@@ -1157,19 +1320,24 @@ wanted_sort_fields_get(struct mailbox *box,
 
 		switch (sort_program[i] & MAIL_SORT_MASK) {
 		case MAIL_SORT_ARRIVAL:
-			*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
+			/* the primary ARRIVAL, DATE and SIZE keys are usually
+			   found from the index without accessing the mail */
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
 			break;
 		case MAIL_SORT_CC:
 			header = "Cc";
 			break;
 		case MAIL_SORT_DATE:
-			*wanted_fields_r |= MAIL_FETCH_DATE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_DATE;
 			break;
 		case MAIL_SORT_FROM:
 			header = "From";
 			break;
 		case MAIL_SORT_SIZE:
-			*wanted_fields_r |= MAIL_FETCH_VIRTUAL_SIZE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_VIRTUAL_SIZE;
 			break;
 		case MAIL_SORT_SUBJECT:
 			header = "Subject";
@@ -1194,6 +1362,64 @@ wanted_sort_fields_get(struct mailbox *box,
 	}
 }
 
+static bool search_args_can_batch(const struct mail_search_arg *args)
+{
+	/* batching is useful only if all of the messages in the seq1..seq2
+	   range get returned. so allow only args that match every message,
+	   and sequence sets that are a single range (seq1..seq2 is that
+	   range). flags, keywords and modseqs could exclude any number of
+	   the messages, whose fields would then be looked up for nothing. */
+	for (; args != NULL; args = args->next) {
+		switch (args->type) {
+		case SEARCH_ALL:
+			if (args->match_not)
+				return FALSE;
+			break;
+		case SEARCH_SEQSET:
+		case SEARCH_UIDSET:
+			if (args->match_not ||
+			    array_count(&args->value.seqset) != 1)
+				return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void search_init_cache_batch(struct index_search_context *ctx)
+{
+	if (ctx->mail_ctx.wanted_fields == 0 ||
+	    !search_args_can_batch(ctx->mail_ctx.args->args))
+		return;
+
+	i_array_init(&ctx->cache_batch_fields, 8);
+	index_mail_get_wanted_cache_fields(ctx->box,
+					   ctx->mail_ctx.wanted_fields,
+					   &ctx->cache_batch_fields);
+	if (array_count(&ctx->cache_batch_fields) == 0)
+		array_free(&ctx->cache_batch_fields);
+}
+
+static void search_cache_batch(struct index_search_context *ctx)
+{
+	struct mailbox_transaction_context *t = ctx->mail_ctx.transaction;
+	const unsigned int *fields;
+	unsigned int count;
+	uint32_t seq = ctx->mail_ctx.seq;
+
+	ctx->cache_batch_seq2 = seq + SEARCH_CACHE_BATCH_COUNT - 1;
+	if (ctx->cache_batch_seq2 > ctx->seq2 ||
+	    ctx->cache_batch_seq2 < seq)
+		ctx->cache_batch_seq2 = ctx->seq2;
+
+	/* errors are noticed by the normal lookups */
+	fields = array_get(&ctx->cache_batch_fields, &count);
+	(void)mail_cache_lookup_batch(t->cache_view, seq,
+				      ctx->cache_batch_seq2, fields, count);
+}
+
 struct mail_search_context *
 index_storage_search_init(struct mailbox_transaction_context *t,
 			  struct mail_search_args *args,
@@ -1247,6 +1473,7 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 
 	search_get_seqset(ctx, status.messages, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	search_init_cache_batch(ctx);
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1283,6 +1510,14 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 		index_sort_program_deinit(&ctx->mail_ctx.sort_program);
 	if (ctx->thread_ctx != NULL)
 		mail_thread_deinit(&ctx->thread_ctx);
+	if (ctx->workers != NULL)
+		index_search_workers_deinit(&ctx->workers);
+	if (array_is_created(&ctx->limit_seqs))
+		array_free(&ctx->limit_seqs);
+	if (array_is_created(&ctx->cache_batch_fields)) {
+		mail_cache_lookup_batch_free(_ctx->transaction->cache_view);
+		array_free(&ctx->cache_batch_fields);
+	}
 	array_free(&ctx->mail_ctx.results);
 	array_free(&ctx->mail_ctx.module_contexts);
 
@@ -1505,6 +1740,21 @@ static bool search_would_block(struct index_search_context *ctx)
 	return ret;
 }
 
+/* Returns how many milliseconds can still be spent on this call before the
+   caller should get control back. */
+static unsigned int
+search_nonblock_msecs_left(struct index_search_context *ctx)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = SEARCH_MAX_NONBLOCK_USECS -
+		timeval_diff_usecs(&now, &ctx->last_nonblock_timeval);
+	return usecs <= 0 ? 0 : (usecs + 999) / 1000;
+}
+
 static int search_more_with_mail(struct index_search_context *ctx,
 				 struct mail *mail)
 {
@@ -1529,6 +1779,9 @@ static int search_more_with_mail(struct index_search_context *ctx,
 	cost1 = search_get_cost(mail->transaction);
 	ret = -1;
 	while (box->v.search_next_update_seq(_ctx)) {
+		if (_ctx->seq > ctx->cache_batch_seq2 &&
+		    array_is_created(&ctx->cache_batch_fields))
+			search_cache_batch(ctx);
 		mail_set_seq(mail, _ctx->seq);
 
 		ctx->cur_mail = mail;
@@ -1576,6 +1829,15 @@ static int search_more_with_mail(struct index_search_context *ctx,
 			break;
 		}
 	}
+	if (ctx->workers_pending) {
+		/* we already waited for the workers as long as we could.
+		   the next call gets a full time slice again. */
+		ctx->workers_pending = FALSE;
+		if (gettimeofday(&ctx->last_nonblock_timeval, NULL) < 0)
+			i_fatal("gettimeofday() failed: %m");
+		ctx->cost = 0;
+		ret = 0;
+	}
 	cost2 = search_get_cost(mail->transaction);
 	ctx->cost += cost2 - cost1;
 	return ret;
@@ -1754,6 +2016,88 @@ bool index_storage_search_next_nonblock(struct mail_search_context *_ctx,
 	return TRUE;
 }
 
+bool index_search_seq_may_match(struct index_search_context *ctx,
+				struct mail *mail, uint32_t seq)
+{
+	struct mail_search_arg *args = ctx->mail_ctx.args->args;
+	int ret;
+
+	mail_search_args_reset(args, FALSE);
+	ctx->mail_ctx.seq = seq;
+	ret = mail_search_args_foreach(args, search_seqset_arg, ctx);
+	if (ret != 0 && ctx->have_index_args)
+		ret = mail_search_args_foreach(args, search_index_arg, ctx);
+	if (ret != 0) {
+		mail_set_seq(mail, seq);
+		ctx->cur_mail = mail;
+		ret = search_match_once(ctx);
+		ctx->cur_mail = NULL;
+		/* expunged mails get handled by the main process */
+		if (mail->expunged)
+			ret = -1;
+	}
+	return ret != 0;
+}
+
+static bool
+search_workers_wanted(struct index_search_context *ctx, uint32_t seq1)
+{
+	struct mailbox *box = ctx->box;
+	bool have_headers, have_body;
+
+	if (box->storage->set->mail_search_workers == 0 || ctx->failed ||
+	    ctx->have_mailbox_args || seq1 > ctx->seq2 ||
+	    ctx->seq2 - seq1 + 1 < SEARCH_WORKERS_MIN_MESSAGES)
+		return FALSE;
+
+	/* the workers read the mails independently of the main process. this
+	   works only with local storages that have no per-mailbox file
+	   state, and not with virtual mailboxes. */
+	if ((box->storage->class_flags & (MAIL_STORAGE_CLASS_FLAG_NO_ROOT |
+					  MAIL_STORAGE_CLASS_FLAG_MAILBOX_IS_FILE)) != 0 ||
+	    box->v.search_next_update_seq != index_storage_search_next_update_seq)
+		return FALSE;
+
+	/* only body searches are slow enough to be worth it */
+	(void)mail_search_args_analyze(ctx->mail_ctx.args->args,
+				       &have_headers, &have_body);
+	return have_body;
+}
+
+static void search_workers_start(struct index_search_context *ctx)
+{
+	uint32_t seq1 = ctx->mail_ctx.seq;
+	bool wanted;
+
+	ctx->workers_checked = TRUE;
+	T_BEGIN {
+		wanted = search_workers_wanted(ctx, seq1);
+	} T_END;
+	if (wanted) {
+		ctx->workers = index_search_workers_init(ctx, seq1,
+			ctx->box->storage->set->mail_search_workers);
+	}
+}
+
+static void search_skip_limit_seqs(struct index_search_context *ctx)
+{
+	struct mail_search_context *_ctx = &ctx->mail_ctx;
+	const struct seq_range *range;
+	unsigned int count;
+
+	if (!array_is_created(&ctx->limit_seqs))
+		return;
+
+	range = array_get(&ctx->limit_seqs, &count);
+	while (ctx->limit_seqs_idx < count &&
+	       range[ctx->limit_seqs_idx].seq2 < _ctx->seq)
+		ctx->limit_seqs_idx++;
+	if (ctx->limit_seqs_idx == count)
+		_ctx->seq = ctx->seq2 + 1;
+	else if (_ctx->seq < range[ctx->limit_seqs_idx].seq1)
+		_ctx->seq = range[ctx->limit_seqs_idx].seq1;
+}
+
 bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 {
         struct index_search_context *ctx = (struct index_search_context *)_ctx;
@@ -1766,9 +2110,17 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 	} else {
 		_ctx->seq++;
 	}
+	search_skip_limit_seqs(ctx);
+	if (!ctx->workers_checked && _ctx->seq > ctx->seq1) {
+		/* the first message was already searched by us. this way
+		   the storage's lazily initialized state (e.g. maildir's
+		   uidlist) gets copied to the workers, instead of each of
+		   them initializing it separately. */
+		search_workers_start(ctx);
+	}
 
 	if (!ctx->have_seqsets && !ctx->have_index_args &&
-	    _ctx->update_result == NULL) {
+	    _ctx->update_result == NULL && ctx->workers == NULL) {
 		_ctx->progress_cur = _ctx->seq;
 		return _ctx->seq <= ctx->seq2;
 	}
@@ -1787,21 +2139,34 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 		if (ret != 0 && _ctx->update_result != NULL) {
 			/* see if this message never matches */
 			mail_index_lookup_uid(ctx->view, _ctx->seq, &uid);
-			if (seq_range_exists(&_ctx->update_result->never_uids,
-					     uid))
+			if (seq_bitmap_exists(&_ctx->update_result->never_uids,
+					      uid))
 				ret = 0;
 		}
+		if (ret != 0 && ctx->workers != NULL) {
+			ret = index_search_workers_seq_may_match(ctx->workers,
+				_ctx->seq, search_nonblock_msecs_left(ctx));
+			if (ret < 0) {
+				/* the workers haven't checked this message
+				   yet. don't block waiting for them, retry
+				   it on the next call. */
+				ctx->workers_pending = TRUE;
+				_ctx->seq--;
+				return FALSE;
+			}
+		}
 		if (ret != 0)
 			break;
 
 		/* doesn't, try next one */
 		_ctx->seq++;
+		search_skip_limit_seqs(ctx);
 		mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	}
 
 	if (ret != 0 && _ctx->update_result != NULL) {
 		mail_index_lookup_uid(ctx->view, _ctx->seq, &uid);
-		if (seq_range_exists(&_ctx->update_result->uids, uid)) {
+		if (seq_bitmap_exists(&_ctx->update_result->uids, uid)) {
 			/* we already know that the static data
 			   matches. mark it as such. */
 			search_set_static_matches(_ctx->args->args);
@@ -38,17 +38,112 @@ struct sort_cmp_context {
 
 static struct sort_cmp_context static_node_cmp_context;
 
+/* ARRIVAL, DATE and SIZE keys never change, so once they've been looked up
+   they're stored in an index extension. This way the following sorts don't
+   need to do cache lookups (or even open the mail files) for every message.
+   The extension has the key + 1 as a 32bit integer, or 0 if it isn't known
+   yet. Keys that don't fit (e.g. dates before 1970) are simply looked up
+   every time. If the value the key was taken from is found to be corrupted,
+   index_sort_numbers_reset() sets the key back to 0. */
+static uint32_t
+index_sort_number_ext_register(struct mail_index *index, const char *name)
+{
+	return mail_index_ext_register(index, name, 0,
+				       sizeof(uint32_t), sizeof(uint32_t));
+}
+
+static void
+index_sort_number_init(struct mail_search_sort_program *program,
+		       const char *name)
+{
+	program->number_ext_id =
+		index_sort_number_ext_register(program->t->box->index, name);
+}
+
+static bool
+index_sort_number_lookup(struct mail_search_sort_program *program,
+			 uint32_t seq, uint64_t *num_r)
+{
+	const void *data;
+	bool expunged;
+
+	mail_index_lookup_ext(program->t->view, seq, program->number_ext_id,
+			      &data, &expunged);
+	if (data == NULL || *(const uint32_t *)data == 0)
+		return FALSE;
+	*num_r = *(const uint32_t *)data - 1;
+	return TRUE;
+}
+
+static void
+index_sort_number_update(struct mail_search_sort_program *program,
+			 uint32_t seq, uint64_t num)
+{
+	uint32_t value;
+
+	if (num >= (uint32_t)-1)
+		return;
+	value = num + 1;
+	mail_index_update_ext(program->t->itrans, seq, program->number_ext_id,
+			      &value, NULL);
+}
+
+static void index_sort_number_reset(struct mail *mail, const char *name)
+{
+	uint32_t ext_id, value = 0;
+	const void *data;
+	bool expunged;
+
+	ext_id = index_sort_number_ext_register(mail->box->index, name);
+	mail_index_lookup_ext(mail->transaction->view, mail->seq, ext_id,
+			      &data, &expunged);
+	if (data != NULL) {
+		mail_index_update_ext(mail->transaction->itrans, mail->seq,
+				      ext_id, &value, NULL);
+	}
+}
+
+void index_sort_numbers_reset(struct mail *mail, enum mail_fetch_field field)
+{
+	switch ((int)field) {
+	case 0:
+		index_sort_number_reset(mail, "sort-a");
+		index_sort_number_reset(mail, "sort-d");
+		index_sort_number_reset(mail, "sort-z");
+		break;
+	case MAIL_FETCH_RECEIVED_DATE:
+		/* DATE falls back to the received date */
+		index_sort_number_reset(mail, "sort-a");
+		index_sort_number_reset(mail, "sort-d");
+		break;
+	case MAIL_FETCH_DATE:
+		index_sort_number_reset(mail, "sort-d");
+		break;
+	case MAIL_FETCH_PHYSICAL_SIZE:
+	case MAIL_FETCH_VIRTUAL_SIZE:
+	case MAIL_FETCH_MESSAGE_PARTS:
+		/* virtual size may have been taken from the message parts */
+		index_sort_number_reset(mail, "sort-z");
+		break;
+	}
+}
+
 static void
 index_sort_list_add_arrival(struct mail_search_sort_program *program,
 			    struct mail *mail)
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
+	uint64_t num;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
+	if (index_sort_number_lookup(program, mail->seq, &num))
+		node->date = num;
+	else if (mail_get_received_date(mail, &node->date) < 0)
 		node->date = 0;
+	else if (node->date >= 0)
+		index_sort_number_update(program, mail->seq, node->date);
 }
 
 static void
@@ -57,15 +152,24 @@ index_sort_list_add_date(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
+	uint64_t num;
 	int tz;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_date(mail, &node->date, &tz) < 0)
+	if (index_sort_number_lookup(program, mail->seq, &num))
+		node->date = num;
+	else if (mail_get_date(mail, &node->date, &tz) < 0)
 		node->date = 0;
 	else if (node->date == 0) {
 		if (mail_get_received_date(mail, &node->date) < 0)
 			node->date = 0;
+		else if (node->date >= 0) {
+			index_sort_number_update(program, mail->seq,
+						 node->date);
+		}
+	} else if (node->date > 0) {
+		index_sort_number_update(program, mail->seq, node->date);
 	}
 }
 
@@ -75,11 +179,16 @@ index_sort_list_add_size(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_size) *nodes = program->context;
 	struct mail_sort_node_size *node;
+	uint64_t num;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_virtual_size(mail, &node->size) < 0)
+	if (index_sort_number_lookup(program, mail->seq, &num))
+		node->size = num;
+	else if (mail_get_virtual_size(mail, &node->size) < 0)
 		node->size = 0;
+	else
+		index_sort_number_update(program, mail->seq, node->size);
 }
 
 static uoff_t index_sort_get_pop3_order(struct mail *mail)
@@ -277,10 +386,13 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 		i_array_init(nodes, 128);
 
 		if ((program->sort_program[0] &
-		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL)
+		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL) {
+			index_sort_number_init(program, "sort-a");
 			program->sort_list_add = index_sort_list_add_arrival;
-		else
+		} else {
+			index_sort_number_init(program, "sort-d");
 			program->sort_list_add = index_sort_list_add_date;
+		}
 		program->sort_list_finish = index_sort_list_finish_date;
 		program->context = nodes;
 		break;
@@ -290,6 +402,7 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 
 		nodes = i_malloc(sizeof(*nodes));
 		i_array_init(nodes, 128);
+		index_sort_number_init(program, "sort-z");
 		program->sort_list_add = index_sort_list_add_size;
 		program->sort_list_finish = index_sort_list_finish_size;
 		program->context = nodes;
@@ -15,4 +15,9 @@ void index_sort_list_finish(struct mail_search_sort_program *program);
 bool index_sort_list_next(struct mail_search_sort_program *program,
 			  uint32_t *seq_r);
 
+/* Forget the ARRIVAL/DATE/SIZE sort keys that were stored for the mail if
+   they depend on the given field, which was found to be corrupted. 0 resets
+   all of them. */
+void index_sort_numbers_reset(struct mail *mail, enum mail_fetch_field field);
+
 #endif
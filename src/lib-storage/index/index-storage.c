@@ -7,6 +7,7 @@
 #include "str.h"
 #include "mkdir-parents.h"
 #include "dict.h"
+#include "compression.h"
 #include "mail-index-alloc-cache.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
@@ -71,6 +72,7 @@ static void index_cache_register_defaults(struct mailbox *box)
 	       sizeof(global_cache_fields));
 	mail_cache_register_fields(cache, ibox->cache_fields,
 				   MAIL_INDEX_CACHE_FIELD_COUNT);
+	mail_cache_set_columns(cache, set->mail_cache_columns);
 
 	if (strcmp(set->mail_never_cache_fields, "*") == 0) {
 		/* all caching disabled for now */
@@ -231,6 +233,11 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 	mail_index_set_lock_method(box->index,
 		box->storage->set->parsed_lock_method,
 		mail_storage_get_lock_timeout(box->storage, UINT_MAX));
+	if (box->storage->set->mail_index_log_compress[0] != '\0') {
+		mail_index_set_log_compression(box->index,
+			compression_lookup_handler(
+				box->storage->set->mail_index_log_compress));
+	}
 	return 0;
 }
 
@@ -248,6 +255,9 @@ int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 
 	if (index_storage_mailbox_alloc_index(box) < 0)
 		return -1;
+	/* start reading the index files while we're still doing the other
+	   syscalls */
+	mail_index_prefetch(box->index);
 
 	/* make sure mail_index_set_permissions() has been called */
 	(void)mailbox_get_permissions(box);
@@ -300,6 +310,7 @@ int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 		mail_index_modseq_enable(box->index);
 
 	index_thread_mailbox_opened(box);
+	index_header_map_mailbox_opened(box);
 	hook_mailbox_opened(box);
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "hash.h"
+#include "str-table.h"
 #include "imap-base-subject.h"
 #include "mail-storage-private.h"
 #include "index-thread-private.h"
@@ -38,6 +39,7 @@ struct thread_finish_context {
 
 	struct mail *tmp_mail;
 	struct mail_thread_cache *cache;
+	enum mail_thread_type thread_type;
 
 	ARRAY(struct mail_thread_root_node) roots;
 	ARRAY(struct mail_thread_shadow_node) shadow_nodes;
@@ -58,33 +60,25 @@ struct mail_thread_iterate_context {
 struct subject_gather_context {
 	struct thread_finish_context *ctx;
 
-	pool_t subject_pool;
-	HASH_TABLE(char *, struct mail_thread_root_node *) subject_hash;
+	/* the base subjects are from mail_thread_cache.base_subjects, so
+	   they can be compared by their pointers */
+	HASH_TABLE(const char *, struct mail_thread_root_node *) subject_hash;
 };
 
 static void
 add_base_subject(struct subject_gather_context *ctx, const char *subject,
-		 struct mail_thread_root_node *node)
+		 bool is_reply_or_forward, struct mail_thread_root_node *node)
 {
 	struct mail_thread_root_node *hash_node;
-	char *hash_subject;
-	bool is_reply_or_forward;
-
-	subject = imap_get_base_subject_cased(pool_datastack_create(), subject,
-					      &is_reply_or_forward);
-	/* (ii) If the thread subject is empty, skip this message. */
-	if (*subject == '\0')
-		return;
 
 	/* (iii) Look up the message associated with the thread
 	   subject in the subject table. */
-	if (!hash_table_lookup_full(ctx->subject_hash, subject, &hash_subject,
-				    &hash_node)) {
+	hash_node = hash_table_lookup(ctx->subject_hash, subject);
+	if (hash_node == NULL) {
 		/* (iv) If there is no message in the subject table with the
 		   thread subject, add the current message and the thread
 		   subject to the subject table. */
-		hash_subject = p_strdup(ctx->subject_pool, subject);
-		hash_table_insert(ctx->subject_hash, hash_subject, node);
+		hash_table_insert(ctx->subject_hash, subject, node);
 	} else {
 		/* Otherwise, if the message in the subject table is not a
 		   dummy, AND either of the following criteria are true:
@@ -100,7 +94,7 @@ add_base_subject(struct subject_gather_context *ctx, const char *subject,
 		    (node->dummy ||
 		     (hash_node->reply_or_forward && !is_reply_or_forward))) {
 			hash_node->parent_root_idx1 = node->root_idx1;
-			hash_table_update(ctx->subject_hash, hash_subject, node);
+			hash_table_update(ctx->subject_hash, subject, node);
 		} else {
 			node->parent_root_idx1 = hash_node->root_idx1;
 		}
@@ -141,30 +135,109 @@ thread_lookup_existing(struct thread_finish_context *ctx, uint32_t idx)
 	return node->uid;
 }
 
+static struct mail_thread_msg_info *
+thread_get_msg_info(struct thread_finish_context *ctx, uint32_t idx,
+		    uint32_t uid)
+{
+	struct mail_thread_cache *cache = ctx->cache;
+	struct mail_thread_msg_info *info;
+
+	info = array_idx_modifiable(&cache->msg_infos, idx);
+	if (info->uid != uid) {
+		/* the node was moved or it has a new message */
+		if (info->base_subject != NULL)
+			str_table_unref(cache->base_subjects,
+					&info->base_subject);
+		memset(info, 0, sizeof(*info));
+		info->uid = uid;
+	}
+	return info;
+}
+
+static void thread_set_mail_uid(struct thread_finish_context *ctx,
+				uint32_t uid)
+{
+	if (!mail_set_uid(ctx->tmp_mail, uid)) {
+		/* the UID should have existed. we would have rebuild
+		   the thread tree otherwise. */
+		i_unreached();
+	}
+}
+
 static void
 thread_child_node_fill(struct thread_finish_context *ctx,
 		       struct mail_thread_child_node *child)
 {
+	struct mail_thread_msg_info *info;
+	bool failed = FALSE;
 	int tz;
 
 	child->uid = thread_lookup_existing(ctx, child->idx);
-
-	if (!mail_set_uid(ctx->tmp_mail, child->uid)) {
-		/* the UID should have existed. we would have rebuild
-		   the thread tree otherwise. */
-		i_unreached();
+	info = thread_get_msg_info(ctx, child->idx, child->uid);
+	if (ctx->use_sent_date && info->have_sort_date) {
+		child->sort_date = info->sort_date;
+		return;
 	}
 
+	thread_set_mail_uid(ctx, child->uid);
+
 	/* get sent date if we want to use it and if it's valid */
 	if (!ctx->use_sent_date)
 		child->sort_date = 0;
-	else if (mail_get_date(ctx->tmp_mail, &child->sort_date, &tz) < 0)
+	else if (mail_get_date(ctx->tmp_mail, &child->sort_date, &tz) < 0) {
 		child->sort_date = 0;
+		failed = TRUE;
+	}
 
 	if (child->sort_date == 0) {
 		/* fallback to received date */
-		(void)mail_get_received_date(ctx->tmp_mail, &child->sort_date);
+		if (mail_get_received_date(ctx->tmp_mail,
+					   &child->sort_date) < 0)
+			failed = TRUE;
+	}
+
+	if (ctx->use_sent_date && !failed) {
+		info->sort_date = child->sort_date;
+		info->have_sort_date = TRUE;
+	}
+}
+
+static const char *
+thread_get_base_subject(struct thread_finish_context *ctx, uint32_t idx,
+			bool *reply_or_forward_r)
+{
+	struct mail_thread_msg_info *info;
+	const char *subject;
+	uint32_t uid;
+	int ret;
+
+	uid = thread_lookup_existing(ctx, idx);
+	info = thread_get_msg_info(ctx, idx, uid);
+	if (!info->have_subject) {
+		thread_set_mail_uid(ctx, uid);
+		ret = mail_get_first_header(ctx->tmp_mail, HDR_SUBJECT,
+					    &subject);
+		if (ret < 0) {
+			*reply_or_forward_r = FALSE;
+			return NULL;
+		}
+		if (ret > 0) T_BEGIN {
+			bool reply_or_forward;
+
+			subject = imap_get_base_subject_cased(
+				pool_datastack_create(), subject,
+				&reply_or_forward);
+			if (*subject != '\0') {
+				info->base_subject =
+					str_table_ref(ctx->cache->base_subjects,
+						      subject);
+			}
+			info->reply_or_forward = reply_or_forward;
+		} T_END;
+		info->have_subject = TRUE;
 	}
+	*reply_or_forward_r = info->reply_or_forward;
+	return info->base_subject;
 }
 
 static void
@@ -208,7 +281,8 @@ static void gather_base_subjects(struct thread_finish_context *ctx)
 	unsigned int i, count;
 	ARRAY_TYPE(mail_thread_child_node) sorted_children;
 	const struct mail_thread_child_node *children;
-	uint32_t idx, uid;
+	uint32_t idx;
+	bool reply_or_forward;
 
 	memset(&gather_ctx, 0, sizeof(gather_ctx));
 	gather_ctx.ctx = ctx;
@@ -216,11 +290,8 @@ static void gather_base_subjects(struct thread_finish_context *ctx)
 	roots = array_get_modifiable(&ctx->roots, &count);
 	if (count == 0)
 		return;
-	gather_ctx.subject_pool =
-		pool_alloconly_create(MEMPOOL_GROWING"base subjects",
-				      nearest_power(count * 20));
-	hash_table_create(&gather_ctx.subject_hash, gather_ctx.subject_pool,
-			  count * 2, str_hash, strcmp);
+	hash_table_create_direct(&gather_ctx.subject_hash, default_pool,
+				 count * 2);
 
 	i_array_init(&sorted_children, 64);
 	for (i = 0; i < count; i++) {
@@ -238,21 +309,16 @@ static void gather_base_subjects(struct thread_finish_context *ctx)
 			continue;
 		}
 
-		uid = thread_lookup_existing(ctx, idx);
-		if (!mail_set_uid(ctx->tmp_mail, uid)) {
-			/* the UID should have existed. we would have rebuild
-			   the thread tree otherwise. */
-			i_unreached();
+		subject = thread_get_base_subject(ctx, idx, &reply_or_forward);
+		/* (ii) If the thread subject is empty, skip this message. */
+		if (subject != NULL) {
+			add_base_subject(&gather_ctx, subject,
+					 reply_or_forward, &roots[i]);
 		}
-		if (mail_get_first_header(ctx->tmp_mail, HDR_SUBJECT,
-					  &subject) > 0) T_BEGIN {
-			add_base_subject(&gather_ctx, subject, &roots[i]);
-		} T_END;
 	}
 	i_assert(roots[count-1].parent_root_idx1 <= count);
 	array_free(&sorted_children);
 	hash_table_destroy(&gather_ctx.subject_hash);
-	pool_unref(&gather_ctx.subject_pool);
 }
 
 static void thread_add_shadow_child(struct thread_finish_context *ctx,
@@ -609,6 +675,40 @@ mail_thread_iterate_children(struct mail_thread_iterate_context *parent_iter,
 	return child_iter;
 }
 
+static void thread_finish_context_unref(struct thread_finish_context **_ctx)
+{
+	struct thread_finish_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+
+	i_assert(ctx->refcount > 0);
+	if (--ctx->refcount > 0)
+		return;
+
+	array_free(&ctx->roots);
+	array_free(&ctx->shadow_nodes);
+	i_free(ctx);
+}
+
+void mail_thread_cache_changed(struct mail_thread_cache *cache)
+{
+	if (cache->finished != NULL)
+		thread_finish_context_unref(&cache->finished);
+}
+
+void mail_thread_cache_set_uid_validity(struct mail_thread_cache *cache,
+					uint32_t uid_validity)
+{
+	if (cache->msg_infos_uid_validity == uid_validity)
+		return;
+
+	mail_thread_cache_changed(cache);
+	array_clear(&cache->msg_infos);
+	str_table_deinit(&cache->base_subjects);
+	cache->base_subjects = str_table_init();
+	cache->msg_infos_uid_validity = uid_validity;
+}
+
 struct mail_thread_iterate_context *
 mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 			      struct mail *tmp_mail,
@@ -619,12 +719,26 @@ mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 	struct thread_finish_context *ctx;
 
 	iter = i_new(struct mail_thread_iterate_context, 1);
-	ctx = iter->ctx = i_new(struct thread_finish_context, 1);
-	ctx->refcount = 1;
-	ctx->cache = cache;
-	ctx->tmp_mail = tmp_mail;
-	ctx->return_seqs = return_seqs;
-	mail_thread_finish(ctx, thread_type);
+	if (cache->finished != NULL &&
+	    cache->finished->thread_type == thread_type) {
+		/* nothing has changed since the previous THREAD */
+		ctx = iter->ctx = cache->finished;
+		ctx->refcount++;
+		ctx->tmp_mail = tmp_mail;
+		ctx->return_seqs = return_seqs;
+	} else {
+		mail_thread_cache_changed(cache);
+		ctx = iter->ctx = i_new(struct thread_finish_context, 1);
+		ctx->refcount = 1;
+		ctx->cache = cache;
+		ctx->tmp_mail = tmp_mail;
+		ctx->thread_type = thread_type;
+		ctx->return_seqs = return_seqs;
+		mail_thread_finish(ctx, thread_type);
+
+		cache->finished = ctx;
+		ctx->refcount++;
+	}
 
 	mail_thread_iterate_fill_root(iter);
 	if (return_seqs)
@@ -667,11 +781,7 @@ int mail_thread_iterate_deinit(struct mail_thread_iterate_context **_iter)
 
 	*_iter = NULL;
 
-	if (--iter->ctx->refcount == 0) {
-		array_free(&iter->ctx->roots);
-		array_free(&iter->ctx->shadow_nodes);
-		i_free(iter->ctx);
-	}
+	thread_finish_context_unref(&iter->ctx);
 	array_free(&iter->children);
 	i_free(iter);
 	return 0;
@@ -152,6 +152,7 @@ void mail_thread_add(struct mail_thread_cache *cache,
 	i_assert(msgid_map->ref_index == MAIL_THREAD_NODE_REF_MSGID);
 	i_assert(cache->last_uid <= msgid_map->uid);
 
+	mail_thread_cache_changed(cache);
 	cache->last_uid = msgid_map->uid;
 
 	idx = thread_msg_add(cache, msgid_map->uid, msgid_map->str_idx);
@@ -210,6 +211,7 @@ bool mail_thread_remove(struct mail_thread_cache *cache,
 		*msgid_map_idx += count;
 		return TRUE;
 	}
+	mail_thread_cache_changed(cache);
 
 	node = array_idx_modifiable(&cache->thread_nodes, idx);
 	if (node->expunge_rebuilds) {
@@ -44,6 +44,22 @@ ARRAY_DEFINE_TYPE(mail_thread_node, struct mail_thread_node);
 #define MAIL_THREAD_NODE_EXISTS(node) \
 	((node)->uid != 0)
 
+/* Sort date and base subject of a message. They never change, so they're
+   kept over THREAD commands. */
+struct mail_thread_msg_info {
+	/* UID that the fields are for, 0 = nothing looked up yet */
+	uint32_t uid;
+	/* sent date, or received date if the sent date isn't valid */
+	time_t sort_date;
+	/* base subject from mail_thread_cache.base_subjects, NULL if empty */
+	const char *base_subject;
+
+	unsigned int have_sort_date:1;
+	unsigned int have_subject:1;
+	unsigned int reply_or_forward:1;
+};
+ARRAY_DEFINE_TYPE(mail_thread_msg_info, struct mail_thread_msg_info);
+
 struct mail_thread_cache {
 	uint32_t last_uid;
 	/* indexes used for invalid Message-IDs. that means no other messages
@@ -56,6 +72,15 @@ struct mail_thread_cache {
 
 	/* indexed by mail_index_strmap_rec.str_idx */
 	ARRAY_TYPE(mail_thread_node) thread_nodes;
+	/* indexed the same as thread_nodes. the UID is checked, so the
+	   nodes can be moved around without updating these. */
+	ARRAY_TYPE(mail_thread_msg_info) msg_infos;
+	struct str_table *base_subjects;
+	uint32_t msg_infos_uid_validity;
+
+	/* The finished thread tree. It's reused by the following THREAD
+	   commands until thread_nodes change. */
+	struct thread_finish_context *finished;
 };
 
 static inline uint32_t crc32_str_nonzero(const char *str)
@@ -71,6 +96,14 @@ bool mail_thread_remove(struct mail_thread_cache *cache,
 			const struct mail_index_strmap_rec *msgid_map,
 			unsigned int *msgid_map_idx);
 
+/* thread_nodes were changed, so the finished thread tree can't be used
+   anymore. */
+void mail_thread_cache_changed(struct mail_thread_cache *cache);
+/* Forget the sort dates and base subjects of all messages if UIDVALIDITY
+   has changed since they were looked up. */
+void mail_thread_cache_set_uid_validity(struct mail_thread_cache *cache,
+					uint32_t uid_validity);
+
 struct mail_thread_iterate_context *
 mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 			      struct mail *tmp_mail,
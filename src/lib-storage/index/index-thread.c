@@ -6,6 +6,7 @@
 #include "array.h"
 #include "bsearch-insert-pos.h"
 #include "hash2.h"
+#include "str-table.h"
 #include "message-id.h"
 #include "mail-search.h"
 #include "mail-search-build.h"
@@ -177,6 +178,7 @@ static void mail_thread_strmap_remap(const uint32_t *idx_map,
 		mailbox_search_result_free(&cache->search_result);
 		return;
 	}
+	mail_thread_cache_changed(cache);
 
 	invalid_count = cache->next_invalid_msgid_str_idx -
 		cache->first_invalid_msgid_str_idx;
@@ -468,6 +470,7 @@ mail_thread_cache_fix_invalid_indexes(struct mail_thread_mailbox *tbox)
 			cache->next_invalid_msgid_str_idx = new_first_idx;
 	} else if (highest_idx >= cache->first_invalid_msgid_str_idx) {
 		/* conflict - move the invalid indexes forward */
+		mail_thread_cache_changed(cache);
 		array_copy(&cache->thread_nodes.arr, new_first_idx,
 			   &cache->thread_nodes.arr,
 			   cache->first_invalid_msgid_str_idx, count);
@@ -501,6 +504,7 @@ static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 				       struct mail_search_context *search_ctx)
 {
 	struct mail_thread_cache *cache = tbox->cache;
+	struct mailbox_status status;
 	struct mail *mail;
 	const struct mail_index_strmap_rec *msgid_map;
 	unsigned int i, count;
@@ -515,6 +519,9 @@ static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 	}
 
 	cache->last_uid = 0;
+	mail_thread_cache_changed(cache);
+	mailbox_get_open_status(ctx->box, STATUS_UIDVALIDITY, &status);
+	mail_thread_cache_set_uid_validity(cache, status.uidvalidity);
 	cache->first_invalid_msgid_str_idx = cache->next_invalid_msgid_str_idx =
 		mail_index_strmap_view_get_highest_idx(tbox->strmap_view) + 1 +
 		THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
@@ -625,6 +632,7 @@ static void mail_thread_mailbox_close(struct mailbox *box)
 		mail_index_strmap_view_close(&tbox->strmap_view);
 	if (tbox->cache->search_result != NULL)
 		mailbox_search_result_free(&tbox->cache->search_result);
+	mail_thread_cache_changed(tbox->cache);
 	tbox->module_ctx.super.close(box);
 }
 
@@ -636,6 +644,8 @@ static void mail_thread_mailbox_free(struct mailbox *box)
 	tbox->module_ctx.super.free(box);
 
 	array_free(&tbox->cache->thread_nodes);
+	array_free(&tbox->cache->msg_infos);
+	str_table_deinit(&tbox->cache->base_subjects);
 	i_free(tbox->cache);
 	i_free(tbox);
 }
@@ -660,6 +670,8 @@ void index_thread_mailbox_opened(struct mailbox *box)
 
 	tbox->cache = i_new(struct mail_thread_cache, 1);
 	i_array_init(&tbox->cache->thread_nodes, 128);
+	i_array_init(&tbox->cache->msg_infos, 128);
+	tbox->cache->base_subjects = str_table_init();
 
 	MODULE_CONTEXT_SET(box, mail_thread_storage_module, tbox);
 }
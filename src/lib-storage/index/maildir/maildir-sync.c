@@ -1048,6 +1048,12 @@ int maildir_storage_sync_force(struct maildir_mailbox *mbox, uint32_t uid)
 	bool lost_files;
 	int ret;
 
+	if (mbox->box.sync_disabled) {
+		mail_storage_set_error(&mbox->storage->storage, MAIL_ERROR_TEMP,
+				       "Mailbox syncing is disabled");
+		return -1;
+	}
+
 	ret = maildir_sync_run(mbox, MAILBOX_SYNC_FLAG_FAST,
 			       TRUE, &uid, &lost_files);
 	if (uid != 0) {
@@ -0,0 +1,410 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "hostpid.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-search.h"
+#include "mail-search-build.h"
+#include "mail-header-map.h"
+#include "index-storage.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct test_message {
+	/* NULL-terminated list of Message-ID header values */
+	const char *message_ids[3];
+	const char *from;
+};
+
+/* The mailbox's messages with UIDs 1.. */
+static const struct test_message test_messages[] = {
+	{ { "<a@example.com>", NULL }, "User A <a@example.com>" },
+	{ { "<b@example.com>", NULL }, "b@example.com" },
+	{ { " <A@EXAMPLE.com> ", NULL }, "\"A\" <A@example.COM>" },
+	/* several ids, encoded words and duplicate headers are always
+	   candidates */
+	{ { "<c@example.com> <d@example.com>", NULL }, NULL },
+	{ { NULL }, "b@example.com, a@example.com" },
+	{ { "<b@example.com>", NULL }, NULL },
+	{ { "=?utf-8?q?foo?= <e@example.com>", NULL }, NULL },
+	{ { "<f@example.com>", "<a@example.com>", NULL }, NULL },
+	{ { "<g@example.com>", NULL }, NULL },
+	/* added later */
+	{ { "<g@example.com>", NULL }, NULL },
+	{ { "<h@example.com>", NULL }, NULL }
+};
+#define TEST_INITIAL_MESSAGES_COUNT 9
+
+struct test_search_context {
+	struct mail_search_context ctx;
+	struct mail *mail;
+	uint32_t seq;
+};
+
+struct mail_storage_module_register mail_storage_module_register = { 0 };
+
+static struct ioloop *ioloop;
+static char index_dir[128];
+static struct mail_index *test_index;
+static struct mail_search_args test_search_args;
+static uint32_t test_search_seq1, test_search_seq2;
+static unsigned int test_critical_count;
+
+struct mailbox_transaction_context *
+mailbox_transaction_begin(struct mailbox *box,
+			  enum mailbox_transaction_flags flags ATTR_UNUSED)
+{
+	struct mailbox_transaction_context *t;
+
+	t = i_new(struct mailbox_transaction_context, 1);
+	t->box = box;
+	return t;
+}
+
+int mailbox_transaction_commit(struct mailbox_transaction_context **t)
+{
+	i_free(*t);
+	return 0;
+}
+
+struct mailbox_header_lookup_ctx *
+mailbox_header_lookup_init(struct mailbox *box ATTR_UNUSED,
+			   const char *const headers[] ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void mailbox_header_lookup_unref(struct mailbox_header_lookup_ctx **ctx)
+{
+	*ctx = NULL;
+}
+
+void mailbox_get_seq_range(struct mailbox *box, uint32_t uid1, uint32_t uid2,
+			   uint32_t *seq1_r, uint32_t *seq2_r)
+{
+	if (!mail_index_lookup_seq_range(box->view, uid1, uid2,
+					 seq1_r, seq2_r))
+		*seq1_r = *seq2_r = 0;
+}
+
+struct mail *
+mail_alloc(struct mailbox_transaction_context *t,
+	   enum mail_fetch_field wanted_fields ATTR_UNUSED,
+	   struct mailbox_header_lookup_ctx *wanted_headers ATTR_UNUSED)
+{
+	struct mail *mail;
+
+	mail = i_new(struct mail, 1);
+	mail->box = t->box;
+	mail->transaction = t;
+	return mail;
+}
+
+void mail_free(struct mail **mail)
+{
+	i_free(*mail);
+}
+
+bool mail_set_uid(struct mail *mail, uint32_t uid)
+{
+	uint32_t seq;
+
+	if (!mail_index_lookup_seq(mail->box->view, uid, &seq))
+		return FALSE;
+	mail->seq = seq;
+	mail->uid = uid;
+	return TRUE;
+}
+
+int mail_get_headers(struct mail *mail, const char *field,
+		     const char *const **value_r)
+{
+	const struct test_message *msg;
+	const char **values;
+
+	i_assert(mail->uid > 0 && mail->uid <= N_ELEMENTS(test_messages));
+	msg = &test_messages[mail->uid - 1];
+
+	values = t_new(const char *, 2);
+	if (strcasecmp(field, "Message-ID") == 0)
+		*value_r = msg->message_ids;
+	else if (strcasecmp(field, "From") == 0) {
+		values[0] = msg->from;
+		*value_r = values;
+	} else {
+		*value_r = values;
+	}
+	return 0;
+}
+
+struct mail_search_args *mail_search_build_init(void)
+{
+	return &test_search_args;
+}
+
+void mail_search_build_add_seqset(struct mail_search_args *args ATTR_UNUSED,
+				  uint32_t seq1, uint32_t seq2)
+{
+	test_search_seq1 = seq1;
+	test_search_seq2 = seq2;
+}
+
+void mail_search_args_unref(struct mail_search_args **args)
+{
+	*args = NULL;
+}
+
+struct mail_search_context *
+mailbox_search_init(struct mailbox_transaction_context *t,
+		    struct mail_search_args *args ATTR_UNUSED,
+		    const enum mail_sort_type *sort_program ATTR_UNUSED,
+		    enum mail_fetch_field wanted_fields ATTR_UNUSED,
+		    struct mailbox_header_lookup_ctx *wanted_headers ATTR_UNUSED)
+{
+	struct test_search_context *ctx;
+
+	ctx = i_new(struct test_search_context, 1);
+	ctx->ctx.transaction = t;
+	ctx->mail = mail_alloc(t, 0, NULL);
+	ctx->seq = test_search_seq1;
+	return &ctx->ctx;
+}
+
+bool mailbox_search_next(struct mail_search_context *_ctx,
+			 struct mail **mail_r)
+{
+	struct test_search_context *ctx = (struct test_search_context *)_ctx;
+
+	if (ctx->seq > test_search_seq2)
+		return FALSE;
+	ctx->mail->seq = ctx->seq++;
+	mail_index_lookup_uid(ctx->mail->box->view, ctx->mail->seq,
+			      &ctx->mail->uid);
+	*mail_r = ctx->mail;
+	return TRUE;
+}
+
+int mailbox_search_deinit(struct mail_search_context **_ctx)
+{
+	struct test_search_context *ctx =
+		(struct test_search_context *)*_ctx;
+
+	*_ctx = NULL;
+	mail_free(&ctx->mail);
+	i_free(ctx);
+	return 0;
+}
+
+void mail_storage_set_critical(struct mail_storage *storage ATTR_UNUSED,
+			       const char *fmt ATTR_UNUSED, ...)
+{
+	test_critical_count++;
+}
+
+static void test_mailbox_close(struct mailbox *box ATTR_UNUSED)
+{
+}
+
+static void test_mailbox_free(struct mailbox *box ATTR_UNUSED)
+{
+}
+
+static void test_append(unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const struct mail_index_header *hdr;
+	uint32_t uid_validity = 1234, seq;
+	unsigned int i;
+
+	view = mail_index_view_open(test_index);
+	hdr = mail_index_get_header(view);
+	trans = mail_index_transaction_begin(view, 0);
+	if (hdr->uid_validity == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(trans, hdr->next_uid + i, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+}
+
+static void test_expunge_uid(uint32_t uid)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq;
+
+	if (mail_index_sync_begin(test_index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_index_lookup_seq(view, uid, &seq))
+		mail_index_expunge(trans, seq);
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+}
+
+static void test_mailbox_open(struct mailbox *box)
+{
+	memset(box, 0, sizeof(*box));
+	box->vname = "INBOX";
+	box->index = test_index;
+	(void)mail_index_refresh(test_index);
+	box->view = mail_index_view_open(test_index);
+	box->v.close = test_mailbox_close;
+	box->v.free = test_mailbox_free;
+	p_array_init(&box->module_contexts, default_pool, 5);
+	index_header_map_mailbox_opened(box);
+}
+
+static void test_mailbox_deinit(struct mailbox *box)
+{
+	box->v.close(box);
+	box->v.free(box);
+	mail_index_view_close(&box->view);
+	array_free(&box->module_contexts);
+}
+
+/* Verify that uids contain exactly the given UIDs, followed by all the UIDs
+   that weren't in the map yet. */
+static bool
+test_uids_equal(const ARRAY_TYPE(seq_range) *uids,
+		const uint32_t *expected_uids, unsigned int count,
+		uint32_t next_uid)
+{
+	ARRAY_TYPE(seq_range) expected;
+	unsigned int i;
+
+	t_array_init(&expected, count + 1);
+	for (i = 0; i < count; i++)
+		seq_range_array_add(&expected, expected_uids[i]);
+	seq_range_array_add_range(&expected, next_uid, (uint32_t)-1);
+	return array_cmp(uids, &expected);
+}
+
+static void test_header_map_init(void)
+{
+	ioloop = io_loop_create();
+	i_snprintf(index_dir, sizeof(index_dir),
+		   "/tmp/test-index-header-map.%s", my_pid);
+	if (mkdir(index_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", index_dir);
+	test_index = mail_index_alloc(index_dir, "dovecot.index");
+	if (mail_index_open_or_create(test_index,
+				      MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", index_dir);
+	test_append(TEST_INITIAL_MESSAGES_COUNT);
+	test_critical_count = 0;
+}
+
+static void test_header_map_deinit(void)
+{
+	mail_index_close(test_index);
+	mail_index_free(&test_index);
+	if (unlink_directory(index_dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", index_dir);
+	io_loop_destroy(&ioloop);
+}
+
+static void test_header_map_lookup(void)
+{
+	static const uint32_t msgid_a_uids[] = { 1, 3, 4, 7, 8 };
+	static const uint32_t msgid_g_uids[] = { 4, 7, 8, 9, 10 };
+	static const uint32_t from_a_uids[] = { 1, 3, 5 };
+	struct mailbox box;
+	ARRAY_TYPE(seq_range) uids;
+
+	test_begin("header map lookup");
+	test_header_map_init();
+	test_mailbox_open(&box);
+
+	/* the key is matched case-insensitively, and the messages that may
+	   have the id somewhere else in the header are candidates */
+	t_array_init(&uids, 8);
+	test_assert(mail_header_map_lookup(&box,
+			MAIL_HEADER_MAP_FIELD_MESSAGE_ID, "A@example.com",
+			&uids) == 1);
+	test_assert(test_uids_equal(&uids, msgid_a_uids,
+				    N_ELEMENTS(msgid_a_uids),
+				    TEST_INITIAL_MESSAGES_COUNT + 1));
+
+	array_clear(&uids);
+	test_assert(mail_header_map_lookup(&box, MAIL_HEADER_MAP_FIELD_FROM,
+					   "a@example.com", &uids) == 1);
+	test_assert(test_uids_equal(&uids, from_a_uids,
+				    N_ELEMENTS(from_a_uids),
+				    TEST_INITIAL_MESSAGES_COUNT + 1));
+
+	test_mailbox_deinit(&box);
+
+	/* messages added after the map was updated are added to it by
+	   the next lookup */
+	test_append(2);
+	test_mailbox_open(&box);
+	array_clear(&uids);
+	test_assert(mail_header_map_lookup(&box,
+			MAIL_HEADER_MAP_FIELD_MESSAGE_ID, "g@example.com",
+			&uids) == 1);
+	test_assert(test_uids_equal(&uids, msgid_g_uids,
+				    N_ELEMENTS(msgid_g_uids),
+				    N_ELEMENTS(test_messages) + 1));
+	test_mailbox_deinit(&box);
+
+	test_assert(test_critical_count == 0);
+	test_header_map_deinit();
+	test_end();
+}
+
+static void test_header_map_duplicates(void)
+{
+	static const uint32_t dup_uids[] = { 1, 2, 3, 6 };
+	static const uint32_t dup_uids2[] = { 2, 6, 9, 10 };
+	struct mailbox box;
+	ARRAY_TYPE(seq_range) uids;
+
+	test_begin("header map duplicates");
+	test_header_map_init();
+	test_mailbox_open(&box);
+
+	/* only the first Message-ID header's key counts, so UIDs 4 and 8
+	   aren't duplicates of anything */
+	t_array_init(&uids, 8);
+	test_assert(mail_header_map_get_duplicates(&box,
+			MAIL_HEADER_MAP_FIELD_MESSAGE_ID, &uids) == 1);
+	test_assert(test_uids_equal(&uids, dup_uids, N_ELEMENTS(dup_uids),
+				    TEST_INITIAL_MESSAGES_COUNT + 1));
+	test_mailbox_deinit(&box);
+
+	/* reopen the map from the file after expunges and new messages */
+	test_expunge_uid(1);
+	test_append(2);
+	test_mailbox_open(&box);
+	array_clear(&uids);
+	test_assert(mail_header_map_get_duplicates(&box,
+			MAIL_HEADER_MAP_FIELD_MESSAGE_ID, &uids) == 1);
+	test_assert(test_uids_equal(&uids, dup_uids2, N_ELEMENTS(dup_uids2),
+				    N_ELEMENTS(test_messages) + 1));
+	test_mailbox_deinit(&box);
+
+	test_assert(test_critical_count == 0);
+	test_header_map_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_header_map_lookup,
+		test_header_map_duplicates,
+		NULL
+	};
+	return test_run(test_functions);
+}
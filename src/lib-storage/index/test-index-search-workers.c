@@ -0,0 +1,287 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "test-common.h"
+#include "index-storage.h"
+#include "index-search-private.h"
+
+#include <unistd.h>
+
+#define TEST_SEQ_COUNT 1000
+
+static uint32_t test_worker_exit_seq;
+static unsigned int test_worker_delay_usecs;
+static uint32_t test_worker_sleep_seq;
+static unsigned int test_error_count;
+
+static bool test_seq_matches(uint32_t seq)
+{
+	return seq % 3 == 0 || seq % 7 == 0;
+}
+
+struct mail *
+mail_alloc(struct mailbox_transaction_context *t ATTR_UNUSED,
+	   enum mail_fetch_field wanted_fields ATTR_UNUSED,
+	   struct mailbox_header_lookup_ctx *wanted_headers ATTR_UNUSED)
+{
+	return NULL;
+}
+
+bool index_search_seq_may_match(struct index_search_context *ctx,
+				struct mail *mail ATTR_UNUSED, uint32_t seq)
+{
+	/* this is called only by the worker processes */
+	if (!ctx->box->mail_cache_disabled || !ctx->box->sync_disabled)
+		_exit(2);
+	if (seq == test_worker_exit_seq)
+		_exit(1);
+	if (test_worker_delay_usecs != 0)
+		usleep(test_worker_delay_usecs);
+	if (seq == test_worker_sleep_seq)
+		sleep(2);
+	return test_seq_matches(seq);
+}
+
+static void ATTR_FORMAT(2, 0)
+test_error_handler(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_error_count++;
+}
+
+/* Wait for the workers' result as long as it takes */
+static bool
+test_seq_may_match(struct index_search_workers *workers, uint32_t seq)
+{
+	int ret;
+
+	while ((ret = index_search_workers_seq_may_match(workers, seq,
+							 1000)) < 0) ;
+	return ret > 0;
+}
+
+/* Returns TRUE if all the stopped workers exited within a few seconds */
+static bool test_workers_reap(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 5000; i++) {
+		if (index_search_workers_reap() == 0)
+			return TRUE;
+		usleep(1000);
+	}
+	return FALSE;
+}
+
+static void test_search_ctx_init(struct index_search_context *ctx,
+				 struct mailbox *box, uint32_t seq2)
+{
+	memset(box, 0, sizeof(*box));
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->box = box;
+	ctx->seq2 = seq2;
+}
+
+static void test_index_search_workers_ordering(void)
+{
+	static const unsigned int worker_counts[] = { 1, 3, 8, 100 };
+	static const uint32_t seq1s[] = { 1, 5, 64, 65 };
+	struct index_search_context ctx;
+	struct mailbox box;
+	struct index_search_workers *workers;
+	unsigned int i, j;
+	uint32_t seq;
+	bool success = TRUE;
+
+	test_begin("search workers result ordering");
+	for (i = 0; i < N_ELEMENTS(worker_counts); i++) {
+		for (j = 0; j < N_ELEMENTS(seq1s); j++) {
+			test_search_ctx_init(&ctx, &box, TEST_SEQ_COUNT);
+			workers = index_search_workers_init(&ctx, seq1s[j],
+							    worker_counts[i]);
+			test_assert(workers != NULL);
+			if (workers == NULL)
+				continue;
+			for (seq = 1; seq <= TEST_SEQ_COUNT + 1; seq++) {
+				bool expected = seq < seq1s[j] ||
+					seq > TEST_SEQ_COUNT ||
+					test_seq_matches(seq);
+				if (test_seq_may_match(workers, seq) != expected)
+					success = FALSE;
+			}
+			index_search_workers_deinit(&workers);
+		}
+	}
+	test_assert(success);
+	/* the main process's mailbox isn't modified */
+	test_assert(!box.mail_cache_disabled && !box.sync_disabled);
+	test_end();
+}
+
+static void test_index_search_workers_skip(void)
+{
+	struct index_search_context ctx;
+	struct mailbox box;
+	struct index_search_workers *workers;
+	uint32_t seq;
+	bool success = TRUE;
+
+	test_begin("search workers skipping batches");
+	test_search_ctx_init(&ctx, &box, TEST_SEQ_COUNT);
+	workers = index_search_workers_init(&ctx, 1, 3);
+	test_assert(workers != NULL);
+	for (seq = 7; seq <= TEST_SEQ_COUNT && workers != NULL; seq += 97) {
+		if (test_seq_may_match(workers, seq) != test_seq_matches(seq))
+			success = FALSE;
+	}
+	test_assert(success);
+	if (workers != NULL)
+		index_search_workers_deinit(&workers);
+	test_end();
+}
+
+static void test_index_search_workers_stop(void)
+{
+	struct index_search_context ctx;
+	struct mailbox box;
+	struct index_search_workers *workers;
+	failure_callback_t *fatal_callback, *error_callback;
+	failure_callback_t *info_callback, *debug_callback;
+	uint32_t seq;
+	bool success = TRUE;
+
+	test_begin("search workers stopped early");
+	i_get_failure_handlers(&fatal_callback, &error_callback,
+			       &info_callback, &debug_callback);
+	i_set_error_handler(test_error_handler);
+	test_error_count = 0;
+
+	/* the workers are still busy when they're stopped. stopping doesn't
+	   wait for them, but they exit by themselves without any errors. */
+	test_worker_delay_usecs = 1000;
+	test_search_ctx_init(&ctx, &box, TEST_SEQ_COUNT);
+	workers = index_search_workers_init(&ctx, 1, 4);
+	test_assert(workers != NULL);
+	for (seq = 1; seq <= 10 && workers != NULL; seq++) {
+		if (test_seq_may_match(workers, seq) != test_seq_matches(seq))
+			success = FALSE;
+	}
+	test_assert(success);
+	if (workers != NULL)
+		index_search_workers_deinit(&workers);
+	test_assert(test_workers_reap());
+	test_worker_delay_usecs = 0;
+
+	i_set_error_handler(error_callback);
+	test_assert(test_error_count == 0);
+	test_end();
+}
+
+static void test_index_search_workers_nonblock(void)
+{
+	struct index_search_context ctx;
+	struct mailbox box;
+	struct index_search_workers *workers;
+	struct timeval start, end;
+	unsigned int pending_count = 0;
+	uint32_t seq;
+	bool success = TRUE;
+	int ret;
+
+	test_begin("search workers nonblocking");
+	/* each batch takes the workers more than 100 ms, and the second
+	   worker gets stuck for a while in its first batch */
+	test_worker_delay_usecs = 2000;
+	test_worker_sleep_seq = 70;
+	test_search_ctx_init(&ctx, &box, TEST_SEQ_COUNT);
+	workers = index_search_workers_init(&ctx, 1, 2);
+	test_assert(workers != NULL);
+	if (workers != NULL) {
+		test_assert(index_search_workers_seq_may_match(workers, 1, 0) < 0);
+		if (gettimeofday(&start, NULL) < 0)
+			i_fatal("gettimeofday() failed: %m");
+		test_assert(index_search_workers_seq_may_match(workers, 1, 10) < 0);
+		if (gettimeofday(&end, NULL) < 0)
+			i_fatal("gettimeofday() failed: %m");
+		test_assert(timeval_diff_msecs(&end, &start) < 100);
+	}
+
+	/* the results come in eventually */
+	for (seq = 1; seq <= 64 && workers != NULL; seq++) {
+		while ((ret = index_search_workers_seq_may_match(workers, seq,
+								 10)) < 0)
+			pending_count++;
+		if ((ret > 0) != test_seq_matches(seq))
+			success = FALSE;
+	}
+	test_assert(success);
+	test_assert(pending_count > 0);
+
+	/* stopping doesn't wait for the stuck worker */
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	if (workers != NULL)
+		index_search_workers_deinit(&workers);
+	test_assert(index_search_workers_reap() > 0);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	test_assert(timeval_diff_msecs(&end, &start) < 1000);
+	test_assert(test_workers_reap());
+	test_worker_delay_usecs = 0;
+	test_worker_sleep_seq = 0;
+	test_end();
+}
+
+static void test_index_search_workers_failure(void)
+{
+	struct index_search_context ctx;
+	struct mailbox box;
+	struct index_search_workers *workers;
+	failure_callback_t *fatal_callback, *error_callback;
+	failure_callback_t *info_callback, *debug_callback;
+	uint32_t seq, fail_batch_seq1;
+	bool success = TRUE;
+
+	test_begin("search workers failure");
+	i_get_failure_handlers(&fatal_callback, &error_callback,
+			       &info_callback, &debug_callback);
+	i_set_error_handler(test_error_handler);
+	test_error_count = 0;
+
+	/* the worker searching the 5th batch dies in the middle of it */
+	test_worker_exit_seq = 300;
+	fail_batch_seq1 = 4 * 64 + 1;
+	test_search_ctx_init(&ctx, &box, TEST_SEQ_COUNT);
+	workers = index_search_workers_init(&ctx, 1, 3);
+	test_assert(workers != NULL);
+	for (seq = 1; seq <= TEST_SEQ_COUNT && workers != NULL; seq++) {
+		/* everything may match after the failure */
+		bool expected = seq >= fail_batch_seq1 ||
+			test_seq_matches(seq);
+		if (test_seq_may_match(workers, seq) != expected)
+			success = FALSE;
+	}
+	test_assert(success);
+	if (workers != NULL)
+		index_search_workers_deinit(&workers);
+	test_assert(test_workers_reap());
+	test_worker_exit_seq = 0;
+
+	i_set_error_handler(error_callback);
+	test_assert(test_error_count > 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_index_search_workers_ordering,
+		test_index_search_workers_skip,
+		test_index_search_workers_stop,
+		test_index_search_workers_nonblock,
+		test_index_search_workers_failure,
+		NULL
+	};
+	return test_run(test_functions);
+}
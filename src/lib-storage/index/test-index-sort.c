@@ -0,0 +1,296 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "index-storage.h"
+#include "index-sort.h"
+
+#include <stdlib.h>
+
+#define TEST_SIZE_4G 4294967296ULL
+
+struct test_sort_mail {
+	time_t received_date, sent_date;
+	uoff_t virtual_size;
+};
+
+/* The values that mail_get_*() return, i.e. what would be looked up from
+   cache. These include ties, values that fit into the extension only
+   barely and ones that don't fit at all and must be looked up every time. */
+static struct test_sort_mail test_mails[] = {
+	{ 1000, 2000, 100 },
+	{ 900, 0, TEST_SIZE_4G + 10 },
+	{ 1100, -100, 50 },
+	{ 0, 4294967294LL, 4294967294ULL },
+	{ 4294967295LL, 4294967295LL, 4294967295ULL },
+	{ 1000, 0, 50 },
+	{ -5, 1500, 0 },
+	{ 800, TEST_SIZE_4G, 7 },
+	{ 700, 1, TEST_SIZE_4G },
+};
+static unsigned int test_lookup_count;
+
+struct mail *
+mail_alloc(struct mailbox_transaction_context *t,
+	   enum mail_fetch_field wanted_fields ATTR_UNUSED,
+	   struct mailbox_header_lookup_ctx *wanted_headers ATTR_UNUSED)
+{
+	struct mail *mail;
+
+	mail = i_new(struct mail, 1);
+	mail->box = t->box;
+	mail->transaction = t;
+	return mail;
+}
+
+void mail_free(struct mail **mail)
+{
+	i_free(*mail);
+}
+
+void mail_set_seq(struct mail *mail, uint32_t seq)
+{
+	i_assert(seq >= 1 && seq <= N_ELEMENTS(test_mails));
+	mail->seq = seq;
+	mail->uid = seq;
+}
+
+int mail_get_received_date(struct mail *mail, time_t *date_r)
+{
+	test_lookup_count++;
+	*date_r = test_mails[mail->seq-1].received_date;
+	return 0;
+}
+
+int mail_get_date(struct mail *mail, time_t *date_r, int *timezone_r)
+{
+	test_lookup_count++;
+	*date_r = test_mails[mail->seq-1].sent_date;
+	*timezone_r = 0;
+	return 0;
+}
+
+int mail_get_virtual_size(struct mail *mail, uoff_t *size_r)
+{
+	test_lookup_count++;
+	*size_r = test_mails[mail->seq-1].virtual_size;
+	return 0;
+}
+
+int mail_get_special(struct mail *mail ATTR_UNUSED,
+		     enum mail_fetch_field field ATTR_UNUSED,
+		     const char **value_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+int mail_get_first_header(struct mail *mail ATTR_UNUSED,
+			  const char *field ATTR_UNUSED,
+			  const char **value_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void mail_storage_set_critical(struct mail_storage *storage ATTR_UNUSED,
+			       const char *fmt ATTR_UNUSED, ...)
+{
+	i_unreached();
+}
+
+static uint64_t test_sort_key(enum mail_sort_type type, uint32_t seq)
+{
+	const struct test_sort_mail *mail = &test_mails[seq-1];
+
+	switch (type) {
+	case MAIL_SORT_ARRIVAL:
+		return mail->received_date;
+	case MAIL_SORT_DATE:
+		return mail->sent_date != 0 ? mail->sent_date :
+			mail->received_date;
+	case MAIL_SORT_SIZE:
+		return mail->virtual_size;
+	default:
+		i_unreached();
+	}
+}
+
+static enum mail_sort_type test_sort_type;
+
+static int test_sort_cmp(const uint32_t *seq1, const uint32_t *seq2)
+{
+	int64_t key1 = test_sort_key(test_sort_type, *seq1);
+	int64_t key2 = test_sort_key(test_sort_type, *seq2);
+
+	if (key1 < key2)
+		return -1;
+	if (key1 > key2)
+		return 1;
+	return *seq1 < *seq2 ? -1 : (*seq1 > *seq2 ? 1 : 0);
+}
+
+static struct mail_index *test_index_create(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1234;
+
+	index = mail_index_alloc(NULL, "test.dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uid = 1; uid <= N_ELEMENTS(test_mails); uid++)
+		mail_index_append(trans, uid, &seq);
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	return index;
+}
+
+static void
+test_transaction_begin(struct mailbox *box,
+		       struct mailbox_transaction_context *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->box = box;
+	t->itrans = mail_index_transaction_begin(box->view, 0);
+	t->view = mail_index_transaction_open_updated_view(t->itrans);
+}
+
+static void test_transaction_commit(struct mailbox_transaction_context *t)
+{
+	mail_index_view_close(&t->view);
+	if (mail_index_transaction_commit(&t->itrans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+}
+
+/* Sort all the mails and check that the result is the same as when sorting
+   by the values that mail_get_*() return. Returns the number of
+   mail_get_*() calls that were needed. */
+static unsigned int
+test_sort(struct mailbox *box, enum mail_sort_type type)
+{
+	const enum mail_sort_type sort_program[] = { type, MAIL_SORT_END };
+	struct mailbox_transaction_context t;
+	struct mail_search_sort_program *program;
+	struct mail *mail;
+	uint32_t seq, expected_seqs[N_ELEMENTS(test_mails)];
+	unsigned int i, lookup_count;
+
+	test_transaction_begin(box, &t);
+	mail = mail_alloc(&t, 0, NULL);
+	test_lookup_count = 0;
+	program = index_sort_program_init(&t, sort_program);
+	for (seq = 1; seq <= N_ELEMENTS(test_mails); seq++) {
+		mail_set_seq(mail, seq);
+		index_sort_list_add(program, mail);
+	}
+	index_sort_list_finish(program);
+	lookup_count = test_lookup_count;
+
+	for (i = 0; i < N_ELEMENTS(expected_seqs); i++)
+		expected_seqs[i] = i + 1;
+	test_sort_type = type;
+	qsort(expected_seqs, N_ELEMENTS(expected_seqs), sizeof(uint32_t),
+	      (int (*)(const void *, const void *))test_sort_cmp);
+	for (i = 0; index_sort_list_next(program, &seq); i++)
+		test_assert_idx(i < N_ELEMENTS(expected_seqs) &&
+				seq == expected_seqs[i], i);
+	test_assert(i == N_ELEMENTS(expected_seqs));
+
+	index_sort_program_deinit(&program);
+	mail_free(&mail);
+	test_transaction_commit(&t);
+	return lookup_count;
+}
+
+static void test_reset(struct mailbox *box, uint32_t seq,
+		       enum mail_fetch_field field)
+{
+	struct mailbox_transaction_context t;
+	struct mail *mail;
+
+	test_transaction_begin(box, &t);
+	mail = mail_alloc(&t, 0, NULL);
+	mail_set_seq(mail, seq);
+	index_sort_numbers_reset(mail, field);
+	mail_free(&mail);
+	test_transaction_commit(&t);
+}
+
+static void test_index_sort_numbers(void)
+{
+	struct ioloop *ioloop;
+	struct mailbox box;
+	unsigned int lookups;
+
+	test_begin("index sort numbers");
+	ioloop = io_loop_create();
+	memset(&box, 0, sizeof(box));
+	box.index = test_index_create();
+	box.view = mail_index_view_open(box.index);
+
+	/* the first sorts store the keys to the extension. the second ones
+	   use them, except for the ones that don't fit. */
+	lookups = test_sort(&box, MAIL_SORT_SIZE);
+	test_assert(lookups >= N_ELEMENTS(test_mails));
+	test_assert(test_sort(&box, MAIL_SORT_SIZE) == 3);
+	lookups = test_sort(&box, MAIL_SORT_ARRIVAL);
+	test_assert(lookups >= N_ELEMENTS(test_mails));
+	test_assert(test_sort(&box, MAIL_SORT_ARRIVAL) == 2);
+	lookups = test_sort(&box, MAIL_SORT_DATE);
+	test_assert(lookups >= N_ELEMENTS(test_mails));
+	test_assert(test_sort(&box, MAIL_SORT_DATE) == 3);
+
+	/* the cached virtual size was found to be broken and the fixed
+	   value moves the mail to be the smallest */
+	test_mails[0].virtual_size = 1;
+	test_reset(&box, 1, MAIL_FETCH_VIRTUAL_SIZE);
+	test_assert(test_sort(&box, MAIL_SORT_SIZE) == 4);
+	test_assert(test_sort(&box, MAIL_SORT_SIZE) == 3);
+
+	/* received date affects both ARRIVAL and DATE, since the mail has
+	   no Date: header */
+	test_mails[5].received_date = 10;
+	test_reset(&box, 6, MAIL_FETCH_RECEIVED_DATE);
+	test_assert(test_sort(&box, MAIL_SORT_ARRIVAL) == 3);
+	test_assert(test_sort(&box, MAIL_SORT_DATE) == 5);
+
+	test_mails[6].sent_date = 3000;
+	test_reset(&box, 7, MAIL_FETCH_DATE);
+	test_assert(test_sort(&box, MAIL_SORT_ARRIVAL) == 2);
+	test_assert(test_sort(&box, MAIL_SORT_DATE) == 4);
+
+	/* everything in the cache is gone */
+	test_mails[1].virtual_size = 20;
+	test_mails[2].received_date = 1;
+	test_mails[2].sent_date = 0;
+	test_reset(&box, 2, 0);
+	test_reset(&box, 3, 0);
+	test_assert(test_sort(&box, MAIL_SORT_SIZE) == 4);
+	test_assert(test_sort(&box, MAIL_SORT_ARRIVAL) == 4);
+	test_assert(test_sort(&box, MAIL_SORT_DATE) == 6);
+
+	mail_index_view_close(&box.view);
+	mail_index_close(box.index);
+	mail_index_free(&box.index);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_index_sort_numbers,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,389 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "str-table.h"
+#include "test-common.h"
+#include "mail-storage.h"
+#include "index-thread-private.h"
+
+#include <stdlib.h>
+
+#define TEST_MSG_COUNT 300
+#define TEST_MAX_REFS 3
+/* Message-IDs that no message has, i.e. they become dummy nodes */
+#define TEST_MISSING_MSGID_IDX(n) (TEST_MSG_COUNT * 2 + 1 + (n))
+#define TEST_MISSING_MSGID_COUNT 20
+#define TEST_HIGHEST_STR_IDX TEST_MISSING_MSGID_IDX(TEST_MISSING_MSGID_COUNT)
+
+struct test_thread_msg {
+	uint32_t uid;
+	uint32_t msgid_idx;
+	/* oldest reference first, the last one is the parent */
+	uint32_t refs[TEST_MAX_REFS];
+	unsigned int refs_count;
+
+	const char *subject;
+	time_t sent_date, received_date;
+	bool expunged;
+};
+
+static const char *test_subjects[] = {
+	"hello", "Re: hello", "Fwd: hello", "[list] hello",
+	"world", "Re: world", "Re: Re: world",
+	"", NULL, "other", "Re: other"
+};
+
+static ARRAY(struct test_thread_msg) test_msgs;
+static unsigned int test_lookup_count;
+
+static struct test_thread_msg *test_msg_lookup(uint32_t uid)
+{
+	struct test_thread_msg *msgs;
+	unsigned int count;
+
+	msgs = array_get_modifiable(&test_msgs, &count);
+	if (uid == 0 || uid > count || msgs[uid-1].expunged)
+		return NULL;
+	return &msgs[uid-1];
+}
+
+bool mail_set_uid(struct mail *mail, uint32_t uid)
+{
+	if (test_msg_lookup(uid) == NULL)
+		return FALSE;
+	mail->uid = uid;
+	return TRUE;
+}
+
+int mail_get_date(struct mail *mail, time_t *date_r, int *timezone_r)
+{
+	test_lookup_count++;
+	*date_r = test_msg_lookup(mail->uid)->sent_date;
+	*timezone_r = 0;
+	return 0;
+}
+
+int mail_get_received_date(struct mail *mail, time_t *date_r)
+{
+	test_lookup_count++;
+	*date_r = test_msg_lookup(mail->uid)->received_date;
+	return 0;
+}
+
+int mail_get_first_header(struct mail *mail, const char *field,
+			  const char **value_r)
+{
+	test_lookup_count++;
+	i_assert(strcmp(field, HDR_SUBJECT) == 0);
+	*value_r = test_msg_lookup(mail->uid)->subject;
+	return *value_r == NULL ? 0 : 1;
+}
+
+void mailbox_get_seq_range(struct mailbox *box ATTR_UNUSED,
+			   uint32_t uid1 ATTR_UNUSED, uint32_t uid2 ATTR_UNUSED,
+			   uint32_t *seq1_r ATTR_UNUSED,
+			   uint32_t *seq2_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static void test_msg_set_contents(struct test_thread_msg *msg)
+{
+	msg->subject = test_subjects[rand() % N_ELEMENTS(test_subjects)];
+	/* use a few dates a lot, so there are ties */
+	msg->sent_date = rand() % 3 == 0 ? 0 : 1000 + rand() % 50;
+	msg->received_date = 1000 + rand() % 100;
+}
+
+static void test_msgs_append(unsigned int count)
+{
+	struct test_thread_msg *msg;
+	unsigned int i, uid;
+
+	for (; count > 0; count--) {
+		uid = array_count(&test_msgs) + 1;
+		i_assert(uid <= TEST_MSG_COUNT * 2);
+
+		msg = array_append_space(&test_msgs);
+		msg->uid = uid;
+		/* some duplicate Message-IDs */
+		msg->msgid_idx = uid > 10 && rand() % 20 == 0 ?
+			1 + rand() % (uid - 1) : uid;
+		msg->refs_count = rand() % (TEST_MAX_REFS + 1);
+		for (i = 0; i < msg->refs_count; i++) {
+			if (uid > 1 && rand() % 4 != 0)
+				msg->refs[i] = 1 + rand() % (uid - 1);
+			else {
+				msg->refs[i] = TEST_MISSING_MSGID_IDX(
+					rand() % TEST_MISSING_MSGID_COUNT);
+			}
+		}
+		test_msg_set_contents(msg);
+	}
+}
+
+static void
+test_msgid_map_append(ARRAY_TYPE(mail_index_strmap_rec) *msgid_map,
+		      const struct test_thread_msg *msg)
+{
+	struct mail_index_strmap_rec *rec;
+	unsigned int i;
+
+	rec = array_append_space(msgid_map);
+	rec->uid = msg->uid;
+	rec->ref_index = MAIL_THREAD_NODE_REF_MSGID;
+	rec->str_idx = msg->msgid_idx;
+	for (i = 0; i < msg->refs_count; i++) {
+		rec = array_append_space(msgid_map);
+		rec->uid = msg->uid;
+		rec->ref_index = MAIL_THREAD_NODE_REF_REFERENCES1 + i;
+		rec->str_idx = msg->refs[i];
+	}
+}
+
+/* Returns the msgid_map for all the existing messages with UID >= first_uid.
+   It's zero-terminated like the strmap view's. */
+static const struct mail_index_strmap_rec *
+test_msgid_map_get(uint32_t first_uid, unsigned int *count_r)
+{
+	ARRAY_TYPE(mail_index_strmap_rec) msgid_map;
+	const struct test_thread_msg *msg;
+	unsigned int count;
+
+	t_array_init(&msgid_map, 128);
+	array_foreach(&test_msgs, msg) {
+		if (!msg->expunged && msg->uid >= first_uid)
+			test_msgid_map_append(&msgid_map, msg);
+	}
+	count = array_count(&msgid_map);
+	(void)array_append_space(&msgid_map);
+	*count_r = count;
+	return array_idx(&msgid_map, 0);
+}
+
+static void test_cache_add(struct mail_thread_cache *cache, uint32_t first_uid)
+{
+	const struct mail_index_strmap_rec *msgid_map;
+	unsigned int i, count;
+
+	T_BEGIN {
+		msgid_map = test_msgid_map_get(first_uid, &count);
+		for (i = 0; i < count; )
+			mail_thread_add(cache, msgid_map + i, &i);
+	} T_END;
+}
+
+/* Rebuild the thread_nodes the same way as mail_thread_cache_sync_add()
+   does when the cache can't be updated. */
+static void test_cache_rebuild(struct mail_thread_cache *cache,
+			       uint32_t uid_validity)
+{
+	cache->last_uid = 0;
+	mail_thread_cache_changed(cache);
+	mail_thread_cache_set_uid_validity(cache, uid_validity);
+	cache->first_invalid_msgid_str_idx = cache->next_invalid_msgid_str_idx =
+		TEST_HIGHEST_STR_IDX + 1 +
+		THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
+	array_clear(&cache->thread_nodes);
+	test_cache_add(cache, 1);
+}
+
+static struct mail_thread_cache *test_cache_init(uint32_t uid_validity)
+{
+	struct mail_thread_cache *cache;
+
+	cache = i_new(struct mail_thread_cache, 1);
+	i_array_init(&cache->thread_nodes, 128);
+	i_array_init(&cache->msg_infos, 128);
+	cache->base_subjects = str_table_init();
+	test_cache_rebuild(cache, uid_validity);
+	return cache;
+}
+
+static void test_cache_deinit(struct mail_thread_cache **_cache)
+{
+	struct mail_thread_cache *cache = *_cache;
+
+	*_cache = NULL;
+	mail_thread_cache_changed(cache);
+	array_free(&cache->thread_nodes);
+	array_free(&cache->msg_infos);
+	str_table_deinit(&cache->base_subjects);
+	i_free(cache);
+}
+
+static void test_cache_expunge(struct mail_thread_cache *cache,
+			       unsigned int count, uint32_t uid_validity)
+{
+	const struct mail_index_strmap_rec *msgid_map;
+	struct test_thread_msg *msgs;
+	unsigned int i, j, msgs_count, map_count;
+	bool rebuild = FALSE;
+
+	msgs = array_get_modifiable(&test_msgs, &msgs_count);
+	for (; count > 0; count--) T_BEGIN {
+		do {
+			i = rand() % msgs_count;
+		} while (msgs[i].expunged);
+
+		msgid_map = test_msgid_map_get(msgs[i].uid, &map_count);
+		j = 0;
+		if (!rebuild && !mail_thread_remove(cache, msgid_map, &j))
+			rebuild = TRUE;
+		msgs[i].expunged = TRUE;
+	} T_END;
+
+	if (rebuild) {
+		/* mail_thread_remove() failed, so index-thread would rebuild
+		   the tree */
+		test_cache_rebuild(cache, uid_validity);
+	}
+}
+
+/* Expunge a message that mail_thread_remove() can remove without
+   rebuilding the tree. */
+static void test_cache_expunge_simple(struct mail_thread_cache *cache)
+{
+	const struct mail_index_strmap_rec *msgid_map;
+	const struct mail_thread_node *node;
+	struct test_thread_msg *msgs;
+	unsigned int i, j, count, map_count;
+
+	msgs = array_get_modifiable(&test_msgs, &count);
+	for (i = rand() % count;; i = (i + 1) % count) {
+		if (msgs[i].expunged || msgs[i].refs_count > 0)
+			continue;
+		node = array_idx(&cache->thread_nodes, msgs[i].msgid_idx);
+		if (node->uid == msgs[i].uid && !node->expunge_rebuilds)
+			break;
+	}
+
+	T_BEGIN {
+		msgid_map = test_msgid_map_get(msgs[i].uid, &map_count);
+		j = 0;
+		test_assert(mail_thread_remove(cache, msgid_map, &j));
+	} T_END;
+	msgs[i].expunged = TRUE;
+}
+
+static void
+test_thread_append(string_t *str, struct mail_thread_iterate_context *iter)
+{
+	const struct mail_thread_child_node *node;
+	struct mail_thread_iterate_context *child_iter;
+
+	while ((node = mail_thread_iterate_next(iter, &child_iter)) != NULL) {
+		str_printfa(str, "(%u", node->uid);
+		if (child_iter != NULL) {
+			str_append_c(str, ' ');
+			test_thread_append(str, child_iter);
+			if (mail_thread_iterate_deinit(&child_iter) < 0)
+				i_unreached();
+		}
+		str_append_c(str, ')');
+	}
+}
+
+static const char *
+test_thread(struct mail_thread_cache *cache, enum mail_thread_type type)
+{
+	struct mail_thread_iterate_context *iter;
+	struct mail mail;
+	string_t *str = t_str_new(1024);
+
+	memset(&mail, 0, sizeof(mail));
+	iter = mail_thread_iterate_init_full(cache, &mail, type, FALSE);
+	test_thread_append(str, iter);
+	if (mail_thread_iterate_deinit(&iter) < 0)
+		i_unreached();
+	return str_c(str);
+}
+
+/* Thread using the cache that has been kept over the previous THREADs and
+   check that the result is the same as with a newly built cache. */
+static bool
+test_thread_matches(struct mail_thread_cache *cache,
+		    enum mail_thread_type type, uint32_t uid_validity)
+{
+	struct mail_thread_cache *new_cache;
+	const char *result, *new_result;
+
+	new_cache = test_cache_init(uid_validity);
+	result = test_thread(cache, type);
+	new_result = test_thread(new_cache, type);
+	test_cache_deinit(&new_cache);
+	return strcmp(result, new_result) == 0;
+}
+
+static void test_thread_reuse(void)
+{
+	static const enum mail_thread_type types[] = {
+		MAIL_THREAD_REFERENCES, MAIL_THREAD_REFS
+	};
+	struct mail_thread_cache *cache;
+	struct test_thread_msg *msg;
+	uint32_t uid_validity = 1;
+	unsigned int i, round;
+
+	test_begin("thread tree reuse");
+	i_array_init(&test_msgs, TEST_MSG_COUNT * 2);
+	test_msgs_append(TEST_MSG_COUNT);
+	cache = test_cache_init(uid_validity);
+
+	for (round = 0; round < 4; round++) T_BEGIN {
+		for (i = 0; i < N_ELEMENTS(types); i++) {
+			test_assert_idx(test_thread_matches(cache, types[i],
+							    uid_validity),
+					round * 10 + i);
+			/* nothing changed, so the previous finished tree is
+			   used without any lookups */
+			test_lookup_count = 0;
+			(void)test_thread(cache, types[i]);
+			test_assert_idx(test_lookup_count == 0, round * 10 + i);
+		}
+		/* switching back to the other type */
+		test_assert_idx(test_thread_matches(cache, types[0],
+						    uid_validity), round);
+
+		switch (round) {
+		case 0:
+			/* new mails */
+			i = array_count(&test_msgs) + 1;
+			test_msgs_append(TEST_MSG_COUNT / 4);
+			test_cache_add(cache, i);
+			break;
+		case 1:
+			for (i = 0; i < 10; i++) {
+				test_cache_expunge_simple(cache);
+				test_assert_idx(test_thread_matches(cache,
+						types[i % 2], uid_validity), i);
+			}
+			test_cache_expunge(cache, TEST_MSG_COUNT / 5,
+					   uid_validity);
+			break;
+		case 2:
+			/* UIDVALIDITY changes and the same UIDs now have
+			   different subjects and dates */
+			array_foreach_modifiable(&test_msgs, msg)
+				test_msg_set_contents(msg);
+			uid_validity++;
+			test_cache_rebuild(cache, uid_validity);
+			break;
+		}
+	} T_END;
+
+	test_cache_deinit(&cache);
+	array_free(&test_msgs);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_thread_reuse,
+		NULL
+	};
+	return test_run(test_functions);
+}
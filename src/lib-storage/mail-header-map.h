@@ -0,0 +1,43 @@
+#ifndef MAIL_HEADER_MAP_H
+#define MAIL_HEADER_MAP_H
+
+#include "seq-range-array.h"
+
+struct mailbox;
+
+/* Headers whose values are indexed in the header map. The map is kept in
+   dovecot.index.hdrmap and it's updated incrementally whenever it's used. */
+enum mail_header_map_field {
+	MAIL_HEADER_MAP_FIELD_MESSAGE_ID = 0,
+	MAIL_HEADER_MAP_FIELD_IN_REPLY_TO,
+	MAIL_HEADER_MAP_FIELD_LIST_ID,
+	MAIL_HEADER_MAP_FIELD_FROM,
+
+	MAIL_HEADER_MAP_FIELD_COUNT
+};
+
+/* Returns TRUE if the header is indexed in the header map. */
+bool mail_header_map_field_find(const char *hdr_name,
+				enum mail_header_map_field *field_r);
+/* Returns the header name for the field. */
+const char *mail_header_map_field_get_name(enum mail_header_map_field field);
+
+/* Add to uids all the messages that may have "<id>" (case-insensitively)
+   in the field's header. The header values are only matched against the
+   indexed keys (e.g. the first Message-ID or the From address), so
+   messages with more complex headers and messages that were added after the
+   map was updated are always added. The caller must still check the headers
+   itself. Returns 1 if ok, 0 if the mailbox has no header map, -1 if
+   error. */
+int mail_header_map_lookup(struct mailbox *box,
+			   enum mail_header_map_field field, const char *id,
+			   ARRAY_TYPE(seq_range) *uids);
+/* Add to uids all the messages whose first field header has the same value
+   (case-insensitively) as another message's. Messages that were added after
+   the map was updated are always added. Returns 1 if ok, 0 if the mailbox has
+   no header map, -1 if error. */
+int mail_header_map_get_duplicates(struct mailbox *box,
+				   enum mail_header_map_field field,
+				   ARRAY_TYPE(seq_range) *uids);
+
+#endif
@@ -1,9 +1,19 @@
 /* Copyright (c) 2002-2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "hash.h"
+#include "str.h"
 #include "mail-search.h"
 
+/* Relative costs of checking a search arg for a single message */
+#define SEARCH_PLAN_COST_INDEX 1
+#define SEARCH_PLAN_COST_CACHE 10
+#define SEARCH_PLAN_COST_HEADER 100
+#define SEARCH_PLAN_COST_BODY 1000
+/* Don't trust the match probability estimates too much */
+#define SEARCH_PLAN_MIN_PROBABILITY 0.01
+
 struct mail_search_simplify_prev_arg {
 	struct {
 		enum mail_search_arg_type type;
@@ -18,6 +28,20 @@ struct mail_search_simplify_prev_arg {
 	struct mail_search_arg *prev_arg;
 };
 
+struct mail_search_plan_estimate {
+	/* expected cost of checking the arg */
+	double cost;
+	/* probability that the arg matches */
+	double probability;
+};
+
+struct mail_search_plan_arg {
+	struct mail_search_arg *arg;
+	struct mail_search_plan_estimate est;
+	double rank;
+	unsigned int idx;
+};
+
 struct mail_search_simplify_ctx {
 	pool_t pool;
 	/* arg mask => prev_arg */
@@ -441,3 +465,232 @@ void mail_search_args_simplify(struct mail_search_args *args)
 	while (removals)
 		removals = mail_search_args_simplify_sub(args->box, args->args, TRUE);
 }
+
+static double mail_search_plan_flags_probability(enum mail_flags flags)
+{
+	double probability = 1;
+
+	if ((flags & MAIL_ANSWERED) != 0)
+		probability *= 0.1;
+	if ((flags & MAIL_FLAGGED) != 0)
+		probability *= 0.05;
+	if ((flags & MAIL_DELETED) != 0)
+		probability *= 0.02;
+	if ((flags & MAIL_SEEN) != 0)
+		probability *= 0.8;
+	if ((flags & MAIL_DRAFT) != 0)
+		probability *= 0.01;
+	if ((flags & MAIL_RECENT) != 0)
+		probability *= 0.01;
+	return probability;
+}
+
+static void
+mail_search_plan_estimate_list(const struct mail_search_arg *args, bool and,
+			       struct mail_search_plan_estimate *est_r);
+
+static void
+mail_search_plan_estimate(const struct mail_search_arg *arg,
+			  struct mail_search_plan_estimate *est_r)
+{
+	switch (arg->type) {
+	case SEARCH_OR:
+	case SEARCH_SUB:
+		mail_search_plan_estimate_list(arg->value.subargs,
+					       arg->type == SEARCH_SUB, est_r);
+		break;
+	case SEARCH_ALL:
+		est_r->cost = 0;
+		est_r->probability = 1;
+		break;
+	case SEARCH_SEQSET:
+	case SEARCH_UIDSET:
+	case SEARCH_MODSEQ:
+	case SEARCH_REAL_UID:
+		est_r->cost = SEARCH_PLAN_COST_INDEX;
+		est_r->probability = 0.5;
+		break;
+	case SEARCH_FLAGS:
+		est_r->cost = SEARCH_PLAN_COST_INDEX;
+		est_r->probability =
+			mail_search_plan_flags_probability(arg->value.flags);
+		break;
+	case SEARCH_KEYWORDS:
+		est_r->cost = SEARCH_PLAN_COST_INDEX;
+		est_r->probability = 0.05;
+		break;
+	case SEARCH_MAILBOX:
+	case SEARCH_MAILBOX_GUID:
+	case SEARCH_MAILBOX_GLOB:
+		/* the same for all the messages in a mailbox */
+		est_r->cost = SEARCH_PLAN_COST_INDEX;
+		est_r->probability = 0.5;
+		break;
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+		/* the sent date comes from the Date: header, which isn't
+		   always cached */
+		est_r->cost = arg->value.date_type == MAIL_SEARCH_DATE_TYPE_SENT ?
+			SEARCH_PLAN_COST_HEADER : SEARCH_PLAN_COST_CACHE;
+		est_r->probability = arg->type == SEARCH_ON ? 0.01 : 0.5;
+		break;
+	case SEARCH_SMALLER:
+	case SEARCH_LARGER:
+		est_r->cost = SEARCH_PLAN_COST_CACHE;
+		est_r->probability = 0.5;
+		break;
+	case SEARCH_GUID:
+		est_r->cost = SEARCH_PLAN_COST_CACHE;
+		est_r->probability = SEARCH_PLAN_MIN_PROBABILITY;
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		/* an empty value only checks that the header exists */
+		est_r->cost = SEARCH_PLAN_COST_HEADER;
+		est_r->probability = arg->value.str[0] == '\0' ? 0.5 : 0.1;
+		break;
+	case SEARCH_BODY:
+		est_r->cost = SEARCH_PLAN_COST_BODY;
+		est_r->probability = 0.05;
+		break;
+	case SEARCH_TEXT:
+		est_r->cost = SEARCH_PLAN_COST_HEADER + SEARCH_PLAN_COST_BODY;
+		est_r->probability = 0.05;
+		break;
+	case SEARCH_INTHREAD:
+		/* the thread index needs to be built, and the subargs are
+		   checked for all the messages */
+		mail_search_plan_estimate_list(arg->value.subargs, TRUE, est_r);
+		est_r->cost += SEARCH_PLAN_COST_HEADER;
+		est_r->probability = 0.1;
+		break;
+	}
+	if (arg->match_not)
+		est_r->probability = 1 - est_r->probability;
+}
+
+static void
+mail_search_plan_estimate_list(const struct mail_search_arg *args, bool and,
+			       struct mail_search_plan_estimate *est_r)
+{
+	struct mail_search_plan_estimate est;
+	double cost = 0, continue_probability = 1;
+
+	/* the args are checked in order until the result is known */
+	for (; args != NULL; args = args->next) {
+		mail_search_plan_estimate(args, &est);
+		cost += continue_probability * est.cost;
+		continue_probability *= and ? est.probability :
+			1 - est.probability;
+	}
+	est_r->cost = cost;
+	est_r->probability = and ? continue_probability :
+		1 - continue_probability;
+}
+
+static int
+mail_search_plan_arg_cmp(const struct mail_search_plan_arg *arg1,
+			 const struct mail_search_plan_arg *arg2)
+{
+	if (arg1->rank < arg2->rank)
+		return -1;
+	if (arg1->rank > arg2->rank)
+		return 1;
+	/* keep the original order for equally good args */
+	return arg1->idx < arg2->idx ? -1 : 1;
+}
+
+static void
+mail_search_args_plan_sub(struct mail_search_arg **argsp, bool and)
+{
+	ARRAY(struct mail_search_plan_arg) plan_args;
+	struct mail_search_plan_arg *plan_arg;
+	struct mail_search_arg *arg, **argp;
+	double decide_probability;
+
+	t_array_init(&plan_args, 8);
+	for (arg = *argsp; arg != NULL; arg = arg->next) {
+		if (arg->type == SEARCH_SUB || arg->type == SEARCH_OR ||
+		    arg->type == SEARCH_INTHREAD) {
+			mail_search_args_plan_sub(&arg->value.subargs,
+						  arg->type != SEARCH_OR);
+		}
+		plan_arg = array_append_space(&plan_args);
+		plan_arg->arg = arg;
+		plan_arg->idx = array_count(&plan_args);
+		mail_search_plan_estimate(arg, &plan_arg->est);
+
+		/* An AND list's result is known after the first non-match and
+		   an OR list's after the first match. Checking the args in the
+		   order of cost per probability of deciding the result
+		   minimizes the expected cost (if the args are
+		   independent). */
+		decide_probability = and ? 1 - plan_arg->est.probability :
+			plan_arg->est.probability;
+		if (decide_probability < SEARCH_PLAN_MIN_PROBABILITY)
+			decide_probability = SEARCH_PLAN_MIN_PROBABILITY;
+		plan_arg->rank = plan_arg->est.cost / decide_probability;
+	}
+	array_sort(&plan_args, mail_search_plan_arg_cmp);
+
+	argp = argsp;
+	array_foreach_modifiable(&plan_args, plan_arg) {
+		*argp = plan_arg->arg;
+		argp = &plan_arg->arg->next;
+	}
+	*argp = NULL;
+}
+
+void mail_search_args_plan(struct mail_search_args *args)
+{
+	args->planned = TRUE;
+
+	T_BEGIN {
+		mail_search_args_plan_sub(&args->args, TRUE);
+	} T_END;
+}
+
+static void
+mail_search_args_plan_explain_sub(string_t *dest,
+				  const struct mail_search_arg *args)
+{
+	struct mail_search_plan_estimate est;
+	const char *error;
+
+	for (; args != NULL; args = args->next) {
+		if (args->type == SEARCH_SUB || args->type == SEARCH_OR) {
+			str_append(dest, args->type == SEARCH_OR ?
+				   "(OR " : "(");
+			mail_search_args_plan_explain_sub(dest,
+							  args->value.subargs);
+			str_truncate(dest, str_len(dest)-1);
+			str_append_c(dest, ')');
+		} else if (args->type == SEARCH_MAILBOX ||
+			   args->type == SEARCH_MAILBOX_GLOB) {
+			str_printfa(dest, "%sMAILBOX %s",
+				    args->match_not ? "NOT " : "",
+				    args->value.str);
+		} else if (args->type == SEARCH_MAILBOX_GUID) {
+			str_printfa(dest, "%sMAILBOX-GUID %s",
+				    args->match_not ? "NOT " : "",
+				    args->value.str);
+		} else if (!mail_search_arg_to_imap(dest, args, &error)) {
+			str_printfa(dest, "<%s>", error);
+		}
+		mail_search_plan_estimate(args, &est);
+		str_printfa(dest, " [cost=%.1f match=%.2f] ",
+			    est.cost, est.probability);
+	}
+}
+
+void mail_search_args_plan_explain(string_t *dest,
+				   const struct mail_search_args *args)
+{
+	struct mail_search_plan_estimate est;
+
+	mail_search_args_plan_explain_sub(dest, args->args);
+	mail_search_plan_estimate_list(args->args, TRUE, &est);
+	str_printfa(dest, "=> expected cost %.1f per message", est.cost);
+}
@@ -338,6 +338,7 @@ mail_search_args_dup(const struct mail_search_args *args)
 
 	new_args = mail_search_build_init();
 	new_args->simplified = args->simplified;
+	new_args->planned = args->planned;
 	new_args->have_inthreads = args->have_inthreads;
 	new_args->args = mail_search_arg_dup(new_args->pool, args->args);
 	return new_args;
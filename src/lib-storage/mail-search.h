@@ -111,6 +111,7 @@ struct mail_search_args {
 	struct mail_search_arg *args;
 
 	unsigned int simplified:1;
+	unsigned int planned:1;
 	unsigned int have_inthreads:1;
 	/* Stop mail_search_next() when finding a non-matching mail.
 	   (Could be useful when wanting to find only the oldest mails.) */
@@ -190,6 +191,15 @@ bool mail_search_args_match_mailbox(struct mail_search_args *args,
 /* Simplify/optimize search arguments. Afterwards all OR/SUB args are
    guaranteed to have match_not=FALSE. */
 void mail_search_args_simplify(struct mail_search_args *args);
+/* Reorder the AND and OR lists so that the args that are cheap to check and
+   likely to decide the result are checked first. The cost and match
+   probability estimates depend only on the search query, so the same query
+   always gets the same order. */
+void mail_search_args_plan(struct mail_search_args *args);
+/* Append the planned args with their estimated costs and match probabilities
+   to dest. */
+void mail_search_args_plan_explain(string_t *dest,
+				   const struct mail_search_args *args);
 
 /* Append all args as IMAP SEARCH AND-query to the dest string and returns TRUE.
    If some search arg can't be written as IMAP SEARCH parameter, error_r is set
@@ -359,6 +359,9 @@ struct mailbox {
 	unsigned int synced:1;
 	/* Updating cache file is disabled */
 	unsigned int mail_cache_disabled:1;
+	/* Syncing is disabled. Lookups that would need to sync the mailbox
+	   fail instead. */
+	unsigned int sync_disabled:1;
 };
 
 struct mail_vfuncs {
@@ -470,6 +473,8 @@ struct mailbox_transaction_stats {
 	unsigned long long files_read_bytes;
 	/* number of cache lookup hits */
 	unsigned long cache_hit_count;
+	/* number of cache lookups that didn't find the field */
+	unsigned long cache_miss_count;
 };
 
 struct mail_save_private_changes {
@@ -6,6 +6,7 @@
 #include "var-expand.h"
 #include "unichar.h"
 #include "settings-parser.h"
+#include "compression.h"
 #include "mail-index.h"
 #include "mail-user.h"
 #include "mail-namespace.h"
@@ -32,10 +33,15 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_SIZE, mail_attachment_min_size),
 	DEF(SET_STR_VARS, mail_attribute_dict),
 	DEF(SET_UINT, mail_prefetch_count),
+	DEF(SET_UINT, mail_search_workers),
 	DEF(SET_STR, mail_cache_fields),
 	DEF(SET_STR, mail_always_cache_fields),
 	DEF(SET_STR, mail_never_cache_fields),
 	DEF(SET_UINT, mail_cache_min_mail_count),
+	DEF(SET_BOOL, mail_cache_columns),
+	DEF(SET_STR, mail_index_log_compress),
+	DEF(SET_BOOL, mail_index_log_commit_offset),
+	DEF(SET_BOOL, mail_index_pack_records),
 	DEF(SET_TIME, mailbox_idle_check_interval),
 	DEF(SET_UINT, mail_max_keyword_length),
 	DEF(SET_TIME, mail_max_lock_timeout),
@@ -70,10 +76,15 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_min_size = 1024*128,
 	.mail_attribute_dict = "",
 	.mail_prefetch_count = 0,
+	.mail_search_workers = 0,
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
 	.mail_cache_min_mail_count = 0,
+	.mail_cache_columns = FALSE,
+	.mail_index_log_compress = "",
+	.mail_index_log_commit_offset = FALSE,
+	.mail_index_pack_records = FALSE,
 	.mailbox_idle_check_interval = 30,
 	.mail_max_keyword_length = 50,
 	.mail_max_lock_timeout = 0,
@@ -348,6 +359,36 @@ fix_base_path(struct mail_user_settings *set, pool_t pool, const char **str)
 }
 
 /* <settings checks> */
+#ifndef CONFIG_BINARY
+static bool
+mail_index_log_compress_check(const char *name, const char **error_r)
+{
+	const struct compression_handler *handler;
+
+	if (name[0] == '\0')
+		return TRUE;
+
+	handler = compression_lookup_handler(name);
+	if (handler == NULL) {
+		*error_r = t_strdup_printf(
+			"Unknown mail_index_log_compress: %s", name);
+		return FALSE;
+	}
+	if (handler->create_ostream == NULL) {
+		*error_r = t_strdup_printf("mail_index_log_compress: "
+			"Support not compiled in for handler: %s", name);
+		return FALSE;
+	}
+	if (handler->is_compressed == NULL) {
+		*error_r = t_strdup_printf("mail_index_log_compress: "
+			"Handler %s can't be used, because its format "
+			"can't be detected", name);
+		return FALSE;
+	}
+	return TRUE;
+}
+#endif
+
 static bool mail_storage_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 					const char **error_r)
 {
@@ -361,6 +402,12 @@ static bool mail_storage_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 		*error_r = "mailbox_idle_check_interval must not be 0";
 		return FALSE;
 	}
+	if (set->mail_search_workers > MAIL_SEARCH_WORKERS_MAX) {
+		*error_r = t_strdup_printf(
+			"mail_search_workers must not be higher than %u",
+			MAIL_SEARCH_WORKERS_MAX);
+		return FALSE;
+	}
 
 	if (strcmp(set->mail_fsync, "optimized") == 0)
 		set->parsed_fsync_mode = FSYNC_MODE_OPTIMIZED;
@@ -436,6 +483,9 @@ static bool mail_storage_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 	}
 	hash_format_deinit_free(&format);
 #ifndef CONFIG_BINARY
+	if (!mail_index_log_compress_check(set->mail_index_log_compress,
+					   error_r))
+		return FALSE;
 	if (*set->ssl_client_ca_dir != '\0' &&
 	    access(set->ssl_client_ca_dir, X_OK) < 0) {
 		*error_r = t_strdup_printf(
@@ -5,6 +5,9 @@
 #include "fsync-mode.h"
 
 #define MAIL_STORAGE_SET_DRIVER_NAME "MAIL"
+/* Each search worker is a forked mail process, so don't allow configuring
+   more of them than could possibly be useful. */
+#define MAIL_SEARCH_WORKERS_MAX 64
 
 struct mail_user;
 struct mail_storage;
@@ -17,10 +20,15 @@ struct mail_storage_settings {
 	uoff_t mail_attachment_min_size;
 	const char *mail_attribute_dict;
 	unsigned int mail_prefetch_count;
+	unsigned int mail_search_workers;
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
 	unsigned int mail_cache_min_mail_count;
+	bool mail_cache_columns;
+	const char *mail_index_log_compress;
+	bool mail_index_log_commit_offset;
+	bool mail_index_pack_records;
 	unsigned int mailbox_idle_check_interval;
 	unsigned int mail_max_keyword_length;
 	unsigned int mail_max_lock_timeout;
@@ -1727,6 +1727,16 @@ mailbox_search_init(struct mailbox_transaction_context *t,
 	mail_search_args_ref(args);
 	if (!args->simplified)
 		mail_search_args_simplify(args);
+	if (!args->planned) {
+		mail_search_args_plan(args);
+		if (t->box->storage->set->mail_debug) T_BEGIN {
+			string_t *str = t_str_new(256);
+
+			mail_search_args_plan_explain(str, args);
+			i_debug("%s: Search plan: %s",
+				mailbox_get_vname(t->box), str_c(str));
+		} T_END;
+	}
 	return t->box->v.search_init(t, args, sort_program,
 				     wanted_fields, wanted_headers);
 }
@@ -2396,6 +2406,10 @@ mail_storage_settings_to_index_flags(const struct mail_storage_settings *set)
 		index_flags |= MAIL_INDEX_OPEN_FLAG_DOTLOCK_USE_EXCL;
 	if (set->mail_nfs_index)
 		index_flags |= MAIL_INDEX_OPEN_FLAG_NFS_FLUSH;
+	if (set->mail_index_log_commit_offset)
+		index_flags |= MAIL_INDEX_OPEN_FLAG_LOG_COMMIT_OFFSET;
+	if (set->mail_index_pack_records)
+		index_flags |= MAIL_INDEX_OPEN_FLAG_PACK_RECORDS;
 	return index_flags;
 }
 
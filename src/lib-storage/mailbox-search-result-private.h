@@ -2,6 +2,7 @@
 #define MAILBOX_SEARCH_RESULT_PRIVATE_H
 
 #include "mail-storage.h"
+#include "seq-bitmap.h"
 
 struct mail_search_result {
 	struct mailbox *box;
@@ -9,9 +10,11 @@ struct mail_search_result {
 	struct mail_search_args *search_args;
 
 	/* UIDs of messages currently in the result */
-	ARRAY_TYPE(seq_range) uids;
+	struct seq_bitmap uids;
+	/* uids as a seq_range array for mailbox_search_result_get() */
+	ARRAY_TYPE(seq_range) uids_arr;
 	/* UIDs of messages that will never match the result */
-	ARRAY_TYPE(seq_range) never_uids;
+	struct seq_bitmap never_uids;
 	ARRAY_TYPE(seq_range) removed_uids, added_uids;
 
 	unsigned int args_have_flags:1;
@@ -41,8 +41,8 @@ mailbox_search_result_alloc(struct mailbox *box, struct mail_search_args *args,
 	result = i_new(struct mail_search_result, 1);
 	result->box = box;
 	result->flags = flags;
-	i_array_init(&result->uids, 32);
-	i_array_init(&result->never_uids, 128);
+	seq_bitmap_init(&result->uids);
+	seq_bitmap_init(&result->never_uids);
 
 	if ((result->flags & MAILBOX_SEARCH_RESULT_FLAG_UPDATE) != 0) {
 		result->search_args = args;
@@ -74,8 +74,10 @@ void mailbox_search_result_free(struct mail_search_result **_result)
 	if (result->search_args != NULL)
 		mail_search_args_unref(&result->search_args);
 
-	array_free(&result->uids);
-	array_free(&result->never_uids);
+	seq_bitmap_deinit(&result->uids);
+	seq_bitmap_deinit(&result->never_uids);
+	if (array_is_created(&result->uids_arr))
+		array_free(&result->uids_arr);
 	if (array_is_created(&result->removed_uids)) {
 		array_free(&result->removed_uids);
 		array_free(&result->added_uids);
@@ -118,10 +120,9 @@ void mailbox_search_result_add(struct mail_search_result *result, uint32_t uid)
 {
 	i_assert(uid > 0);
 
-	if (seq_range_exists(&result->uids, uid))
+	if (seq_bitmap_add(&result->uids, uid))
 		return;
 
-	seq_range_array_add(&result->uids, uid);
 	if (array_is_created(&result->added_uids)) {
 		seq_range_array_add(&result->added_uids, uid);
 		seq_range_array_remove(&result->removed_uids, uid);
@@ -131,7 +132,7 @@ void mailbox_search_result_add(struct mail_search_result *result, uint32_t uid)
 void mailbox_search_result_remove(struct mail_search_result *result,
 				  uint32_t uid)
 {
-	if (seq_range_array_remove(&result->uids, uid)) {
+	if (seq_bitmap_remove(&result->uids, uid)) {
 		if (array_is_created(&result->removed_uids)) {
 			seq_range_array_add(&result->removed_uids, uid);
 			seq_range_array_remove(&result->added_uids, uid);
@@ -162,7 +163,7 @@ void mailbox_search_results_remove(struct mailbox *box, uint32_t uid)
 void mailbox_search_result_never(struct mail_search_result *result,
 				 uint32_t uid)
 {
-	seq_range_array_add(&result->never_uids, uid);
+	seq_bitmap_add(&result->never_uids, uid);
 }
 
 void mailbox_search_results_never(struct mail_search_context *ctx,
@@ -182,7 +183,12 @@ void mailbox_search_results_never(struct mail_search_context *ctx,
 const ARRAY_TYPE(seq_range) *
 mailbox_search_result_get(struct mail_search_result *result)
 {
-	return &result->uids;
+	if (!array_is_created(&result->uids_arr))
+		i_array_init(&result->uids_arr, 32);
+	else
+		array_clear(&result->uids_arr);
+	seq_bitmap_to_array(&result->uids, &result->uids_arr);
+	return &result->uids_arr;
 }
 
 void mailbox_search_result_sync(struct mail_search_result *result,
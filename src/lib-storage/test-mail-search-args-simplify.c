@@ -98,6 +98,26 @@ struct {
 	{ "OR ( TEXT foo OR TEXT foo TEXT foo ) ( TEXT foo ( TEXT foo ) )", "TEXT foo" },
 };
 
+struct {
+	const char *input;
+	const char *output;
+} plan_tests[] = {
+	{ "SEEN", "(SEEN)" },
+	{ "BODY x SEEN SINCE 1-Jan-2026", "(SEEN) SINCE \"01-Jan-2026\" BODY x" },
+	{ "TEXT foo BODY bar", "BODY bar TEXT foo" },
+	{ "BODY foo BODY bar", "BODY foo BODY bar" },
+	{ "NOT BODY x FLAGGED", "(FLAGGED) NOT BODY x" },
+	{ "NOT SUBJECT foo SUBJECT bar", "SUBJECT bar NOT SUBJECT foo" },
+	{ "SENTSINCE 1-Jan-2026 SINCE 1-Jan-2026",
+	  "SINCE \"01-Jan-2026\" SENTSINCE \"01-Jan-2026\"" },
+	{ "OR BODY x FLAGGED", "(OR (FLAGGED) BODY x)" },
+	{ "OR ( BODY a SEEN ) FLAGGED", "(OR (FLAGGED) ((SEEN) BODY a))" },
+	{ "OR ( BODY a SEEN ) ( TEXT b DELETED )",
+	  "(OR ((DELETED) TEXT b) ((SEEN) BODY a))" },
+	{ "BODY a OR ( TEXT b DELETED ) FLAGGED",
+	  "(OR (FLAGGED) ((DELETED) TEXT b)) BODY a" },
+};
+
 static struct mail_search_args *
 test_build_search_args(const char *args)
 {
@@ -133,10 +153,32 @@ static void test_mail_search_args_simplify(void)
 	test_end();
 }
 
+static void test_mail_search_args_plan(void)
+{
+	struct mail_search_args *args;
+	string_t *str = t_str_new(256);
+	const char *error;
+	unsigned int i;
+
+	test_begin("mail search args plan");
+	for (i = 0; i < N_ELEMENTS(plan_tests); i++) {
+		args = test_build_search_args(plan_tests[i].input);
+		mail_search_args_simplify(args);
+		mail_search_args_plan(args);
+
+		str_truncate(str, 0);
+		test_assert(mail_search_args_to_imap(str, args->args, &error));
+		test_assert_idx(strcmp(str_c(str), plan_tests[i].output) == 0, i);
+		mail_search_args_unref(&args);
+	}
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_mail_search_args_simplify,
+		test_mail_search_args_plan,
 		NULL
 	};
 
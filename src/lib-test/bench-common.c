@@ -0,0 +1,44 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "bench-common.h"
+
+void bench_timer_start(struct bench_timer *timer)
+{
+	if (gettimeofday(&timer->start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+long long bench_timer_lap(struct bench_timer *timer)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, &timer->start);
+	timer->start = now;
+	return usecs;
+}
+
+void bench_arg_uint(int argc, char *argv[], int idx, const char *name,
+		    unsigned int min_value, unsigned int max_value,
+		    unsigned int *value_r)
+{
+	unsigned int value;
+
+	if (idx >= argc)
+		return;
+	if (str_to_uint(argv[idx], &value) < 0 ||
+	    value < min_value || value > max_value)
+		i_fatal("Invalid %s: %s", name, argv[idx]);
+	*value_r = value;
+}
+
+double bench_mbytes_per_sec(uoff_t size, long long usecs)
+{
+	return size / (1024.0*1024.0) /
+		((usecs == 0 ? 1 : usecs) / 1000000.0);
+}
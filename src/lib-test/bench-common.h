@@ -0,0 +1,25 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+/* Helpers for the bench-* programs. The programs aren't built by default,
+   use "make bench" in the directory to build them. */
+
+struct bench_timer {
+	struct timeval start;
+};
+
+/* Start (or restart) the timer. */
+void bench_timer_start(struct bench_timer *timer);
+/* Return microseconds since the timer was started and restart it. */
+long long bench_timer_lap(struct bench_timer *timer);
+
+/* Parse argv[idx] as unsigned integer into *value_r if it was given. Fail
+   with "Invalid <name>" if it's not between min_value..max_value. */
+void bench_arg_uint(int argc, char *argv[], int idx, const char *name,
+		    unsigned int min_value, unsigned int max_value,
+		    unsigned int *value_r);
+
+/* Return MB/s for processing size bytes in usecs. */
+double bench_mbytes_per_sec(uoff_t size, long long usecs);
+
+#endif
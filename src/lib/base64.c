@@ -43,44 +43,96 @@ static const unsigned char b64dec[256] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
 };
 
+/* Encode all the full 3 byte groups at once directly into dest. Returns the
+   number of bytes encoded. */
+static size_t
+base64_encode_groups(const unsigned char *src, size_t src_size, buffer_t *dest)
+{
+	size_t i, groups = src_size / 3;
+	unsigned char *out;
+	uint32_t v;
+
+	if (groups == 0)
+		return 0;
+
+	out = buffer_append_space_unsafe(dest, groups * 4);
+	for (i = 0; i < groups; i++, src += 3, out += 4) {
+		v = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2];
+		out[0] = b64enc[v >> 18];
+		out[1] = b64enc[(v >> 12) & 0x3f];
+		out[2] = b64enc[(v >> 6) & 0x3f];
+		out[3] = b64enc[v & 0x3f];
+	}
+	return groups * 3;
+}
+
 void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 {
 	const unsigned char *src_c = src;
 	unsigned char tmp[4];
 	size_t src_pos;
 
-	for (src_pos = 0; src_pos < src_size; ) {
-		tmp[0] = b64enc[src_c[src_pos] >> 2];
-		switch (src_size - src_pos) {
-		case 1:
-			tmp[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
-			tmp[2] = '=';
-			tmp[3] = '=';
-			src_pos++;
-			break;
-		case 2:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
-			tmp[3] = '=';
-			src_pos += 2;
-			break;
-		default:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2) |
-					((src_c[src_pos+2] & 0xc0) >> 6)];
-			tmp[3] = b64enc[src_c[src_pos+2] & 0x3f];
-			src_pos += 3;
-			break;
-		}
-		buffer_append(dest, tmp, 4);
+	src_pos = base64_encode_groups(src_c, src_size, dest);
+	if (src_pos == src_size)
+		return;
+
+	tmp[0] = b64enc[src_c[src_pos] >> 2];
+	switch (src_size - src_pos) {
+	case 1:
+		tmp[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
+		tmp[2] = '=';
+		break;
+	case 2:
+		tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
+				(src_c[src_pos+1] >> 4)];
+		tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
+		break;
+	default:
+		i_unreached();
 	}
+	tmp[3] = '=';
+	buffer_append(dest, tmp, 4);
 }
 
+/* max. number of groups decoded at once by base64_decode_groups() */
+#define BASE64_DECODE_MAX_GROUPS 64
+
 #define IS_EMPTY(c) \
 	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
 
+/* Decode full 4 character groups directly into dest until whitespace,
+   padding or invalid input is found. Returns the number of characters
+   decoded. */
+static size_t
+base64_decode_groups(const unsigned char *src, size_t src_size, buffer_t *dest)
+{
+	size_t i, groups = src_size / 4, used = dest->used;
+	unsigned char *out, a, b, c, d;
+
+	/* the destination may be a fixed size buffer that is only large
+	   enough for the decoded data, so don't reserve more space than
+	   the groups can produce. also reserving a lot more than what
+	   typically gets used (a single line) would make buffer clear the
+	   extra space every time. */
+	if (groups > BASE64_DECODE_MAX_GROUPS)
+		groups = BASE64_DECODE_MAX_GROUPS;
+	out = buffer_append_space_unsafe(dest, groups * 3);
+	for (i = 0; i < groups; i++, src += 4, out += 3) {
+		a = b64dec[src[0]];
+		b = b64dec[src[1]];
+		c = b64dec[src[2]];
+		d = b64dec[src[3]];
+		/* valid characters are < 0x40 */
+		if (((a | b | c | d) & 0x80) != 0)
+			break;
+		out[0] = (a << 2) | (b >> 4);
+		out[1] = (b << 4) | (c >> 2);
+		out[2] = (c << 6) | d;
+	}
+	buffer_set_used_size(dest, used + i * 3);
+	return i * 4;
+}
+
 int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
@@ -91,6 +143,16 @@ int base64_decode(const void *src, size_t src_size,
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
 		input[0] = b64dec[src_c[src_pos]];
+		if (input[0] != 0xff) {
+			/* decode the (usually long) run of full groups at
+			   once. the rest is handled one group at a time. */
+			src_pos += base64_decode_groups(src_c + src_pos,
+							src_size - src_pos,
+							dest);
+			if (src_pos+3 >= src_size)
+				break;
+			input[0] = b64dec[src_c[src_pos]];
+		}
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
 				ret = -1;
@@ -0,0 +1,87 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure base64_encode() and base64_decode() throughput. Random data is
+   encoded into 76 character CRLF-terminated lines like in MIME parts, and
+   the decoded result is verified to match the original data.
+
+   Usage: bench-base64 [<kbytes> [<rounds>]] */
+
+#include "lib.h"
+#include "buffer.h"
+#include "base64.h"
+#include "randgen.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+
+#define BENCH_BASE64_LINE_LEN 76
+/* bytes that encode into a single full line */
+#define BENCH_BASE64_LINE_SRC_LEN (BENCH_BASE64_LINE_LEN / 4 * 3)
+
+static void bench_encode(const unsigned char *data, size_t size,
+			 buffer_t *dest)
+{
+	size_t pos, len;
+
+	buffer_set_used_size(dest, 0);
+	for (pos = 0; pos < size; pos += len) {
+		len = I_MIN(size - pos, BENCH_BASE64_LINE_SRC_LEN);
+		base64_encode(data + pos, len, dest);
+		buffer_append(dest, "\r\n", 2);
+	}
+}
+
+static void bench_print(const char *name, long long usecs, size_t size,
+			unsigned int rounds)
+{
+	printf("%-8s %12lld %10.1f\n", name, usecs,
+	       bench_mbytes_per_sec((uoff_t)size * rounds, usecs));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int kbytes = 8192, rounds = 10, i;
+	unsigned char *data;
+	buffer_t *encoded, *decoded;
+	struct bench_timer timer;
+	size_t size;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "kbytes", 1, UINT_MAX / 1024, &kbytes);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+	size = (size_t)kbytes * 1024;
+
+	data = i_malloc(size);
+	random_fill_weak(data, size);
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(size) +
+					size / BENCH_BASE64_LINE_SRC_LEN * 2 + 2);
+	decoded = buffer_create_dynamic(default_pool, size);
+
+	printf("%u kB, %u rounds (MB/s of unencoded data)\n", kbytes, rounds);
+	printf("%-8s %12s %10s\n", "op", "usecs", "MB/s");
+
+	bench_timer_start(&timer);
+	for (i = 0; i < rounds; i++)
+		bench_encode(data, size, encoded);
+	bench_print("encode", bench_timer_lap(&timer), size, rounds);
+
+	bench_timer_start(&timer);
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		if (base64_decode(encoded->data, encoded->used,
+				  NULL, decoded) < 0)
+			i_fatal("base64_decode() failed");
+	}
+	bench_print("decode", bench_timer_lap(&timer), size, rounds);
+
+	if (decoded->used != size || memcmp(decoded->data, data, size) != 0)
+		i_fatal("Decoded data doesn't match the original");
+
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+	i_free(data);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare chained (hash_table_create*()) and open addressing
+   (hash_table_create_flat*()) hash tables with <keys> pointer keys and
+   <keys> string keys: inserting all the keys, looking up all of them and
+   as many missing keys, iterating through the table and removing all the
+   keys.
+
+   Usage: bench-hash [<keys>] */
+
+#include "lib.h"
+#include "hash.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+
+enum bench_hash_op {
+	BENCH_HASH_OP_INSERT,
+	BENCH_HASH_OP_LOOKUP,
+	BENCH_HASH_OP_MISS,
+	BENCH_HASH_OP_ITERATE,
+	BENCH_HASH_OP_REMOVE,
+
+	BENCH_HASH_OP_COUNT
+};
+
+HASH_TABLE_DEFINE_TYPE(bench, void *, void *);
+
+static unsigned int keys_count = 1000000;
+/* the first keys_count keys are inserted, the rest are used for misses */
+static void **direct_keys;
+static char **str_keys;
+
+static unsigned int bench_str_hash(const void *key)
+{
+	return str_hash(key);
+}
+
+static int bench_str_cmp(const void *key1, const void *key2)
+{
+	return strcmp(key1, key2);
+}
+
+static void
+bench_hash_table(HASH_TABLE_TYPE(bench) hash, void **keys,
+		 long long usecs_r[BENCH_HASH_OP_COUNT])
+{
+	struct hash_iterate_context *iter;
+	struct bench_timer timer;
+	void *key, *value;
+	unsigned int i, count = 0;
+
+	bench_timer_start(&timer);
+	for (i = 0; i < keys_count; i++)
+		hash_table_insert(hash, keys[i], POINTER_CAST(i + 1));
+	usecs_r[BENCH_HASH_OP_INSERT] = bench_timer_lap(&timer);
+
+	for (i = 0; i < keys_count; i++) {
+		if (hash_table_lookup(hash, keys[i]) != POINTER_CAST(i + 1))
+			i_fatal("Key %u lookup failed", i);
+	}
+	usecs_r[BENCH_HASH_OP_LOOKUP] = bench_timer_lap(&timer);
+
+	for (i = keys_count; i < keys_count*2; i++) {
+		if (hash_table_lookup(hash, keys[i]) != NULL)
+			i_fatal("Missing key %u found", i);
+	}
+	usecs_r[BENCH_HASH_OP_MISS] = bench_timer_lap(&timer);
+
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		count++;
+	hash_table_iterate_deinit(&iter);
+	if (count != keys_count)
+		i_fatal("Iterated %u keys instead of %u", count, keys_count);
+	usecs_r[BENCH_HASH_OP_ITERATE] = bench_timer_lap(&timer);
+
+	for (i = 0; i < keys_count; i++)
+		hash_table_remove(hash, keys[i]);
+	usecs_r[BENCH_HASH_OP_REMOVE] = bench_timer_lap(&timer);
+}
+
+static void bench_print(const char *name, bool flat, bool str_key)
+{
+	HASH_TABLE_TYPE(bench) hash;
+	long long usecs[BENCH_HASH_OP_COUNT];
+	unsigned int i;
+
+	if (str_key && flat)
+		hash_table_create_flat(&hash, default_pool, 0,
+				       bench_str_hash, bench_str_cmp);
+	else if (str_key)
+		hash_table_create(&hash, default_pool, 0,
+				  bench_str_hash, bench_str_cmp);
+	else if (flat)
+		hash_table_create_flat_direct(&hash, default_pool, 0);
+	else
+		hash_table_create_direct(&hash, default_pool, 0);
+
+	bench_hash_table(hash, str_key ? (void **)str_keys : direct_keys,
+			 usecs);
+	hash_table_destroy(&hash);
+
+	printf("%-14s", name);
+	for (i = 0; i < BENCH_HASH_OP_COUNT; i++)
+		printf(" %10lld", usecs[i]);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "keys", 1, 100000000, &keys_count);
+
+	direct_keys = i_new(void *, keys_count*2);
+	str_keys = i_new(char *, keys_count*2);
+	for (i = 0; i < keys_count*2; i++) {
+		/* distinct non-zero keys in random looking order */
+		direct_keys[i] = POINTER_CAST((i + 1) * 2654435761U);
+		str_keys[i] = i_strdup_printf("key-%u", (i + 1) * 2654435761U);
+	}
+
+	printf("%u keys (usecs)\n", keys_count);
+	printf("%-14s %10s %10s %10s %10s %10s\n", "table",
+	       "insert", "lookup", "miss", "iterate", "remove");
+	bench_print("chained", FALSE, FALSE);
+	bench_print("flat", TRUE, FALSE);
+	bench_print("chained str", FALSE, TRUE);
+	bench_print("flat str", TRUE, TRUE);
+
+	for (i = 0; i < keys_count*2; i++)
+		i_free(str_keys[i]);
+	i_free(str_keys);
+	i_free(direct_keys);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Measure how many I/O callbacks per second the ioloop backend that was
+   chosen at configure time can run. Tokens are passed around a ring of
+   pipes, so there are always <tokens> readable fds among <pipes> idle ones.
+   In the "readd" mode each callback also removes its io and adds it back,
+   like connections that keep switching between reading and writing do.
+   Build with different --with-ioloop values to compare the backends.
+
+   Usage: bench-ioloop [<pipes> [<tokens> [<events>]]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "fd-set-nonblock.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+struct bench_pipe {
+	int fd[2];
+	struct io *io;
+	struct bench_pipe *next;
+};
+
+static struct ioloop *ioloop;
+static struct bench_pipe *pipes;
+static unsigned int events_left;
+static bool readd_io;
+
+static void bench_pipe_input(struct bench_pipe *p);
+
+static const char *bench_ioloop_name(void)
+{
+#if defined(IOLOOP_URING)
+	return "uring";
+#elif defined(IOLOOP_EPOLL)
+	return "epoll";
+#elif defined(IOLOOP_KQUEUE)
+	return "kqueue";
+#elif defined(IOLOOP_POLL)
+	return "poll";
+#else
+	return "select";
+#endif
+}
+
+static void bench_pipe_input(struct bench_pipe *p)
+{
+	char c;
+
+	if (read(p->fd[0], &c, 1) != 1)
+		i_fatal("read(pipe) failed: %m");
+	if (write(p->next->fd[1], &c, 1) != 1)
+		i_fatal("write(pipe) failed: %m");
+	if (readd_io) {
+		io_remove(&p->io);
+		p->io = io_add(p->fd[0], IO_READ, bench_pipe_input, p);
+	}
+	if (--events_left == 0)
+		io_loop_stop(ioloop);
+}
+
+static long long bench_run(unsigned int events, bool readd)
+{
+	struct bench_timer timer;
+
+	events_left = events;
+	readd_io = readd;
+	bench_timer_start(&timer);
+	io_loop_run(ioloop);
+	return bench_timer_lap(&timer);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int pipes_count = 400, tokens = 40, events = 1000000;
+	unsigned int i;
+	long long usecs;
+	char c = 0;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "pipes", 1, UINT_MAX, &pipes_count);
+	bench_arg_uint(argc, argv, 2, "tokens", 1, pipes_count, &tokens);
+	bench_arg_uint(argc, argv, 3, "events", 1, UINT_MAX, &events);
+
+	pipes = i_new(struct bench_pipe, pipes_count);
+	for (i = 0; i < pipes_count; i++) {
+		if (pipe(pipes[i].fd) < 0)
+			i_fatal("pipe() failed: %m");
+		fd_set_nonblock(pipes[i].fd[0], TRUE);
+		/* spread the tokens' next pipes around the whole ring */
+		pipes[i].next = &pipes[(i + pipes_count / tokens + 1) %
+				       pipes_count];
+		pipes[i].io = io_add(pipes[i].fd[0], IO_READ,
+				     bench_pipe_input, &pipes[i]);
+	}
+	for (i = 0; i < tokens; i++) {
+		if (write(pipes[i * (pipes_count / tokens)].fd[1], &c, 1) != 1)
+			i_fatal("write(pipe) failed: %m");
+	}
+
+	printf("ioloop %s, %u pipes, %u tokens\n", bench_ioloop_name(),
+	       pipes_count, tokens);
+	printf("%-8s %12s %14s\n", "mode", "usecs", "events/sec");
+	usecs = bench_run(events, FALSE);
+	printf("%-8s %12lld %14.0f\n", "static", usecs,
+	       events * 1000000.0 / (usecs == 0 ? 1 : usecs));
+	usecs = bench_run(events, TRUE);
+	printf("%-8s %12lld %14.0f\n", "readd", usecs,
+	       events * 1000000.0 / (usecs == 0 ? 1 : usecs));
+
+	for (i = 0; i < pipes_count; i++) {
+		io_remove(&pipes[i].io);
+		i_close_fd(&pipes[i].fd[0]);
+		i_close_fd(&pipes[i].fd[1]);
+	}
+	i_free(pipes);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
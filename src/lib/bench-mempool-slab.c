@@ -0,0 +1,91 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare the system pool and a slab pool with small object churn:
+   <live> objects of random size between 16 and <maxsize> bytes are kept
+   allocated, and <ops> times a random one of them is freed and replaced
+   with a new one. For the slab pool the slab usage at the end is printed
+   as well.
+
+   Usage: bench-mempool-slab [<ops> [<live> [<maxsize>]]] */
+
+#include "lib.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_MIN_OBJ_SIZE 16
+
+static unsigned int ops = 20000000, live = 200000;
+static unsigned int max_size = 80;
+
+static size_t bench_obj_size(void)
+{
+	return BENCH_MIN_OBJ_SIZE + rand() % (max_size - BENCH_MIN_OBJ_SIZE + 1);
+}
+
+static void bench_pool(const char *name, pool_t pool)
+{
+	struct pool_slab_stats stats;
+	void **objs;
+	struct bench_timer timer;
+	long long alloc_usecs, churn_usecs, free_usecs;
+	unsigned int i, idx;
+
+	objs = i_new(void *, live);
+	srand(1);
+
+	bench_timer_start(&timer);
+	for (i = 0; i < live; i++)
+		objs[i] = p_malloc(pool, bench_obj_size());
+	alloc_usecs = bench_timer_lap(&timer);
+
+	for (i = 0; i < ops; i++) {
+		idx = rand() % live;
+		p_free(pool, objs[idx]);
+		objs[idx] = p_malloc(pool, bench_obj_size());
+	}
+	churn_usecs = bench_timer_lap(&timer);
+
+	if (pool != system_pool)
+		pool_slab_get_stats(pool, &stats);
+	bench_timer_start(&timer);
+	for (i = 0; i < live; i++)
+		p_free(pool, objs[i]);
+	free_usecs = bench_timer_lap(&timer);
+	i_free(objs);
+
+	printf("%-8s %12lld %12lld %12lld", name,
+	       alloc_usecs, churn_usecs, free_usecs);
+	if (pool != system_pool) {
+		printf("   %u slabs, %"PRIuSIZE_T" kB used of %"PRIuSIZE_T
+		       " kB (%u%%)", stats.slab_count, stats.used_size / 1024,
+		       stats.alloc_size / 1024,
+		       (unsigned int)(stats.used_size * 100 /
+				      I_MAX(stats.alloc_size, 1)));
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pool_t pool;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "ops", 0, UINT_MAX, &ops);
+	bench_arg_uint(argc, argv, 2, "live", 1, UINT_MAX, &live);
+	bench_arg_uint(argc, argv, 3, "maxsize", BENCH_MIN_OBJ_SIZE,
+		       UINT_MAX / 2, &max_size);
+
+	printf("%u ops, %u live objects of %u..%u bytes (usecs)\n",
+	       ops, live, BENCH_MIN_OBJ_SIZE, max_size);
+	printf("%-8s %12s %12s %12s\n", "pool", "alloc", "churn", "free");
+	bench_pool("system", system_pool);
+	pool = pool_slab_create("bench slab pool");
+	bench_pool("slab", pool);
+	pool_unref(&pool);
+
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,145 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare seq_range arrays and seq_bitmap with a fragmented set of UIDs:
+   adding <count> random UIDs between 1 and <max>, looking them up,
+   converting the set to a seq_range array and removing the UIDs in random
+   order. Adding <count> UIDs in ascending order is measured separately,
+   since that's the best case for seq_range arrays.
+
+   Usage: bench-seq-bitmap [<count> [<max>]] */
+
+#include "lib.h"
+#include "array.h"
+#include "seq-range-array.h"
+#include "seq-bitmap.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+enum bench_op {
+	BENCH_OP_ADD,
+	BENCH_OP_EXISTS,
+	BENCH_OP_TO_ARRAY,
+	BENCH_OP_REMOVE,
+	BENCH_OP_ADD_ASC,
+
+	BENCH_OP_COUNT
+};
+
+static void
+bench_seq_range(const uint32_t *uids, unsigned int count,
+		long long usecs_r[BENCH_OP_COUNT])
+{
+	ARRAY_TYPE(seq_range) range, copy;
+	struct bench_timer timer;
+	unsigned int i;
+
+	i_array_init(&range, 64);
+	i_array_init(&copy, 64);
+	bench_timer_start(&timer);
+	for (i = 0; i < count; i++)
+		seq_range_array_add(&range, uids[i]);
+	usecs_r[BENCH_OP_ADD] = bench_timer_lap(&timer);
+
+	for (i = 0; i < count; i++) {
+		if (!seq_range_exists(&range, uids[i]))
+			i_fatal("UID %u not found", uids[i]);
+	}
+	usecs_r[BENCH_OP_EXISTS] = bench_timer_lap(&timer);
+
+	array_append_array(&copy, &range);
+	usecs_r[BENCH_OP_TO_ARRAY] = bench_timer_lap(&timer);
+
+	for (i = count; i > 0; i--)
+		seq_range_array_remove(&range, uids[i-1]);
+	usecs_r[BENCH_OP_REMOVE] = bench_timer_lap(&timer);
+	if (array_count(&range) != 0)
+		i_fatal("seq_range not empty after removes");
+
+	for (i = 1; i <= count; i++)
+		seq_range_array_add(&range, i * 2);
+	usecs_r[BENCH_OP_ADD_ASC] = bench_timer_lap(&timer);
+
+	array_free(&range);
+	array_free(&copy);
+}
+
+static void
+bench_seq_bitmap(const uint32_t *uids, unsigned int count,
+		 long long usecs_r[BENCH_OP_COUNT])
+{
+	struct seq_bitmap bitmap;
+	ARRAY_TYPE(seq_range) copy;
+	struct bench_timer timer;
+	unsigned int i;
+
+	seq_bitmap_init(&bitmap);
+	i_array_init(&copy, 64);
+	bench_timer_start(&timer);
+	for (i = 0; i < count; i++)
+		seq_bitmap_add(&bitmap, uids[i]);
+	usecs_r[BENCH_OP_ADD] = bench_timer_lap(&timer);
+
+	for (i = 0; i < count; i++) {
+		if (!seq_bitmap_exists(&bitmap, uids[i]))
+			i_fatal("UID %u not found", uids[i]);
+	}
+	usecs_r[BENCH_OP_EXISTS] = bench_timer_lap(&timer);
+
+	seq_bitmap_to_array(&bitmap, &copy);
+	usecs_r[BENCH_OP_TO_ARRAY] = bench_timer_lap(&timer);
+
+	for (i = count; i > 0; i--)
+		seq_bitmap_remove(&bitmap, uids[i-1]);
+	usecs_r[BENCH_OP_REMOVE] = bench_timer_lap(&timer);
+	if (seq_bitmap_count(&bitmap) != 0)
+		i_fatal("seq_bitmap not empty after removes");
+
+	for (i = 1; i <= count; i++)
+		seq_bitmap_add(&bitmap, i * 2);
+	usecs_r[BENCH_OP_ADD_ASC] = bench_timer_lap(&timer);
+
+	seq_bitmap_deinit(&bitmap);
+	array_free(&copy);
+}
+
+static void bench_print(const char *name,
+			const long long usecs[BENCH_OP_COUNT])
+{
+	unsigned int i;
+
+	printf("%-10s", name);
+	for (i = 0; i < BENCH_OP_COUNT; i++)
+		printf(" %10lld", usecs[i]);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = 100000, max = 10000000, i;
+	long long usecs[BENCH_OP_COUNT];
+	uint32_t *uids;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "count", 1, (uint32_t)-1 / 2, &count);
+	bench_arg_uint(argc, argv, 2, "max", 1, (uint32_t)-1, &max);
+
+	uids = i_new(uint32_t, count);
+	srand(1);
+	for (i = 0; i < count; i++)
+		uids[i] = ((uint32_t)rand() * 65599 + rand()) % max + 1;
+
+	printf("%u UIDs between 1 and %u (usecs)\n", count, max);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "set",
+	       "add", "exists", "to_array", "remove", "add_asc");
+	bench_seq_range(uids, count, usecs);
+	bench_print("seq_range", usecs);
+	bench_seq_bitmap(uids, count, usecs);
+	bench_print("seq_bitmap", usecs);
+
+	i_free(uids);
+	lib_deinit();
+	return 0;
+}
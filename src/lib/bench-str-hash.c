@@ -0,0 +1,159 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare the seeded str_hash() and strcase_hash() against the old ASU
+   hash they replaced: how long it takes to hash <keys> keys <rounds>
+   times, and how many of the keys collide with an earlier key when they're
+   put into a power-of-two sized table with at least as many slots as there
+   are keys. A perfectly random hash gives about keys/e collisions when the
+   table size equals the number of keys.
+
+   Usage: bench-str-hash [<keys> [<rounds>]] */
+
+#include "lib.h"
+#include "hash.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <ctype.h>
+
+typedef unsigned int bench_hash_t(const char *p);
+
+struct bench_key_set {
+	const char *name;
+	const char *(*key)(unsigned int n);
+};
+
+/* the old str_hash(): a char* hash function from ASU -- from glib */
+static unsigned int old_str_hash(const char *p)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	unsigned int g, h = 0;
+
+	while (*s != '\0') {
+		h = (h << 4) + *s;
+		if ((g = h & 0xf0000000UL)) {
+			h = h ^ (g >> 24);
+			h = h ^ g;
+		}
+		s++;
+	}
+	return h;
+}
+
+static unsigned int old_strcase_hash(const char *p)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	unsigned int g, h = 0;
+
+	while (*s != '\0') {
+		h = (h << 4) + i_toupper(*s);
+		if ((g = h & 0xf0000000UL)) {
+			h = h ^ (g >> 24);
+			h = h ^ g;
+		}
+		s++;
+	}
+	return h;
+}
+
+/* keeps the hashing loop from being optimized away */
+static volatile unsigned int bench_hash_sum;
+
+static const char *bench_key_message_id(unsigned int n)
+{
+	return t_strdup_printf("<%08x.%u.%u@mx%u.example.com>",
+			       n * 2654435761U, 1430000000 + n / 7, n % 32768,
+			       n % 16);
+}
+
+static const char *bench_key_username(unsigned int n)
+{
+	return t_strdup_printf("User%u@Example.COM", n);
+}
+
+static const char *bench_key_number(unsigned int n)
+{
+	return t_strdup_printf("%u", n);
+}
+
+static const struct bench_key_set key_sets[] = {
+	{ "message-id", bench_key_message_id },
+	{ "username", bench_key_username },
+	{ "number", bench_key_number }
+};
+
+static unsigned int
+bench_collisions(char *const *keys, unsigned int keys_count,
+		 bench_hash_t *hash)
+{
+	unsigned char *slots;
+	unsigned int i, mask, slot, collisions = 0;
+
+	for (mask = 1; mask < keys_count; mask <<= 1) ;
+	slots = i_new(unsigned char, mask);
+	mask--;
+
+	for (i = 0; i < keys_count; i++) {
+		slot = hash(keys[i]) & mask;
+		if (slots[slot] != 0)
+			collisions++;
+		slots[slot] = 1;
+	}
+	i_free(slots);
+	return collisions;
+}
+
+static void
+bench_hash(const char *name, char *const *keys, unsigned int keys_count,
+	   unsigned int rounds, bench_hash_t *hash)
+{
+	struct bench_timer timer;
+	unsigned int i, j, sum = 0;
+	long long usecs;
+
+	bench_timer_start(&timer);
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < keys_count; i++)
+			sum += hash(keys[i]);
+	}
+	usecs = bench_timer_lap(&timer);
+	bench_hash_sum = sum;
+
+	printf("%-18s %12lld %12u\n", name, usecs,
+	       bench_collisions(keys, keys_count, hash));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int keys_count = 1000000, rounds = 10, i, j;
+	char **keys;
+
+	lib_init();
+
+	bench_arg_uint(argc, argv, 1, "keys", 1, 100000000, &keys_count);
+	bench_arg_uint(argc, argv, 2, "rounds", 1, UINT_MAX, &rounds);
+
+	keys = i_new(char *, keys_count);
+	printf("%u keys, %u rounds\n", keys_count, rounds);
+	for (i = 0; i < N_ELEMENTS(key_sets); i++) {
+		for (j = 0; j < keys_count; j++) T_BEGIN {
+			keys[j] = i_strdup(key_sets[i].key(j));
+		} T_END;
+
+		printf("\n%-18s %12s %12s\n", key_sets[i].name,
+		       "usecs", "collisions");
+		bench_hash("old str_hash", keys, keys_count, rounds,
+			   old_str_hash);
+		bench_hash("str_hash", keys, keys_count, rounds, str_hash);
+		bench_hash("old strcase_hash", keys, keys_count, rounds,
+			   old_strcase_hash);
+		bench_hash("strcase_hash", keys, keys_count, rounds,
+			   strcase_hash);
+
+		for (j = 0; j < keys_count; j++)
+			i_free(keys[j]);
+	}
+	i_free(keys);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare adding, resetting and removing a large number of long idle
+   timeouts when they're kept in the timing wheel (timeout_add()) and when
+   they're kept only in the priority queue (timeout_add_short()). The
+   timeouts are between 1 and 30 minutes, so none of them expire while the
+   benchmark runs.
+
+   Usage: bench-timeout-wheel [<timeouts> [<resets>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_TIMEOUT_MIN_MSECS (60*1000)
+#define BENCH_TIMEOUT_SPREAD_MSECS (29*60*1000)
+
+static void bench_timeout_callback(void *context ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static struct timeout *bench_timeout_add(bool wheel)
+{
+	unsigned int msecs = BENCH_TIMEOUT_MIN_MSECS +
+		rand() % BENCH_TIMEOUT_SPREAD_MSECS;
+
+	return wheel ?
+		timeout_add(msecs, bench_timeout_callback, (void *)NULL) :
+		timeout_add_short(msecs, bench_timeout_callback, (void *)NULL);
+}
+
+static void bench_run(const char *name, bool wheel,
+		      unsigned int timeouts_count, unsigned int resets)
+{
+	struct timeout **timeouts;
+	struct bench_timer timer;
+	long long add_usecs, reset_usecs, churn_usecs, remove_usecs;
+	unsigned int i, idx;
+
+	timeouts = i_new(struct timeout *, timeouts_count);
+	srand(1);
+
+	bench_timer_start(&timer);
+	for (i = 0; i < timeouts_count; i++)
+		timeouts[i] = bench_timeout_add(wheel);
+	add_usecs = bench_timer_lap(&timer);
+
+	/* idle connections that see some traffic */
+	for (i = 0; i < resets; i++)
+		timeout_reset(timeouts[rand() % timeouts_count]);
+	reset_usecs = bench_timer_lap(&timer);
+
+	/* connections that come and go */
+	for (i = 0; i < resets; i++) {
+		idx = rand() % timeouts_count;
+		timeout_remove(&timeouts[idx]);
+		timeouts[idx] = bench_timeout_add(wheel);
+	}
+	churn_usecs = bench_timer_lap(&timer);
+
+	for (i = 0; i < timeouts_count; i++)
+		timeout_remove(&timeouts[i]);
+	remove_usecs = bench_timer_lap(&timer);
+	i_free(timeouts);
+
+	printf("%-10s %12lld %12lld %12lld %12lld\n", name,
+	       add_usecs, reset_usecs, churn_usecs, remove_usecs);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	unsigned int timeouts_count = 100000, resets = 1000000;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "timeouts", 1, UINT_MAX,
+		       &timeouts_count);
+	bench_arg_uint(argc, argv, 2, "resets", 0, UINT_MAX, &resets);
+
+	printf("%u timeouts, %u resets and %u remove+adds (usecs)\n",
+	       timeouts_count, resets, resets);
+	printf("%-10s %12s %12s %12s %12s\n",
+	       "queue", "add", "reset", "churn", "remove");
+	bench_run("wheel", TRUE, timeouts_count, resets);
+	bench_run("priorityq", FALSE, timeouts_count, resets);
+
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -5,13 +5,21 @@
 #include "lib.h"
 #include "hash.h"
 #include "primes.h"
+#include "randgen.h"
 
 #include <ctype.h>
 
 #define HASH_TABLE_MIN_SIZE 67
+#define HASH_FLAT_MIN_SIZE 16
+/* flat_index[] values: empty slot, removed slot or entry index + 2 */
+#define HASH_FLAT_SLOT_EMPTY 0
+#define HASH_FLAT_SLOT_REMOVED 1
+#define HASH_FLAT_SLOT_FIRST 2
 
 #undef hash_table_create
 #undef hash_table_create_direct
+#undef hash_table_create_flat
+#undef hash_table_create_flat_direct
 #undef hash_table_destroy
 #undef hash_table_clear
 #undef hash_table_lookup
@@ -44,6 +52,26 @@ struct hash_table {
 
 	hash_callback_t *hash_cb;
 	hash_cmp_callback_t *key_compare_cb;
+
+	/* Flat tables keep the entries in an array in insertion order.
+	   flat_index[] is a linearly probed power-of-two sized array of
+	   indexes to it, so a lookup touches only a few cache lines. Removed
+	   entries stay in the array with key=NULL until the table is thawed,
+	   so iteration can continue while entries are added or removed. */
+	struct hash_flat_entry *flat_entries;
+	unsigned int flat_entries_count, flat_entries_alloc;
+	uint32_t *flat_index;
+	/* non-empty slots in flat_index[], including removed ones */
+	unsigned int flat_index_used;
+	unsigned int flat_shift;
+
+	unsigned int flat:1;
+};
+
+struct hash_flat_entry {
+	void *key;
+	void *value;
+	unsigned int hash;
 };
 
 struct hash_iterate_context {
@@ -54,26 +82,235 @@ struct hash_iterate_context {
 
 static bool hash_table_resize(struct hash_table *table, bool grow);
 
-void hash_table_create(struct hash_table **table_r, pool_t node_pool,
-		       unsigned int initial_size, hash_callback_t *hash_cb,
-		       hash_cmp_callback_t *key_compare_cb)
+static inline unsigned int
+hash_flat_first_slot(const struct hash_table *table, unsigned int hash)
+{
+	/* multiplicative hashing spreads also the aligned pointers of
+	   direct tables over the whole power-of-two sized index */
+	return (uint32_t)(hash * 2654435769U) >> table->flat_shift;
+}
+
+static void hash_flat_index_create(struct hash_table *table, unsigned int size)
+{
+	unsigned int i, slot, mask = size - 1;
+
+	i_assert((size & mask) == 0);
+
+	i_free(table->flat_index);
+	table->flat_index = i_new(uint32_t, size);
+	table->size = size;
+	table->flat_shift = 33 - bits_required32(size);
+
+	for (i = 0; i < table->flat_entries_count; i++) {
+		if (table->flat_entries[i].key == NULL)
+			continue;
+
+		slot = hash_flat_first_slot(table, table->flat_entries[i].hash);
+		while (table->flat_index[slot] != HASH_FLAT_SLOT_EMPTY)
+			slot = (slot + 1) & mask;
+		table->flat_index[slot] = i + HASH_FLAT_SLOT_FIRST;
+	}
+	table->flat_index_used = table->nodes_count;
+}
+
+static void hash_flat_compress(struct hash_table *table)
+{
+	unsigned int i, count = 0, new_alloc;
+
+	for (i = 0; i < table->flat_entries_count; i++) {
+		if (table->flat_entries[i].key != NULL)
+			table->flat_entries[count++] = table->flat_entries[i];
+	}
+	table->flat_entries_count = count;
+	table->removed_count = 0;
+
+	new_alloc = I_MAX(count * 2, HASH_FLAT_MIN_SIZE);
+	if (table->flat_entries_alloc > new_alloc * 2) {
+		table->flat_entries = i_realloc(table->flat_entries,
+			sizeof(struct hash_flat_entry) *
+			table->flat_entries_alloc,
+			sizeof(struct hash_flat_entry) * new_alloc);
+		table->flat_entries_alloc = new_alloc;
+	}
+}
+
+static void hash_flat_rebuild(struct hash_table *table)
+{
+	unsigned int size;
+
+	/* entries can't be moved while the table is frozen, because
+	   iterators point to them. */
+	if (table->frozen == 0)
+		hash_flat_compress(table);
+
+	size = nearest_power((size_t)table->nodes_count * 2 + 2);
+	hash_flat_index_create(table, I_MAX(size, table->initial_size));
+}
+
+static void hash_flat_check_removed(struct hash_table *table)
+{
+	i_assert(table->frozen == 0);
+
+	if (table->removed_count > table->nodes_count ||
+	    (table->size > table->initial_size &&
+	     table->nodes_count * 8 < table->size))
+		hash_flat_rebuild(table);
+}
+
+/* Returns the entry for the key, or NULL if it doesn't exist. slot_r is set
+   to the key's slot, or to the first unused slot if it wasn't found. */
+static struct hash_flat_entry *
+hash_flat_lookup(const struct hash_table *table, const void *key,
+		 unsigned int hash, unsigned int *slot_r)
+{
+	struct hash_flat_entry *entry;
+	unsigned int slot, idx, free_slot = UINT_MAX, mask = table->size - 1;
+
+	for (slot = hash_flat_first_slot(table, hash);;
+	     slot = (slot + 1) & mask) {
+		idx = table->flat_index[slot];
+		if (idx == HASH_FLAT_SLOT_EMPTY)
+			break;
+		if (idx == HASH_FLAT_SLOT_REMOVED) {
+			if (free_slot == UINT_MAX)
+				free_slot = slot;
+			continue;
+		}
+		entry = &table->flat_entries[idx - HASH_FLAT_SLOT_FIRST];
+		if (entry->hash == hash &&
+		    table->key_compare_cb(entry->key, key) == 0) {
+			*slot_r = slot;
+			return entry;
+		}
+	}
+	*slot_r = free_slot != UINT_MAX ? free_slot : slot;
+	return NULL;
+}
+
+static void
+hash_flat_insert(struct hash_table *table, void *key, void *value,
+		 bool replace_key)
+{
+	struct hash_flat_entry *entry;
+	unsigned int hash, slot, new_alloc;
+
+	i_assert(key != NULL);
+
+	hash = table->hash_cb(key);
+	entry = hash_flat_lookup(table, key, hash, &slot);
+	if (entry != NULL) {
+		if (replace_key)
+			entry->key = key;
+		entry->value = value;
+		return;
+	}
+
+	if (table->flat_index[slot] == HASH_FLAT_SLOT_EMPTY) {
+		/* keep the index at most 2/3 full, so that there's always
+		   an empty slot and the probe sequences stay short */
+		if ((table->flat_index_used + 1) * 3 > table->size * 2) {
+			hash_flat_rebuild(table);
+			(void)hash_flat_lookup(table, key, hash, &slot);
+		}
+		table->flat_index_used++;
+	}
+
+	if (table->flat_entries_count == table->flat_entries_alloc) {
+		new_alloc = I_MAX(table->flat_entries_alloc * 2,
+				  HASH_FLAT_MIN_SIZE);
+		table->flat_entries = i_realloc(table->flat_entries,
+			sizeof(struct hash_flat_entry) *
+			table->flat_entries_alloc,
+			sizeof(struct hash_flat_entry) * new_alloc);
+		table->flat_entries_alloc = new_alloc;
+	}
+	entry = &table->flat_entries[table->flat_entries_count];
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	table->flat_index[slot] =
+		table->flat_entries_count++ + HASH_FLAT_SLOT_FIRST;
+	table->nodes_count++;
+}
+
+static bool hash_flat_remove(struct hash_table *table, const void *key)
+{
+	struct hash_flat_entry *entry;
+	unsigned int slot, mask = table->size - 1;
+
+	entry = hash_flat_lookup(table, key, table->hash_cb(key), &slot);
+	if (unlikely(entry == NULL))
+		return FALSE;
+
+	if (table->flat_index[(slot + 1) & mask] == HASH_FLAT_SLOT_EMPTY) {
+		/* end of the probe sequence, no need to leave a marker */
+		table->flat_index[slot] = HASH_FLAT_SLOT_EMPTY;
+		table->flat_index_used--;
+	} else {
+		table->flat_index[slot] = HASH_FLAT_SLOT_REMOVED;
+	}
+	table->nodes_count--;
+
+	if (table->frozen == 0 &&
+	    entry == &table->flat_entries[table->flat_entries_count-1]) {
+		/* the last entry can be dropped immediately */
+		table->flat_entries_count--;
+	} else {
+		entry->key = NULL;
+		entry->value = NULL;
+		table->removed_count++;
+	}
+
+	if (table->frozen == 0)
+		hash_flat_check_removed(table);
+	return TRUE;
+}
+
+static void
+hash_table_init(struct hash_table **table_r, pool_t node_pool,
+		hash_callback_t *hash_cb, hash_cmp_callback_t *key_compare_cb)
 {
 	struct hash_table *table;
 
 	pool_ref(node_pool);
 	table = i_new(struct hash_table, 1);
 	table->node_pool = node_pool;
-	table->initial_size =
-		I_MAX(primes_closest(initial_size), HASH_TABLE_MIN_SIZE);
-
 	table->hash_cb = hash_cb;
 	table->key_compare_cb = key_compare_cb;
+	*table_r = table;
+}
+
+void hash_table_create(struct hash_table **table_r, pool_t node_pool,
+		       unsigned int initial_size, hash_callback_t *hash_cb,
+		       hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	hash_table_init(&table, node_pool, hash_cb, key_compare_cb);
+	table->initial_size =
+		I_MAX(primes_closest(initial_size), HASH_TABLE_MIN_SIZE);
 
 	table->size = table->initial_size;
 	table->nodes = i_new(struct hash_node, table->size);
 	*table_r = table;
 }
 
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	hash_table_init(&table, node_pool, hash_cb, key_compare_cb);
+	table->flat = TRUE;
+	table->initial_size = nearest_power((size_t)initial_size * 2);
+	if (table->initial_size < HASH_FLAT_MIN_SIZE)
+		table->initial_size = HASH_FLAT_MIN_SIZE;
+	hash_flat_index_create(table, table->initial_size);
+	*table_r = table;
+}
+
 static unsigned int direct_hash(const void *p)
 {
 	/* NOTE: may truncate the value, but that doesn't matter. */
@@ -92,6 +329,13 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+void hash_table_create_flat_direct(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size)
+{
+	hash_table_create_flat(table_r, node_pool, initial_size,
+			       direct_hash, direct_cmp);
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -129,18 +373,29 @@ void hash_table_destroy(struct hash_table **_table)
 
 	*_table = NULL;
 
-	if (!table->node_pool->alloconly_pool) {
+	if (!table->flat && !table->node_pool->alloconly_pool) {
 		hash_table_destroy_nodes(table);
 		destroy_node_list(table, table->free_nodes);
 	}
 
 	pool_unref(&table->node_pool);
 	i_free(table->nodes);
+	i_free(table->flat_entries);
+	i_free(table->flat_index);
 	i_free(table);
 }
 
 void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
+	if (table->flat) {
+		memset(table->flat_index, 0, sizeof(uint32_t) * table->size);
+		table->flat_index_used = 0;
+		table->flat_entries_count = 0;
+		table->nodes_count = 0;
+		table->removed_count = 0;
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool)
 		hash_table_destroy_nodes(table);
 
@@ -179,6 +434,15 @@ void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
 
+	if (table->flat) {
+		struct hash_flat_entry *entry;
+		unsigned int slot;
+
+		entry = hash_flat_lookup(table, key, table->hash_cb(key),
+					 &slot);
+		return entry != NULL ? entry->value : NULL;
+	}
+
 	node = hash_table_lookup_node(table, key, table->hash_cb(key));
 	return node != NULL ? node->value : NULL;
 }
@@ -189,6 +453,19 @@ bool hash_table_lookup_full(const struct hash_table *table,
 {
 	struct hash_node *node;
 
+	if (table->flat) {
+		struct hash_flat_entry *entry;
+		unsigned int slot;
+
+		entry = hash_flat_lookup(table, lookup_key,
+					 table->hash_cb(lookup_key), &slot);
+		if (entry == NULL)
+			return FALSE;
+		*orig_key = entry->key;
+		*value = entry->value;
+		return TRUE;
+	}
+
 	node = hash_table_lookup_node(table, lookup_key,
 				      table->hash_cb(lookup_key));
 	if (node == NULL)
@@ -282,13 +559,21 @@ void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
 	struct hash_node *node;
 
+	if (table->flat) {
+		hash_flat_insert(table, key, value, TRUE);
+		return;
+	}
+
 	node = hash_table_insert_node(table, key, value, TRUE);
 	node->key = key;
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, TRUE);
+	if (table->flat)
+		hash_flat_insert(table, key, value, FALSE);
+	else
+		hash_table_insert_node(table, key, value, TRUE);
 }
 
 static void
@@ -331,6 +616,9 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 	struct hash_node *node;
 	unsigned int hash;
 
+	if (table->flat)
+		return hash_flat_remove(table, key);
+
 	hash = table->hash_cb(key);
 
 	node = hash_table_lookup_node(table, key, hash);
@@ -360,7 +648,8 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
+	if (!table->flat)
+		ctx->next = &table->nodes[0];
 	return ctx;
 }
 
@@ -387,6 +676,21 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 {
 	struct hash_node *node;
 
+	if (ctx->table->flat) {
+		const struct hash_flat_entry *entry;
+
+		while (ctx->pos < ctx->table->flat_entries_count) {
+			entry = &ctx->table->flat_entries[ctx->pos++];
+			if (entry->key != NULL) {
+				*key_r = entry->key;
+				*value_r = entry->value;
+				return TRUE;
+			}
+		}
+		*key_r = *value_r = NULL;
+		return FALSE;
+	}
+
 	node = ctx->next;
 	if (node != NULL && node->key == NULL)
 		node = hash_table_iterate_next(ctx, node);
@@ -422,7 +726,9 @@ void hash_table_thaw(struct hash_table *table)
 	if (--table->frozen > 0)
 		return;
 
-	if (table->removed_count > 0) {
+	if (table->flat)
+		hash_flat_check_removed(table);
+	else if (table->removed_count > 0) {
 		if (!hash_table_resize(table, FALSE))
 			hash_table_compress_removed(table);
 	}
@@ -498,55 +804,74 @@ void hash_table_copy(struct hash_table *dest, struct hash_table *src)
 	hash_table_thaw(dest);
 }
 
-/* a char* hash function from ASU -- from glib */
-unsigned int str_hash(const char *p)
+/* The string hashes process 8 bytes at a time with xxHash64's round and
+   avalanche functions. The seed is randomized at startup, so that remote
+   users can't easily find keys that all end up in the same slot. */
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+static uint64_t hash_seed = HASH_PRIME3;
+
+void hash_seed_init(void)
 {
-        const unsigned char *s = (const unsigned char *)p;
-	unsigned int g, h = 0;
+	random_init();
+	random_fill(&hash_seed, sizeof(hash_seed));
+	random_deinit();
+}
 
-	while (*s != '\0') {
-		h = (h << 4) + *s;
-		if ((g = h & 0xf0000000UL)) {
-			h = h ^ (g >> 24);
-			h = h ^ g;
-		}
-		s++;
-	}
+static inline uint64_t hash_round(uint64_t acc, uint64_t word)
+{
+	acc += word * HASH_PRIME2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * HASH_PRIME1;
+}
 
-	return h;
+/* Uppercase the ASCII letters in all the bytes of the word. */
+static inline uint64_t hash_word_toupper(uint64_t word)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint64_t low7 = word & (0x7f * ones);
+	uint64_t ge_a = low7 + (0x80 - 'a') * ones;
+	uint64_t gt_z = low7 + (0x80 - 'z' - 1) * ones;
+
+	return word - (((ge_a & ~gt_z & ~word) & (0x80 * ones)) >> 2);
 }
 
-/* a char* hash function from ASU -- from glib */
-unsigned int strcase_hash(const char *p)
+static inline unsigned int
+hash_mem_words(const unsigned char *s, size_t size, bool upper)
 {
-        const unsigned char *s = (const unsigned char *)p;
-	unsigned int g, h = 0;
+	uint64_t word, h = hash_seed ^ (size * HASH_PRIME1);
 
-	while (*s != '\0') {
-		h = (h << 4) + i_toupper(*s);
-		if ((g = h & 0xf0000000UL)) {
-			h = h ^ (g >> 24);
-			h = h ^ g;
-		}
-		s++;
+	for (; size >= sizeof(word); s += sizeof(word), size -= sizeof(word)) {
+		memcpy(&word, s, sizeof(word));
+		h = hash_round(h, upper ? hash_word_toupper(word) : word);
+	}
+	if (size > 0) {
+		word = 0;
+		memcpy(&word, s, size);
+		h = hash_round(h, upper ? hash_word_toupper(word) : word);
 	}
 
-	return h;
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return (unsigned int)h;
 }
 
-unsigned int mem_hash(const void *p, unsigned int size)
+unsigned int str_hash(const char *p)
 {
-	const unsigned char *s = p;
-	unsigned int i, g, h = 0;
+	return hash_mem_words((const unsigned char *)p, strlen(p), FALSE);
+}
 
-	for (i = 0; i < size; i++) {
-		h = (h << 4) + *s;
-		if ((g = h & 0xf0000000UL)) {
-			h = h ^ (g >> 24);
-			h = h ^ g;
-		}
-		s++;
-	}
-	return h;
+unsigned int strcase_hash(const char *p)
+{
+	return hash_mem_words((const unsigned char *)p, strlen(p), TRUE);
 }
 
+unsigned int mem_hash(const void *p, unsigned int size)
+{
+	return hash_mem_words(p, size, FALSE);
+}
@@ -61,6 +61,52 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 	hash_table_create_direct(&(*table)._table, pool, size)
 #endif
 
+/* Create an open addressing hash table. It's used exactly like the tables
+   created with hash_table_create(), but the entries are stored in a single
+   array and looked up via a compact index. This is faster and uses less
+   memory for large tables, but node_pool isn't used for anything. */
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_table_create_flat(table, pool, size, hash_cb, key_cmp_cb) \
+	({(void)COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)); \
+	(void)COMPILE_ERROR_IF_TRUE( \
+		!__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+			int (*)(typeof((*table)._key), typeof((*table)._key))) && \
+		!__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+			int (*)(typeof((*table)._const_key), typeof((*table)._const_key)))); \
+	(void)COMPILE_ERROR_IF_TRUE( \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+			unsigned int (*)(typeof((*table)._key))) && \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+			unsigned int (*)(typeof((*table)._const_key)))); \
+	hash_table_create_flat(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb);})
+#else
+#  define hash_table_create_flat(table, pool, size, hash_cb, key_cmp_cb) \
+	hash_table_create_flat(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb)
+#endif
+void hash_table_create_flat_direct(struct hash_table **table_r,
+				   pool_t node_pool,
+				   unsigned int initial_size);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_table_create_flat_direct(table, pool, size) \
+	({(void)COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)); \
+	hash_table_create_flat_direct(&(*table)._table, pool, size);})
+#else
+#  define hash_table_create_flat_direct(table, pool, size) \
+	hash_table_create_flat_direct(&(*table)._table, pool, size)
+#endif
+
 #define hash_table_is_created(table) \
 	((table)._table != NULL)
 
@@ -165,6 +211,10 @@ void hash_table_copy(struct hash_table *dest, struct hash_table *src);
 #define hash_table_copy(table1, table2) \
 	hash_table_copy((table1)._table, (table2)._table)
 
+/* Randomize the seed used by the hash functions below. This is called by
+   lib_init(), so the hashes differ between processes and can't be stored. */
+void hash_seed_init(void);
+
 /* hash function for strings */
 unsigned int str_hash(const char *p) ATTR_PURE;
 unsigned int strcase_hash(const char *p) ATTR_PURE;
@@ -2,6 +2,7 @@
 #define IOLOOP_PRIVATE_H
 
 #include "priorityq.h"
+#include "timeout-wheel.h"
 #include "ioloop.h"
 
 #ifndef IOLOOP_INITIAL_FD_COUNT
@@ -16,6 +17,9 @@ struct ioloop {
 	struct io_file *io_files;
 	struct io_file *next_io_file;
 	struct priorityq *timeouts;
+	/* timeouts added with timeout_add() are kept in the wheel until
+	   they're about to expire, then they're moved to the timeouts queue */
+	struct timeout_wheel *timeout_wheel;
 
         struct ioloop_handler_context *handler_context;
         struct ioloop_notify_handler_context *notify_handler_context;
@@ -59,6 +63,7 @@ struct io_file {
 
 struct timeout {
 	struct priorityq_item item;
+	struct timeout_wheel_item wheel_item;
 	unsigned int source_linenum;
 
         unsigned int msecs;
@@ -71,6 +76,8 @@ struct timeout {
 	struct ioloop_context *ctx;
 
 	unsigned int one_shot:1;
+	/* added with timeout_add_short(), never put to the timeout wheel */
+	unsigned int short_timeout:1;
 };
 
 struct ioloop_context_callback {
@@ -0,0 +1,487 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "fd-close-on-exec.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Number of submission queue entries. If the queue fills up between
+   io_loop_handler_run_internal() calls, it's flushed with a separate
+   io_uring_enter() call. */
+#define IOLOOP_URING_MIN_SQ_ENTRIES 32
+#define IOLOOP_URING_MAX_SQ_ENTRIES 4096
+/* Completion queue is this many times larger than the submission queue.
+   The kernel buffers overflowing completions internally (we require
+   IORING_FEAT_NODROP), so this just keeps the common case fast. */
+#define IOLOOP_URING_CQ_MULTIPLIER 8
+
+/* user_data for operations whose completions we don't care about */
+#define IOLOOP_URING_USER_DATA_IGNORE 0
+
+#define IO_URING_POLL_ERROR (POLLERR | POLLHUP | POLLNVAL)
+#define IO_URING_POLL_INPUT (POLLIN | POLLPRI | IO_URING_POLL_ERROR)
+#define IO_URING_POLL_OUTPUT (POLLOUT | IO_URING_POLL_ERROR)
+
+struct io_uring_fd {
+	struct io_list list;
+	/* Incremented every time the poll request for this fd is replaced
+	   or cancelled. Completions for older generations are ignored. */
+	uint32_t gen;
+	/* poll mask of the currently submitted request, 0 if none */
+	unsigned int armed_mask;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+
+	/* mmap()ed rings */
+	void *sq_ring_ptr, *cq_ring_ptr;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_khead, *sq_ktail, *sq_array;
+	unsigned int sq_mask, sq_entries;
+	unsigned int *cq_khead, *cq_ktail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* our copy of the submission queue tail */
+	unsigned int sq_tail;
+
+	ARRAY(struct io_uring_fd *) fd_index;
+	ARRAY(struct io_uring_cqe) events;
+	ARRAY(int) rearm_fds;
+};
+
+static int sys_io_uring_setup(unsigned int entries,
+			      struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags,
+			      const void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+static void *io_uring_mmap(int fd, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring, %"PRIuSIZE_T") failed: %m", size);
+	return ptr;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+	struct io_uring_params params;
+	unsigned int entries;
+	char *sq_ptr, *cq_ptr;
+
+	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->events, initial_fd_count);
+	i_array_init(&ctx->rearm_fds, initial_fd_count);
+
+	entries = I_MIN(I_MAX(initial_fd_count, IOLOOP_URING_MIN_SQ_ENTRIES),
+			IOLOOP_URING_MAX_SQ_ENTRIES);
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = nearest_power(entries) * IOLOOP_URING_CQ_MULTIPLIER;
+
+	ctx->ring_fd = sys_io_uring_setup(entries, &params);
+	if (ctx->ring_fd < 0) {
+		if (errno == ENOSYS || errno == EPERM) {
+			i_fatal("io_uring_setup() failed: %m (kernel doesn't "
+				"support io_uring or it's disabled - "
+				"rebuild with --with-ioloop=epoll)");
+		}
+		i_fatal("io_uring_setup() failed: %m");
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	if ((params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		i_fatal("io_uring: Kernel is too old "
+			"(NODROP and EXT_ARG features are required)");
+	}
+
+	ctx->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ctx->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ctx->sq_ring_size = I_MAX(ctx->sq_ring_size, ctx->cq_ring_size);
+		ctx->sq_ring_ptr = io_uring_mmap(ctx->ring_fd, ctx->sq_ring_size,
+						 IORING_OFF_SQ_RING);
+		ctx->cq_ring_ptr = ctx->sq_ring_ptr;
+		ctx->cq_ring_size = 0;
+	} else {
+		ctx->sq_ring_ptr = io_uring_mmap(ctx->ring_fd, ctx->sq_ring_size,
+						 IORING_OFF_SQ_RING);
+		ctx->cq_ring_ptr = io_uring_mmap(ctx->ring_fd, ctx->cq_ring_size,
+						 IORING_OFF_CQ_RING);
+	}
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = io_uring_mmap(ctx->ring_fd, ctx->sqes_size,
+				  IORING_OFF_SQES);
+
+	sq_ptr = ctx->sq_ring_ptr;
+	ctx->sq_khead = (void *)(sq_ptr + params.sq_off.head);
+	ctx->sq_ktail = (void *)(sq_ptr + params.sq_off.tail);
+	ctx->sq_array = (void *)(sq_ptr + params.sq_off.array);
+	ctx->sq_mask = *(unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+	ctx->sq_entries = params.sq_entries;
+	ctx->sq_tail = *ctx->sq_ktail;
+
+	cq_ptr = ctx->cq_ring_ptr;
+	ctx->cq_khead = (void *)(cq_ptr + params.cq_off.head);
+	ctx->cq_ktail = (void *)(cq_ptr + params.cq_off.tail);
+	ctx->cq_mask = *(unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+	ctx->cqes = (void *)(cq_ptr + params.cq_off.cqes);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **list;
+	unsigned int i, count;
+
+	list = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(list[i]);
+
+	if (munmap(ctx->sqes, ctx->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (ctx->cq_ring_size > 0 &&
+	    munmap(ctx->cq_ring_ptr, ctx->cq_ring_size) < 0)
+		i_error("munmap(io_uring cq) failed: %m");
+	if (munmap(ctx->sq_ring_ptr, ctx->sq_ring_size) < 0)
+		i_error("munmap(io_uring sq) failed: %m");
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	array_free(&ioloop->handler_context->fd_index);
+	array_free(&ioloop->handler_context->events);
+	array_free(&ioloop->handler_context->rearm_fds);
+	i_free(ioloop->handler_context);
+}
+
+static unsigned int io_uring_sq_pending(struct ioloop_handler_context *ctx)
+{
+	return ctx->sq_tail - __atomic_load_n(ctx->sq_khead, __ATOMIC_ACQUIRE);
+}
+
+static void io_uring_flush(struct ioloop_handler_context *ctx)
+{
+	unsigned int pending;
+
+	while ((pending = io_uring_sq_pending(ctx)) > 0) {
+		if (sys_io_uring_enter(ctx->ring_fd, pending, 0, 0,
+				       NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(submit) failed: %m");
+		if (io_uring_sq_pending(ctx) == pending)
+			break;
+	}
+}
+
+static struct io_uring_sqe *io_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (io_uring_sq_pending(ctx) >= ctx->sq_entries) {
+		io_uring_flush(ctx);
+		if (io_uring_sq_pending(ctx) >= ctx->sq_entries)
+			i_panic("io_uring: Submission queue is stuck full");
+	}
+
+	idx = ctx->sq_tail & ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ctx->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void io_uring_sqe_queue(struct ioloop_handler_context *ctx)
+{
+	ctx->sq_tail++;
+	__atomic_store_n(ctx->sq_ktail, ctx->sq_tail, __ATOMIC_RELEASE);
+}
+
+static uint64_t io_uring_fd_key(int fd, uint32_t gen)
+{
+	return ((uint64_t)gen << 32) | (uint32_t)fd;
+}
+
+static unsigned int io_uring_fd_mask(const struct io_uring_fd *ufd)
+{
+	unsigned int mask = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = ufd->list.ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if (io->io.condition & IO_READ)
+			mask |= IO_URING_POLL_INPUT;
+		if (io->io.condition & IO_WRITE)
+			mask |= IO_URING_POLL_OUTPUT;
+		if (io->io.condition & IO_ERROR)
+			mask |= IO_URING_POLL_ERROR;
+	}
+	return mask;
+}
+
+static void
+io_uring_poll_cancel(struct ioloop_handler_context *ctx,
+		     struct io_uring_fd *ufd, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ufd->armed_mask != 0) {
+		/* the poll request keeps a reference to the file, so it
+		   must be cancelled even if the fd was already closed */
+		sqe = io_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = io_uring_fd_key(fd, ufd->gen);
+		sqe->user_data = IOLOOP_URING_USER_DATA_IGNORE;
+		io_uring_sqe_queue(ctx);
+		ufd->armed_mask = 0;
+	}
+	/* invalidate any already received completions */
+	if (++ufd->gen == 0)
+		ufd->gen++;
+}
+
+static void
+io_uring_poll_arm(struct ioloop_handler_context *ctx,
+		  struct io_uring_fd *ufd, int fd, unsigned int mask)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t poll_mask = mask;
+
+	i_assert(ufd->armed_mask == 0);
+	i_assert(mask != 0);
+
+#ifdef WORDS_BIGENDIAN
+	poll_mask = (poll_mask << 16) | (poll_mask >> 16);
+#endif
+	/* Use one-shot polls, which are re-armed after the completion is
+	   handled. Multishot polls are edge-triggered, but ioloop callers
+	   expect level-triggered behavior. The re-arms are batched into the
+	   same io_uring_enter() call that waits for the next events. */
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = poll_mask;
+	sqe->user_data = io_uring_fd_key(fd, ufd->gen);
+	io_uring_sqe_queue(ctx);
+	ufd->armed_mask = mask;
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp, *ufd;
+	unsigned int mask;
+
+	ufdp = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL) {
+		*ufdp = i_new(struct io_uring_fd, 1);
+		(*ufdp)->gen = 1;
+	}
+	ufd = *ufdp;
+
+	(void)ioloop_iolist_add(&ufd->list, io);
+
+	mask = io_uring_fd_mask(ufd);
+	if (ufd->armed_mask != mask) {
+		io_uring_poll_cancel(ctx, ufd, io->fd);
+		io_uring_poll_arm(ctx, ufd, io->fd, mask);
+	}
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp, *ufd;
+	unsigned int mask;
+
+	ufdp = array_idx_modifiable(&ctx->fd_index, io->fd);
+	ufd = *ufdp;
+	(void)ioloop_iolist_del(&ufd->list, io);
+
+	mask = io_uring_fd_mask(ufd);
+	if (ufd->armed_mask != mask) {
+		io_uring_poll_cancel(ctx, ufd, io->fd);
+		if (mask != 0)
+			io_uring_poll_arm(ctx, ufd, io->fd, mask);
+	}
+	i_free(io);
+}
+
+static void io_uring_reap(struct ioloop_handler_context *ctx)
+{
+	const struct io_uring_cqe *cqe;
+	struct io_uring_fd *const *ufdp;
+	unsigned int head, tail;
+	int fd;
+
+	array_clear(&ctx->events);
+	array_clear(&ctx->rearm_fds);
+
+	head = *ctx->cq_khead;
+	tail = __atomic_load_n(ctx->cq_ktail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ctx->cqes[head & ctx->cq_mask];
+		if (cqe->user_data == IOLOOP_URING_USER_DATA_IGNORE)
+			continue;
+
+		fd = (int)(cqe->user_data & 0xffffffffU);
+		if ((unsigned int)fd >= array_count(&ctx->fd_index))
+			continue;
+		ufdp = array_idx(&ctx->fd_index, fd);
+		if (*ufdp == NULL || (*ufdp)->gen != (cqe->user_data >> 32)) {
+			/* cancelled or replaced request */
+			continue;
+		}
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			i_panic("io_uring poll(%d) failed: %m", fd);
+		}
+		(*ufdp)->armed_mask = 0;
+		array_append(&ctx->events, cqe, 1);
+		array_append(&ctx->rearm_fds, &fd, 1);
+	}
+	__atomic_store_n(ctx->cq_khead, head, __ATOMIC_RELEASE);
+}
+
+static void io_uring_rearm(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_fd **ufdp;
+	unsigned int mask;
+	const int *fdp;
+
+	array_foreach(&ctx->rearm_fds, fdp) {
+		ufdp = array_idx_modifiable(&ctx->fd_index, *fdp);
+		if ((*ufdp)->armed_mask != 0) {
+			/* already re-armed by io_loop_handle_add/remove() */
+			continue;
+		}
+		mask = io_uring_fd_mask(*ufdp);
+		if (mask != 0)
+			io_uring_poll_arm(ctx, *ufdp, *fdp, mask);
+	}
+	array_clear(&ctx->rearm_fds);
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	const struct io_uring_cqe *event;
+	struct io_uring_fd *ufd;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, events_count;
+	int msecs, fd, j;
+	bool call;
+
+        /* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+	if (ioloop->io_files == NULL) {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		i_assert(msecs >= 0);
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (msecs >= 0) {
+		ts.tv_sec = msecs / 1000;
+		ts.tv_nsec = (long long)(msecs % 1000) * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+
+	/* submit all the queued poll changes and wait for events using a
+	   single syscall */
+	if (sys_io_uring_enter(ctx->ring_fd, io_uring_sq_pending(ctx), 1,
+			       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			       &arg, sizeof(arg)) < 0 &&
+	    errno != EINTR && errno != ETIME && errno != EBUSY &&
+	    errno != EAGAIN)
+		i_fatal("io_uring_enter(): %m");
+
+	io_uring_reap(ctx);
+
+	/* execute timeout handlers */
+        io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running) {
+		/* the completed polls are one-shot, so they must be re-armed
+		   even if we don't handle them now */
+		io_uring_rearm(ctx);
+		return;
+	}
+
+	events_count = array_count(&ctx->events);
+	for (i = 0; i < events_count; i++) {
+		event = array_idx(&ctx->events, i);
+		fd = (int)(event->user_data & 0xffffffffU);
+		/* the io_uring_fd structs are never freed before deinit,
+		   so the pointer stays valid even if fd_index grows */
+		ufd = *(struct io_uring_fd *const *)array_idx(&ctx->fd_index, fd);
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			if (ufd->gen != (event->user_data >> 32)) {
+				/* an earlier callback removed or changed the
+				   I/Os for this fd */
+				break;
+			}
+			io = ufd->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((event->res & (POLLHUP | POLLERR | POLLNVAL)) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (event->res & (POLLIN | POLLPRI)) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (event->res & POLLOUT) != 0;
+			else if ((io->io.condition & IO_ERROR) != 0)
+				call = (event->res & IO_URING_POLL_ERROR) != 0;
+
+			if (call)
+				io_loop_call_io(&io->io);
+		}
+	}
+	io_uring_rearm(ctx);
+}
+
+#endif	/* IOLOOP_URING */
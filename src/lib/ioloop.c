@@ -8,6 +8,10 @@
 
 #include <unistd.h>
 
+#define TIMEOUT_FROM_WHEEL_ITEM(wheel_item) \
+	((struct timeout *)((char *)(wheel_item) - \
+			    offsetof(struct timeout, wheel_item)))
+
 #define timer_is_larger(tvp, uvp) \
 	((tvp)->tv_sec > (uvp)->tv_sec || \
 	 ((tvp)->tv_sec == (uvp)->tv_sec && \
@@ -197,6 +201,33 @@ static void timeout_update_next(struct timeout *timeout, struct timeval *tv_now)
 	}
 }
 
+static uint64_t timeval_to_wheel_msecs(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+static void timeout_queue(struct timeout *timeout)
+{
+	struct ioloop *ioloop = timeout->ioloop;
+
+	if (!timeout->short_timeout &&
+	    timeout_wheel_add(ioloop->timeout_wheel, &timeout->wheel_item,
+			      timeval_to_wheel_msecs(&timeout->next_run)))
+		return;
+	priorityq_add(ioloop->timeouts, &timeout->item);
+}
+
+static void timeout_unqueue(struct timeout *timeout)
+{
+	struct ioloop *ioloop = timeout->ioloop;
+
+	if (timeout_wheel_item_is_added(&timeout->wheel_item))
+		timeout_wheel_remove(ioloop->timeout_wheel,
+				     &timeout->wheel_item);
+	else if (timeout->item.idx != UINT_MAX)
+		priorityq_remove(ioloop->timeouts, &timeout->item);
+}
+
 static struct timeout *
 timeout_add_common(unsigned int source_linenum,
 			    timeout_callback_t *callback, void *context)
@@ -204,6 +235,7 @@ timeout_add_common(unsigned int source_linenum,
 	struct timeout *timeout;
 
 	timeout = i_new(struct timeout, 1);
+	timeout->item.idx = UINT_MAX;
         timeout->source_linenum = source_linenum;
 	timeout->ioloop = current_ioloop;
 
@@ -229,7 +261,7 @@ struct timeout *timeout_add(unsigned int msecs, unsigned int source_linenum,
 
 	timeout_update_next(timeout, timeout->ioloop->running ?
 			    NULL : &ioloop_timeval);
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	timeout_queue(timeout);
 	return timeout;
 }
 
@@ -238,7 +270,16 @@ struct timeout *
 timeout_add_short(unsigned int msecs, unsigned int source_linenum,
 		  timeout_callback_t *callback, void *context)
 {
-	return timeout_add(msecs, source_linenum, callback, context);
+	struct timeout *timeout;
+
+	timeout = timeout_add_common(source_linenum, callback, context);
+	timeout->msecs = msecs;
+	timeout->short_timeout = TRUE;
+
+	timeout_update_next(timeout, timeout->ioloop->running ?
+			    NULL : &ioloop_timeval);
+	timeout_queue(timeout);
+	return timeout;
 }
 
 #undef timeout_add_absolute
@@ -253,7 +294,7 @@ timeout_add_absolute(const struct timeval *time,
 	timeout->one_shot = TRUE;
 	timeout->next_run = *time;
 
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	timeout_queue(timeout);
 	return timeout;
 }
 
@@ -265,9 +306,10 @@ timeout_copy(const struct timeout *old_to)
 	new_to = timeout_add_common
 		(old_to->source_linenum, old_to->callback, old_to->context);
 	new_to->one_shot = old_to->one_shot;
+	new_to->short_timeout = old_to->short_timeout;
 	new_to->msecs = old_to->msecs;
 	new_to->next_run = old_to->next_run;
-	priorityq_add(new_to->ioloop->timeouts, &new_to->item);
+	timeout_queue(new_to);
 
 	return new_to;
 }
@@ -284,8 +326,7 @@ void timeout_remove(struct timeout **_timeout)
 	struct timeout *timeout = *_timeout;
 
 	*_timeout = NULL;
-	if (timeout->item.idx != UINT_MAX)
-		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	timeout_unqueue(timeout);
 	timeout_free(timeout);
 }
 
@@ -308,8 +349,8 @@ timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 		 timeout->next_run.tv_sec > tv_now->tv_sec ||
 		 (timeout->next_run.tv_sec == tv_now->tv_sec &&
 		  timeout->next_run.tv_usec > tv_now->tv_usec));
-	priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	timeout_unqueue(timeout);
+	timeout_queue(timeout);
 }
 
 void timeout_reset(struct timeout *timeout)
@@ -318,8 +359,8 @@ void timeout_reset(struct timeout *timeout)
 	timeout_reset_timeval(timeout, NULL);
 }
 
-static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
-				 struct timeval *tv_now)
+static int timeval_get_wait_time(const struct timeval *next_run,
+				 struct timeval *tv_r, struct timeval *tv_now)
 {
 	int ret;
 
@@ -331,10 +372,10 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 	tv_r->tv_usec = tv_now->tv_usec;
 
 	i_assert(tv_r->tv_sec > 0);
-	i_assert(timeout->next_run.tv_sec > 0);
+	i_assert(next_run->tv_sec > 0);
 
-	tv_r->tv_sec = timeout->next_run.tv_sec - tv_r->tv_sec;
-	tv_r->tv_usec = timeout->next_run.tv_usec - tv_r->tv_usec;
+	tv_r->tv_sec = next_run->tv_sec - tv_r->tv_sec;
+	tv_r->tv_usec = next_run->tv_usec - tv_r->tv_usec;
 	if (tv_r->tv_usec < 0) {
 		tv_r->tv_sec--;
 		tv_r->tv_usec += 1000000;
@@ -354,16 +395,24 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 	return ret;
 }
 
+static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
+				 struct timeval *tv_now)
+{
+	return timeval_get_wait_time(&timeout->next_run, tv_r, tv_now);
+}
+
 int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 {
-	struct timeval tv_now;
+	struct timeval tv_now, tv_next, tv_wheel;
 	struct priorityq_item *item;
 	struct timeout *timeout;
+	uint64_t wheel_msecs;
 	int msecs;
 
 	item = priorityq_peek(ioloop->timeouts);
 	timeout = (struct timeout *)item;
-	if (timeout == NULL) {
+	wheel_msecs = timeout_wheel_get_next_msecs(ioloop->timeout_wheel);
+	if (timeout == NULL && wheel_msecs == (uint64_t)-1) {
 		/* no timeouts. use INT_MAX msecs for timeval and
 		   return -1 for poll/epoll infinity. */
 		tv_r->tv_sec = INT_MAX / 1000;
@@ -372,8 +421,21 @@ int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 		return -1;
 	}
 
+	if (wheel_msecs != (uint64_t)-1) {
+		/* wake up when the wheel has timeouts to move to the queue */
+		tv_wheel.tv_sec = wheel_msecs / 1000;
+		tv_wheel.tv_usec = (wheel_msecs % 1000) * 1000;
+	}
+	if (timeout == NULL)
+		tv_next = tv_wheel;
+	else if (wheel_msecs != (uint64_t)-1 &&
+		 timeval_cmp(&tv_wheel, &timeout->next_run) < 0)
+		tv_next = tv_wheel;
+	else
+		tv_next = timeout->next_run;
+
 	tv_now.tv_sec = 0;
-	msecs = timeout_get_wait_time(timeout, tv_r, &tv_now);
+	msecs = timeval_get_wait_time(&tv_next, tv_r, &tv_now);
 	ioloop->next_max_time = (tv_now.tv_sec + msecs/1000) + 1;
 	return msecs;
 }
@@ -395,9 +457,20 @@ static void io_loop_default_time_moved(time_t old_time, time_t new_time)
 
 static void io_loop_timeouts_update(struct ioloop *ioloop, long diff_secs)
 {
+	struct timeout_wheel *wheel = ioloop->timeout_wheel;
+	struct timeout_wheel_item *wheel_item;
 	struct priorityq_item *const *items;
 	unsigned int i, count;
 
+	/* the wheel positions depend on the absolute times, so just move
+	   all of its timeouts to the queue. they'll go back to the wheel
+	   when they're reset. */
+	while ((wheel_item = timeout_wheel_pop_any(wheel)) != NULL) {
+		struct timeout *to = TIMEOUT_FROM_WHEEL_ITEM(wheel_item);
+
+		priorityq_add(ioloop->timeouts, &to->item);
+	}
+
 	count = priorityq_count(ioloop->timeouts);
 	items = priorityq_items(ioloop->timeouts);
 	for (i = 0; i < count; i++) {
@@ -417,8 +490,10 @@ static void io_loops_timeouts_update(long diff_secs)
 
 static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 {
+	struct timeout_wheel_item *wheel_item;
 	struct priorityq_item *item;
 	struct timeval tv, tv_call;
+	uint64_t now_msecs;
 	unsigned int t_id;
 
 	if (gettimeofday(&ioloop_timeval, NULL) < 0)
@@ -446,6 +521,15 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 	ioloop_time = ioloop_timeval.tv_sec;
 	tv_call = ioloop_timeval;
 
+	/* move the timeouts that expire soon from the wheel to the queue */
+	now_msecs = timeval_to_wheel_msecs(&tv_call);
+	while ((wheel_item = timeout_wheel_pop(ioloop->timeout_wheel,
+					       now_msecs)) != NULL) {
+		struct timeout *timeout = TIMEOUT_FROM_WHEEL_ITEM(wheel_item);
+
+		priorityq_add(ioloop->timeouts, &timeout->item);
+	}
+
 	while ((item = priorityq_peek(ioloop->timeouts)) != NULL) {
 		struct timeout *timeout = (struct timeout *)item;
 
@@ -587,6 +671,8 @@ struct ioloop *io_loop_create(void)
 
         ioloop = i_new(struct ioloop, 1);
 	ioloop->timeouts = priorityq_init(timeout_cmp, 32);
+	ioloop->timeout_wheel =
+		timeout_wheel_init(timeval_to_wheel_msecs(&ioloop_timeval));
 
 	ioloop->time_moved_callback = current_ioloop != NULL ?
 		current_ioloop->time_moved_callback :
@@ -600,6 +686,8 @@ struct ioloop *io_loop_create(void)
 void io_loop_destroy(struct ioloop **_ioloop)
 {
 	struct ioloop *ioloop = *_ioloop;
+	struct timeout_wheel *wheel = ioloop->timeout_wheel;
+	struct timeout_wheel_item *wheel_item;
 	struct priorityq_item *item;
 
 	*_ioloop = NULL;
@@ -629,7 +717,15 @@ void io_loop_destroy(struct ioloop **_ioloop)
 			  to->source_linenum);
 		timeout_free(to);
 	}
+	while ((wheel_item = timeout_wheel_pop_any(wheel)) != NULL) {
+		struct timeout *to = TIMEOUT_FROM_WHEEL_ITEM(wheel_item);
+
+		i_warning("Timeout leak: %p (line %u)", (void *)to->callback,
+			  to->source_linenum);
+		timeout_free(to);
+	}
 	priorityq_deinit(&ioloop->timeouts);
+	timeout_wheel_deinit(&ioloop->timeout_wheel);
 
 	if (ioloop->handler_context != NULL)
 		io_loop_handler_deinit(ioloop);
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "env-util.h"
+#include "hash.h"
 #include "hostpid.h"
 #include "ipwd.h"
 #include "process-title.h"
@@ -87,6 +88,7 @@ void lib_init(void)
 
 	data_stack_init();
 	hostpid_init();
+	hash_seed_init();
 }
 
 void lib_deinit(void)
@@ -0,0 +1,488 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "llist.h"
+#include "safe-memset.h"
+#include "mempool.h"
+
+#include <stdlib.h>
+
+/* Each slab is a SLAB_SIZE aligned memory block beginning with struct slab
+   and followed by objects of the same size class. The alignment allows
+   finding the slab for an object without any per-object header. */
+#define SLAB_SIZE 8192
+#define SLAB_MAX_OBJ_SIZE 1024
+#define SLAB_CLASS_ALIGN 16
+
+#define SLAB_HEADER_SIZE MEM_ALIGN(sizeof(struct slab))
+#define SLAB_OBJ(slab, idx) \
+	((unsigned char *)(slab) + SLAB_HEADER_SIZE + \
+	 (idx) * (slab)->class->obj_size)
+#define SLAB_FROM_PTR(mem) \
+	((struct slab *)((uintptr_t)(mem) & ~(uintptr_t)(SLAB_SIZE-1)))
+
+#ifdef DEBUG
+#  define CLEAR_CHR 0xde
+#endif
+
+static const unsigned int slab_class_sizes[] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024
+};
+#define SLAB_CLASS_COUNT N_ELEMENTS(slab_class_sizes)
+
+struct slab {
+	struct slab *prev, *next;
+	struct slab_pool *pool;
+	/* NULL for large allocations */
+	struct slab_class *class;
+	/* size of a large allocation */
+	size_t size;
+#ifndef HAVE_POSIX_MEMALIGN
+	/* the unaligned malloc()ed memory */
+	void *mem;
+#endif
+
+	/* freed objects, linked through their first bytes */
+	void *free_list;
+	unsigned int used_count;
+	/* objects starting from this index have never been allocated */
+	unsigned int unused_idx;
+
+	/* unsigned char objs[]; */
+};
+
+struct slab_class {
+	size_t obj_size;
+	unsigned int objs_per_slab;
+
+	/* slabs that have some free objects */
+	struct slab *partial_slabs;
+	/* slabs that have all objects allocated */
+	struct slab *full_slabs;
+	/* a single slab with no allocated objects is kept around, so that
+	   alloc/free of the same object doesn't keep freeing the slab */
+	struct slab *empty_slab;
+
+	struct pool_slab_stats stats;
+};
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+
+	struct slab_class classes[SLAB_CLASS_COUNT];
+	/* allocations larger than SLAB_MAX_OBJ_SIZE */
+	struct slab *large_allocs;
+	struct pool_slab_stats large_stats;
+#ifdef DEBUG
+	char *name;
+#endif
+};
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+/* size => class index, in SLAB_CLASS_ALIGN steps */
+static uint8_t slab_size_classes[SLAB_MAX_OBJ_SIZE / SLAB_CLASS_ALIGN + 1];
+
+static void slab_size_classes_init(void)
+{
+	unsigned int i, class_idx = 0;
+
+	if (slab_size_classes[N_ELEMENTS(slab_size_classes)-1] != 0)
+		return;
+
+	for (i = 0; i < N_ELEMENTS(slab_size_classes); i++) {
+		while (slab_class_sizes[class_idx] < i * SLAB_CLASS_ALIGN)
+			class_idx++;
+		slab_size_classes[i] = class_idx;
+	}
+}
+
+pool_t pool_slab_create(const char *name ATTR_UNUSED)
+{
+	struct slab_pool *spool;
+	unsigned int i;
+
+	slab_size_classes_init();
+
+	spool = i_new(struct slab_pool, 1);
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		spool->classes[i].obj_size = slab_class_sizes[i];
+		spool->classes[i].objs_per_slab =
+			(SLAB_SIZE - SLAB_HEADER_SIZE) / slab_class_sizes[i];
+		spool->classes[i].stats.obj_size = slab_class_sizes[i];
+	}
+#ifdef DEBUG
+	spool->name = i_strdup(name);
+#endif
+	return &spool->pool;
+}
+
+static struct slab *slab_mem_alloc(size_t size)
+{
+	struct slab *slab;
+	void *mem;
+
+	i_assert(size >= SLAB_HEADER_SIZE);
+
+#ifdef HAVE_POSIX_MEMALIGN
+	if (unlikely(posix_memalign(&mem, SLAB_SIZE, size) != 0))
+		mem = NULL;
+	slab = mem;
+#else
+	mem = malloc(size + SLAB_SIZE - 1);
+	slab = (void *)(((uintptr_t)mem + SLAB_SIZE - 1) &
+			~(uintptr_t)(SLAB_SIZE-1));
+#endif
+	if (unlikely(mem == NULL)) {
+		i_fatal_status(FATAL_OUTOFMEM, "slab_mem_alloc(%"PRIuSIZE_T
+			       "): Out of memory", size);
+	}
+	memset(slab, 0, SLAB_HEADER_SIZE);
+#ifndef HAVE_POSIX_MEMALIGN
+	slab->mem = mem;
+#endif
+	return slab;
+}
+
+static void slab_mem_free(struct slab *slab, size_t size ATTR_UNUSED)
+{
+#ifdef DEBUG
+	safe_memset(slab, CLEAR_CHR, size);
+#endif
+#ifdef HAVE_POSIX_MEMALIGN
+	free(slab);
+#else
+	free(slab->mem);
+#endif
+}
+
+static struct slab *
+slab_alloc(struct slab_pool *spool, struct slab_class *class)
+{
+	struct slab *slab;
+
+	slab = slab_mem_alloc(SLAB_SIZE);
+	slab->pool = spool;
+	slab->class = class;
+
+	class->stats.slab_count++;
+	class->stats.alloc_size += SLAB_SIZE;
+	return slab;
+}
+
+static void slab_free(struct slab_class *class, struct slab *slab)
+{
+	class->stats.slab_count--;
+	class->stats.alloc_size -= SLAB_SIZE;
+	slab_mem_free(slab, SLAB_SIZE);
+}
+
+static void slab_free_list(struct slab_class *class, struct slab **list)
+{
+	struct slab *slab, *next;
+
+	for (slab = *list; slab != NULL; slab = next) {
+		next = slab->next;
+		slab_free(class, slab);
+	}
+	*list = NULL;
+}
+
+static void pool_slab_free_all(struct slab_pool *spool)
+{
+	struct slab_class *class;
+	struct slab *slab, *next;
+	unsigned int i;
+
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		class = &spool->classes[i];
+		slab_free_list(class, &class->partial_slabs);
+		slab_free_list(class, &class->full_slabs);
+		if (class->empty_slab != NULL) {
+			slab_free(class, class->empty_slab);
+			class->empty_slab = NULL;
+		}
+		class->stats.used_count = 0;
+		class->stats.used_size = 0;
+	}
+
+	for (slab = spool->large_allocs; slab != NULL; slab = next) {
+		next = slab->next;
+		slab_mem_free(slab, SLAB_HEADER_SIZE + slab->size);
+	}
+	spool->large_allocs = NULL;
+	spool->large_stats.used_count = 0;
+	spool->large_stats.used_size = 0;
+	spool->large_stats.alloc_size = 0;
+}
+
+static const char *pool_slab_get_name(pool_t pool ATTR_UNUSED)
+{
+#ifdef DEBUG
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	return spool->name;
+#else
+	return "slab";
+#endif
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)*pool;
+
+	if (--spool->refcount > 0)
+		return;
+
+	*pool = NULL;
+	pool_slab_free_all(spool);
+#ifdef DEBUG
+	i_free(spool->name);
+#endif
+	i_free(spool);
+}
+
+static void *pool_slab_large_malloc(struct slab_pool *spool, size_t size)
+{
+	struct slab *slab;
+	void *mem;
+
+	slab = slab_mem_alloc(SLAB_HEADER_SIZE + size);
+	slab->pool = spool;
+	slab->size = size;
+	DLLIST_PREPEND(&spool->large_allocs, slab);
+
+	spool->large_stats.used_count++;
+	spool->large_stats.used_size += size;
+	spool->large_stats.alloc_size += SLAB_HEADER_SIZE + size;
+	spool->large_stats.malloc_count++;
+
+	mem = (unsigned char *)slab + SLAB_HEADER_SIZE;
+	memset(mem, 0, size);
+	return mem;
+}
+
+static void pool_slab_large_free(struct slab_pool *spool, struct slab *slab)
+{
+	DLLIST_REMOVE(&spool->large_allocs, slab);
+
+	spool->large_stats.used_count--;
+	spool->large_stats.used_size -= slab->size;
+	spool->large_stats.alloc_size -= SLAB_HEADER_SIZE + slab->size;
+	spool->large_stats.free_count++;
+
+	slab_mem_free(slab, SLAB_HEADER_SIZE + slab->size);
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_class *class;
+	struct slab *slab;
+	void *mem;
+
+	if (unlikely(size == 0 || size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", size);
+
+	if (size > SLAB_MAX_OBJ_SIZE)
+		return pool_slab_large_malloc(spool, size);
+
+	class = &spool->classes[slab_size_classes[(size + SLAB_CLASS_ALIGN-1) /
+						  SLAB_CLASS_ALIGN]];
+	slab = class->partial_slabs;
+	if (unlikely(slab == NULL)) {
+		if (class->empty_slab != NULL) {
+			slab = class->empty_slab;
+			class->empty_slab = NULL;
+		} else {
+			slab = slab_alloc(spool, class);
+		}
+		DLLIST_PREPEND(&class->partial_slabs, slab);
+	}
+
+	if (slab->free_list != NULL) {
+		mem = slab->free_list;
+		slab->free_list = *(void **)mem;
+	} else {
+		i_assert(slab->unused_idx < class->objs_per_slab);
+		mem = SLAB_OBJ(slab, slab->unused_idx);
+		slab->unused_idx++;
+	}
+	if (++slab->used_count == class->objs_per_slab) {
+		DLLIST_REMOVE(&class->partial_slabs, slab);
+		DLLIST_PREPEND(&class->full_slabs, slab);
+	}
+
+	class->stats.used_count++;
+	class->stats.used_size += class->obj_size;
+	class->stats.malloc_count++;
+
+	memset(mem, 0, class->obj_size);
+	return mem;
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_class *class;
+	struct slab *slab;
+
+	if (mem == NULL)
+		return;
+
+	slab = SLAB_FROM_PTR(mem);
+	i_assert(slab->pool == spool);
+
+	if (slab->class == NULL) {
+		pool_slab_large_free(spool, slab);
+		return;
+	}
+	class = slab->class;
+	i_assert(slab->used_count > 0);
+
+#ifdef DEBUG
+	safe_memset(mem, CLEAR_CHR, class->obj_size);
+#endif
+	*(void **)mem = slab->free_list;
+	slab->free_list = mem;
+
+	if (slab->used_count-- == class->objs_per_slab) {
+		DLLIST_REMOVE(&class->full_slabs, slab);
+		DLLIST_PREPEND(&class->partial_slabs, slab);
+	}
+	if (slab->used_count == 0) {
+		DLLIST_REMOVE(&class->partial_slabs, slab);
+		if (class->empty_slab == NULL) {
+			slab->free_list = NULL;
+			slab->unused_idx = 0;
+			class->empty_slab = slab;
+		} else {
+			slab_free(class, slab);
+		}
+	}
+
+	class->stats.used_count--;
+	class->stats.used_size -= class->obj_size;
+	class->stats.free_count++;
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	struct slab *slab;
+	size_t cur_size;
+	void *new_mem;
+
+	if (unlikely(new_size == 0 || new_size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", new_size);
+
+	if (mem == NULL)
+		return pool_slab_malloc(pool, new_size);
+
+	slab = SLAB_FROM_PTR(mem);
+	cur_size = slab->class != NULL ? slab->class->obj_size : slab->size;
+	i_assert(old_size == (size_t)-1 || old_size <= cur_size);
+	if (old_size > cur_size)
+		old_size = cur_size;
+
+	if (slab->class != NULL && new_size <= cur_size) {
+		/* fits into the same object */
+		if (old_size < new_size) {
+			memset((unsigned char *)mem + old_size, 0,
+			       new_size - old_size);
+		}
+		return mem;
+	}
+
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, I_MIN(old_size, new_size));
+	pool_slab_free(pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	pool_slab_free_all(spool);
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+bool pool_slab_get_class_stats(pool_t pool, unsigned int idx,
+			       struct pool_slab_stats *stats_r)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	i_assert(pool->v == &static_slab_pool_vfuncs);
+
+	if (idx < SLAB_CLASS_COUNT)
+		*stats_r = spool->classes[idx].stats;
+	else if (idx == SLAB_CLASS_COUNT)
+		*stats_r = spool->large_stats;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r)
+{
+	struct pool_slab_stats stats;
+	unsigned int i;
+
+	memset(stats_r, 0, sizeof(*stats_r));
+	for (i = 0; pool_slab_get_class_stats(pool, i, &stats); i++) {
+		stats_r->used_count += stats.used_count;
+		stats_r->slab_count += stats.slab_count;
+		stats_r->used_size += stats.used_size;
+		stats_r->alloc_size += stats.alloc_size;
+		stats_r->malloc_count += stats.malloc_count;
+		stats_r->free_count += stats.free_count;
+	}
+}
@@ -58,6 +58,13 @@ extern pool_t unsafe_data_stack_pool;
    malloc()ed block size, part of it is used internally. */
 pool_t pool_alloconly_create(const char *name, size_t size);
 
+/* Create a new slab pool. Small allocations are rounded up to a size class
+   and each size class is allocated from its own slabs with a free list, so
+   freeing and allocating many small objects doesn't churn malloc(). Large
+   allocations get their own memory blocks. Unlike alloconly pools, the
+   memory is actually freed with p_free(). */
+pool_t pool_slab_create(const char *name);
+
 /* When allocating memory from returned pool, the data stack frame must be
    the same as it was when calling this function. pool_unref() also checks
    that the stack frame is the same. This should make it quite safe to use. */
@@ -132,4 +139,27 @@ size_t pool_alloconly_get_total_used_size(pool_t pool);
 /* Returns how much system memory has been allocated for this pool. */
 size_t pool_alloconly_get_total_alloc_size(pool_t pool);
 
+/* These functions are only for pools created with pool_slab_create(): */
+
+struct pool_slab_stats {
+	/* object size of the size class, 0 for large allocations and for
+	   the total stats */
+	size_t obj_size;
+	/* number of currently allocated objects and slabs */
+	unsigned int used_count, slab_count;
+	/* memory used by the allocated objects (rounded up to the size class)
+	   and memory allocated from the system. The difference between these
+	   is the fragmentation overhead. */
+	size_t used_size, alloc_size;
+	/* number of p_malloc() and p_free() calls done */
+	uint64_t malloc_count, free_count;
+};
+
+/* Returns the total statistics of all the size classes. */
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r);
+/* Returns the statistics of the size class idx (0..). The last index is
+   for the large allocations. Returns FALSE if idx is too large. */
+bool pool_slab_get_class_stats(pool_t pool, unsigned int idx,
+			       struct pool_slab_stats *stats_r);
+
 #endif
@@ -0,0 +1,1025 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "seq-bitmap.h"
+
+#define SEQ_BITMAP_KEY(seq) ((seq) >> 16)
+#define SEQ_BITMAP_LOW(seq) ((seq) & 0xffff)
+#define SEQ_BITMAP_CHUNK_SIZE 65536U
+#define SEQ_BITMAP_CHUNK_WORDS (SEQ_BITMAP_CHUNK_SIZE / 64)
+/* array containers use at most as much memory as bitmaps */
+#define SEQ_BITMAP_MAX_ARRAY_COUNT \
+	(SEQ_BITMAP_CHUNK_WORDS * sizeof(uint64_t) / sizeof(uint16_t))
+
+enum seq_bitmap_container_type {
+	SEQ_BITMAP_CONTAINER_ARRAY = 0,
+	SEQ_BITMAP_CONTAINER_BITS,
+	SEQ_BITMAP_CONTAINER_FULL
+};
+
+struct seq_bitmap_container {
+	enum seq_bitmap_container_type type;
+	/* seq>>16 of the first and the last chunk. These differ only for
+	   full containers spanning multiple chunks. */
+	uint32_t key, last_key;
+	/* number of sequences in array and bits containers */
+	unsigned int count;
+	/* number of allocated array elements */
+	unsigned int alloc;
+	union {
+		uint16_t *array;
+		uint64_t *bits;
+	} u;
+};
+
+static inline unsigned int seq_bitmap_popcount64(uint64_t word)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(word);
+#else
+	unsigned int count;
+
+	for (count = 0; word != 0; count++)
+		word &= word - 1;
+	return count;
+#endif
+}
+
+static inline unsigned int seq_bitmap_ctz64(uint64_t word)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(word);
+#else
+	unsigned int bit = 0;
+
+	for (; (word & 1) == 0; word >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+static unsigned int
+seq_bitmap_container_count(const struct seq_bitmap_container *c)
+{
+	if (c->type == SEQ_BITMAP_CONTAINER_FULL)
+		return (c->last_key - c->key + 1) * SEQ_BITMAP_CHUNK_SIZE;
+	return c->count;
+}
+
+static void seq_bitmap_container_free(struct seq_bitmap_container *c)
+{
+	if (c->type == SEQ_BITMAP_CONTAINER_BITS)
+		i_free(c->u.bits);
+	else
+		i_free(c->u.array);
+}
+
+static void
+seq_bitmap_container_copy(struct seq_bitmap_container *dest,
+			  const struct seq_bitmap_container *src)
+{
+	*dest = *src;
+	switch (src->type) {
+	case SEQ_BITMAP_CONTAINER_ARRAY:
+		dest->alloc = src->count;
+		dest->u.array = i_new(uint16_t, dest->alloc);
+		memcpy(dest->u.array, src->u.array,
+		       sizeof(uint16_t) * src->count);
+		break;
+	case SEQ_BITMAP_CONTAINER_BITS:
+		dest->u.bits = i_new(uint64_t, SEQ_BITMAP_CHUNK_WORDS);
+		memcpy(dest->u.bits, src->u.bits,
+		       sizeof(uint64_t) * SEQ_BITMAP_CHUNK_WORDS);
+		break;
+	case SEQ_BITMAP_CONTAINER_FULL:
+		break;
+	}
+}
+
+/* Returns the index of the first element >= low. */
+static unsigned int
+seq_bitmap_array_find(const struct seq_bitmap_container *c, uint16_t low)
+{
+	unsigned int left_idx = 0, right_idx = c->count, idx;
+
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (c->u.array[idx] < low)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return left_idx;
+}
+
+static void
+seq_bitmap_array_reserve(struct seq_bitmap_container *c, unsigned int count)
+{
+	unsigned int new_alloc;
+
+	if (count <= c->alloc)
+		return;
+	new_alloc = I_MAX(nearest_power(count), 4);
+	c->u.array = i_realloc(c->u.array, sizeof(uint16_t) * c->alloc,
+			       sizeof(uint16_t) * new_alloc);
+	c->alloc = new_alloc;
+}
+
+/* Set or clear bits low..high, and return the number of changed bits. */
+static unsigned int
+seq_bitmap_bits_update(uint64_t *bits, unsigned int low, unsigned int high,
+		       bool set)
+{
+	unsigned int i, changed = 0;
+	uint64_t mask, old_word;
+
+	for (i = low / 64; i <= high / 64; i++) {
+		mask = (uint64_t)-1;
+		if (i == low / 64)
+			mask &= (uint64_t)-1 << (low % 64);
+		if (i == high / 64)
+			mask &= (uint64_t)-1 >> (63 - high % 64);
+		old_word = bits[i];
+		bits[i] = set ? (old_word | mask) : (old_word & ~mask);
+		changed += seq_bitmap_popcount64(old_word ^ bits[i]);
+	}
+	return changed;
+}
+
+static void seq_bitmap_container_to_bits(struct seq_bitmap_container *c)
+{
+	uint64_t *bits;
+	unsigned int i;
+
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_ARRAY);
+
+	bits = i_new(uint64_t, SEQ_BITMAP_CHUNK_WORDS);
+	for (i = 0; i < c->count; i++)
+		bits[c->u.array[i] / 64] |= (uint64_t)1 << (c->u.array[i] % 64);
+	i_free(c->u.array);
+	c->u.bits = bits;
+	c->alloc = 0;
+	c->type = SEQ_BITMAP_CONTAINER_BITS;
+}
+
+static void seq_bitmap_container_to_array(struct seq_bitmap_container *c)
+{
+	uint16_t *array;
+	uint64_t word;
+	unsigned int i, count = 0;
+
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_BITS);
+
+	array = i_new(uint16_t, I_MAX(c->count, 1));
+	for (i = 0; i < SEQ_BITMAP_CHUNK_WORDS; i++) {
+		for (word = c->u.bits[i]; word != 0; word &= word - 1)
+			array[count++] = i * 64 + seq_bitmap_ctz64(word);
+	}
+	i_assert(count == c->count);
+	i_free(c->u.bits);
+	c->u.array = array;
+	c->alloc = I_MAX(c->count, 1);
+	c->type = SEQ_BITMAP_CONTAINER_ARRAY;
+}
+
+static bool
+seq_bitmap_chunk_exists(const struct seq_bitmap_container *c, uint16_t low)
+{
+	unsigned int idx;
+
+	switch (c->type) {
+	case SEQ_BITMAP_CONTAINER_ARRAY:
+		idx = seq_bitmap_array_find(c, low);
+		return idx < c->count && c->u.array[idx] == low;
+	case SEQ_BITMAP_CONTAINER_BITS:
+		return (c->u.bits[low / 64] & ((uint64_t)1 << (low % 64))) != 0;
+	case SEQ_BITMAP_CONTAINER_FULL:
+		break;
+	}
+	return TRUE;
+}
+
+static bool
+seq_bitmap_chunk_add(struct seq_bitmap_container *c, uint16_t low)
+{
+	unsigned int idx;
+
+	if (c->type == SEQ_BITMAP_CONTAINER_BITS) {
+		if (seq_bitmap_bits_update(c->u.bits, low, low, TRUE) == 0)
+			return TRUE;
+		c->count++;
+		return FALSE;
+	}
+
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_ARRAY);
+	idx = seq_bitmap_array_find(c, low);
+	if (idx < c->count && c->u.array[idx] == low)
+		return TRUE;
+	seq_bitmap_array_reserve(c, c->count + 1);
+	memmove(c->u.array + idx + 1, c->u.array + idx,
+		sizeof(uint16_t) * (c->count - idx));
+	c->u.array[idx] = low;
+	c->count++;
+	return FALSE;
+}
+
+static void
+seq_bitmap_chunk_add_range(struct seq_bitmap_container *c,
+			   uint16_t low, uint16_t high)
+{
+	unsigned int i, idx1, idx2, new_count;
+
+	if (c->type == SEQ_BITMAP_CONTAINER_ARRAY &&
+	    c->count + (high - low + 1) > SEQ_BITMAP_MAX_ARRAY_COUNT)
+		seq_bitmap_container_to_bits(c);
+	if (c->type == SEQ_BITMAP_CONTAINER_BITS) {
+		c->count += seq_bitmap_bits_update(c->u.bits, low, high, TRUE);
+		return;
+	}
+
+	/* replace the existing elements between low..high */
+	idx1 = seq_bitmap_array_find(c, low);
+	idx2 = idx1;
+	while (idx2 < c->count && c->u.array[idx2] <= high)
+		idx2++;
+	new_count = c->count - (idx2 - idx1) + (high - low + 1);
+	seq_bitmap_array_reserve(c, new_count);
+	memmove(c->u.array + idx1 + (high - low + 1), c->u.array + idx2,
+		sizeof(uint16_t) * (c->count - idx2));
+	for (i = low; i <= high; i++)
+		c->u.array[idx1++] = i;
+	c->count = new_count;
+}
+
+static unsigned int
+seq_bitmap_chunk_remove_range(struct seq_bitmap_container *c,
+			      uint16_t low, uint16_t high)
+{
+	unsigned int idx1, idx2, removed;
+
+	if (c->type == SEQ_BITMAP_CONTAINER_BITS) {
+		removed = seq_bitmap_bits_update(c->u.bits, low, high, FALSE);
+		c->count -= removed;
+		return removed;
+	}
+
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_ARRAY);
+	idx1 = seq_bitmap_array_find(c, low);
+	idx2 = idx1;
+	while (idx2 < c->count && c->u.array[idx2] <= high)
+		idx2++;
+	memmove(c->u.array + idx1, c->u.array + idx2,
+		sizeof(uint16_t) * (c->count - idx2));
+	removed = idx2 - idx1;
+	c->count -= removed;
+	return removed;
+}
+
+/* dest |= src */
+static void
+seq_bitmap_chunk_or(struct seq_bitmap_container *dest,
+		    const struct seq_bitmap_container *src)
+{
+	unsigned int i;
+	uint64_t old_word;
+
+	if (src->type == SEQ_BITMAP_CONTAINER_ARRAY &&
+	    (dest->type == SEQ_BITMAP_CONTAINER_BITS ||
+	     dest->count + src->count <= SEQ_BITMAP_MAX_ARRAY_COUNT)) {
+		for (i = 0; i < src->count; i++)
+			(void)seq_bitmap_chunk_add(dest, src->u.array[i]);
+		return;
+	}
+
+	if (dest->type == SEQ_BITMAP_CONTAINER_ARRAY)
+		seq_bitmap_container_to_bits(dest);
+	if (src->type == SEQ_BITMAP_CONTAINER_ARRAY) {
+		for (i = 0; i < src->count; i++)
+			(void)seq_bitmap_chunk_add(dest, src->u.array[i]);
+		return;
+	}
+	for (i = 0; i < SEQ_BITMAP_CHUNK_WORDS; i++) {
+		old_word = dest->u.bits[i];
+		dest->u.bits[i] |= src->u.bits[i];
+		dest->count +=
+			seq_bitmap_popcount64(dest->u.bits[i] ^ old_word);
+	}
+}
+
+/* dest &= src (invert=FALSE) or dest &= ~src (invert=TRUE) */
+static void
+seq_bitmap_chunk_and(struct seq_bitmap_container *dest,
+		     const struct seq_bitmap_container *src, bool invert)
+{
+	unsigned int i, count;
+	uint64_t mask;
+
+	if (dest->type == SEQ_BITMAP_CONTAINER_BITS &&
+	    src->type == SEQ_BITMAP_CONTAINER_BITS) {
+		dest->count = 0;
+		for (i = 0; i < SEQ_BITMAP_CHUNK_WORDS; i++) {
+			mask = invert ? ~src->u.bits[i] : src->u.bits[i];
+			dest->u.bits[i] &= mask;
+			dest->count += seq_bitmap_popcount64(dest->u.bits[i]);
+		}
+	} else if (dest->type == SEQ_BITMAP_CONTAINER_ARRAY) {
+		/* filter the array */
+		count = 0;
+		for (i = 0; i < dest->count; i++) {
+			uint16_t low = dest->u.array[i];
+
+			if (seq_bitmap_chunk_exists(src, low) != invert)
+				dest->u.array[count++] = low;
+		}
+		dest->count = count;
+	} else if (invert) {
+		for (i = 0; i < src->count; i++) {
+			(void)seq_bitmap_chunk_remove_range(dest,
+				src->u.array[i], src->u.array[i]);
+		}
+	} else {
+		/* the result is a subset of the src array */
+		uint16_t *array = i_new(uint16_t, I_MAX(src->count, 1));
+
+		count = 0;
+		for (i = 0; i < src->count; i++) {
+			if (seq_bitmap_chunk_exists(dest, src->u.array[i]))
+				array[count++] = src->u.array[i];
+		}
+		i_free(dest->u.bits);
+		dest->u.array = array;
+		dest->alloc = I_MAX(src->count, 1);
+		dest->count = count;
+		dest->type = SEQ_BITMAP_CONTAINER_ARRAY;
+	}
+}
+
+static uint32_t
+seq_bitmap_chunk_nth(const struct seq_bitmap_container *c, unsigned int n,
+		     struct seq_bitmap_iter *iter)
+{
+	unsigned int i, word_count;
+	uint64_t word;
+
+	switch (c->type) {
+	case SEQ_BITMAP_CONTAINER_ARRAY:
+		return (c->key << 16) | c->u.array[n];
+	case SEQ_BITMAP_CONTAINER_BITS:
+		break;
+	case SEQ_BITMAP_CONTAINER_FULL:
+		return (c->key << 16) + n;
+	}
+
+	/* continue from the previously returned word when possible */
+	if (n < iter->prev_word_n) {
+		iter->prev_word = 0;
+		iter->prev_word_n = 0;
+	}
+	for (i = iter->prev_word;; i++) {
+		i_assert(i < SEQ_BITMAP_CHUNK_WORDS);
+		word_count = seq_bitmap_popcount64(c->u.bits[i]);
+		if (n < iter->prev_word_n + word_count)
+			break;
+		iter->prev_word_n += word_count;
+	}
+	iter->prev_word = i;
+
+	word = c->u.bits[i];
+	for (n -= iter->prev_word_n; n > 0; n--)
+		word &= word - 1;
+	return (c->key << 16) | (i * 64 + seq_bitmap_ctz64(word));
+}
+
+void seq_bitmap_init(struct seq_bitmap *bitmap)
+{
+	i_array_init(&bitmap->containers, 8);
+}
+
+void seq_bitmap_deinit(struct seq_bitmap *bitmap)
+{
+	seq_bitmap_clear(bitmap);
+	array_free(&bitmap->containers);
+}
+
+void seq_bitmap_clear(struct seq_bitmap *bitmap)
+{
+	struct seq_bitmap_container *c;
+
+	array_foreach_modifiable(&bitmap->containers, c)
+		seq_bitmap_container_free(c);
+	array_clear(&bitmap->containers);
+}
+
+/* Find the container that has the key. If it's not found, idx_r is set to
+   the position where it should be inserted. */
+static bool
+seq_bitmap_lookup(const struct seq_bitmap *bitmap, uint32_t key,
+		  unsigned int *idx_r)
+{
+	const struct seq_bitmap_container *containers;
+	unsigned int idx, left_idx, right_idx, count;
+
+	containers = array_get(&bitmap->containers, &count);
+	if (count > 0 && containers[count-1].last_key < key) {
+		/* appending is the common case */
+		*idx_r = count;
+		return FALSE;
+	}
+
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (containers[idx].last_key < key)
+			left_idx = idx + 1;
+		else if (containers[idx].key > key)
+			right_idx = idx;
+		else {
+			*idx_r = idx;
+			return TRUE;
+		}
+	}
+	*idx_r = left_idx;
+	return FALSE;
+}
+
+static struct seq_bitmap_container *
+seq_bitmap_insert(struct seq_bitmap *bitmap, unsigned int idx,
+		  enum seq_bitmap_container_type type,
+		  uint32_t key, uint32_t last_key)
+{
+	struct seq_bitmap_container *c;
+
+	c = array_insert_space(&bitmap->containers, idx);
+	c->type = type;
+	c->key = key;
+	c->last_key = last_key;
+	return c;
+}
+
+static void seq_bitmap_delete(struct seq_bitmap *bitmap, unsigned int idx)
+{
+	seq_bitmap_container_free(array_idx_modifiable(&bitmap->containers,
+						       idx));
+	array_delete(&bitmap->containers, idx, 1);
+}
+
+/* Join the full container with its neighbors if they're full as well. */
+static void seq_bitmap_join_full(struct seq_bitmap *bitmap, unsigned int idx)
+{
+	struct seq_bitmap_container *containers;
+	unsigned int count;
+
+	containers = array_get_modifiable(&bitmap->containers, &count);
+	i_assert(containers[idx].type == SEQ_BITMAP_CONTAINER_FULL);
+
+	if (idx + 1 < count &&
+	    containers[idx+1].type == SEQ_BITMAP_CONTAINER_FULL &&
+	    containers[idx].last_key + 1 == containers[idx+1].key) {
+		containers[idx].last_key = containers[idx+1].last_key;
+		array_delete(&bitmap->containers, idx + 1, 1);
+	}
+	if (idx > 0 &&
+	    containers[idx-1].type == SEQ_BITMAP_CONTAINER_FULL &&
+	    containers[idx-1].last_key + 1 == containers[idx].key) {
+		containers[idx-1].last_key = containers[idx].last_key;
+		array_delete(&bitmap->containers, idx, 1);
+	}
+}
+
+/* Convert the chunk container to the most compact type after its contents
+   have changed. */
+static void
+seq_bitmap_container_changed(struct seq_bitmap *bitmap, unsigned int idx)
+{
+	struct seq_bitmap_container *c;
+
+	c = array_idx_modifiable(&bitmap->containers, idx);
+	if (c->count == 0) {
+		seq_bitmap_delete(bitmap, idx);
+		return;
+	}
+
+	switch (c->type) {
+	case SEQ_BITMAP_CONTAINER_ARRAY:
+		if (c->count > SEQ_BITMAP_MAX_ARRAY_COUNT)
+			seq_bitmap_container_to_bits(c);
+		break;
+	case SEQ_BITMAP_CONTAINER_BITS:
+		if (c->count == SEQ_BITMAP_CHUNK_SIZE) {
+			i_free(c->u.bits);
+			c->count = 0;
+			c->type = SEQ_BITMAP_CONTAINER_FULL;
+			seq_bitmap_join_full(bitmap, idx);
+		} else if (c->count <= SEQ_BITMAP_MAX_ARRAY_COUNT) {
+			seq_bitmap_container_to_array(c);
+		}
+		break;
+	case SEQ_BITMAP_CONTAINER_FULL:
+		i_unreached();
+	}
+}
+
+/* Split the key's chunk out of a full container into its own bits container.
+   Returns the new container's index. */
+static unsigned int
+seq_bitmap_split_full(struct seq_bitmap *bitmap, unsigned int idx,
+		      uint32_t key)
+{
+	struct seq_bitmap_container *c;
+	uint32_t last_key;
+
+	c = array_idx_modifiable(&bitmap->containers, idx);
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_FULL);
+	i_assert(c->key <= key && key <= c->last_key);
+
+	last_key = c->last_key;
+	if (c->key < key) {
+		c->last_key = key - 1;
+		c = seq_bitmap_insert(bitmap, ++idx,
+				      SEQ_BITMAP_CONTAINER_FULL, key, key);
+	}
+	c->type = SEQ_BITMAP_CONTAINER_BITS;
+	c->last_key = key;
+	c->count = SEQ_BITMAP_CHUNK_SIZE;
+	c->u.bits = i_new(uint64_t, SEQ_BITMAP_CHUNK_WORDS);
+	memset(c->u.bits, 0xff, sizeof(uint64_t) * SEQ_BITMAP_CHUNK_WORDS);
+
+	if (key < last_key) {
+		(void)seq_bitmap_insert(bitmap, idx + 1,
+					SEQ_BITMAP_CONTAINER_FULL,
+					key + 1, last_key);
+	}
+	return idx;
+}
+
+/* Mark chunks key..last_key as full. */
+static void
+seq_bitmap_add_full(struct seq_bitmap *bitmap, uint32_t key, uint32_t last_key)
+{
+	const struct seq_bitmap_container *c;
+	unsigned int idx;
+
+	(void)seq_bitmap_lookup(bitmap, key, &idx);
+	while (idx < array_count(&bitmap->containers)) {
+		c = array_idx(&bitmap->containers, idx);
+		if (c->key > last_key)
+			break;
+		if (c->type == SEQ_BITMAP_CONTAINER_FULL) {
+			key = I_MIN(key, c->key);
+			last_key = I_MAX(last_key, c->last_key);
+		}
+		seq_bitmap_delete(bitmap, idx);
+	}
+	(void)seq_bitmap_insert(bitmap, idx, SEQ_BITMAP_CONTAINER_FULL,
+				key, last_key);
+	seq_bitmap_join_full(bitmap, idx);
+}
+
+/* Remove chunks key..last_key from the full container. */
+static void
+seq_bitmap_remove_full(struct seq_bitmap *bitmap, unsigned int idx,
+		       uint32_t key, uint32_t last_key)
+{
+	struct seq_bitmap_container *c;
+	uint32_t old_last_key;
+
+	c = array_idx_modifiable(&bitmap->containers, idx);
+	i_assert(c->type == SEQ_BITMAP_CONTAINER_FULL);
+	i_assert(c->key <= key && last_key <= c->last_key);
+
+	old_last_key = c->last_key;
+	if (c->key == key && old_last_key == last_key)
+		seq_bitmap_delete(bitmap, idx);
+	else if (c->key == key)
+		c->key = last_key + 1;
+	else {
+		c->last_key = key - 1;
+		if (last_key < old_last_key) {
+			(void)seq_bitmap_insert(bitmap, idx + 1,
+						SEQ_BITMAP_CONTAINER_FULL,
+						last_key + 1, old_last_key);
+		}
+	}
+}
+
+bool seq_bitmap_add(struct seq_bitmap *bitmap, uint32_t seq)
+{
+	struct seq_bitmap_container *c;
+	unsigned int idx;
+
+	if (seq_bitmap_lookup(bitmap, SEQ_BITMAP_KEY(seq), &idx)) {
+		c = array_idx_modifiable(&bitmap->containers, idx);
+		if (c->type == SEQ_BITMAP_CONTAINER_FULL)
+			return TRUE;
+	} else {
+		c = seq_bitmap_insert(bitmap, idx, SEQ_BITMAP_CONTAINER_ARRAY,
+				      SEQ_BITMAP_KEY(seq), SEQ_BITMAP_KEY(seq));
+	}
+	if (seq_bitmap_chunk_add(c, SEQ_BITMAP_LOW(seq)))
+		return TRUE;
+	seq_bitmap_container_changed(bitmap, idx);
+	return FALSE;
+}
+
+void seq_bitmap_add_range(struct seq_bitmap *bitmap,
+			  uint32_t seq1, uint32_t seq2)
+{
+	struct seq_bitmap_container *c;
+	uint32_t key, key2 = SEQ_BITMAP_KEY(seq2), low, high;
+	unsigned int idx;
+
+	i_assert(seq1 <= seq2);
+
+	for (key = SEQ_BITMAP_KEY(seq1);; key++) {
+		low = key == SEQ_BITMAP_KEY(seq1) ? SEQ_BITMAP_LOW(seq1) : 0;
+		high = key == key2 ? SEQ_BITMAP_LOW(seq2) : 0xffff;
+
+		if (low == 0 && high == 0xffff) {
+			/* one or more full chunks */
+			uint32_t last_key = SEQ_BITMAP_LOW(seq2) == 0xffff ?
+				key2 : key2 - 1;
+
+			seq_bitmap_add_full(bitmap, key, last_key);
+			key = last_key;
+		} else if (seq_bitmap_lookup(bitmap, key, &idx)) {
+			c = array_idx_modifiable(&bitmap->containers, idx);
+			if (c->type != SEQ_BITMAP_CONTAINER_FULL) {
+				seq_bitmap_chunk_add_range(c, low, high);
+				seq_bitmap_container_changed(bitmap, idx);
+			}
+		} else {
+			c = seq_bitmap_insert(bitmap, idx,
+					      SEQ_BITMAP_CONTAINER_ARRAY,
+					      key, key);
+			seq_bitmap_chunk_add_range(c, low, high);
+			seq_bitmap_container_changed(bitmap, idx);
+		}
+		if (key == key2)
+			break;
+	}
+}
+
+void seq_bitmap_add_array(struct seq_bitmap *bitmap,
+			  const ARRAY_TYPE(seq_range) *array)
+{
+	const struct seq_range *range;
+
+	array_foreach(array, range)
+		seq_bitmap_add_range(bitmap, range->seq1, range->seq2);
+}
+
+void seq_bitmap_merge(struct seq_bitmap *dest, const struct seq_bitmap *src)
+{
+	const struct seq_bitmap_container *s;
+	struct seq_bitmap_container *d;
+	unsigned int idx;
+
+	i_assert(dest != src);
+
+	array_foreach(&src->containers, s) {
+		if (s->type == SEQ_BITMAP_CONTAINER_FULL) {
+			seq_bitmap_add_full(dest, s->key, s->last_key);
+		} else if (!seq_bitmap_lookup(dest, s->key, &idx)) {
+			d = array_insert_space(&dest->containers, idx);
+			seq_bitmap_container_copy(d, s);
+		} else {
+			d = array_idx_modifiable(&dest->containers, idx);
+			if (d->type != SEQ_BITMAP_CONTAINER_FULL) {
+				seq_bitmap_chunk_or(d, s);
+				seq_bitmap_container_changed(dest, idx);
+			}
+		}
+	}
+}
+
+bool seq_bitmap_remove(struct seq_bitmap *bitmap, uint32_t seq)
+{
+	return seq_bitmap_remove_range(bitmap, seq, seq) > 0;
+}
+
+unsigned int seq_bitmap_remove_range(struct seq_bitmap *bitmap,
+				     uint32_t seq1, uint32_t seq2)
+{
+	const struct seq_bitmap_container *containers;
+	struct seq_bitmap_container *c;
+	uint32_t key, key2 = SEQ_BITMAP_KEY(seq2), low, high, last_key;
+	unsigned int idx, count, removed = 0;
+
+	i_assert(seq1 <= seq2);
+
+	key = SEQ_BITMAP_KEY(seq1);
+	while (key <= key2) {
+		if (!seq_bitmap_lookup(bitmap, key, &idx)) {
+			/* skip over the missing chunks */
+			containers = array_get(&bitmap->containers, &count);
+			if (idx == count || containers[idx].key > key2)
+				break;
+			key = containers[idx].key;
+			continue;
+		}
+		low = key == SEQ_BITMAP_KEY(seq1) ? SEQ_BITMAP_LOW(seq1) : 0;
+		high = key == key2 ? SEQ_BITMAP_LOW(seq2) : 0xffff;
+
+		c = array_idx_modifiable(&bitmap->containers, idx);
+		if (c->type == SEQ_BITMAP_CONTAINER_FULL) {
+			if (low == 0 && high == 0xffff) {
+				last_key = SEQ_BITMAP_LOW(seq2) == 0xffff ?
+					key2 : key2 - 1;
+				last_key = I_MIN(last_key, c->last_key);
+				seq_bitmap_remove_full(bitmap, idx,
+						       key, last_key);
+				removed += (last_key - key + 1) *
+					SEQ_BITMAP_CHUNK_SIZE;
+				key = last_key + 1;
+				continue;
+			}
+			idx = seq_bitmap_split_full(bitmap, idx, key);
+			c = array_idx_modifiable(&bitmap->containers, idx);
+		}
+		removed += seq_bitmap_chunk_remove_range(c, low, high);
+		seq_bitmap_container_changed(bitmap, idx);
+		key++;
+	}
+	return removed;
+}
+
+unsigned int seq_bitmap_remove_bitmap(struct seq_bitmap *dest,
+				      const struct seq_bitmap *src)
+{
+	const struct seq_bitmap_container *s;
+	struct seq_bitmap_container *d;
+	unsigned int idx, old_count, removed = 0;
+
+	i_assert(dest != src);
+
+	array_foreach(&src->containers, s) {
+		if (s->type == SEQ_BITMAP_CONTAINER_FULL) {
+			removed += seq_bitmap_remove_range(dest, s->key << 16,
+				(s->last_key << 16) | 0xffff);
+			continue;
+		}
+		if (!seq_bitmap_lookup(dest, s->key, &idx))
+			continue;
+
+		d = array_idx_modifiable(&dest->containers, idx);
+		if (d->type == SEQ_BITMAP_CONTAINER_FULL) {
+			idx = seq_bitmap_split_full(dest, idx, s->key);
+			d = array_idx_modifiable(&dest->containers, idx);
+		}
+		old_count = d->count;
+		seq_bitmap_chunk_and(d, s, TRUE);
+		removed += old_count - d->count;
+		seq_bitmap_container_changed(dest, idx);
+	}
+	return removed;
+}
+
+unsigned int seq_bitmap_intersect(struct seq_bitmap *dest,
+				  const struct seq_bitmap *src)
+{
+	const struct seq_bitmap_container *s, *src_containers;
+	struct seq_bitmap_container *d, full;
+	unsigned int idx, src_idx, src_count, old_count;
+
+	i_assert(dest != src);
+
+	old_count = seq_bitmap_count(dest);
+	src_containers = array_get(&src->containers, &src_count);
+	for (idx = 0; idx < array_count(&dest->containers); ) {
+		d = array_idx_modifiable(&dest->containers, idx);
+		if (d->type == SEQ_BITMAP_CONTAINER_FULL) {
+			/* replace with the src containers within the range */
+			full = *d;
+			array_delete(&dest->containers, idx, 1);
+			(void)seq_bitmap_lookup(src, full.key, &src_idx);
+			for (; src_idx < src_count; src_idx++) {
+				s = &src_containers[src_idx];
+				if (s->key > full.last_key)
+					break;
+				d = array_insert_space(&dest->containers,
+						       idx++);
+				seq_bitmap_container_copy(d, s);
+				d->key = I_MAX(d->key, full.key);
+				d->last_key = I_MIN(d->last_key,
+						    full.last_key);
+			}
+			continue;
+		}
+
+		if (!seq_bitmap_lookup(src, d->key, &src_idx)) {
+			seq_bitmap_delete(dest, idx);
+			continue;
+		}
+		s = &src_containers[src_idx];
+		if (s->type != SEQ_BITMAP_CONTAINER_FULL) {
+			seq_bitmap_chunk_and(d, s, FALSE);
+			if (d->count == 0) {
+				seq_bitmap_delete(dest, idx);
+				continue;
+			}
+			seq_bitmap_container_changed(dest, idx);
+		}
+		idx++;
+	}
+	return old_count - seq_bitmap_count(dest);
+}
+
+bool seq_bitmap_exists(const struct seq_bitmap *bitmap, uint32_t seq)
+{
+	unsigned int idx;
+
+	if (!seq_bitmap_lookup(bitmap, SEQ_BITMAP_KEY(seq), &idx))
+		return FALSE;
+	return seq_bitmap_chunk_exists(array_idx(&bitmap->containers, idx),
+				       SEQ_BITMAP_LOW(seq));
+}
+
+unsigned int seq_bitmap_count(const struct seq_bitmap *bitmap)
+{
+	const struct seq_bitmap_container *c;
+	unsigned int count = 0;
+
+	array_foreach(&bitmap->containers, c)
+		count += seq_bitmap_container_count(c);
+	return count;
+}
+
+/* Returns the first bit >= pos that is set (or unset), or
+   SEQ_BITMAP_CHUNK_SIZE if there are none. */
+static unsigned int
+seq_bitmap_bits_find(const uint64_t *bits, unsigned int pos, bool set)
+{
+	unsigned int i = pos / 64;
+	uint64_t word;
+
+	if (pos >= SEQ_BITMAP_CHUNK_SIZE)
+		return SEQ_BITMAP_CHUNK_SIZE;
+
+	word = (set ? bits[i] : ~bits[i]) & (~(uint64_t)0 << (pos % 64));
+	while (word == 0) {
+		if (++i == SEQ_BITMAP_CHUNK_WORDS)
+			return SEQ_BITMAP_CHUNK_SIZE;
+		word = set ? bits[i] : ~bits[i];
+	}
+	return i * 64 + seq_bitmap_ctz64(word);
+}
+
+/* The ranges are added in ascending order, so usually they can be simply
+   appended to the array without looking up their position. */
+static void
+seq_bitmap_array_add(ARRAY_TYPE(seq_range) *array, uint32_t seq1, uint32_t seq2)
+{
+	struct seq_range *last, value;
+	unsigned int count;
+
+	count = array_count(array);
+	last = count == 0 ? NULL : array_idx_modifiable(array, count - 1);
+	if (last == NULL || seq1 > last->seq2 + 1) {
+		value.seq1 = seq1;
+		value.seq2 = seq2;
+		array_append(array, &value, 1);
+	} else if (seq1 >= last->seq1) {
+		if (seq2 > last->seq2)
+			last->seq2 = seq2;
+	} else {
+		seq_range_array_add_range(array, seq1, seq2);
+	}
+}
+
+static void
+seq_bitmap_container_get_ranges(const struct seq_bitmap_container *c,
+				ARRAY_TYPE(seq_range) *array)
+{
+	unsigned int i, low, high;
+
+	switch (c->type) {
+	case SEQ_BITMAP_CONTAINER_ARRAY:
+		for (i = 0; i < c->count; ) {
+			low = high = c->u.array[i++];
+			while (i < c->count && c->u.array[i] == high + 1)
+				high = c->u.array[i++];
+			seq_bitmap_array_add(array, (c->key << 16) | low,
+					     (c->key << 16) | high);
+		}
+		break;
+	case SEQ_BITMAP_CONTAINER_BITS:
+		/* add each run of set bits as a single range */
+		low = seq_bitmap_bits_find(c->u.bits, 0, TRUE);
+		while (low < SEQ_BITMAP_CHUNK_SIZE) {
+			high = seq_bitmap_bits_find(c->u.bits, low, FALSE);
+			seq_bitmap_array_add(array, (c->key << 16) | low,
+					     (c->key << 16) | (high - 1));
+			low = seq_bitmap_bits_find(c->u.bits, high, TRUE);
+		}
+		break;
+	case SEQ_BITMAP_CONTAINER_FULL:
+		seq_bitmap_array_add(array, c->key << 16,
+				     (c->last_key << 16) | 0xffff);
+		break;
+	}
+}
+
+void seq_bitmap_to_array(const struct seq_bitmap *bitmap,
+			 ARRAY_TYPE(seq_range) *array)
+{
+	const struct seq_bitmap_container *c;
+
+	array_foreach(&bitmap->containers, c)
+		seq_bitmap_container_get_ranges(c, array);
+}
+
+void seq_bitmap_remove_shift(struct seq_bitmap *bitmap,
+			     const ARRAY_TYPE(seq_range) *ranges)
+{
+	const struct seq_bitmap_container *containers;
+	const struct seq_range *r, *tail;
+	ARRAY_TYPE(seq_range) tail_ranges;
+	unsigned int i, idx, count, r_count, t_count;
+	uint32_t seq1, seq2, shift = 0;
+
+	r = array_get(ranges, &r_count);
+	if (r_count == 0)
+		return;
+
+	/* take out everything starting from the first removed sequence's
+	   chunk. the sequences before it in the same chunk are added back
+	   unchanged. */
+	i_array_init(&tail_ranges, 64);
+	(void)seq_bitmap_lookup(bitmap, SEQ_BITMAP_KEY(r[0].seq1), &idx);
+	containers = array_get(&bitmap->containers, &count);
+	for (i = idx; i < count; i++)
+		seq_bitmap_container_get_ranges(&containers[i], &tail_ranges);
+	if (idx < count) {
+		(void)seq_bitmap_remove_range(bitmap, containers[idx].key << 16,
+					      (uint32_t)-1);
+	}
+
+	/* add them back without the removed ranges. the sequences only
+	   decrease, so they're still added in ascending order. */
+	tail = array_get(&tail_ranges, &t_count);
+	for (i = 0; i < t_count; i++) {
+		seq1 = tail[i].seq1;
+		seq2 = tail[i].seq2;
+		for (;;) {
+			while (r_count > 0 && r->seq2 < seq1) {
+				shift += r->seq2 - r->seq1 + 1;
+				r++; r_count--;
+			}
+			if (r_count > 0 && r->seq1 <= seq1) {
+				/* beginning of the range is removed */
+				if (r->seq2 >= seq2)
+					break;
+				seq1 = r->seq2 + 1;
+				continue;
+			}
+			if (r_count > 0 && r->seq1 <= seq2) {
+				/* the range continues after a removed range */
+				seq_bitmap_add_range(bitmap, seq1 - shift,
+						     r->seq1 - 1 - shift);
+				seq1 = r->seq1;
+				continue;
+			}
+			seq_bitmap_add_range(bitmap, seq1 - shift,
+					     seq2 - shift);
+			break;
+		}
+	}
+	array_free(&tail_ranges);
+}
+
+void seq_bitmap_iter_init(struct seq_bitmap_iter *iter_r,
+			  const struct seq_bitmap *bitmap)
+{
+	memset(iter_r, 0, sizeof(*iter_r));
+	iter_r->bitmap = bitmap;
+}
+
+bool seq_bitmap_iter_nth(struct seq_bitmap_iter *iter, unsigned int n,
+			 uint32_t *seq_r)
+{
+	const struct seq_bitmap_container *containers;
+	unsigned int i, count, c_count;
+
+	if (n < iter->prev_n) {
+		/* iterating backwards, don't bother optimizing */
+		iter->prev_n = 0;
+		iter->prev_idx = 0;
+		iter->prev_word = iter->prev_word_n = 0;
+	}
+
+	containers = array_get(&iter->bitmap->containers, &count);
+	for (i = iter->prev_idx; i < count; i++) {
+		c_count = seq_bitmap_container_count(&containers[i]);
+		if (n - iter->prev_n < c_count) {
+			*seq_r = seq_bitmap_chunk_nth(&containers[i],
+						      n - iter->prev_n, iter);
+			iter->prev_idx = i;
+			return TRUE;
+		}
+		iter->prev_n += c_count;
+		iter->prev_word = iter->prev_word_n = 0;
+	}
+	iter->prev_idx = i;
+	return FALSE;
+}
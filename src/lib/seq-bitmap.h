@@ -0,0 +1,75 @@
+#ifndef SEQ_BITMAP_H
+#define SEQ_BITMAP_H
+
+#include "seq-range-array.h"
+
+/* Compressed bitmap of sequences/UIDs (a "roaring bitmap"). The 32-bit
+   space is split into chunks of 65536 sequences. Each chunk is stored as
+   a sorted array when it's sparse, as a bitmap when it's dense and
+   consecutive completely full chunks are stored as a single run. Unlike
+   with seq_range arrays, adding or removing sequences in the middle of a
+   fragmented set doesn't need to move the whole set in memory. */
+struct seq_bitmap_container;
+
+struct seq_bitmap {
+	ARRAY(struct seq_bitmap_container) containers;
+};
+
+struct seq_bitmap_iter {
+	const struct seq_bitmap *bitmap;
+	unsigned int prev_n, prev_idx;
+	/* position inside the previous bits container */
+	unsigned int prev_word, prev_word_n;
+};
+
+void seq_bitmap_init(struct seq_bitmap *bitmap);
+void seq_bitmap_deinit(struct seq_bitmap *bitmap);
+/* Remove all sequences from the bitmap. */
+void seq_bitmap_clear(struct seq_bitmap *bitmap);
+
+/* Add sequence to bitmap. Returns TRUE if it already existed. */
+bool ATTR_NOWARN_UNUSED_RESULT
+seq_bitmap_add(struct seq_bitmap *bitmap, uint32_t seq);
+void seq_bitmap_add_range(struct seq_bitmap *bitmap,
+			  uint32_t seq1, uint32_t seq2);
+void seq_bitmap_add_array(struct seq_bitmap *bitmap,
+			  const ARRAY_TYPE(seq_range) *array);
+void seq_bitmap_merge(struct seq_bitmap *dest, const struct seq_bitmap *src);
+/* Remove the given sequence from bitmap. Returns TRUE if it was found. */
+bool ATTR_NOWARN_UNUSED_RESULT
+seq_bitmap_remove(struct seq_bitmap *bitmap, uint32_t seq);
+/* Remove a sequence range. Returns number of sequences actually removed. */
+unsigned int ATTR_NOWARN_UNUSED_RESULT
+seq_bitmap_remove_range(struct seq_bitmap *bitmap,
+			uint32_t seq1, uint32_t seq2);
+/* Remove the sequence ranges and move the sequences after each removed
+   range down to fill the gap, the same way as message sequences change
+   after expunges. The ranges must be sorted and non-overlapping. */
+void seq_bitmap_remove_shift(struct seq_bitmap *bitmap,
+			     const ARRAY_TYPE(seq_range) *ranges);
+/* Remove sequences from dest that exist in src. Returns number of sequences
+   actually removed. */
+unsigned int ATTR_NOWARN_UNUSED_RESULT
+seq_bitmap_remove_bitmap(struct seq_bitmap *dest,
+			 const struct seq_bitmap *src);
+/* Remove sequences from dest that don't exist in src. Returns number of
+   sequences actually removed. */
+unsigned int ATTR_NOWARN_UNUSED_RESULT
+seq_bitmap_intersect(struct seq_bitmap *dest, const struct seq_bitmap *src);
+
+/* Returns TRUE if sequence exists in the bitmap. */
+bool seq_bitmap_exists(const struct seq_bitmap *bitmap, uint32_t seq) ATTR_PURE;
+/* Return number of sequences in the bitmap. */
+unsigned int seq_bitmap_count(const struct seq_bitmap *bitmap) ATTR_PURE;
+
+/* Append the sequences as ranges to the array. */
+void seq_bitmap_to_array(const struct seq_bitmap *bitmap,
+			 ARRAY_TYPE(seq_range) *array);
+
+void seq_bitmap_iter_init(struct seq_bitmap_iter *iter_r,
+			  const struct seq_bitmap *bitmap);
+/* Get the nth sequence (0 = first). Returns FALSE if idx is too large. */
+bool seq_bitmap_iter_nth(struct seq_bitmap_iter *iter, unsigned int n,
+			 uint32_t *seq_r);
+
+#endif
@@ -102,9 +102,47 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static void test_base64_random_lines(void)
+{
+	string_t *str, *wrapped, *dest;
+	unsigned char buf[4096];
+	unsigned int i, j, max, line_len;
+	size_t src_pos;
+	int ret;
+
+	str = t_str_new(sizeof(buf)*2);
+	wrapped = t_str_new(sizeof(buf)*2);
+	dest = t_str_new(sizeof(buf));
+
+	test_begin("base64 decode with random line lengths");
+	for (i = 0; i < 100; i++) {
+		max = rand() % sizeof(buf);
+		for (j = 0; j < max; j++)
+			buf[j] = rand();
+
+		str_truncate(str, 0);
+		str_truncate(wrapped, 0);
+		str_truncate(dest, 0);
+		base64_encode(buf, max, str);
+		/* groups can't be split across lines */
+		line_len = (rand() % 25 + 1) * 4;
+		for (j = 0; j < str_len(str); j += line_len) {
+			str_append_n(wrapped, str_c(str) + j, line_len);
+			str_append(wrapped, rand() % 2 == 0 ? "\r\n" : "\n");
+		}
+		ret = base64_decode(str_data(wrapped), str_len(wrapped),
+				    &src_pos, dest);
+		test_assert_idx(ret >= 0 && src_pos == str_len(wrapped), i);
+		test_assert_idx(str_len(dest) == max &&
+				memcmp(buf, str_data(dest), max) == 0, i);
+	}
+	test_end();
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
 	test_base64_decode();
 	test_base64_random();
+	test_base64_random_lines();
 }
@@ -5,7 +5,7 @@
 
 #include <stdlib.h>
 
-static void test_hash_random_pool(pool_t pool)
+static void test_hash_random_pool(pool_t pool, bool flat)
 {
 #define KEYMAX 100000
 	HASH_TABLE(void *, void *) hash;
@@ -13,7 +13,10 @@ static void test_hash_random_pool(pool_t pool)
 	unsigned int i, key, keyidx, delidx;
 
 	keys = i_new(unsigned int, KEYMAX); keyidx = 0;
-	hash_table_create_direct(&hash, pool, 0);
+	if (flat)
+		hash_table_create_flat_direct(&hash, pool, 0);
+	else
+		hash_table_create_direct(&hash, pool, 0);
 	for (i = 0; i < KEYMAX; i++) {
 		key = (rand() % KEYMAX) + 1;
 		if (rand() % 5 > 0) {
@@ -32,17 +35,169 @@ static void test_hash_random_pool(pool_t pool)
 	}
 	for (i = 0; i < keyidx; i++)
 		hash_table_remove(hash, POINTER_CAST(keys[i]));
+	test_assert(hash_table_count(hash) == 0);
 	hash_table_destroy(&hash);
 	i_free(keys);
 }
 
+static void test_hash_flat_random(void)
+{
+	HASH_TABLE(void *, void *) flat;
+	HASH_TABLE(void *, void *) ref;
+	struct hash_iterate_context *iter;
+	void *key, *value, *value2;
+	unsigned int i, n, count;
+
+	test_begin("hash flat random");
+	hash_table_create_flat_direct(&flat, default_pool, 0);
+	hash_table_create_direct(&ref, default_pool, 0);
+	for (i = 0; i < 100000; i++) {
+		key = POINTER_CAST((rand() % 5000) * 8 + 8);
+		value = POINTER_CAST(i + 1);
+		switch (rand() % 3) {
+		case 0:
+			hash_table_insert(flat, key, value);
+			hash_table_insert(ref, key, value);
+			break;
+		case 1:
+			test_assert(hash_table_try_remove(flat, key) ==
+				    hash_table_try_remove(ref, key));
+			break;
+		case 2:
+			test_assert(hash_table_lookup(flat, key) ==
+				    hash_table_lookup(ref, key));
+			break;
+		}
+		test_assert(hash_table_count(flat) == hash_table_count(ref));
+	}
+
+	/* all the entries are found via iteration */
+	count = 0;
+	iter = hash_table_iterate_init(flat);
+	while (hash_table_iterate(iter, flat, &key, &value)) {
+		test_assert(hash_table_lookup(ref, key) == value);
+		count++;
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(count == hash_table_count(ref));
+
+	/* removing and adding while iterating */
+	n = 0;
+	iter = hash_table_iterate_init(flat);
+	while (hash_table_iterate(iter, flat, &key, &value)) {
+		test_assert(hash_table_lookup_full(flat, key, &key, &value2));
+		test_assert(value == value2);
+		if (n++ % 2 == 0) {
+			hash_table_remove(flat, key);
+			hash_table_remove(ref, key);
+		}
+		if (n <= count) {
+			/* these may or may not be iterated */
+			key = POINTER_CAST(100000 * 8 + n * 8);
+			hash_table_insert(flat, key, value);
+			hash_table_insert(ref, key, value);
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(n >= count);
+	test_assert(hash_table_count(flat) == hash_table_count(ref));
+
+	iter = hash_table_iterate_init(ref);
+	while (hash_table_iterate(iter, ref, &key, &value))
+		test_assert(hash_table_lookup(flat, key) == value);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(flat, TRUE);
+	test_assert(hash_table_count(flat) == 0);
+	test_assert(hash_table_lookup(flat, key) == NULL);
+	hash_table_destroy(&flat);
+	hash_table_destroy(&ref);
+	test_end();
+}
+
+static void test_hash_flat_strings(void)
+{
+	static const char *const keys[] = {
+		"foo", "bar", "FOO", "", "foobar", "baz"
+	};
+	HASH_TABLE(const char *, const char *) hash;
+	const char *key, *value, *new_value;
+	unsigned int i;
+
+	test_begin("hash flat strings");
+	hash_table_create_flat(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < N_ELEMENTS(keys); i++)
+		hash_table_insert(hash, keys[i], keys[i]);
+	test_assert(hash_table_count(hash) == N_ELEMENTS(keys));
+	for (i = 0; i < N_ELEMENTS(keys); i++) {
+		key = t_strdup(keys[i]);
+		test_assert(hash_table_lookup(hash, key) == keys[i]);
+	}
+	key = "nonexistent";
+	test_assert(hash_table_lookup(hash, key) == NULL);
+
+	/* update() keeps the original key, insert() replaces it */
+	new_value = "updated";
+	hash_table_update(hash, t_strdup(keys[0]), new_value);
+	test_assert(hash_table_lookup_full(hash, keys[0], &key, &value));
+	test_assert(key == keys[0] && value == new_value);
+	hash_table_insert(hash, t_strdup(keys[1]), new_value);
+	test_assert(hash_table_lookup_full(hash, keys[1], &key, &value));
+	test_assert(key != keys[1] && value == new_value);
+	test_assert(hash_table_count(hash) == N_ELEMENTS(keys));
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_functions(void)
+{
+	static const char *const strs[] = {
+		"", "a", "abcdefg", "abcdefgh", "abcdefghi",
+		"user@example.com", "<20150101.123456@example.org>",
+		"Mixed CASE with @[]{}`~ symbols and more than 32 bytes"
+	};
+	unsigned int counts[1024];
+	unsigned int i, hash, max_count;
+	const char *str;
+
+	test_begin("hash functions");
+	for (i = 0; i < N_ELEMENTS(strs); i++) {
+		str = strs[i];
+		test_assert(str_hash(str) == mem_hash(str, strlen(str)));
+		test_assert(strcase_hash(str) == strcase_hash(t_str_lcase(str)));
+		test_assert(strcase_hash(str) == strcase_hash(t_str_ucase(str)));
+		test_assert(strcase_hash(str) == str_hash(t_str_ucase(str)));
+	}
+	/* only ASCII letters are case-folded */
+	test_assert(strcase_hash("@[") != strcase_hash("`{"));
+	test_assert(mem_hash("ab", 2) != mem_hash("ab\0\0", 4));
+
+	/* similar keys are spread evenly */
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < 100000; i++) {
+		hash = str_hash(t_strdup_printf("user%u@example.com", i));
+		counts[hash % N_ELEMENTS(counts)]++;
+	}
+	max_count = 0;
+	for (i = 0; i < N_ELEMENTS(counts); i++)
+		max_count = I_MAX(max_count, counts[i]);
+	test_assert(max_count < 100000 / N_ELEMENTS(counts) * 2);
+	test_end();
+}
+
 void test_hash(void)
 {
 	pool_t pool;
 
-	test_hash_random_pool(default_pool);
+	test_hash_random_pool(default_pool, FALSE);
+	test_hash_random_pool(default_pool, TRUE);
 
 	pool = pool_alloconly_create("test hash", 1024);
-	test_hash_random_pool(pool);
+	test_hash_random_pool(pool, FALSE);
+	test_hash_random_pool(pool, TRUE);
 	pool_unref(&pool);
+
+	test_hash_flat_random();
+	test_hash_flat_strings();
+	test_hash_functions();
 }
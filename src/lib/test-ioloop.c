@@ -0,0 +1,145 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "ioloop.h"
+
+#include <unistd.h>
+
+struct test_ioloop_ctx {
+	struct io *io;
+	int fd;
+	unsigned int count;
+};
+
+static void test_ioloop_timeout_stop(void *context ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_read_one(struct test_ioloop_ctx *ctx)
+{
+	char c;
+
+	/* read only a single byte at a time. the remaining data must
+	   cause the callback to be called again. */
+	if (read(ctx->fd, &c, 1) == 1)
+		ctx->count++;
+	else
+		io_remove(&ctx->io);
+	if (ctx->count == 3)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_level_triggered(void)
+{
+	struct test_ioloop_ctx ctx;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	int fd[2];
+
+	test_begin("ioloop level triggered");
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fd = fd[0];
+
+	ioloop = io_loop_create();
+	ctx.io = io_add(fd[0], IO_READ, test_ioloop_read_one, &ctx);
+	to = timeout_add(1000, test_ioloop_timeout_stop, (void *)NULL);
+	test_assert(write(fd[1], "abc", 3) == 3);
+	io_loop_run(ioloop);
+	test_assert(ctx.count == 3);
+
+	if (ctx.io != NULL)
+		io_remove(&ctx.io);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	test_end();
+}
+
+static void test_ioloop_write_callback(struct test_ioloop_ctx *ctx)
+{
+	ctx->count++;
+	io_remove(&ctx->io);
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_fail_callback(struct test_ioloop_ctx *ctx)
+{
+	ctx->count++;
+}
+
+static void test_ioloop_readd(void)
+{
+	struct test_ioloop_ctx read_ctx, write_ctx;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	int fd[2];
+
+	test_begin("ioloop remove and readd");
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	memset(&read_ctx, 0, sizeof(read_ctx));
+	memset(&write_ctx, 0, sizeof(write_ctx));
+
+	ioloop = io_loop_create();
+	/* a removed io must not be called even if the fd becomes readable */
+	read_ctx.io = io_add(fd[0], IO_READ, test_ioloop_fail_callback,
+			     &read_ctx);
+	io_remove(&read_ctx.io);
+	test_assert(write(fd[1], "x", 1) == 1);
+
+	/* changing the set of conditions for the same fd */
+	write_ctx.io = io_add(fd[1], IO_WRITE, test_ioloop_write_callback,
+			      &write_ctx);
+	to = timeout_add(1000, test_ioloop_timeout_stop, (void *)NULL);
+	io_loop_run(ioloop);
+	test_assert(write_ctx.count == 1);
+	test_assert(read_ctx.count == 0);
+
+	/* readding the fd gets the pending input */
+	read_ctx.fd = fd[0];
+	read_ctx.io = io_add(fd[0], IO_READ, test_ioloop_read_one, &read_ctx);
+	test_assert(write(fd[1], "yz", 2) == 2);
+	io_loop_run(ioloop);
+	test_assert(read_ctx.count == 3);
+
+	if (read_ctx.io != NULL)
+		io_remove(&read_ctx.io);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	test_end();
+}
+
+static void test_ioloop_timeout_count(unsigned int *count)
+{
+	if (++*count == 3)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_timeouts(void)
+{
+	struct ioloop *ioloop;
+	struct timeout *to;
+	unsigned int count = 0;
+
+	test_begin("ioloop timeouts");
+	ioloop = io_loop_create();
+	to = timeout_add_short(1, test_ioloop_timeout_count, &count);
+	io_loop_run(ioloop);
+	test_assert(count == 3);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+void test_ioloop(void)
+{
+	test_ioloop_level_triggered();
+	test_ioloop_readd();
+	test_ioloop_timeouts();
+}
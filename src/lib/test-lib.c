@@ -19,6 +19,7 @@ int main(void)
 		test_hash_format,
 		test_hash_method,
 		test_hex_binary,
+		test_ioloop,
 		test_iso8601_date,
 		test_istream,
 		test_istream_base64_decoder,
@@ -32,12 +33,14 @@ int main(void)
 		test_json_tree,
 		test_llist,
 		test_mempool_alloconly,
+		test_mempool_slab,
 		test_net,
 		test_numpack,
 		test_ostream_file,
 		test_primes,
 		test_printf_format_fix,
 		test_priorityq,
+		test_seq_bitmap,
 		test_seq_range_array,
 		test_str,
 		test_strescape,
@@ -47,6 +50,7 @@ int main(void)
 		test_str_sanitize,
 		test_str_table,
 		test_time_util,
+		test_timeout_wheel,
 		test_unichar,
 		test_utc_mktime,
 		test_var_expand,
@@ -20,6 +20,7 @@ void test_hash(void);
 void test_hash_format(void);
 void test_hash_method(void);
 void test_hex_binary(void);
+void test_ioloop(void);
 void test_iso8601_date(void);
 void test_istream(void);
 void test_istream_base64_decoder(void);
@@ -33,6 +34,7 @@ void test_json_parser(void);
 void test_json_tree(void);
 void test_llist(void);
 void test_mempool_alloconly(void);
+void test_mempool_slab(void);
 enum fatal_test_state fatal_mempool(int);
 void test_net(void);
 void test_numpack(void);
@@ -41,6 +43,7 @@ void test_primes(void);
 void test_printf_format_fix(void);
 enum fatal_test_state fatal_printf_format_fix(int);
 void test_priorityq(void);
+void test_seq_bitmap(void);
 void test_seq_range_array(void);
 void test_str(void);
 void test_strescape(void);
@@ -50,6 +53,7 @@ void test_str_find(void);
 void test_str_sanitize(void);
 void test_str_table(void);
 void test_time_util(void);
+void test_timeout_wheel(void);
 void test_unichar(void);
 void test_utc_mktime(void);
 void test_var_expand(void);
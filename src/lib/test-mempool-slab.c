@@ -0,0 +1,135 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+#include <stdlib.h>
+
+#define TEST_SLAB_OBJ_COUNT 2000
+
+struct test_slab_obj {
+	unsigned char *mem;
+	size_t size;
+};
+
+static bool mem_has_bytes(const void *mem, size_t size, uint8_t b)
+{
+	const uint8_t *bytes = mem;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != b)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static size_t test_slab_rand_size(void)
+{
+	/* mostly small objects with an occasional large one */
+	if (rand() % 50 == 0)
+		return 1 + rand() % 5000;
+	return 1 + rand() % 200;
+}
+
+static void test_mempool_slab_random(void)
+{
+	struct test_slab_obj objs[TEST_SLAB_OBJ_COUNT];
+	struct pool_slab_stats stats;
+	pool_t pool;
+	unsigned int i, j, idx, used_count = 0;
+	size_t new_size;
+
+	test_begin("mempool slab random");
+	pool = pool_slab_create("test");
+	memset(objs, 0, sizeof(objs));
+	for (i = 0; i < 100000; i++) {
+		idx = rand() % TEST_SLAB_OBJ_COUNT;
+		if (objs[idx].mem == NULL) {
+			objs[idx].size = test_slab_rand_size();
+			objs[idx].mem = p_malloc(pool, objs[idx].size);
+			test_assert(mem_has_bytes(objs[idx].mem,
+						  objs[idx].size, 0));
+			memset(objs[idx].mem, idx & 0xff, objs[idx].size);
+			used_count++;
+		} else if (rand() % 4 == 0) {
+			new_size = test_slab_rand_size();
+			objs[idx].mem = p_realloc(pool, objs[idx].mem,
+						  objs[idx].size, new_size);
+			test_assert(mem_has_bytes(objs[idx].mem,
+				I_MIN(objs[idx].size, new_size), idx & 0xff));
+			if (new_size > objs[idx].size) {
+				test_assert(mem_has_bytes(objs[idx].mem +
+					objs[idx].size,
+					new_size - objs[idx].size, 0));
+			}
+			objs[idx].size = new_size;
+			memset(objs[idx].mem, idx & 0xff, objs[idx].size);
+		} else {
+			test_assert(mem_has_bytes(objs[idx].mem,
+						  objs[idx].size, idx & 0xff));
+			p_free(pool, objs[idx].mem);
+			used_count--;
+		}
+	}
+
+	for (j = 0; j < TEST_SLAB_OBJ_COUNT; j++) {
+		if (objs[j].mem != NULL) {
+			test_assert_idx(mem_has_bytes(objs[j].mem, objs[j].size,
+						      j & 0xff), j);
+		}
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_count == used_count);
+	test_assert(stats.used_size <= stats.alloc_size);
+	test_assert(stats.malloc_count - stats.free_count == used_count);
+
+	/* free everything - only the cached empty slabs should be left */
+	for (j = 0; j < TEST_SLAB_OBJ_COUNT; j++)
+		p_free(pool, objs[j].mem);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_count == 0);
+	test_assert(stats.used_size == 0);
+	for (i = 0; pool_slab_get_class_stats(pool, i, &stats); i++)
+		test_assert_idx(stats.slab_count <= 1, i);
+	test_assert(i > 1);
+	test_assert(stats.obj_size == 0 && stats.alloc_size == 0);
+
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_clear(void)
+{
+	struct pool_slab_stats stats;
+	pool_t pool;
+	void *mem[1000];
+	unsigned int i;
+
+	test_begin("mempool slab clear");
+	pool = pool_slab_create("test");
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		mem[i] = p_malloc(pool, i < 10 ? 10000 : 24);
+	test_assert(pool_slab_get_class_stats(pool, 1, &stats));
+	test_assert(stats.obj_size == 32);
+	test_assert(stats.used_count == N_ELEMENTS(mem) - 10);
+	test_assert(stats.slab_count > 1);
+
+	p_clear(pool);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_count == 0 && stats.slab_count == 0);
+	test_assert(stats.alloc_size == 0);
+	test_assert(stats.malloc_count == N_ELEMENTS(mem));
+
+	/* the pool is still usable after clearing */
+	mem[0] = p_malloc(pool, 100);
+	memset(mem[0], 1, 100);
+	p_free(pool, mem[0]);
+	pool_unref(&pool);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_random();
+	test_mempool_slab_clear();
+}
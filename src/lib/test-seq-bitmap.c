@@ -0,0 +1,323 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "array.h"
+#include "seq-bitmap.h"
+
+#include <stdlib.h>
+
+static bool
+seq_bitmap_equals(const struct seq_bitmap *bitmap,
+		  const ARRAY_TYPE(seq_range) *range)
+{
+	ARRAY_TYPE(seq_range) tmp;
+	const struct seq_range *r1, *r2;
+	unsigned int i, count1, count2;
+
+	if (seq_bitmap_count(bitmap) != seq_range_count(range))
+		return FALSE;
+
+	t_array_init(&tmp, 32);
+	seq_bitmap_to_array(bitmap, &tmp);
+	r1 = array_get(&tmp, &count1);
+	r2 = array_get(range, &count2);
+	if (count1 != count2)
+		return FALSE;
+	for (i = 0; i < count1; i++) {
+		if (r1[i].seq1 != r2[i].seq1 || r1[i].seq2 != r2[i].seq2)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static uint32_t test_rand_seq(void)
+{
+	/* spread the sequences over a few chunks, with both sparse and
+	   dense areas. seq 0 isn't valid, and seq_range_array_intersect()
+	   never removes it. */
+	switch (rand() % 3) {
+	case 0:
+		return 1 + rand() % 300000;
+	case 1:
+		return 65536 + rand() % 8000;
+	default:
+		return 0x20000 + rand() % 400;
+	}
+}
+
+static void
+test_seq_bitmap_random_fill(struct seq_bitmap *bitmap,
+			    ARRAY_TYPE(seq_range) *range, unsigned int count)
+{
+	unsigned int i;
+	uint32_t seq1, seq2;
+
+	for (i = 0; i < count; i++) {
+		seq1 = test_rand_seq();
+		if (rand() % 20 == 0) {
+			seq2 = seq1 + rand() % 150000;
+			seq_bitmap_add_range(bitmap, seq1, seq2);
+			seq_range_array_add_range(range, seq1, seq2);
+		} else {
+			test_assert(seq_bitmap_add(bitmap, seq1) ==
+				    seq_range_array_add(range, seq1));
+		}
+	}
+}
+
+static void test_seq_bitmap_random(void)
+{
+	struct seq_bitmap bitmap;
+	ARRAY_TYPE(seq_range) range;
+	unsigned int i, j, removed;
+	uint32_t seq1, seq2;
+
+	test_begin("seq bitmap random");
+	seq_bitmap_init(&bitmap);
+	t_array_init(&range, 128);
+	for (i = 0; i < 20; i++) {
+		test_seq_bitmap_random_fill(&bitmap, &range, 2000);
+		test_assert_idx(seq_bitmap_equals(&bitmap, &range), i);
+
+		for (j = 0; j < 1000; j++) {
+			seq1 = test_rand_seq();
+			test_assert(seq_bitmap_exists(&bitmap, seq1) ==
+				    seq_range_exists(&range, seq1));
+			if (rand() % 30 == 0) {
+				seq2 = seq1 + rand() % 100000;
+				removed = seq_bitmap_remove_range(&bitmap,
+								  seq1, seq2);
+				test_assert(removed ==
+					    seq_range_array_remove_range(&range,
+						seq1, seq2));
+			} else {
+				bool found = seq_range_exists(&range, seq1);
+
+				test_assert(seq_bitmap_remove(&bitmap, seq1) ==
+					    found);
+				seq_range_array_remove(&range, seq1);
+			}
+		}
+		test_assert_idx(seq_bitmap_equals(&bitmap, &range), i);
+	}
+	seq_bitmap_deinit(&bitmap);
+	test_end();
+}
+
+static void test_seq_bitmap_set_operations(void)
+{
+	struct seq_bitmap bitmap1, bitmap2, tmp;
+	ARRAY_TYPE(seq_range) range1, range2, range_tmp;
+	unsigned int i, removed;
+
+	test_begin("seq bitmap set operations");
+	seq_bitmap_init(&bitmap1);
+	seq_bitmap_init(&bitmap2);
+	seq_bitmap_init(&tmp);
+	for (i = 0; i < 20; i++) {
+		seq_bitmap_clear(&bitmap1);
+		seq_bitmap_clear(&bitmap2);
+		t_array_init(&range1, 128);
+		t_array_init(&range2, 128);
+		test_seq_bitmap_random_fill(&bitmap1, &range1, 3000);
+		test_seq_bitmap_random_fill(&bitmap2, &range2, 3000);
+
+		seq_bitmap_clear(&tmp);
+		seq_bitmap_merge(&tmp, &bitmap1);
+		test_assert_idx(seq_bitmap_equals(&tmp, &range1), i);
+		seq_bitmap_merge(&tmp, &bitmap2);
+		t_array_init(&range_tmp, 128);
+		array_append_array(&range_tmp, &range1);
+		seq_range_array_merge(&range_tmp, &range2);
+		test_assert_idx(seq_bitmap_equals(&tmp, &range_tmp), i);
+
+		seq_bitmap_clear(&tmp);
+		seq_bitmap_merge(&tmp, &bitmap1);
+		array_clear(&range_tmp);
+		array_append_array(&range_tmp, &range1);
+		removed = seq_range_array_intersect(&range_tmp, &range2);
+		test_assert_idx(seq_bitmap_intersect(&tmp, &bitmap2) ==
+				removed, i);
+		test_assert_idx(seq_bitmap_equals(&tmp, &range_tmp), i);
+
+		seq_bitmap_clear(&tmp);
+		seq_bitmap_merge(&tmp, &bitmap1);
+		array_clear(&range_tmp);
+		array_append_array(&range_tmp, &range1);
+		test_assert_idx(seq_bitmap_remove_bitmap(&tmp, &bitmap2) ==
+				seq_range_array_remove_seq_range(&range_tmp,
+								 &range2), i);
+		test_assert_idx(seq_bitmap_equals(&tmp, &range_tmp), i);
+	}
+	seq_bitmap_deinit(&bitmap1);
+	seq_bitmap_deinit(&bitmap2);
+	seq_bitmap_deinit(&tmp);
+	test_end();
+}
+
+static void test_seq_bitmap_full_range(void)
+{
+	struct seq_bitmap bitmap, bitmap2;
+	ARRAY_TYPE(seq_range) range;
+	const struct seq_range *r;
+	unsigned int count;
+
+	test_begin("seq bitmap full range");
+	seq_bitmap_init(&bitmap);
+	seq_bitmap_add_range(&bitmap, 1, (uint32_t)-2);
+	test_assert(seq_bitmap_count(&bitmap) == (uint32_t)-2);
+	test_assert(!seq_bitmap_exists(&bitmap, 0));
+	test_assert(seq_bitmap_exists(&bitmap, 1));
+	test_assert(seq_bitmap_exists(&bitmap, 0x12345678));
+	test_assert(!seq_bitmap_exists(&bitmap, (uint32_t)-1));
+	test_assert(seq_bitmap_add(&bitmap, 100000));
+
+	/* split the full run */
+	test_assert(seq_bitmap_remove(&bitmap, 0x12345678));
+	test_assert(!seq_bitmap_remove(&bitmap, 0x12345678));
+	test_assert(seq_bitmap_remove_range(&bitmap, 0x20000000,
+					    0x2fffffff) == 0x10000000);
+	t_array_init(&range, 4);
+	seq_bitmap_to_array(&bitmap, &range);
+	r = array_get(&range, &count);
+	test_assert(count == 3);
+	test_assert(r[0].seq1 == 1 && r[0].seq2 == 0x12345677);
+	test_assert(r[1].seq1 == 0x12345679 && r[1].seq2 == 0x1fffffff);
+	test_assert(r[2].seq1 == 0x30000000 && r[2].seq2 == (uint32_t)-2);
+
+	/* join back */
+	test_assert(!seq_bitmap_add(&bitmap, 0x12345678));
+	seq_bitmap_add_range(&bitmap, 0x20000000, 0x2fffffff);
+	array_clear(&range);
+	seq_bitmap_to_array(&bitmap, &range);
+	test_assert(array_count(&range) == 1);
+
+	/* intersection with the full run */
+	seq_bitmap_init(&bitmap2);
+	test_assert(!seq_bitmap_add(&bitmap2, 5));
+	test_assert(!seq_bitmap_add(&bitmap2, (uint32_t)-1));
+	seq_bitmap_add_range(&bitmap2, 0x10000000, 0x10100000);
+	test_assert(seq_bitmap_intersect(&bitmap, &bitmap2) ==
+		    (uint32_t)-2 - 0x100002);
+	array_clear(&range);
+	seq_bitmap_to_array(&bitmap, &range);
+	r = array_get(&range, &count);
+	test_assert(count == 2);
+	test_assert(r[0].seq1 == 5 && r[0].seq2 == 5);
+	test_assert(r[1].seq1 == 0x10000000 && r[1].seq2 == 0x10100000);
+	seq_bitmap_deinit(&bitmap2);
+	seq_bitmap_deinit(&bitmap);
+	test_end();
+}
+
+static void test_seq_bitmap_iter(void)
+{
+	struct seq_bitmap bitmap;
+	struct seq_bitmap_iter iter;
+	ARRAY_TYPE(seq_range) range;
+	struct seq_range_iter range_iter;
+	unsigned int i, n;
+	uint32_t seq1, seq2;
+
+	test_begin("seq bitmap iter");
+	seq_bitmap_init(&bitmap);
+	t_array_init(&range, 128);
+	test_seq_bitmap_random_fill(&bitmap, &range, 5000);
+
+	seq_bitmap_iter_init(&iter, &bitmap);
+	seq_range_array_iter_init(&range_iter, &range);
+	for (n = 0; seq_range_array_iter_nth(&range_iter, n, &seq2); n++) {
+		test_assert(seq_bitmap_iter_nth(&iter, n, &seq1));
+		test_assert(seq1 == seq2);
+	}
+	test_assert(!seq_bitmap_iter_nth(&iter, n, &seq1));
+
+	/* random access */
+	for (i = 0; i < 1000; i++) {
+		n = rand() % (seq_range_count(&range) + 10);
+		test_assert(seq_bitmap_iter_nth(&iter, n, &seq1) ==
+			    seq_range_array_iter_nth(&range_iter, n, &seq2));
+		test_assert(n >= seq_range_count(&range) || seq1 == seq2);
+	}
+	seq_bitmap_deinit(&bitmap);
+	test_end();
+}
+
+/* Do what seq_bitmap_remove_shift() does one sequence at a time */
+static void
+test_seq_range_remove_shift(const ARRAY_TYPE(seq_range) *src,
+			    const ARRAY_TYPE(seq_range) *removed,
+			    ARRAY_TYPE(seq_range) *dest)
+{
+	const struct seq_range *src_r, *r;
+	unsigned int i, src_count, count;
+	uint32_t seq, shift = 0;
+
+	src_r = array_get(src, &src_count);
+	r = array_get(removed, &count);
+	for (i = 0; i < src_count; i++) {
+		for (seq = src_r[i].seq1; seq <= src_r[i].seq2; seq++) {
+			while (count > 0 && r->seq2 < seq) {
+				shift += r->seq2 - r->seq1 + 1;
+				r++; count--;
+			}
+			if (count == 0 || seq < r->seq1)
+				seq_range_array_add(dest, seq - shift);
+		}
+	}
+}
+
+static void test_seq_bitmap_remove_shift(void)
+{
+	struct seq_bitmap bitmap;
+	ARRAY_TYPE(seq_range) range, removed, expected;
+	const struct seq_range *r;
+	unsigned int i, j, count;
+	uint32_t seq1;
+
+	test_begin("seq bitmap remove shift");
+	seq_bitmap_init(&bitmap);
+	t_array_init(&range, 128);
+	t_array_init(&removed, 32);
+	t_array_init(&expected, 128);
+	for (i = 0; i < 20; i++) {
+		seq_bitmap_clear(&bitmap);
+		array_clear(&range);
+		test_seq_bitmap_random_fill(&bitmap, &range, 2000);
+
+		array_clear(&removed);
+		for (j = rand() % 20; j > 0; j--) {
+			seq1 = test_rand_seq();
+			seq_range_array_add_range(&removed, seq1,
+						  seq1 + rand() % 70000);
+		}
+		array_clear(&expected);
+		test_seq_range_remove_shift(&range, &removed, &expected);
+		seq_bitmap_remove_shift(&bitmap, &removed);
+		test_assert_idx(seq_bitmap_equals(&bitmap, &expected), i);
+	}
+
+	/* full containers */
+	seq_bitmap_clear(&bitmap);
+	seq_bitmap_add_range(&bitmap, 1, (uint32_t)-2);
+	array_clear(&removed);
+	seq_range_array_add_range(&removed, 10, 19);
+	seq_range_array_add_range(&removed, 0x20000, 0x2ffff);
+	seq_bitmap_remove_shift(&bitmap, &removed);
+	array_clear(&range);
+	seq_bitmap_to_array(&bitmap, &range);
+	r = array_get(&range, &count);
+	test_assert(count == 1);
+	test_assert(r[0].seq1 == 1 && r[0].seq2 == (uint32_t)-2 - 10 - 0x10000);
+	seq_bitmap_deinit(&bitmap);
+	test_end();
+}
+
+void test_seq_bitmap(void)
+{
+	test_seq_bitmap_random();
+	test_seq_bitmap_set_operations();
+	test_seq_bitmap_full_range();
+	test_seq_bitmap_iter();
+	test_seq_bitmap_remove_shift();
+}
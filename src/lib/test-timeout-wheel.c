@@ -0,0 +1,134 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "timeout-wheel.h"
+
+#include <stdlib.h>
+
+#define TEST_TICK_MSECS 1024
+
+struct test_wheel_item {
+	struct timeout_wheel_item item;
+	uint64_t expire_msecs;
+};
+
+static void test_timeout_wheel_basic(void)
+{
+	struct timeout_wheel *wheel;
+	struct test_wheel_item items[3];
+	uint64_t now = 1000000 * TEST_TICK_MSECS;
+
+	memset(items, 0, sizeof(items));
+	test_begin("timeout wheel");
+	wheel = timeout_wheel_init(now);
+	test_assert(timeout_wheel_get_next_msecs(wheel) == (uint64_t)-1);
+
+	/* items within the current tick aren't added */
+	test_assert(!timeout_wheel_add(wheel, &items[0].item, now + 10));
+	test_assert(!timeout_wheel_item_is_added(&items[0].item));
+
+	test_assert(timeout_wheel_add(wheel, &items[0].item, now + 5000));
+	test_assert(timeout_wheel_add(wheel, &items[1].item, now + 3600*1000));
+	test_assert(timeout_wheel_add(wheel, &items[2].item,
+				      now + 40ULL*24*3600*1000));
+	test_assert(timeout_wheel_count(wheel) == 3);
+	test_assert(timeout_wheel_get_next_msecs(wheel) <= now + 5000);
+
+	test_assert(timeout_wheel_pop(wheel, now + 4000) == NULL);
+	test_assert(timeout_wheel_pop(wheel, now + 5000) == &items[0].item);
+	test_assert(timeout_wheel_pop(wheel, now + 5000) == NULL);
+
+	timeout_wheel_remove(wheel, &items[1].item);
+	test_assert(timeout_wheel_pop(wheel, now + 3600*1000) == NULL);
+	test_assert(timeout_wheel_pop(wheel, now + 40ULL*24*3600*1000) ==
+		    &items[2].item);
+	test_assert(timeout_wheel_count(wheel) == 0);
+	test_assert(timeout_wheel_pop_any(wheel) == NULL);
+	timeout_wheel_deinit(&wheel);
+	test_end();
+}
+
+static void test_timeout_wheel_reset_churn(void)
+{
+#define TEST_WHEEL_ITEM_COUNT 100000
+#define TEST_WHEEL_STEPS 200
+#define TEST_WHEEL_RESETS_PER_STEP 20000
+	struct timeout_wheel *wheel;
+	struct timeout_wheel_item *item;
+	struct test_wheel_item *items, *titem;
+	uint64_t now, next_msecs, min_expire;
+	unsigned int i, j, count = 0;
+	bool success = TRUE;
+
+	test_begin("timeout wheel reset churn");
+	now = (uint64_t)rand() * TEST_TICK_MSECS;
+	wheel = timeout_wheel_init(now);
+	items = i_new(struct test_wheel_item, TEST_WHEEL_ITEM_COUNT);
+
+	for (i = 0; i < TEST_WHEEL_STEPS && success; i++) {
+		/* remove and re-add random timeouts, like idle timeouts that
+		   are reset whenever there's activity */
+		for (j = 0; j < TEST_WHEEL_RESETS_PER_STEP; j++) {
+			titem = &items[rand() % TEST_WHEEL_ITEM_COUNT];
+			if (timeout_wheel_item_is_added(&titem->item)) {
+				timeout_wheel_remove(wheel, &titem->item);
+				count--;
+			}
+			if (rand() % 8 == 0)
+				continue;
+			titem->expire_msecs = now + 2*TEST_TICK_MSECS +
+				rand() % (rand() % 2 == 0 ? 60*1000 :
+					  2*3600*1000);
+			test_assert(timeout_wheel_add(wheel, &titem->item,
+						      titem->expire_msecs));
+			count++;
+		}
+		test_assert(timeout_wheel_count(wheel) == count);
+
+		/* nothing may expire before the wheel says so */
+		next_msecs = timeout_wheel_get_next_msecs(wheel);
+		now += rand() % (rand() % 4 == 0 ? 600*1000 : 3000);
+		if (next_msecs > now) {
+			if (timeout_wheel_pop(wheel, now) != NULL)
+				success = FALSE;
+			continue;
+		}
+
+		while ((item = timeout_wheel_pop(wheel, now)) != NULL) {
+			titem = (struct test_wheel_item *)item;
+			if (titem->expire_msecs / TEST_TICK_MSECS >
+			    now / TEST_TICK_MSECS)
+				success = FALSE;
+			count--;
+		}
+		/* everything left must expire after the current tick */
+		min_expire = (uint64_t)-1;
+		for (j = 0; j < TEST_WHEEL_ITEM_COUNT; j++) {
+			titem = &items[j];
+			if (!timeout_wheel_item_is_added(&titem->item))
+				continue;
+			if (titem->expire_msecs / TEST_TICK_MSECS <=
+			    now / TEST_TICK_MSECS)
+				success = FALSE;
+			if (titem->expire_msecs < min_expire)
+				min_expire = titem->expire_msecs;
+		}
+		if (timeout_wheel_get_next_msecs(wheel) > min_expire)
+			success = FALSE;
+	}
+	test_assert(success);
+	test_assert(timeout_wheel_count(wheel) == count);
+
+	while (timeout_wheel_pop_any(wheel) != NULL)
+		count--;
+	test_assert(count == 0);
+	timeout_wheel_deinit(&wheel);
+	i_free(items);
+	test_end();
+}
+
+void test_timeout_wheel(void)
+{
+	test_timeout_wheel_basic();
+	test_timeout_wheel_reset_churn();
+}
@@ -0,0 +1,285 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "llist.h"
+#include "timeout-wheel.h"
+
+/* One tick is 1024 milliseconds. Items within the same tick aren't sorted
+   by the wheel. */
+#define WHEEL_TICK_SHIFT 10
+/* Each level has 64 slots, so a 64bit bitmap can track the non-empty ones. */
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVEL_SLOTS (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVEL_MASK (WHEEL_LEVEL_SLOTS - 1)
+/* Four levels cover 2^24 ticks (~198 days). Items further away than that
+   are placed to the last slot and they cascade back into it. */
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ((uint64_t)1 << (WHEEL_LEVEL_BITS * WHEEL_LEVELS))
+
+#define WHEEL_LEVEL_SHIFT(level) ((level) * WHEEL_LEVEL_BITS)
+
+struct timeout_wheel_level {
+	struct timeout_wheel_item *slots[WHEEL_LEVEL_SLOTS];
+	/* bit n is set if slots[n] is non-empty */
+	uint64_t used_slots;
+};
+
+struct timeout_wheel {
+	/* the current tick. everything before it has been processed. */
+	uint64_t cur_tick;
+	unsigned int count;
+
+	struct timeout_wheel_level levels[WHEEL_LEVELS];
+	/* items whose tick has already been reached */
+	struct timeout_wheel_item *due;
+};
+
+static unsigned int wheel_lowest_bit(uint64_t bits)
+{
+	i_assert(bits != 0);
+	return bits_required64(bits & -bits) - 1;
+}
+
+struct timeout_wheel *timeout_wheel_init(uint64_t now_msecs)
+{
+	struct timeout_wheel *wheel;
+
+	wheel = i_new(struct timeout_wheel, 1);
+	wheel->cur_tick = now_msecs >> WHEEL_TICK_SHIFT;
+	return wheel;
+}
+
+void timeout_wheel_deinit(struct timeout_wheel **_wheel)
+{
+	struct timeout_wheel *wheel = *_wheel;
+
+	*_wheel = NULL;
+	i_assert(wheel->count == 0);
+	i_free(wheel);
+}
+
+unsigned int timeout_wheel_count(const struct timeout_wheel *wheel)
+{
+	return wheel->count;
+}
+
+static void
+timeout_wheel_link(struct timeout_wheel_item **list,
+		   struct timeout_wheel_item *item)
+{
+	DLLIST_PREPEND(list, item);
+	item->list = list;
+}
+
+static void
+timeout_wheel_insert(struct timeout_wheel *wheel,
+		     struct timeout_wheel_item *item)
+{
+	struct timeout_wheel_level *level;
+	uint64_t tick, diff;
+	unsigned int i, idx;
+
+	tick = item->expire_msecs >> WHEEL_TICK_SHIFT;
+	if (tick <= wheel->cur_tick) {
+		timeout_wheel_link(&wheel->due, item);
+		return;
+	}
+	diff = tick - wheel->cur_tick;
+	if (diff >= WHEEL_MAX_TICKS) {
+		diff = WHEEL_MAX_TICKS - 1;
+		tick = wheel->cur_tick + diff;
+	}
+	/* find the lowest level that can hold the item */
+	for (i = 0; i < WHEEL_LEVELS - 1; i++) {
+		if (diff < ((uint64_t)1 << WHEEL_LEVEL_SHIFT(i+1)))
+			break;
+	}
+	idx = (tick >> WHEEL_LEVEL_SHIFT(i)) & WHEEL_LEVEL_MASK;
+	level = &wheel->levels[i];
+	timeout_wheel_link(&level->slots[idx], item);
+	level->used_slots |= (uint64_t)1 << idx;
+}
+
+bool timeout_wheel_add(struct timeout_wheel *wheel,
+		       struct timeout_wheel_item *item, uint64_t expire_msecs)
+{
+	i_assert(item->list == NULL);
+
+	if ((expire_msecs >> WHEEL_TICK_SHIFT) <= wheel->cur_tick)
+		return FALSE;
+
+	item->expire_msecs = expire_msecs;
+	timeout_wheel_insert(wheel, item);
+	wheel->count++;
+	return TRUE;
+}
+
+static void
+timeout_wheel_unlink(struct timeout_wheel *wheel,
+		     struct timeout_wheel_item *item)
+{
+	struct timeout_wheel_item **list = item->list;
+	struct timeout_wheel_level *level;
+	unsigned int i, idx;
+
+	DLLIST_REMOVE(list, item);
+	item->list = NULL;
+
+	if (*list != NULL || list == &wheel->due)
+		return;
+	/* the slot became empty - update the bitmap */
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		level = &wheel->levels[i];
+		if (list >= level->slots &&
+		    list < level->slots + WHEEL_LEVEL_SLOTS) {
+			idx = list - level->slots;
+			level->used_slots &= ~((uint64_t)1 << idx);
+			return;
+		}
+	}
+	i_unreached();
+}
+
+void timeout_wheel_remove(struct timeout_wheel *wheel,
+			  struct timeout_wheel_item *item)
+{
+	i_assert(item->list != NULL);
+	i_assert(wheel->count > 0);
+
+	timeout_wheel_unlink(wheel, item);
+	wheel->count--;
+}
+
+static uint64_t timeout_wheel_next_tick(const struct timeout_wheel *wheel)
+{
+	const struct timeout_wheel_level *level;
+	uint64_t level_tick, used, next_tick = (uint64_t)-1, tick;
+	unsigned int i, pos, dist;
+
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		level = &wheel->levels[i];
+		if (level->used_slots == 0)
+			continue;
+
+		/* find the first used slot after the current position. the
+		   current position's slot means a full rotation ahead. */
+		level_tick = wheel->cur_tick >> WHEEL_LEVEL_SHIFT(i);
+		pos = (level_tick + 1) & WHEEL_LEVEL_MASK;
+		used = pos == 0 ? level->used_slots :
+			(level->used_slots >> pos) |
+			(level->used_slots << (WHEEL_LEVEL_SLOTS - pos));
+		dist = wheel_lowest_bit(used) + 1;
+
+		tick = (level_tick + dist) << WHEEL_LEVEL_SHIFT(i);
+		if (tick < next_tick)
+			next_tick = tick;
+	}
+	return next_tick;
+}
+
+uint64_t timeout_wheel_get_next_msecs(struct timeout_wheel *wheel)
+{
+	uint64_t tick;
+
+	if (wheel->due != NULL)
+		return wheel->cur_tick << WHEEL_TICK_SHIFT;
+	if (wheel->count == 0)
+		return (uint64_t)-1;
+
+	tick = timeout_wheel_next_tick(wheel);
+	i_assert(tick != (uint64_t)-1);
+	return tick << WHEEL_TICK_SHIFT;
+}
+
+static void
+timeout_wheel_cascade(struct timeout_wheel *wheel, unsigned int level_idx)
+{
+	struct timeout_wheel_level *level = &wheel->levels[level_idx];
+	struct timeout_wheel_item *item, *list;
+	unsigned int idx;
+
+	idx = (wheel->cur_tick >> WHEEL_LEVEL_SHIFT(level_idx)) &
+		WHEEL_LEVEL_MASK;
+	list = level->slots[idx];
+	level->slots[idx] = NULL;
+	level->used_slots &= ~((uint64_t)1 << idx);
+
+	while (list != NULL) {
+		item = list;
+		list = item->next;
+		item->prev = item->next = NULL;
+		timeout_wheel_insert(wheel, item);
+	}
+}
+
+static void timeout_wheel_advance(struct timeout_wheel *wheel, uint64_t tick)
+{
+	uint64_t next_tick;
+	unsigned int i;
+
+	if (wheel->count == 0) {
+		/* nothing to do. this also resets the wheel if time has
+		   moved backwards. */
+		wheel->cur_tick = tick;
+		return;
+	}
+
+	while (wheel->cur_tick < tick) {
+		/* skip directly over ticks that have nothing to do */
+		next_tick = timeout_wheel_next_tick(wheel);
+		if (next_tick > tick) {
+			wheel->cur_tick = tick;
+			break;
+		}
+		wheel->cur_tick = next_tick;
+
+		/* move items from higher levels down, then move the current
+		   slot's items to the due list */
+		for (i = WHEEL_LEVELS - 1; i > 0; i--) {
+			if ((wheel->cur_tick &
+			     (((uint64_t)1 << WHEEL_LEVEL_SHIFT(i)) - 1)) == 0)
+				timeout_wheel_cascade(wheel, i);
+		}
+		timeout_wheel_cascade(wheel, 0);
+	}
+}
+
+struct timeout_wheel_item *
+timeout_wheel_pop(struct timeout_wheel *wheel, uint64_t now_msecs)
+{
+	struct timeout_wheel_item *item;
+	uint64_t tick = now_msecs >> WHEEL_TICK_SHIFT;
+
+	if (wheel->due == NULL && tick > wheel->cur_tick)
+		timeout_wheel_advance(wheel, tick);
+	else if (wheel->count == 0)
+		wheel->cur_tick = tick;
+
+	item = wheel->due;
+	if (item != NULL) {
+		timeout_wheel_unlink(wheel, item);
+		wheel->count--;
+	}
+	return item;
+}
+
+struct timeout_wheel_item *timeout_wheel_pop_any(struct timeout_wheel *wheel)
+{
+	struct timeout_wheel_item *item = wheel->due;
+	struct timeout_wheel_level *level;
+	unsigned int i, idx;
+
+	for (i = 0; item == NULL && i < WHEEL_LEVELS; i++) {
+		level = &wheel->levels[i];
+		if (level->used_slots != 0) {
+			idx = wheel_lowest_bit(level->used_slots);
+			item = level->slots[idx];
+		}
+	}
+	if (item != NULL) {
+		timeout_wheel_unlink(wheel, item);
+		wheel->count--;
+	}
+	return item;
+}
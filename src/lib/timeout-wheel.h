@@ -0,0 +1,54 @@
+#ifndef TIMEOUT_WHEEL_H
+#define TIMEOUT_WHEEL_H
+
+/* Hierarchical timing wheel. Adding, removing and resetting items is O(1),
+   so it works well for a large number of long timeouts that are mostly
+   reset or removed before they expire.
+
+   The wheel doesn't order items within a tick (~1 second). When an item's
+   tick is reached, timeout_wheel_pop() returns it and the caller is
+   expected to move it to a precise queue (e.g. priorityq). The items you add
+   to the wheel must contain a struct timeout_wheel_item. */
+
+struct timeout_wheel_item {
+	/* Private: */
+	struct timeout_wheel_item *prev, *next;
+	/* The list where the item currently is, NULL if not in the wheel. */
+	struct timeout_wheel_item **list;
+	uint64_t expire_msecs;
+};
+
+/* Create a new wheel whose time starts at now_msecs. */
+struct timeout_wheel *timeout_wheel_init(uint64_t now_msecs);
+void timeout_wheel_deinit(struct timeout_wheel **wheel);
+
+/* Return number of items in the wheel. */
+unsigned int timeout_wheel_count(const struct timeout_wheel *wheel) ATTR_PURE;
+
+/* Add a new item to the wheel. Returns FALSE and doesn't add the item if it
+   expires within the wheel's current tick. */
+bool timeout_wheel_add(struct timeout_wheel *wheel,
+		       struct timeout_wheel_item *item, uint64_t expire_msecs);
+/* Remove the specified item from the wheel. */
+void timeout_wheel_remove(struct timeout_wheel *wheel,
+			  struct timeout_wheel_item *item);
+/* Returns TRUE if the item is in the wheel. */
+static inline bool
+timeout_wheel_item_is_added(const struct timeout_wheel_item *item)
+{
+	return item->list != NULL;
+}
+
+/* Returns the earliest time when timeout_wheel_pop() may return an item,
+   or (uint64_t)-1 if the wheel is empty. The returned time may be earlier
+   than any item's expiration time. */
+uint64_t timeout_wheel_get_next_msecs(struct timeout_wheel *wheel);
+/* Advance the wheel's time to now_msecs and return an item that expires
+   within the current tick, or NULL if there are no such items. The returned
+   item is removed from the wheel. */
+struct timeout_wheel_item *
+timeout_wheel_pop(struct timeout_wheel *wheel, uint64_t now_msecs);
+/* Remove and return any item from the wheel, or NULL if it's empty. */
+struct timeout_wheel_item *timeout_wheel_pop_any(struct timeout_wheel *wheel);
+
+#endif
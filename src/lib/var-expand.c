@@ -3,7 +3,6 @@
 #include "lib.h"
 #include "array.h"
 #include "md5.h"
-#include "hash.h"
 #include "hex-binary.h"
 #include "hostpid.h"
 #include "str.h"
@@ -69,9 +68,27 @@ m_str_reverse(const char *str, struct var_expand_context *ctx ATTR_UNUSED)
 	return rev;
 }
 
+/* a char* hash function from ASU -- from glib. The %H results are used in
+   paths, so this can't use the randomly seeded str_hash(). */
+static unsigned int var_str_hash(const char *p)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	unsigned int g, h = 0;
+
+	while (*s != '\0') {
+		h = (h << 4) + *s;
+		if ((g = h & 0xf0000000UL)) {
+			h = h ^ (g >> 24);
+			h = h ^ g;
+		}
+		s++;
+	}
+	return h;
+}
+
 static const char *m_str_hash(const char *str, struct var_expand_context *ctx)
 {
-	unsigned int value = str_hash(str);
+	unsigned int value = var_str_hash(str);
 	string_t *hash = t_str_new(20);
 
 	if (ctx->width != 0) {
@@ -0,0 +1,184 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Compare the two ways login-proxy forwards data between the client and
+   the backend TCP connections: login_proxy_splice() and the fallback that
+   reads up to 1024 bytes at a time with net_receive() and sends them to
+   the destination ostream. Data is written in <chunk> sized blocks to a
+   loopback connection, forwarded to a second loopback connection and read
+   from its other end. Everything runs in a single process, so each chunk
+   must fit into the sockets' buffers.
+
+   Usage: bench-login-proxy-splice [<mbytes> [<chunk>]] */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "net.h"
+#include "ostream.h"
+#include "write-full.h"
+#include "login-proxy-splice.h"
+#include "bench-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define BENCH_MAX_CHUNK_SIZE (64*1024)
+/* same as login-proxy's OUTBUF_THRESHOLD */
+#define BENCH_COPY_BUF_SIZE 1024
+
+struct bench_conn {
+	/* client_fd -> proxy_in_fd, proxy_out_fd -> server_fd */
+	int client_fd, proxy_in_fd;
+	int proxy_out_fd, server_fd;
+	struct ostream *proxy_output;
+};
+
+typedef void bench_forward_t(struct bench_conn *conn);
+
+static void bench_tcp_pair(int *connect_fd_r, int *accept_fd_r)
+{
+	struct ip_addr ip;
+	unsigned int port = 0;
+	int listen_fd;
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	listen_fd = net_listen(&ip, &port, 1);
+	if (listen_fd == -1)
+		i_fatal("net_listen() failed: %m");
+	*connect_fd_r = net_connect_ip_blocking(&ip, port, NULL);
+	if (*connect_fd_r == -1)
+		i_fatal("net_connect_ip_blocking() failed: %m");
+	*accept_fd_r = net_accept(listen_fd, NULL, NULL);
+	if (*accept_fd_r < 0)
+		i_fatal("net_accept() failed: %m");
+	i_close_fd(&listen_fd);
+}
+
+static void bench_forward_splice(struct bench_conn *conn)
+{
+	enum login_proxy_splice_error error;
+	int ret;
+
+	if (o_stream_flush(conn->proxy_output) < 0)
+		i_fatal("o_stream_flush(server) failed: %m");
+	ret = login_proxy_splice(conn->proxy_in_fd, conn->proxy_out_fd,
+				 conn->proxy_output, &error);
+	if (ret < 0)
+		i_fatal("login_proxy_splice() failed (error %d): %m", error);
+	if (ret == 0 && o_stream_get_buffer_used_size(conn->proxy_output) == 0)
+		i_fatal("splice() isn't supported");
+}
+
+static void bench_forward_copy(struct bench_conn *conn)
+{
+	unsigned char buf[BENCH_COPY_BUF_SIZE];
+	ssize_t ret;
+
+	if (o_stream_flush(conn->proxy_output) < 0)
+		i_fatal("o_stream_flush(server) failed: %m");
+	ret = net_receive(conn->proxy_in_fd, buf, sizeof(buf));
+	if (ret < 0)
+		i_fatal("net_receive(client) failed: %m");
+	o_stream_cork(conn->proxy_output);
+	if (o_stream_send(conn->proxy_output, buf, ret) != ret)
+		i_fatal("o_stream_send(server) failed: %m");
+	o_stream_uncork(conn->proxy_output);
+}
+
+static bool bench_forward_pending(struct bench_conn *conn)
+{
+	int size;
+
+	if (o_stream_get_buffer_used_size(conn->proxy_output) > 0)
+		return TRUE;
+	if (ioctl(conn->proxy_in_fd, FIONREAD, &size) < 0)
+		i_fatal("ioctl(FIONREAD) failed: %m");
+	return size > 0;
+}
+
+static long long
+bench_run(struct bench_conn *conn, bench_forward_t *forward,
+	  uoff_t total_size, size_t chunk_size)
+{
+	unsigned char *chunk, *server_buf;
+	struct bench_timer timer;
+	uoff_t sent;
+	size_t size, pos;
+	ssize_t ret;
+	long long usecs;
+
+	chunk = i_malloc(chunk_size);
+	server_buf = i_malloc(chunk_size);
+	memset(chunk, 'x', chunk_size);
+
+	bench_timer_start(&timer);
+	for (sent = 0; sent < total_size; sent += size) {
+		size = I_MIN(chunk_size, total_size - sent);
+		if (write_full(conn->client_fd, chunk, size) < 0)
+			i_fatal("write(client) failed: %m");
+		for (pos = 0; pos < size; ) {
+			if (bench_forward_pending(conn))
+				forward(conn);
+			ret = read(conn->server_fd, server_buf, size - pos);
+			if (ret > 0)
+				pos += ret;
+			else if (ret == 0 || errno != EAGAIN)
+				i_fatal("read(server) failed: %m");
+		}
+	}
+	usecs = bench_timer_lap(&timer);
+
+	i_free(chunk);
+	i_free(server_buf);
+	return usecs;
+}
+
+static void
+bench_print(const char *name, long long usecs, uoff_t total_size)
+{
+	printf("%-8s %12lld %10.1f\n", name, usecs,
+	       bench_mbytes_per_sec(total_size, usecs));
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	struct bench_conn conn;
+	unsigned int mbytes = 1024, chunk_size = 64*1024;
+	uoff_t total_size;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	bench_arg_uint(argc, argv, 1, "mbytes", 1, UINT_MAX, &mbytes);
+	bench_arg_uint(argc, argv, 2, "chunk", 1, BENCH_MAX_CHUNK_SIZE,
+		       &chunk_size);
+	total_size = (uoff_t)mbytes * 1024*1024;
+
+	/* the proxy's sockets are non-blocking like in login-proxy. the
+	   server end is non-blocking too, so it can read whatever has been
+	   forwarded so far. */
+	bench_tcp_pair(&conn.client_fd, &conn.proxy_in_fd);
+	bench_tcp_pair(&conn.proxy_out_fd, &conn.server_fd);
+	net_set_nonblock(conn.proxy_out_fd, TRUE);
+	conn.proxy_output = o_stream_create_fd(conn.proxy_out_fd,
+					       (size_t)-1, FALSE);
+
+	printf("%u MB in %u byte chunks\n", mbytes, chunk_size);
+	printf("%-8s %12s %10s\n", "forward", "usecs", "MB/s");
+	bench_print("copy", bench_run(&conn, bench_forward_copy,
+				      total_size, chunk_size), total_size);
+	bench_print("splice", bench_run(&conn, bench_forward_splice,
+					total_size, chunk_size), total_size);
+
+	o_stream_destroy(&conn.proxy_output);
+	login_proxy_splice_deinit();
+	i_close_fd(&conn.client_fd);
+	i_close_fd(&conn.proxy_in_fd);
+	i_close_fd(&conn.proxy_out_fd);
+	i_close_fd(&conn.server_fd);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,159 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#define _GNU_SOURCE /* for splice() */
+#include "lib.h"
+#include "fd-close-on-exec.h"
+#include "ostream.h"
+#include "login-proxy-splice.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Max. bytes to splice() at once. This should fit into the pipe buffer. */
+#define PROXY_SPLICE_MAX_SIZE (64*1024)
+#define PROXY_SPLICE_READ_BUF_SIZE 1024
+
+#ifdef HAVE_SPLICE
+/* A single pipe is shared by all the proxies. It's always empty after
+   login_proxy_splice() returns. */
+static int proxy_splice_pipe[2] = { -1, -1 };
+static bool proxy_splice_disabled = FALSE;
+
+static bool proxy_splice_init(void)
+{
+	if (proxy_splice_disabled)
+		return FALSE;
+	if (proxy_splice_pipe[0] != -1)
+		return TRUE;
+
+	if (pipe(proxy_splice_pipe) < 0) {
+		i_error("proxy: pipe() failed: %m");
+		proxy_splice_pipe[0] = proxy_splice_pipe[1] = -1;
+		return FALSE;
+	}
+	fd_close_on_exec(proxy_splice_pipe[0], TRUE);
+	fd_close_on_exec(proxy_splice_pipe[1], TRUE);
+	return TRUE;
+}
+
+void login_proxy_splice_deinit(void)
+{
+	if (proxy_splice_pipe[0] == -1)
+		return;
+	i_close_fd(&proxy_splice_pipe[0]);
+	i_close_fd(&proxy_splice_pipe[1]);
+}
+
+/* Move size bytes from the pipe to output. Returns 0 if ok, -1 if output
+   failed and -2 if reading the pipe failed. */
+static int proxy_splice_pipe_to_stream(struct ostream *output, size_t size)
+{
+	unsigned char buf[PROXY_SPLICE_READ_BUF_SIZE];
+	ssize_t ret;
+	int old_errno, ret2 = 0;
+
+	/* the pipe must be emptied even on failure */
+	while (size > 0) {
+		ret = read(proxy_splice_pipe[0], buf, I_MIN(size, sizeof(buf)));
+		if (ret <= 0) {
+			/* shouldn't happen, the data is already in the pipe.
+			   we don't know what's left in it now, so it can't be
+			   used anymore. close it and create a new one when
+			   it's needed again. */
+			if (ret == 0) {
+				i_error("proxy: read(splice pipe) returned EOF "
+					"with %"PRIuSIZE_T" bytes left", size);
+				errno = EIO;
+			} else {
+				i_error("proxy: read(splice pipe) failed: %m");
+			}
+			old_errno = errno;
+			login_proxy_splice_deinit();
+			errno = old_errno;
+			return -2;
+		}
+		size -= ret;
+		if (ret2 == 0 && o_stream_send(output, buf, ret) != ret)
+			ret2 = -1;
+	}
+	return ret2;
+}
+
+int login_proxy_splice(int src_fd, int dest_fd, struct ostream *output,
+		       enum login_proxy_splice_error *error_r)
+{
+	ssize_t ret, size;
+	int old_errno;
+
+	/* if there's already something buffered in the output stream,
+	   it must be sent before the spliced data */
+	if (o_stream_get_buffer_used_size(output) > 0 || !proxy_splice_init())
+		return 0;
+
+	size = splice(src_fd, NULL, proxy_splice_pipe[1], NULL,
+		      PROXY_SPLICE_MAX_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (size == 0) {
+		/* disconnected */
+		errno = 0;
+		*error_r = LOGIN_PROXY_SPLICE_ERROR_SRC;
+		return -1;
+	}
+	if (size < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		if (errno == EINVAL) {
+			/* this kernel/fd type doesn't support splicing */
+			proxy_splice_disabled = TRUE;
+			return 0;
+		}
+		*error_r = LOGIN_PROXY_SPLICE_ERROR_SRC;
+		return -1;
+	}
+
+	while (size > 0) {
+		ret = splice(proxy_splice_pipe[0], NULL, dest_fd, NULL, size,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret <= 0) {
+			if (ret == 0 || errno == EAGAIN || errno == EINTR)
+				break;
+			if (errno == EINVAL) {
+				proxy_splice_disabled = TRUE;
+				break;
+			}
+			old_errno = errno;
+			(void)proxy_splice_pipe_to_stream(output, size);
+			errno = old_errno;
+			*error_r = LOGIN_PROXY_SPLICE_ERROR_DEST;
+			return -1;
+		}
+		size -= ret;
+	}
+	if (size > 0) {
+		/* destination can't take more right now. move the rest to
+		   the output stream, which buffers it as usual. */
+		switch (proxy_splice_pipe_to_stream(output, size)) {
+		case 0:
+			break;
+		case -1:
+			errno = output->stream_errno;
+			*error_r = LOGIN_PROXY_SPLICE_ERROR_DEST;
+			return -1;
+		default:
+			*error_r = LOGIN_PROXY_SPLICE_ERROR_PIPE;
+			return -1;
+		}
+	}
+	return 1;
+}
+#else
+int login_proxy_splice(int src_fd ATTR_UNUSED, int dest_fd ATTR_UNUSED,
+		       struct ostream *output ATTR_UNUSED,
+		       enum login_proxy_splice_error *error_r ATTR_UNUSED)
+{
+	return 0;
+}
+
+void login_proxy_splice_deinit(void)
+{
+}
+#endif
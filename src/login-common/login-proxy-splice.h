@@ -0,0 +1,28 @@
+#ifndef LOGIN_PROXY_SPLICE_H
+#define LOGIN_PROXY_SPLICE_H
+
+struct ostream;
+
+enum login_proxy_splice_error {
+	/* reading src_fd failed or it was disconnected */
+	LOGIN_PROXY_SPLICE_ERROR_SRC,
+	/* writing to dest_fd or output failed */
+	LOGIN_PROXY_SPLICE_ERROR_DEST,
+	/* the shared pipe was in an unexpected state. the error was already
+	   logged and a new pipe is created for the next call. */
+	LOGIN_PROXY_SPLICE_ERROR_PIPE
+};
+
+/* Move data from src_fd directly to dest_fd inside the kernel using splice()
+   through a pipe that is shared by all the callers. output is the buffered
+   stream for dest_fd, which receives any data that dest_fd can't take right
+   away. Returns 1 if data was forwarded or there was nothing to read, 0 if
+   splicing can't be used and the data needs to be copied via userspace, -1
+   if forwarding failed (*error_r tells why and errno is set). The pipe is
+   always empty when this returns. */
+int login_proxy_splice(int src_fd, int dest_fd, struct ostream *output,
+		       enum login_proxy_splice_error *error_r);
+
+void login_proxy_splice_deinit(void);
+
+#endif
@@ -14,6 +14,7 @@
 #include "client-common.h"
 #include "ssl-proxy.h"
 #include "login-proxy-state.h"
+#include "login-proxy-splice.h"
 #include "login-proxy.h"
 
 #define MAX_PROXY_INPUT_SIZE 4096
@@ -79,10 +80,29 @@ static void login_proxy_free_errno(struct login_proxy **proxy,
 	login_proxy_free_reason(proxy, reason);
 }
 
+static void
+login_proxy_splice_failed(struct login_proxy **proxy,
+			  enum login_proxy_splice_error error,
+			  const char *src, const char *dest)
+{
+	switch (error) {
+	case LOGIN_PROXY_SPLICE_ERROR_SRC:
+		login_proxy_free_errno(proxy, errno, src);
+		break;
+	case LOGIN_PROXY_SPLICE_ERROR_DEST:
+		login_proxy_free_errno(proxy, errno, dest);
+		break;
+	case LOGIN_PROXY_SPLICE_ERROR_PIPE:
+		login_proxy_free_reason(proxy, "Splice pipe failed");
+		break;
+	}
+}
+
 static void server_input(struct login_proxy *proxy)
 {
 	unsigned char buf[OUTBUF_THRESHOLD];
 	ssize_t ret, ret2;
+	enum login_proxy_splice_error splice_error;
 
 	proxy->last_io = ioloop_time;
 	if (o_stream_get_buffer_used_size(proxy->client_output) >
@@ -93,6 +113,16 @@ static void server_input(struct login_proxy *proxy)
 		return;
 	}
 
+	ret = login_proxy_splice(proxy->server_fd, proxy->client_fd,
+				 proxy->client_output, &splice_error);
+	if (ret < 0) {
+		login_proxy_splice_failed(&proxy, splice_error,
+					  "server", "client");
+		return;
+	}
+	if (ret > 0)
+		return;
+
 	ret = net_receive(proxy->server_fd, buf, sizeof(buf));
 	if (ret < 0) {
 		login_proxy_free_errno(&proxy, errno, "server");
@@ -112,6 +142,7 @@ static void proxy_client_input(struct login_proxy *proxy)
 {
 	unsigned char buf[OUTBUF_THRESHOLD];
 	ssize_t ret, ret2;
+	enum login_proxy_splice_error splice_error;
 
 	proxy->last_io = ioloop_time;
 	if (o_stream_get_buffer_used_size(proxy->server_output) >
@@ -122,6 +153,16 @@ static void proxy_client_input(struct login_proxy *proxy)
 		return;
 	}
 
+	ret = login_proxy_splice(proxy->client_fd, proxy->server_fd,
+				 proxy->server_output, &splice_error);
+	if (ret < 0) {
+		login_proxy_splice_failed(&proxy, splice_error,
+					  "client", "server");
+		return;
+	}
+	if (ret > 0)
+		return;
+
 	ret = net_receive(proxy->client_fd, buf, sizeof(buf));
 	if (ret < 0) {
 		login_proxy_free_errno(&proxy, errno, "client");
@@ -793,4 +834,5 @@ void login_proxy_deinit(void)
 	if (login_proxy_ipc_server != NULL)
 		ipc_server_deinit(&login_proxy_ipc_server);
 	login_proxy_state_deinit(&proxy_state);
+	login_proxy_splice_deinit();
 }
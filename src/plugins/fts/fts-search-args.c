@@ -196,6 +196,8 @@ int fts_search_args_expand(struct fts_backend *backend,
 	args->simplified = FALSE;
 	args->args = args_dup;
 	mail_search_args_simplify(args);
+	if (args->planned)
+		mail_search_args_plan(args);
 
 	/* duplicated args aren't initialized */
 	i_assert(args->init_refcount > 0);
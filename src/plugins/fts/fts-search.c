@@ -4,6 +4,7 @@
 #include "array.h"
 #include "str.h"
 #include "seq-range-array.h"
+#include "seq-bitmap.h"
 #include "mail-search.h"
 #include "../virtual/virtual-storage.h"
 #include "fts-api-private.h"
@@ -32,6 +33,24 @@ uid_range_to_seqs(struct fts_search_context *fctx,
 	}
 }
 
+static void
+uid_range_to_seq_bitmap(struct fts_search_context *fctx,
+			const ARRAY_TYPE(seq_range) *uid_range,
+			struct seq_bitmap *seqs)
+{
+	const struct seq_range *range;
+	uint32_t seq1, seq2;
+
+	array_foreach(uid_range, range) {
+		if (range->seq1 > range->seq2)
+			continue;
+		mailbox_get_seq_range(fctx->box, range->seq1, range->seq2,
+				      &seq1, &seq2);
+		if (seq1 != 0)
+			seq_bitmap_add_range(seqs, seq1, seq2);
+	}
+}
+
 static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 					  struct mail_search_arg *args,
 					  bool and_args)
@@ -107,7 +126,9 @@ static int
 multi_add_lookup_result(struct fts_search_context *fctx,
 			struct fts_search_level *level,
 			struct mail_search_arg *args,
-			struct fts_multi_result *result)
+			struct fts_multi_result *result,
+			struct seq_bitmap *definite_seqs,
+			struct seq_bitmap *maybe_seqs)
 {
 	struct virtual_mailbox *vbox = (struct virtual_mailbox *)fctx->box;
 	ARRAY_TYPE(seq_range) vuids;
@@ -135,14 +156,14 @@ multi_add_lookup_result(struct fts_search_context *fctx,
 						      &br->definite_uids,
 						      &vuids);
 		}
-		uid_range_to_seqs(fctx, &vuids, &level->definite_seqs);
+		uid_range_to_seq_bitmap(fctx, &vuids, definite_seqs);
 
 		array_clear(&vuids);
 		if (array_is_created(&br->maybe_uids)) {
 			vbox->vfuncs.get_virtual_uids(fctx->box, br->box,
 						      &br->maybe_uids, &vuids);
 		}
-		uid_range_to_seqs(fctx, &vuids, &level->maybe_seqs);
+		uid_range_to_seq_bitmap(fctx, &vuids, maybe_seqs);
 
 		if (array_is_created(&br->scores))
 			level_scores_add_vuids(vbox, level, br);
@@ -162,7 +183,9 @@ static int fts_search_lookup_level_multi(struct fts_search_context *fctx,
 	struct fts_backend *backend;
 	struct fts_search_level *level;
 	struct fts_multi_result result;
+	struct seq_bitmap definite_seqs, maybe_seqs;
 	unsigned int i, j, mailbox_count;
+	int ret = 0;
 
 	p_array_init(&mailboxes_arr, fctx->result_pool, 8);
 	vbox->vfuncs.get_virtual_backend_boxes(fctx->box, &mailboxes_arr, TRUE);
@@ -175,6 +198,11 @@ static int fts_search_lookup_level_multi(struct fts_search_context *fctx,
 	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
 	p_array_init(&level->score_map, fctx->result_pool, 1);
 
+	/* the backend boxes' results are merged to the virtual mailbox's
+	   sequences in random order, so collect them to bitmaps first */
+	seq_bitmap_init(&definite_seqs);
+	seq_bitmap_init(&maybe_seqs);
+
 	mailboxes = array_get(&mailboxes_arr, &mailbox_count);
 	t_array_init(&tmp_mailboxes, mailbox_count);
 	for (i = 0; i < mailbox_count; i = j) {
@@ -192,13 +220,21 @@ static int fts_search_lookup_level_multi(struct fts_search_context *fctx,
 		mail_search_args_reset(args, TRUE);
 		if (fts_backend_lookup_multi(backend,
 					     array_idx(&tmp_mailboxes, 0),
-					     args, flags, &result) < 0)
-			return -1;
-
-		if (multi_add_lookup_result(fctx, level, args, &result) < 0)
-			return -1;
+					     args, flags, &result) < 0 ||
+		    multi_add_lookup_result(fctx, level, args, &result,
+					    &definite_seqs, &maybe_seqs) < 0) {
+			ret = -1;
+			break;
+		}
 	}
-	return 0;
+
+	p_array_init(&level->definite_seqs, fctx->result_pool, 32);
+	p_array_init(&level->maybe_seqs, fctx->result_pool, 32);
+	seq_bitmap_to_array(&definite_seqs, &level->definite_seqs);
+	seq_bitmap_to_array(&maybe_seqs, &level->maybe_seqs);
+	seq_bitmap_deinit(&definite_seqs);
+	seq_bitmap_deinit(&maybe_seqs);
+	return ret;
 }
 
 static int fts_search_lookup_level(struct fts_search_context *fctx,
@@ -27,6 +27,7 @@ struct mail_stats {
 	uint32_t trans_files_read_count;
 	uint64_t trans_files_read_bytes;
 	uint64_t trans_cache_hit_count;
+	uint64_t trans_cache_miss_count;
 };
 
 extern const struct stats_vfuncs mail_stats_vfuncs;
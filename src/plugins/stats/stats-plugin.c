@@ -178,6 +178,7 @@ static void stats_transaction_free(struct stats_user *suser,
 	dest->files_read_count += src->files_read_count;
 	dest->files_read_bytes += src->files_read_bytes;
 	dest->cache_hit_count += src->cache_hit_count;
+	dest->cache_miss_count += src->cache_miss_count;
 	i_free(strans);
 }
 
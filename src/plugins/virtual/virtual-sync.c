@@ -657,7 +657,7 @@ virtual_sync_backend_add_vmsgs_results(struct virtual_sync_context *ctx,
 	if (result == NULL)
 		;
 	else if (mail_index_lookup_seq(bbox->box->view, real_uid, &seq))
-		seq_range_array_add(&result->uids, real_uid);
+		seq_bitmap_add(&result->uids, real_uid);
 	else
 		seq_range_array_add(&result->removed_uids, real_uid);
 }